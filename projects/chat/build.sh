@@ -3,8 +3,12 @@ PROJDIR=$(dirname "$0")
 CC="$1"
 CFLAGS="$2"
 OUTDIR="$3"
-LIBS="-lminiupnpc -lncurses"
+LIBS="-lminiupnpc -lncursesw -lpthread -lanl -lz -lssl -lcrypto"
 
 echo "${CC} ${CFLAGS} ${LIBS} ${PROJDIR}/main.c -o ${OUTDIR}"
-$CC $CFLAGS $LIBS $PROJDIR/main.c $PROJDIR/chat.c $PROJDIR/network.c $PROJDIR/upnp.c -o $OUTDIR
+$CC $CFLAGS $LIBS $PROJDIR/main.c $PROJDIR/chat.c $PROJDIR/network.c $PROJDIR/upnp.c $PROJDIR/history.c $PROJDIR/loop.c $PROJDIR/ui.c $PROJDIR/textbox.c $PROJDIR/sendq.c $PROJDIR/zstream.c $PROJDIR/transport.c $PROJDIR/tls.c $PROJDIR/outbox.c $PROJDIR/connector.c $PROJDIR/metrics.c $PROJDIR/shm.c $PROJDIR/transfer.c $PROJDIR/channels.c -o $OUTDIR
 
+
+
+echo "${CC} ${CFLAGS} ${PROJDIR}/fakeigd.c -o ${OUTDIR}-fake-igd"
+$CC $CFLAGS $PROJDIR/fakeigd.c -o $OUTDIR-fake-igd
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include "channels.h"
+
+
+/* Channels are names the host maps to small ids, which is all a frame
+ * carries. Who follows what is a bitset per side: the local user's one
+ * decides what is shown, and on the host the peer's one decides what is
+ * sent, so a message costs one bit test whatever the number of channels.
+ * */
+static struct Channels {
+	char names[CHANNEL_MAX][CHANNEL_NAME_SIZE];   // "" for a free id
+	struct ChannelSet followed;
+	struct ChannelSet peer;
+	int count;          // ids handed out, the next free one on the host
+	uint16_t current;
+} channels;
+
+
+void initializeChannels(void)
+{
+	memset(&channels, 0, sizeof(channels));
+	strcpy(channels.names[CHANNEL_LOBBY], "#lobby");
+	channels.count = 1;
+	channels.current = CHANNEL_LOBBY;
+	channelSetAdd(&channels.followed, CHANNEL_LOBBY);
+	channelSetAdd(&channels.peer, CHANNEL_LOBBY);
+}
+
+
+bool channelNormalize(const char* name, int len, char out[CHANNEL_NAME_SIZE])
+{
+	if (len > 0 && name[0] == '#') {
+		++name;
+		--len;
+	}
+
+	if (len <= 0 || len > CHANNEL_NAME_SIZE - 2)
+		return false;
+
+	for (int i = 0; i < len; ++i) {
+		if ((unsigned char) name[i] <= ' ' || name[i] == 0x7F)
+			return false;
+	}
+
+	out[0] = '#';
+	memcpy(&out[1], name, len);
+	out[len + 1] = '\0';
+	return true;
+}
+
+
+int channelFind(const char* const name)
+{
+	for (int id = 0; id < channels.count; ++id) {
+		if (strcmp(channels.names[id], name) == 0)
+			return id;
+	}
+
+	return -1;
+}
+
+
+int channelRegister(const char* const name)
+{
+	const int id = channelFind(name);
+	if (id != -1 || channels.count == CHANNEL_MAX)
+		return id;
+
+	snprintf(channels.names[channels.count], CHANNEL_NAME_SIZE, "%s", name);
+	return channels.count++;
+}
+
+
+void channelLearn(const uint16_t id, const char* const name)
+{
+	if (id >= CHANNEL_MAX)
+		return;
+
+	// a restarted host may have given the name a new id
+	const int old = channelFind(name);
+	if (old != -1 && old != id)
+		channels.names[old][0] = '\0';
+
+	snprintf(channels.names[id], CHANNEL_NAME_SIZE, "%s", name);
+	if (id >= channels.count)
+		channels.count = id + 1;
+}
+
+
+const char* channelName(const uint16_t id)
+{
+	return id < CHANNEL_MAX && channels.names[id][0] != '\0' ? channels.names[id] : "#?";
+}
+
+
+bool channelFollowed(const uint16_t id)
+{
+	return channelSetHas(&channels.followed, id);
+}
+
+
+void channelJoin(const uint16_t id)
+{
+	channelSetAdd(&channels.followed, id);
+}
+
+
+void channelPart(const uint16_t id)
+{
+	if (id == CHANNEL_LOBBY)
+		return;
+
+	channelSetRemove(&channels.followed, id);
+	if (channels.current == id)
+		channels.current = CHANNEL_LOBBY;
+}
+
+
+uint16_t channelCurrent(void)
+{
+	return channels.current;
+}
+
+
+void channelSwitch(const uint16_t id)
+{
+	channels.current = id;
+}
+
+
+const struct ChannelSet* channelsFollowed(void)
+{
+	return &channels.followed;
+}
+
+
+bool channelPeerFollows(const uint16_t id)
+{
+	return channelSetHas(&channels.peer, id);
+}
+
+
+void channelPeerJoin(const uint16_t id)
+{
+	channelSetAdd(&channels.peer, id);
+}
+
+
+void channelPeerPart(const uint16_t id)
+{
+	if (id != CHANNEL_LOBBY)
+		channelSetRemove(&channels.peer, id);
+}
+
+
+void channelPeerReset(void)
+{
+	memset(&channels.peer, 0, sizeof(channels.peer));
+	channelSetAdd(&channels.peer, CHANNEL_LOBBY);
+}
+
+
+const struct ChannelSet* channelsPeerFollows(void)
+{
+	return &channels.peer;
+}
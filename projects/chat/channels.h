@@ -0,0 +1,68 @@
+#ifndef CHAT_CHANNELS_H_
+#define CHAT_CHANNELS_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define CHANNEL_MAX       ((int)1024)
+#define CHANNEL_NAME_SIZE ((int)32)    // "#name" and its terminator
+#define CHANNEL_LOBBY     ((uint16_t)0)  // "#lobby", everybody is always in it
+
+
+/* one bit per channel id, so a test is a load and a mask however
+ * many channels a connection follows */
+struct ChannelSet {
+	uint64_t bits[CHANNEL_MAX / 64];
+};
+
+
+static inline bool channelSetHas(const struct ChannelSet* const set, const uint16_t id)
+{
+	return id < CHANNEL_MAX && (set->bits[id / 64] & ((uint64_t)1 << (id % 64))) != 0;
+}
+
+
+static inline void channelSetAdd(struct ChannelSet* const set, const uint16_t id)
+{
+	if (id < CHANNEL_MAX)
+		set->bits[id / 64] |= (uint64_t)1 << (id % 64);
+}
+
+
+static inline void channelSetRemove(struct ChannelSet* const set, const uint16_t id)
+{
+	if (id < CHANNEL_MAX)
+		set->bits[id / 64] &= ~((uint64_t)1 << (id % 64));
+}
+
+
+/* only the lobby is known and joined, on both sides */
+extern void initializeChannels(void);
+
+/* "name" or "#name" as "#name", false if it's empty, too long or has
+ * anything but printable non-space characters */
+extern bool channelNormalize(const char* name, int len, char out[CHANNEL_NAME_SIZE]);
+
+/* ids are handed out by the host, the client learns them as it joins */
+extern int channelFind(const char* name);      // -1 if unknown
+extern int channelRegister(const char* name);  // host, -1 if there's no id left
+extern void channelLearn(uint16_t id, const char* name);
+extern const char* channelName(uint16_t id);   // "#?" if unknown
+
+/* what the local user follows, and where what they type goes */
+extern bool channelFollowed(uint16_t id);
+extern void channelJoin(uint16_t id);
+extern void channelPart(uint16_t id);
+extern uint16_t channelCurrent(void);
+extern void channelSwitch(uint16_t id);
+extern const struct ChannelSet* channelsFollowed(void);
+
+/* host, what the peer follows. Kept while a session is resumed */
+extern bool channelPeerFollows(uint16_t id);
+extern void channelPeerJoin(uint16_t id);
+extern void channelPeerPart(uint16_t id);
+extern void channelPeerReset(void);
+extern const struct ChannelSet* channelsPeerFollows(void);
+
+
+#endif
@@ -2,15 +2,39 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
-#include <ctype.h>
-#include <locale.h>
 #include <ncurses.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
 #include "utils/io.h"
+#include "utils/debug.h"
+#include "utils/log.h"
 #include "network.h"
+#include "proto.h"
+#include "history.h"
+#include "loop.h"
+#include "ui.h"
+#include "textbox.h"
+#include "sendq.h"
+#include "zstream.h"
+#include "outbox.h"
+#include "metrics.h"
+#include "transfer.h"
+#include "channels.h"
+#include "report.h"
 
 
-#define CHAT_STACK_SIZE ((int)24)
 #define BUFFER_SIZE     ((int)512)
+#define REPLAY_SIZE     ((int)24)     // history records sent to a new client
+#define MSG_MAX_SIZE    ((int)(FRAME_MAX_PAYLOAD - UNAME_SIZE - 2))  // fits a "uname: msg" record
+#define RECONNECT_MIN_MS ((int)250)
+#define RECONNECT_MAX_MS ((int)30000)
+
+/* a line of the event log (--log), stamped with the time. Only queued,
+ * the logging thread writes it, and dropped if that thread lags behind */
+#define CHAT_LOG(fmt, ...) MYLOG("%ld " fmt "\n", (long) time(NULL), ##__VA_ARGS__)
 
 
 enum ChatCmd {
@@ -20,307 +44,854 @@ enum ChatCmd {
 
 
 static const struct ConnectionInfo* cinfo = NULL;     // connection information
-static char conn_buffer[BUFFER_SIZE]      = { '\0' }; // buffer for incoming msgs
-static char* chatstack[CHAT_STACK_SIZE]   = { NULL }; // the chat msg stack with unames
-static int chatstack_idx                  = 0;        // current chat stack index
+static struct Reader conn_reader;                     // incoming frames
+static bool connected                     = false;    // cinfo->transport is usable
+static uint64_t recv_seq                  = 0;        // messages of this session received
+static int backoff_ms                     = 0;        // client, delay before the next reconnect
+
+static bool pasting                       = false;    // inside a bracketed paste
+
+static pthread_mutex_t notice_lock        = PTHREAD_MUTEX_INITIALIZER;
+static char notices[BUFFER_SIZE];                     // '\n' separated, posted by other threads
+static int notices_len                    = 0;
+static int notice_efd                     = -1;       // wakes the loop up for new notices
+static int quit_signal                    = 0;        // caught while the connection had to be torn down
+
 
-static char buffer[BUFFER_SIZE]           = { '\0' }; // text box's buffer for user input
-static int blen                           = 0;        // text box's current buffer size
-static int bidx                           = 0;        // text box's cursor position in the buffer
-static int cy, cx;                                    // current cursor position in the window
-static int my, mx;                                    // max y and x positions
-static int hy, hx;                                    // text box's home y and x (start position)
+static void connectionLost(void);
 
 
-static void freeChatStack(void)
+static void stackMsg(const uint16_t channel, const char* const uname, const char* const msg)
 {
-	for (int i = 0; i < chatstack_idx; ++i)
-		free(chatstack[i]);
+	if (channel == CHANNEL_LOBBY)
+		historyPrintf(FRAME_HISTORY, channel, "%s: %s", uname, msg);
+	else
+		historyPrintf(FRAME_HISTORY, channel, "%s %s: %s", channelName(channel), uname, msg);
+	uiDamage(UI_HISTORY);
 }
 
 
-static void chatStackPushBack(char* str)
+static void stackInfo(const char* const fmt, ...)
 {
-	if (chatstack_idx >= CHAT_STACK_SIZE) {
-		free(chatstack[0]);
-		for (int i = 0; i < (CHAT_STACK_SIZE - 1); ++i)
-			chatstack[i] = chatstack[i + 1];
-		chatstack_idx = CHAT_STACK_SIZE - 1;
+	char str[BUFFER_SIZE];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(str, sizeof(str), fmt, args);
+	va_end(args);
+	historyPrintf(FRAME_INFO, CHANNEL_LOBBY, "%s", str);
+	uiDamage(UI_HISTORY);
+	CHAT_LOG("%s", str);
+}
+
+
+static void showInfo(const char* const msg)
+{
+	stackInfo("%s", msg);
+}
+
+
+static void clearTextBox(void)
+{
+	textBoxClear();
+	uiDamage(UI_INPUT);
+}
+
+
+// returns true if the text box must be submitted
+static bool updateTextBox(const enum UIKeyKind kind, const int c)
+{
+	#ifdef DEBUG_
+	stackInfo("KEY PRESSED %i", c);
+	#endif
+
+	if (kind == UI_KEY_CHAR) {
+		switch (c) {
+		case 10: // also enter (ascii) [fall]
+		case 13:
+			if (!pasting)
+				return textBoxLength() > 0;
+			textBoxInsert(L'\n');
+			break;
+		case 8: // also backspace (ascii) [fall]
+		case 127:
+			textBoxBackspace();
+			break;
+		default:
+			if (c >= ' ' || c == '\t')
+				textBoxInsert((wchar_t) c);
+			break;
+		}
+		uiDamage(UI_INPUT);
+		return false;
 	}
-	chatstack[chatstack_idx++] = str;
+
+	switch (c) {
+	case KEY_ENTER: // submit msg, if any
+		return textBoxLength() > 0;
+	case KEY_LEFT: textBoxLeft(); break;
+	case KEY_RIGHT: textBoxRight(); break;
+	case KEY_BACKSPACE: textBoxBackspace(); break;
+	case KEY_DC: textBoxDelete(); break;
+	case KEY_HOME: textBoxHome(); break;
+	case KEY_END: textBoxEnd(); break;
+	case UI_KEY_PASTE_BEGIN: pasting = true; break;
+	case UI_KEY_PASTE_END: pasting = false; break;
+	case KEY_RESIZE: uiResize(); break;
+	default: return false;
+	}
+
+	uiDamage(UI_INPUT);
+	return false;
 }
 
 
-static void stackMsg(const char* const uname, const char* const msg)
+// the channel named by arg, or the current one if there's no arg. -1 if unknown
+static int getChannelArg(const char* arg, char name[CHANNEL_NAME_SIZE])
 {
-	char* const str = malloc(snprintf(NULL, 0, "%s: %s", uname, msg) + 1);
-	sprintf(str, "%s: %s", uname, msg);
-	chatStackPushBack(str);
+	while (*arg == ' ')
+		++arg;
+
+	if (*arg == '\0') {
+		snprintf(name, CHANNEL_NAME_SIZE, "%s", channelName(channelCurrent()));
+		return channelCurrent();
+	}
+
+	if (!channelNormalize(arg, strlen(arg), name)) {
+		stackInfo("Bad channel name \'%s\'.", arg);
+		name[0] = '\0';
+		return -1;
+	}
+
+	return channelFind(name);
 }
 
 
-static void stackInfo(const char* const fmt, ...)
+static void switchChannel(const uint16_t id)
 {
-	va_list args;
-	va_start(args, fmt);
+	channelSwitch(id);
+	uiDamage(UI_ALL);
+}
 
-	char* const str = malloc(vsnprintf(NULL, 0, fmt, args) + 1);
 
-	va_end(args);
-	va_start(args, fmt);
+static void joinChannel(const char* const arg)
+{
+	char name[CHANNEL_NAME_SIZE];
+	int id = getChannelArg(arg, name);
+	if (name[0] == '\0')
+		return;
+
+	if (id != -1 && channelFollowed(id)) {
+		switchChannel(id);
+		stackInfo("Talking in %s.", name);
+		return;
+	}
+
+	// the client joins once the host has answered with the id
+	if (cinfo->mode == CONMODE_CLIENT) {
+		if (!connected)
+			stackInfo("Not connected, join %s later.", name);
+		else
+			sendQueueFrame(FRAME_JOIN, CHANNEL_LOBBY, name, strlen(name));
+		return;
+	}
 
-	vsprintf(str, fmt, args);
-	chatStackPushBack(str);
+	if ((id = channelRegister(name)) == -1) {
+		stackInfo("Too many channels, can't create %s.", name);
+		return;
+	}
 
-	va_end(args);
+	channelJoin(id);
+	switchChannel(id);
+	stackInfo("Joined %s.", name);
 }
 
 
-static int setKbdTimeout(const int delay)
+static void partChannel(const char* const arg)
 {
-	static int curdelay = -1;
-	const int prevdelay = curdelay;
-	curdelay = delay;
-	timeout(curdelay);
-	return prevdelay;
+	char name[CHANNEL_NAME_SIZE];
+	const int id = getChannelArg(arg, name);
+	if (name[0] == '\0')
+		return;
+
+	if (id == -1 || !channelFollowed(id)) {
+		stackInfo("Not in %s.", name);
+		return;
+	} else if (id == CHANNEL_LOBBY) {
+		stackInfo("Everybody stays in %s.", name);
+		return;
+	} else if (cinfo->mode == CONMODE_CLIENT) {
+		// the host would keep sending it
+		if (!connected) {
+			stackInfo("Not connected, leave %s later.", name);
+			return;
+		}
+		sendQueueFrame(FRAME_PART, id, "", 0);
+	}
+
+	channelPart(id);
+	uiDamage(UI_ALL);
+	stackInfo("Left %s.", name);
 }
 
 
-static void initializeUI(void)
+static void listChannels(void)
 {
-	initscr();
-	cbreak();
-	noecho();
-	intrflush(stdscr, FALSE);
-	setKbdTimeout(5);
-	keypad(stdscr, TRUE);
+	char line[BUFFER_SIZE];
+	int len = snprintf(line, sizeof(line), "Channels:");
+
+	for (int id = 0; id < CHANNEL_MAX; ++id) {
+		if (!channelFollowed(id))
+			continue;
+		if (len + CHANNEL_NAME_SIZE + 2 > (int) sizeof(line)) {
+			stackInfo("%s", line);
+			len = snprintf(line, sizeof(line), "         ");
+		}
+		len += snprintf(&line[len], sizeof(line) - len, " %s%s", channelName(id),
+		                id == channelCurrent() ? "*" : "");
+	}
+
+	stackInfo("%s", line);
 }
 
 
-static void terminateUI(void)
+static enum ChatCmd parseChatCmd(const char* const uname, const char* const cmd, const bool islocal)
 {
-	endwin();
+	if (strcmp(cmd, "/quit") == 0) {
+		stackInfo("Connection closed by %s. Press any key to exit...", uname);
+		uiRender();
+		if (connected)
+			flushSendQueue();   // the peer must see a local /quit before we wait
+		uiWaitKey();
+		return CHATCMD_QUIT;
+	} else if (islocal && strncmp(cmd, "/join ", 6) == 0) {
+		joinChannel(&cmd[6]);
+	} else if (islocal && (strcmp(cmd, "/part") == 0 || strncmp(cmd, "/part ", 6) == 0)) {
+		partChannel(&cmd[5]);
+	} else if (islocal && strcmp(cmd, "/channels") == 0) {
+		listChannels();
+	} else if (islocal && strncmp(cmd, "/send ", 6) == 0) {
+		transferSend(&cmd[6]);
+	} else if (islocal && strcmp(cmd, "/stats") == 0) {
+		struct SendStats stats;
+		getSendStats(&stats);
+		stackInfo("Sent %llu frames (%llu bytes) in %llu syscalls, %.2f syscalls per frame.",
+		          (unsigned long long) stats.frames, (unsigned long long) stats.bytes,
+		          (unsigned long long) stats.syscalls,
+		          stats.frames > 0 ? (double) stats.syscalls / stats.frames : 0.0);
+		struct ZStreamStats zstats;
+		getZStreamStats(&zstats);
+		stackInfo("Deflated %llu frames, %llu -> %llu bytes, %lluus compressing, %lluus inflating.",
+		          (unsigned long long) zstats.frames, (unsigned long long) zstats.bytes_in,
+		          (unsigned long long) zstats.bytes_out,
+		          (unsigned long long) zstats.deflate_ns / 1000,
+		          (unsigned long long) zstats.inflate_ns / 1000);
+	} else if (islocal) {
+			stackInfo("Unknown command \'%s\'.", cmd);
+	}
+
+	return CHATCMD_NORMAL;
 }
 
 
-static void printUI(void)
+// returns false if the chat must end
+static bool handleMsg(const char* const uname, const uint16_t channel, const char* const msg)
 {
-	printw("Host: %s (%s). Client: %s (%s).\n"
-	       "=================================================\n",
-	       cinfo->host_uname, cinfo->host_ip,
-	       cinfo->client_uname, cinfo->client_ip);
+	const bool islocal = uname == cinfo->local_uname;
+
+	if (msg[0] == '/') {
+		if (parseChatCmd(uname, msg, islocal) == CHATCMD_QUIT)
+			return false;
+	} else {
+		stackMsg(channel, uname, msg);
+	}
 
-	int i;
-	for (i = 0; i < chatstack_idx; ++i)
-		printw("%s\n", chatstack[i]);
-	for (; i < CHAT_STACK_SIZE; ++i)
-		printw("\n");
+	if (islocal)
+		clearTextBox();
 
-	printw("==================================================\n> ");
+	return true;
 }
 
 
-static void clearTextBox(void)
+/* host, the peer follows the channel from now on and gets its recent
+ * history, unless it did already (e.g. it's rejoining after a reconnect) */
+static void peerJoined(const char* const payload, const uint32_t len)
 {
-	cy = hy;
-	cx = hx;
-	blen = 0;
-	bidx = 0;
-	buffer[0] = '\0';
+	char name[CHANNEL_NAME_SIZE];
+	const int id = channelNormalize(payload, len, name) ? channelRegister(name) : -1;
+	if (id == -1) {
+		CHAT_LOG("%s can't join %.*s", cinfo->remote_uname, (int) len, payload);
+		sendQueueFrame(FRAME_JOINED, CHANNEL_LOBBY, "", 0);
+		return;
+	}
+
+	const bool rejoin = channelPeerFollows(id);
+	channelPeerJoin(id);
+	sendQueueFrame(FRAME_JOINED, id, name, strlen(name));
+	if (rejoin)
+		return;
+
+	CHAT_LOG("%s joined %s", cinfo->remote_uname, name);
+
+	// replayed records go out right behind what is queued
+	struct ChannelSet only = { { 0 } };
+	channelSetAdd(&only, id);
+	if (!flushSendQueue() || !historyReplay(cinfo->transport, historyTail(&only, REPLAY_SIZE), &only))
+		connectionLost();
 }
 
 
-static void moveCursorLeft(void)
+/* client, the host's answer to FRAME_JOIN. Rejoins after a reconnect
+ * only refresh the id, a restarted host may have handed out another one */
+static void joinedChannel(const uint16_t id, const char* const payload, const uint32_t len)
 {
-	if (cy > hy || cx > hx) {
-		--bidx;
-		--cx;
-		if (cx < 0) {
-			cx = mx - 1;
-			--cy;
-		}
-		move(cy, cx);
+	char name[CHANNEL_NAME_SIZE];
+	if (len == 0 || id >= CHANNEL_MAX || !channelNormalize(payload, len, name)) {
+		stackInfo("The host refused to open the channel.");
+		return;
 	}
+
+	const int old = channelFind(name);
+	channelLearn(id, name);
+
+	if (old != -1 && channelFollowed(old)) {
+		const bool current = channelCurrent() == old;
+		channelPart(old);
+		channelJoin(id);
+		if (current)
+			channelSwitch(id);
+		return;
+	}
+
+	channelJoin(id);
+	switchChannel(id);
+	stackInfo("Joined %s.", name);
 }
 
 
-static void moveCursorRight(void)
+static bool handleFrame(const struct FrameHeader* const hdr, char* payload)
 {
-	if (bidx < blen) {
-		++bidx;
-		++cx;
-		if (cx >= mx) {
-			cx = 0;
-			++cy;
+	uint32_t len = getFrameLen(hdr);
+
+	// the channel id comes from the wire, nothing past the ids there are is looked up
+	if (getFrameChannel(hdr) >= CHANNEL_MAX)
+		return true;
+
+	// a broken deflate stream is reset by reconnecting
+	if ((hdr->flags & FRAME_FLAG_DEFLATE) != 0 && !zstreamInflate(hdr, payload, &payload, &len)) {
+		connectionLost();
+		return true;
+	}
+
+	switch ((enum FrameType) hdr->type) {
+	case FRAME_MSG: {
+		++recv_seq;
+		metricsAdd(METRIC_MSGS_IN, 1);
+		// payload is followed by at least one spare byte, in conn_reader or zstream's
+		const char next = payload[len];
+		payload[len] = '\0';
+		const bool ret = handleMsg(cinfo->remote_uname, getFrameChannel(hdr), payload);
+		payload[len] = next;
+		return ret;
 		}
-		move(cy, cx);
+	case FRAME_HISTORY:
+		historyAppend(hdr, payload);
+		uiDamage(UI_HISTORY);
+		return true;
+	case FRAME_INFO:
+		return true;
+	case FRAME_FILE_OFFER:
+	case FRAME_FILE_ACK:
+	case FRAME_FILE_DATA:
+	case FRAME_FILE_END:
+	case FRAME_FILE_CANCEL:
+		transferFrame(hdr, payload, len);
+		return true;
+	case FRAME_JOIN:
+		if (cinfo->mode == CONMODE_HOST)
+			peerJoined(payload, len);
+		return true;
+	case FRAME_JOINED:
+		if (cinfo->mode == CONMODE_CLIENT)
+			joinedChannel(getFrameChannel(hdr), payload, len);
+		return true;
+	case FRAME_PART:
+		if (cinfo->mode == CONMODE_HOST) {
+			channelPeerPart(getFrameChannel(hdr));
+			CHAT_LOG("%s left %s", cinfo->remote_uname, channelName(getFrameChannel(hdr)));
+		}
+		return true;
 	}
+
+	return true;
+}
+
+
+static ssize_t recvRemote(void* const src, void* const buf, const size_t len)
+{
+	((void)src);
+
+	const uint64_t start = metricsClock();
+	const ssize_t n = transportRecv(cinfo->transport, buf, len);
+	metricsObserve(TIMING_READ, start);
+	metricsAdd(METRIC_RECV_CALLS, 1);
+	if (n > 0)
+		metricsAdd(METRIC_BYTES_IN, n);
+	return n;
 }
 
 
-static void moveCursorHome(void)
+static size_t frameLength(const char* const header)
 {
-	if (bidx != 0) {
-		bidx = 0;
-		cy = hy;
-		cx = hx;
-		move(cy, cx);
+	const uint32_t len = getFrameLen((const struct FrameHeader*) header);
+	return len > (uint32_t) FRAME_MAX_PAYLOAD ? SIZE_MAX : len;
+}
+
+
+// reads whatever is available and handles every complete frame
+static bool readFrames(void)
+{
+	const enum ReadStatus fill = readerFill(&conn_reader);
+	if (fill != READ_OK) {
+		if (fill != READ_AGAIN)
+			connectionLost();
+		return true;
+	}
+
+	struct View frame;
+	enum ReadStatus status = READ_OK;
+	bool ret = true;
+	while (ret && connected &&
+	       (status = readerFrame(&conn_reader, sizeof(struct FrameHeader), frameLength, &frame)) == READ_OK) {
+		TRACE_SPAN("frame", ((struct FrameHeader*) frame.data)->type, frame.len);
+		const uint64_t frame_start = metricsClock();
+		ret = handleFrame((struct FrameHeader*) frame.data, &frame.data[sizeof(struct FrameHeader)]);
+		metricsObserve(TIMING_PARSE, frame_start);
+		metricsAdd(METRIC_FRAMES_IN, 1);
 	}
+
+	// connectionLost() already dropped what was left
+	if (!connected)
+		return ret;
+	if (status == READ_ERROR) {
+		connectionLost();
+		return ret;
+	}
+
+	// file data doesn't wait here for the rest of the chunk
+	const struct View pending = readerPending(&conn_reader);
+	const struct FrameHeader* const hdr = (struct FrameHeader*) pending.data;
+	if (ret && pending.len >= sizeof(*hdr) && hdr->type == FRAME_FILE_DATA && hdr->flags == 0) {
+		transferBeginData(&pending.data[sizeof(*hdr)], pending.len - sizeof(*hdr), getFrameLen(hdr));
+		metricsAdd(METRIC_FRAMES_IN, 1);
+		readerConsume(&conn_reader, pending.len);
+	}
+
+	metricsSet(GAUGE_RECV_BUFFERED, readerPending(&conn_reader).len);
+	return ret;
 }
 
 
-static void moveCursorEnd(void)
+static bool onRemote(const int fd, void* const arg)
 {
-	if (bidx < blen) {
-		bidx = blen;
-		cx = hx + (blen % mx);
-		cy = hy + (blen / mx);
-		move(cy, cx);
+	((void)fd);
+	((void)arg);
+
+	// TLS may hold decrypted data epoll can't see anymore
+	bool ret = true;
+	do {
+		if (!transferReceiving())
+			ret = readFrames();
+		else if (!transferReceive(cinfo->transport))
+			connectionLost();
+	} while (ret && connected && transportPending(cinfo->transport));
+
+	return ret;
+}
+
+
+/* kept in the outbox until the session ends, sent right away if connected.
+ * The host keeps messages of channels the peer doesn't follow to itself */
+static void sendMsg(const uint16_t channel, const char* const msg, const int len)
+{
+	if (cinfo->mode == CONMODE_HOST && !channelPeerFollows(channel))
+		return;
+
+	outboxPush(FRAME_MSG, channel, msg, len);
+	metricsSet(GAUGE_OUTBOX, outboxEnd() - outboxBegin());
+	metricsAdd(METRIC_MSGS_OUT, 1);
+	if (connected)
+		zstreamQueueFrame(FRAME_MSG, channel, msg, len);
+}
+
+
+// drains every key ncurses has, getch() doesn't block here
+static bool onKeys(const int fd, void* const arg)
+{
+	((void)fd);
+	((void)arg);
+
+	enum UIKeyKind kind;
+	int c;
+	while ((kind = uiGetKey(&c)) != UI_KEY_NONE) {
+		if (!updateTextBox(kind, c))
+			continue;
+
+		const int len = textBoxLength();
+		if (len > MSG_MAX_SIZE) {
+			stackInfo("Message too long (%d bytes, max %d).", len, MSG_MAX_SIZE);
+			continue;
+		}
+
+		// local commands other than /quit stay local, /quit goes where the peer surely is
+		const char* const msg = textBoxText();
+		if (msg[0] != '/')
+			sendMsg(channelCurrent(), msg, len);
+		else if (strcmp(msg, "/quit") == 0)
+			sendMsg(CHANNEL_LOBBY, msg, len);
+		if (!handleMsg(cinfo->local_uname, channelCurrent(), msg))
+			return false;
 	}
+
+	return true;
 }
 
 
+static void postNotice(const char* const msg)
+{
+	pthread_mutex_lock(&notice_lock);
+	notices_len += snprintf(&notices[notices_len], sizeof(notices) - notices_len, "%s\n", msg);
+	if (notices_len >= (int) sizeof(notices))
+		notices_len = sizeof(notices) - 1;
+	pthread_mutex_unlock(&notice_lock);
+	loopWakeup(notice_efd);
+	CHAT_LOG("%s", msg);
+}
+
 
-static void refreshUI(void)
+static bool onNotice(const int fd, void* const arg)
 {
-	clear();
-	move(0, 0);
-	printUI();
-	getyx(stdscr, hy, hx);
-	getmaxyx(stdscr, my, mx);
-	cy = hy + (bidx / mx);
-	cx = hx + (bidx % mx);
-	printw(buffer);
-	move(cy, cx);
-	refresh();
+	((void)fd);
+	((void)arg);
+
+	pthread_mutex_lock(&notice_lock);
+	for (char *line = notices, *nl; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = '\0';
+		// already logged by the thread that posted it
+		historyPrintf(FRAME_INFO, CHANNEL_LOBBY, "%s", line);
+	}
+	uiDamage(UI_HISTORY);
+	notices_len = 0;
+	notices[0] = '\0';
+	pthread_mutex_unlock(&notice_lock);
+	return true;
 }
 
 
-static bool updateTextBox(void)
+// the signal is raised again once everything is cleaned up
+static bool onSignal(const int fd, void* const arg)
 {
-	const int c = getch();
+	((void)arg);
 
-	if (c == ERR)
-		return false;
+	unsigned char sig;
+	if (read(fd, &sig, 1) != 1)
+		return true;
+	quit_signal = sig;
+	return false;
+}
 
-	#ifdef DEBUG_
-	stackInfo("KEY PRESSED %i", c);
-	#endif
 
-	switch (c) {
-	case 10: // also enter (ascii) [fall]
-	case KEY_ENTER: // submit msg, if any
-		return blen > 0;
-	case KEY_LEFT:
-		moveCursorLeft();
-		return false;
-	case KEY_RIGHT:
-		moveCursorRight();
+// sends what this tick produced and draws what it changed
+static bool onIdle(const int fd, void* const arg)
+{
+	((void)fd);
+	((void)arg);
+	metricsAdd(METRIC_LOOP_TICKS, 1);
+
+	if (connected) {
+		const uint64_t start = metricsClock();
+		const bool ok = transferPump() && flushSendQueue();
+		metricsObserve(TIMING_FANOUT, start);
+		if (!ok)
+			connectionLost();
+	}
+
+	const uint64_t start = metricsClock();
+	uiRender();
+	metricsObserve(TIMING_RENDER, start);
+	return true;
+}
+
+
+/* (re)starts the message flow on a freshly handshaken connection. When
+ * the host knew the client's session, each side resends what the other
+ * is missing from its outbox. Otherwise it's a new session, and the
+ * client gets the tail of the history instead */
+static bool startSession(void)
+{
+	readerReset(&conn_reader);
+	initializeSendQueue(cinfo->transport);
+
+	// both deflate streams start over with the connection
+	terminateZStream();
+	if (!initializeZStream((cinfo->features & FEATURE_DEFLATE) != 0) ||
+	    !loopAddFd(cinfo->transport->fd, onRemote, NULL))
 		return false;
-	case 127: // also backspace (ascii) [fall]
-	case KEY_BACKSPACE:
-		if (bidx > 0) {
-			memmove(&buffer[bidx - 1], &buffer[bidx], blen - bidx);
-			buffer[--blen] = '\0';
-			moveCursorLeft();
-			refreshUI();
+
+	connected = true;
+	backoff_ms = RECONNECT_MIN_MS;
+	uiDamage(UI_HEADER);
+	metricsMarkConnection(cinfo->remote_uname);
+	metricsAdd(METRIC_CONNECTIONS, 1);
+	metricsSet(GAUGE_CONNECTED, 1);
+	transferConnected();
+	CHAT_LOG("connected to %s at %s%s", cinfo->remote_uname,
+	         cinfo->mode == CONMODE_HOST ? cinfo->client_ip : cinfo->host_ip,
+	         (cinfo->features & FEATURE_SHM) != 0 ? ", through shared memory" : "");
+
+	if (cinfo->tls_info[0] != '\0')
+		stackInfo("%s", cinfo->tls_info);
+	if ((cinfo->features & FEATURE_SHM) != 0)
+		stackInfo("%s is on this machine, talking through shared memory.", cinfo->remote_uname);
+
+	// the client follows its channels again, the host ignores what it knows already
+	if (cinfo->mode == CONMODE_CLIENT) {
+		for (int id = 1; id < CHANNEL_MAX; ++id) {
+			const char* const name = channelName(id);
+			if (channelFollowed(id) && !sendQueueFrame(FRAME_JOIN, CHANNEL_LOBBY, name, strlen(name)))
+				return false;
 		}
-		return false;
-	case KEY_HOME:
-		moveCursorHome();
-		return false;
-	case KEY_END:
-		moveCursorEnd();
-		return false;
-	case KEY_RESIZE:
-		refreshUI();
-		return false;
 	}
 
-	if (isascii(c) && blen < BUFFER_SIZE) {
-		if (bidx < blen)
-			memmove(&buffer[bidx + 1], &buffer[bidx], blen - bidx);
-		buffer[bidx] = (char) c;
-		buffer[++blen] = '\0';
-		moveCursorRight();
-		refreshUI();
+	if (cinfo->resumed) {
+		const uint64_t pending = outboxEnd() - cinfo->peer_recv_seq;
+		const int64_t lost = outboxResend(cinfo->peer_recv_seq, zstreamQueueFrame);
+		if (lost < 0)
+			return false;
+		stackInfo("Session with %s resumed, %llu messages resent.", cinfo->remote_uname,
+		          (unsigned long long)(pending - lost));
+		if (lost > 0)
+			stackInfo("%lld messages were too old to resend.", (long long) lost);
+		return true;
 	}
 
-	return false;
+	if (outboxEnd() > 0)
+		stackInfo("New session with %s, undelivered messages are lost.", cinfo->remote_uname);
+	resetOutbox();
+	metricsSet(GAUGE_OUTBOX, 0);
+	recv_seq = 0;
+
+	if (cinfo->mode == CONMODE_HOST) {
+		channelPeerReset();
+		historyReplay(cinfo->transport, historyTail(channelsPeerFollows(), REPLAY_SIZE),
+		              channelsPeerFollows());
+	}
+
+	return true;
 }
 
 
-static enum ChatCmd parseChatCmd(const char* const uname, const char* const cmd, const bool islocal)
+static void scheduleReconnect(void);
+
+
+static void onReconnected(const bool ok)
 {
-	if (strcmp(cmd, "/quit") == 0) {
-		stackInfo("Connection closed by %s. Press any key to exit...", uname);
-		refreshUI();
-		const int prev = setKbdTimeout(-1);
-		getch();
-		setKbdTimeout(prev);
-		return CHATCMD_QUIT;
-	} else if (islocal) {
-			stackInfo("Unknown command \'%s\'.", cmd);
+	if (ok) {
+		if (startSession()) {
+			if (cinfo->mode == CONMODE_HOST)
+				loopRemoveFd(cinfo->local_fd);
+			return;
+		}
+		dropConnection();
 	}
 
-	return CHATCMD_NORMAL;
+	// the host simply keeps listening
+	if (cinfo->mode == CONMODE_CLIENT) {
+		backoff_ms = backoff_ms * 2 < RECONNECT_MAX_MS ? backoff_ms * 2 : RECONNECT_MAX_MS;
+		scheduleReconnect();
+	}
 }
 
 
-static bool checkfd(const int fd)
+static bool onReconnect(const int fd, void* const arg)
 {
-	struct timeval timeout = { 0, 5000 };
-	fd_set fds;
+	((void)arg);
+	loopCancel(fd);   // one-shot
+
+	if (!reconnectConnection(recv_seq, onReconnected))
+		onReconnected(false);
+	return true;
+}
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
 
-	return select(fd + 1, &fds, NULL, NULL, &timeout) > 0;
+static void scheduleReconnect(void)
+{
+	// some jitter, so clients of a restarted host don't come back in lockstep
+	const int ms = backoff_ms + rand() % (backoff_ms / 4 + 1);
+	if (loopAddTimer(ms, false, onReconnect, NULL) == -1)
+		stackInfo("Couldn't schedule a reconnect, /quit and start again.");
 }
 
 
-int chat(const enum ConnectionMode mode)
+static bool onAccept(const int fd, void* const arg)
 {
-	if ((cinfo = initializeConnection(mode)) == NULL)
-		return EXIT_FAILURE;
+	((void)fd);
+	((void)arg);
+	reconnectConnection(recv_seq, onReconnected);
+	return true;
+}
 
-	initializeUI();
-	refreshUI();
 
-	const char *uname = NULL, *msg = NULL;
+static void connectionLost(void)
+{
+	if (!connected)
+		return;
+
+	connected = false;
+	readerReset(&conn_reader);
+	metricsSet(GAUGE_CONNECTED, 0);
+	metricsSet(GAUGE_RECV_BUFFERED, 0);
+	transferDisconnected();
+	loopRemoveFd(cinfo->transport->fd);
+	dropConnection();
+	uiDamage(UI_HEADER);
+
+	if (cinfo->mode == CONMODE_HOST) {
+		stackInfo("Connection to %s lost, waiting for it to come back...", cinfo->remote_uname);
+		if (!loopAddFd(cinfo->local_fd, onAccept, NULL))
+			stackInfo("Couldn't wait for the client, /quit and start again.");
+	} else {
+		stackInfo("Connection to %s lost, reconnecting...", cinfo->remote_uname);
+		backoff_ms = RECONNECT_MIN_MS;
+		scheduleReconnect();
+	}
+}
 
-	for (;;) {
-		if (checkfd(cinfo->remote_fd)) {
-			readInto(conn_buffer, cinfo->remote_fd, BUFFER_SIZE);
-			uname = cinfo->remote_uname;
-			msg = conn_buffer;
-		} else if (updateTextBox()) {
-			writeInto(cinfo->remote_fd, buffer);
-			uname = cinfo->local_uname;
-			msg = buffer;
-		}
 
-		if (uname != NULL && msg != NULL) {
-			const bool islocal = uname == cinfo->local_uname;
-
-			if (msg[0] == '/') {
-				if (parseChatCmd(uname, msg, islocal) == CHATCMD_QUIT)
-					break;
-			} else {
-				stackMsg(uname, msg);
-			}
-
-			if (islocal)
-				clearTextBox();
-			
-			uname = NULL;
-			msg = NULL;
-			refreshUI();
-		}
+static bool initializeEvents(void)
+{
+	if (!initializeLoop())
+		return false;
+
+	notice_efd = loopAddWakeup(onNotice, NULL);
+
+	// SIGWINCH interrupts the wait, ncurses then reports KEY_RESIZE
+	loopOnInterrupt(onKeys, NULL);
+	loopOnIdle(onIdle, NULL);
+
+	if (notice_efd == -1 || !loopAddFd(STDIN_FILENO, onKeys, NULL)) {
+		terminateLoop();
+		return false;
+	}
+
+	const int signal_fd = connectionSignalFd();
+	if (signal_fd != -1 && !loopAddFd(signal_fd, onSignal, NULL)) {
+		terminateLoop();
+		return false;
 	}
 
+	setReportNotify(postNotice);
+	setConnectionNotify(postNotice);
+	return true;
+}
+
+
+static void terminateEvents(void)
+{
+	setReportNotify(NULL);
+	setConnectionNotify(NULL);
+	terminateLoop();
+}
+
+
+// the log ends with how it did itself
+static void terminateChatLog(void)
+{
+	struct LogStats stats;
+	logStats(&stats);
+	if (stats.calls > 0) {
+		CHAT_LOG("logged %llu lines, %llu dropped, %llu ns per call (p99 <= %llu ns)",
+		         (unsigned long long) stats.calls, (unsigned long long) stats.dropped,
+		         (unsigned long long) stats.ns_avg, (unsigned long long) stats.ns_p99);
+	}
+	terminateLogging();
+}
+
+
+int chat(const enum ConnectionMode mode, const struct ConnectionConfig* const cfg)
+{
+	if (!initializeTracing())
+		return EXIT_FAILURE;
+
+	// never makes the loop wait, a lagging log loses lines instead
+	if (cfg->log != NULL && !initializeLogging(cfg->log, LOG_POLICY_DROP))
+		goto Lterminate_tracing;
+
+	// its background threads (UPnP) log, so it's stopped before the log
+	if ((cinfo = initializeConnection(mode, cfg)) == NULL)
+		goto Lterminate_log;
+
+	// only the host keeps the log on disk, clients get it replayed
+	if (!initializeHistory(mode == CONMODE_HOST ? cfg->history : NULL))
+		goto Lterminate_connection;
+
+	if (!initializeTextBox())
+		goto Lterminate_history;
+
+	if (!initializeEvents())
+		goto Lterminate_textbox;
+
+	if (!initializeMetrics(cfg->metrics, postNotice))
+		goto Lterminate_events;
+
+	if (!initializeTransfers(cfg->downloads, showInfo))
+		goto Lterminate_metrics;
+
+	if (!initializeReader(&conn_reader, -1, recvRemote, NULL, sizeof(struct FrameHeader) + FRAME_MAX_PAYLOAD))
+		goto Lterminate_transfers;
+
+	resetOutbox();
+	initializeChannels();
+	initializeUI(cinfo);
+	if (!startSession())
+		goto Lterminate_ui;
+	uiRender();
+
+	runLoop();
+
 	terminateUI();
-	freeChatStack();
+	terminateReader(&conn_reader);
+	terminateTransfers();
+	terminateMetrics();
+	terminateEvents();
+	terminateZStream();
+	terminateTextBox();
+	terminateHistory();
+	terminateConnection(cinfo);
+	terminateChatLog();
+	terminateTracing();
+	if (quit_signal != 0)
+		raise(quit_signal);
 	return EXIT_SUCCESS;
-}
 
+Lterminate_ui:
+	terminateUI();
+	terminateZStream();
+	terminateReader(&conn_reader);
+Lterminate_transfers:
+	terminateTransfers();
+Lterminate_metrics:
+	terminateMetrics();
+Lterminate_events:
+	terminateEvents();
+Lterminate_textbox:
+	terminateTextBox();
+Lterminate_history:
+	terminateHistory();
+Lterminate_connection:
+	terminateConnection(cinfo);
+Lterminate_log:
+	terminateChatLog();
+Lterminate_tracing:
+	terminateTracing();
+	return EXIT_FAILURE;
+}
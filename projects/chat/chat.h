@@ -3,7 +3,7 @@
 #include "network.h"
 
 
-extern int chat(enum ConnectionMode mode);
+extern int chat(enum ConnectionMode mode, const struct ConnectionConfig* cfg);
 
 
 #endif
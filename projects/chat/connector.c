@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "connector.h"
+#include "network.h"
+#include "loop.h"
+
+
+/* Happy eyeballs (RFC 8305), simplified. The addresses from getaddrinfo(),
+ * already sorted by RFC 6724, are interleaved by family. A connect to the
+ * next one starts every CONNECT_DELAY_MS, or right away once every attempt
+ * in flight has failed. The first to finish wins and the rest are closed,
+ * so a dead address costs a quarter second instead of a TCP timeout.
+ * */
+#define CONNECT_MAX_ADDRS ((int)16)
+#define CONNECT_DELAY_MS  ((int)250)
+
+
+static struct Connector {
+	struct gaicb req;
+	struct sigevent sev;
+	struct addrinfo hints;
+	struct addrinfo* result;
+	const struct addrinfo* addrs[CONNECT_MAX_ADDRS];  // interleaved by family
+	int attempts[CONNECT_MAX_ADDRS];   // socket per address, -1 when not in flight
+	int naddrs;
+	int next;                          // next address to try
+	int last_errno;                    // why the last attempt failed
+	int timer_fd;                      // async, paces the attempts
+	int efd;                           // async, signaled by the resolver thread
+	ConnectDone done;
+	void* done_arg;
+	bool resolving;                    // the getaddrinfo_a() request is still out
+	bool active;                       // an async connect is in flight
+	char host[HOST_STR_SIZE];
+	char port[PORT_STR_SIZE];
+} conn = { .timer_fd = -1, .efd = -1 };
+
+
+static void resetAttempts(void)
+{
+	for (int i = 0; i < CONNECT_MAX_ADDRS; ++i)
+		conn.attempts[i] = -1;
+	conn.result = NULL;
+	conn.naddrs = 0;
+	conn.next = 0;
+	conn.last_errno = EHOSTUNREACH;
+}
+
+
+static void orderAddrs(const struct addrinfo* const list)
+{
+	const struct addrinfo* same[CONNECT_MAX_ADDRS];
+	const struct addrinfo* other[CONNECT_MAX_ADDRS];
+	int nsame = 0, nother = 0;
+
+	for (const struct addrinfo* ai = list; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family == list->ai_family) {
+			if (nsame < CONNECT_MAX_ADDRS)
+				same[nsame++] = ai;
+		} else if (nother < CONNECT_MAX_ADDRS) {
+			other[nother++] = ai;
+		}
+	}
+
+	conn.naddrs = 0;
+	for (int i = 0; (i < nsame || i < nother) && conn.naddrs < CONNECT_MAX_ADDRS; ++i) {
+		if (i < nsame)
+			conn.addrs[conn.naddrs++] = same[i];
+		if (i < nother && conn.naddrs < CONNECT_MAX_ADDRS)
+			conn.addrs[conn.naddrs++] = other[i];
+	}
+}
+
+
+// starts a non-blocking connect to the next address, returns its socket or -1 if none left
+static int startAttempt(void)
+{
+	while (conn.next < conn.naddrs) {
+		const int i = conn.next++;
+		const struct addrinfo* const ai = conn.addrs[i];
+		const int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		                      ai->ai_protocol);
+		if (fd == -1) {
+			conn.last_errno = errno;
+			continue;
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+			conn.attempts[i] = fd;
+			return fd;
+		}
+
+		conn.last_errno = errno;
+		close(fd);
+	}
+
+	return -1;
+}
+
+
+static int findAttempt(const int fd)
+{
+	for (int i = 0; i < conn.naddrs; ++i)
+		if (conn.attempts[i] == fd)
+			return i;
+	return -1;
+}
+
+
+static int inFlight(void)
+{
+	int n = 0;
+	for (int i = 0; i < conn.naddrs; ++i)
+		n += conn.attempts[i] != -1;
+	return n;
+}
+
+
+// attempt i is writable, returns its socket made blocking if it connected, else -1
+static int finishAttempt(const int i)
+{
+	const int fd = conn.attempts[i];
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	conn.attempts[i] = -1;
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+
+	if (err != 0) {
+		conn.last_errno = err;
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	return fd;
+}
+
+
+static void closeAttempts(void)
+{
+	for (int i = 0; i < conn.naddrs; ++i) {
+		if (conn.attempts[i] == -1)
+			continue;
+		loopRemoveFd(conn.attempts[i]);   // no-op if it isn't there
+		close(conn.attempts[i]);
+		conn.attempts[i] = -1;
+	}
+}
+
+
+int connectBlocking(const char* const host, const char* const port, const char** const error)
+{
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_ADDRCONFIG
+	};
+
+	resetAttempts();
+	const int ret = getaddrinfo(host, port, &hints, &conn.result);
+	if (ret != 0) {
+		*error = gai_strerror(ret);
+		return -1;
+	}
+
+	orderAddrs(conn.result);
+	startAttempt();
+
+	int fd = -1;
+	while (fd == -1 && (inFlight() > 0 || conn.next < conn.naddrs)) {
+		if (inFlight() == 0) {
+			startAttempt();
+			continue;
+		}
+
+		struct pollfd pfds[CONNECT_MAX_ADDRS];
+		int idx[CONNECT_MAX_ADDRS];
+		int n = 0;
+		for (int i = 0; i < conn.naddrs; ++i) {
+			if (conn.attempts[i] != -1) {
+				pfds[n] = (struct pollfd){ .fd = conn.attempts[i], .events = POLLOUT };
+				idx[n++] = i;
+			}
+		}
+
+		const int ready = poll(pfds, n, conn.next < conn.naddrs ? CONNECT_DELAY_MS : -1);
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
+			conn.last_errno = errno;
+			break;
+		} else if (ready == 0) {
+			startAttempt();
+			continue;
+		}
+
+		for (int k = 0; k < n && fd == -1; ++k)
+			if (pfds[k].revents != 0)
+				fd = finishAttempt(idx[k]);
+	}
+
+	closeAttempts();
+	freeaddrinfo(conn.result);
+	conn.result = NULL;
+
+	if (fd == -1)
+		*error = strerror(conn.last_errno);
+	return fd;
+}
+
+
+static void cleanupAsync(void)
+{
+	closeAttempts();
+	if (conn.timer_fd != -1)
+		loopCancel(conn.timer_fd);
+	if (conn.result != NULL)
+		freeaddrinfo(conn.result);
+	conn.timer_fd = -1;
+	conn.result = NULL;
+	conn.active = false;
+}
+
+
+static void finishAsync(const int fd, const char* const error)
+{
+	const ConnectDone done = conn.done;
+	void* const arg = conn.done_arg;
+	cleanupAsync();
+	done(fd, error, arg);
+}
+
+
+static bool onWritable(int fd, void* arg);
+
+
+// starts the next attempt, or gives up if none is left and none is in flight
+static void attemptNext(void)
+{
+	int fd;
+	while ((fd = startAttempt()) != -1) {
+		if (loopAddWritable(fd, onWritable, NULL))
+			return;
+		conn.attempts[findAttempt(fd)] = -1;
+		close(fd);
+	}
+
+	if (inFlight() == 0)
+		finishAsync(-1, strerror(conn.last_errno));
+}
+
+
+static bool onWritable(const int fd, void* const arg)
+{
+	((void)arg);
+	const int i = findAttempt(fd);
+	loopRemoveFd(fd);
+	if (i == -1)
+		return true;
+
+	const int connected = finishAttempt(i);
+	if (connected != -1)
+		finishAsync(connected, NULL);
+	else if (inFlight() == 0)
+		attemptNext();
+
+	return true;
+}
+
+
+static bool onAttemptTimer(const int fd, void* const arg)
+{
+	((void)arg);
+	if (conn.next >= conn.naddrs) {
+		loopCancel(fd);
+		conn.timer_fd = -1;
+		return true;
+	}
+
+	attemptNext();
+	return true;
+}
+
+
+// runs on a thread of the resolver
+static void onResolvedThread(const union sigval sv)
+{
+	((void)sv);
+	loopWakeup(conn.efd);
+}
+
+
+static bool onResolved(const int fd, void* const arg)
+{
+	((void)arg);
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count) || !conn.resolving)
+		return true;
+
+	const int ret = gai_error(&conn.req);
+	if (ret == EAI_INPROGRESS)
+		return true;
+
+	conn.resolving = false;
+	loopRemoveFd(conn.efd);
+
+	if (ret != 0) {
+		finishAsync(-1, gai_strerror(ret));
+		return true;
+	}
+
+	conn.result = conn.req.ar_result;
+	orderAddrs(conn.result);
+	attemptNext();
+
+	if (conn.active && conn.next < conn.naddrs)
+		conn.timer_fd = loopAddTimer(CONNECT_DELAY_MS, true, onAttemptTimer, NULL);
+
+	return true;
+}
+
+
+bool connectAsync(const char* const host, const char* const port,
+                  const ConnectDone done, void* const arg)
+{
+	if (conn.active)
+		return false;
+
+	// a lookup cancelConnect() couldn't stop must be over before req is reused
+	if (conn.resolving) {
+		if (gai_error(&conn.req) == EAI_INPROGRESS)
+			return false;
+		if (conn.req.ar_result != NULL)
+			freeaddrinfo(conn.req.ar_result);
+		conn.resolving = false;
+	}
+
+	if (conn.efd == -1 && (conn.efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+		return false;
+
+	if (!loopAddFd(conn.efd, onResolved, NULL))
+		return false;
+
+	resetAttempts();
+	snprintf(conn.host, HOST_STR_SIZE, "%s", host);
+	snprintf(conn.port, PORT_STR_SIZE, "%s", port);
+	conn.hints = (struct addrinfo) {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_ADDRCONFIG
+	};
+	conn.req = (struct gaicb) {
+		.ar_name = conn.host,
+		.ar_service = conn.port,
+		.ar_request = &conn.hints
+	};
+	conn.sev = (struct sigevent) {
+		.sigev_notify = SIGEV_THREAD,
+		.sigev_notify_function = onResolvedThread
+	};
+
+	struct gaicb* list[1] = { &conn.req };
+	if (getaddrinfo_a(GAI_NOWAIT, list, 1, &conn.sev) != 0) {
+		loopRemoveFd(conn.efd);
+		return false;
+	}
+
+	conn.done = done;
+	conn.done_arg = arg;
+	conn.resolving = true;
+	conn.active = true;
+	return true;
+}
+
+
+void cancelConnect(void)
+{
+	if (!conn.active)
+		return;
+
+	if (conn.resolving) {
+		loopRemoveFd(conn.efd);
+		if (gai_cancel(&conn.req) == EAI_CANCELED)
+			conn.resolving = false;
+	}
+
+	cleanupAsync();
+
+	// the resolver thread may still write to it otherwise
+	if (!conn.resolving) {
+		close(conn.efd);
+		conn.efd = -1;
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef CHAT_CONNECTOR_H_
+#define CHAT_CONNECTOR_H_
+#include <stdbool.h>
+
+
+/* fd is the connected (blocking) socket, or -1 and error says why */
+typedef void (*ConnectDone)(int fd, const char* error, void* arg);
+
+
+/* resolves host and races connects to every address it has, for use
+ * before the event loop runs */
+extern int connectBlocking(const char* host, const char* port, const char** error);
+
+/* the same from inside the event loop: getaddrinfo_a() for the lookup and
+ * non-blocking connects, done is called from the loop once it's over */
+extern bool connectAsync(const char* host, const char* port, ConnectDone done, void* arg);
+
+/* stops an async connect in flight, done isn't called */
+extern void cancelConnect(void);
+
+
+#endif
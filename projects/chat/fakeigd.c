@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/* A fake Internet Gateway Device, so the UPnP code can be tried without a
+ * router. It serves a root description and answers the SOAP calls chat
+ * makes on 127.0.0.1 (GetExternalIPAddress, GetStatusInfo, AddPortMapping
+ * and DeletePortMapping), keeping a table of the mappings and logging
+ * what happens to them, expiries included. There's no SSDP: -c writes the
+ * IGD cache chat tries before discovering, pointing at this one.
+ * One request per connection, one connection at a time.
+ * */
+#define IGD_PORT          ((int)5555)
+#define IGD_EXTERNAL_IP   "203.0.113.1"   // TEST-NET-3, never a real one
+#define IGD_SERVICE       "urn:schemas-upnp-org:service:WANIPConnection:1"
+#define IGD_REQUEST_SIZE  ((int)16384)
+#define IGD_ARG_SIZE      ((int)64)
+#define IGD_MAPPINGS_MAX  ((int)32)
+#define IGD_TIMEOUT_MS    ((int)2000)    // for a client that stops sending
+
+
+struct Mapping {
+	char proto[IGD_ARG_SIZE];
+	char port[IGD_ARG_SIZE];
+	char client[IGD_ARG_SIZE];
+	time_t expires;       // 0 for a permanent lease
+	bool used;
+};
+
+
+static struct {
+	struct Mapping mappings[IGD_MAPPINGS_MAX];
+	bool permanent_only;  // like the routers that reject finite leases
+} igd;
+
+
+static const char root_desc[] =
+	"<?xml version=\"1.0\"?>\r\n"
+	"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+	"<specVersion><major>1</major><minor>0</minor></specVersion>"
+	"<device><deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+	"<friendlyName>chat fake IGD</friendlyName>"
+	"<deviceList><device><deviceType>urn:schemas-upnp-org:device:WANDevice:1</deviceType>"
+	"<serviceList><service>"
+	"<serviceType>urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1</serviceType>"
+	"<serviceId>urn:upnp-org:serviceId:WANCommonIFC1</serviceId>"
+	"<controlURL>/ctl/cif</controlURL><eventSubURL>/evt/cif</eventSubURL>"
+	"<SCPDURL>/cif.xml</SCPDURL>"
+	"</service></serviceList>"
+	"<deviceList><device><deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:1</deviceType>"
+	"<serviceList><service>"
+	"<serviceType>" IGD_SERVICE "</serviceType>"
+	"<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId>"
+	"<controlURL>/ctl</controlURL><eventSubURL>/evt</eventSubURL>"
+	"<SCPDURL>/ipc.xml</SCPDURL>"
+	"</service></serviceList>"
+	"</device></deviceList></device></deviceList></device></root>\r\n";
+
+
+__attribute__((format(printf, 1, 2)))
+static void logEvent(const char* const fmt, ...)
+{
+	char stamp[16];
+	const time_t now = time(NULL);
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+	printf("%s ", stamp);
+
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	putchar('\n');
+}
+
+
+static void expireMappings(void)
+{
+	const time_t now = time(NULL);
+	for (int i = 0; i < IGD_MAPPINGS_MAX; ++i) {
+		struct Mapping* const m = &igd.mappings[i];
+		if (m->used && m->expires != 0 && m->expires <= now) {
+			m->used = false;
+			logEvent("expired %s %s -> %s", m->proto, m->port, m->client);
+		}
+	}
+}
+
+
+static struct Mapping* findMapping(const char* const proto, const char* const port)
+{
+	for (int i = 0; i < IGD_MAPPINGS_MAX; ++i) {
+		struct Mapping* const m = &igd.mappings[i];
+		if (m->used && strcmp(m->proto, proto) == 0 && strcmp(m->port, port) == 0)
+			return m;
+	}
+	return NULL;
+}
+
+
+// the text of <name>...</name> in body, empty if it isn't there
+static void getArg(const char* const body, const char* const name, char* const dest)
+{
+	char tag[IGD_ARG_SIZE + 2];
+	snprintf(tag, sizeof(tag), "<%s>", name);
+	dest[0] = '\0';
+
+	const char* const start = strstr(body, tag);
+	if (start == NULL)
+		return;
+
+	const char* const value = start + strlen(tag);
+	const size_t len = strcspn(value, "<");
+	snprintf(dest, IGD_ARG_SIZE, "%.*s", (int)(len < IGD_ARG_SIZE ? len : IGD_ARG_SIZE - 1), value);
+}
+
+
+static void sendAll(const int fd, const char* const data, const size_t len)
+{
+	size_t sent = 0;
+	while (sent < len) {
+		const ssize_t n = send(fd, &data[sent], len - sent, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		sent += n;
+	}
+}
+
+
+static void respond(const int fd, const char* const status, const char* const type,
+                    const char* const body)
+{
+	char head[256];
+	const int len = snprintf(head, sizeof(head),
+	                         "HTTP/1.1 %s\r\n"
+	                         "Content-Type: %s\r\n"
+	                         "Content-Length: %zu\r\n"
+	                         "Connection: close\r\n"
+	                         "Server: chat-fake-igd UPnP/1.0\r\n\r\n",
+	                         status, type, strlen(body));
+	sendAll(fd, head, len);
+	sendAll(fd, body, strlen(body));
+}
+
+
+static void respondSoap(const int fd, const char* const action, const char* const args)
+{
+	char body[1024];
+	snprintf(body, sizeof(body),
+	         "<?xml version=\"1.0\"?>\r\n"
+	         "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	         "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>"
+	         "<u:%sResponse xmlns:u=\"" IGD_SERVICE "\">%s</u:%sResponse>"
+	         "</s:Body></s:Envelope>\r\n", action, args, action);
+	respond(fd, "200 OK", "text/xml; charset=\"utf-8\"", body);
+}
+
+
+// the UPnP error codes miniupnpc turns into messages
+static void respondFault(const int fd, const int code, const char* const desc)
+{
+	char body[1024];
+	snprintf(body, sizeof(body),
+	         "<?xml version=\"1.0\"?>\r\n"
+	         "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	         "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>"
+	         "<s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring>"
+	         "<detail><UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
+	         "<errorCode>%d</errorCode><errorDescription>%s</errorDescription>"
+	         "</UPnPError></detail></s:Fault></s:Body></s:Envelope>\r\n", code, desc);
+	respond(fd, "500 Internal Server Error", "text/xml; charset=\"utf-8\"", body);
+}
+
+
+static void addPortMapping(const int fd, const char* const body)
+{
+	char proto[IGD_ARG_SIZE], port[IGD_ARG_SIZE], client[IGD_ARG_SIZE], lease[IGD_ARG_SIZE];
+	getArg(body, "NewProtocol", proto);
+	getArg(body, "NewExternalPort", port);
+	getArg(body, "NewInternalClient", client);
+	getArg(body, "NewLeaseDuration", lease);
+
+	const long secs = strtol(lease, NULL, 10);
+	if (proto[0] == '\0' || port[0] == '\0' || client[0] == '\0' || secs < 0) {
+		respondFault(fd, 402, "Invalid Args");
+		return;
+	}
+	if (secs != 0 && igd.permanent_only) {
+		logEvent("refused %s %s, lease %ss", proto, port, lease);
+		respondFault(fd, 725, "OnlyPermanentLeasesSupported");
+		return;
+	}
+
+	struct Mapping* m = findMapping(proto, port);
+	const bool renewed = m != NULL;
+	for (int i = 0; i < IGD_MAPPINGS_MAX && m == NULL; ++i)
+		if (!igd.mappings[i].used)
+			m = &igd.mappings[i];
+	if (m == NULL) {
+		respondFault(fd, 728, "NoPortMapsAvailable");
+		return;
+	}
+
+	snprintf(m->proto, IGD_ARG_SIZE, "%s", proto);
+	snprintf(m->port, IGD_ARG_SIZE, "%s", port);
+	snprintf(m->client, IGD_ARG_SIZE, "%s", client);
+	m->expires = secs != 0 ? time(NULL) + secs : 0;
+	m->used = true;
+
+	if (secs != 0)
+		logEvent("%s %s %s -> %s, lease %lds", renewed ? "renewed" : "added", proto, port, client, secs);
+	else
+		logEvent("%s %s %s -> %s, permanent", renewed ? "renewed" : "added", proto, port, client);
+	respondSoap(fd, "AddPortMapping", "");
+}
+
+
+static void deletePortMapping(const int fd, const char* const body)
+{
+	char proto[IGD_ARG_SIZE], port[IGD_ARG_SIZE];
+	getArg(body, "NewProtocol", proto);
+	getArg(body, "NewExternalPort", port);
+
+	struct Mapping* const m = findMapping(proto, port);
+	if (m == NULL) {
+		logEvent("no mapping %s %s to delete", proto, port);
+		respondFault(fd, 714, "NoSuchEntryInArray");
+		return;
+	}
+
+	m->used = false;
+	logEvent("deleted %s %s -> %s", proto, port, m->client);
+	respondSoap(fd, "DeletePortMapping", "");
+}
+
+
+static void control(const int fd, const char* const action, const char* const body)
+{
+	if (strcmp(action, "GetExternalIPAddress") == 0) {
+		respondSoap(fd, action, "<NewExternalIPAddress>" IGD_EXTERNAL_IP "</NewExternalIPAddress>");
+	} else if (strcmp(action, "GetStatusInfo") == 0) {
+		respondSoap(fd, action, "<NewConnectionStatus>Connected</NewConnectionStatus>"
+		                        "<NewLastConnectionError>ERROR_NONE</NewLastConnectionError>"
+		                        "<NewUptime>1</NewUptime>");
+	} else if (strcmp(action, "GetCommonLinkProperties") == 0) {
+		respondSoap(fd, action, "<NewWANAccessType>Ethernet</NewWANAccessType>"
+		                        "<NewLayer1UpstreamMaxBitRate>1000000</NewLayer1UpstreamMaxBitRate>"
+		                        "<NewLayer1DownstreamMaxBitRate>1000000</NewLayer1DownstreamMaxBitRate>"
+		                        "<NewPhysicalLinkStatus>Up</NewPhysicalLinkStatus>");
+	} else if (strcmp(action, "AddPortMapping") == 0) {
+		addPortMapping(fd, body);
+	} else if (strcmp(action, "DeletePortMapping") == 0) {
+		deletePortMapping(fd, body);
+	} else {
+		logEvent("unknown action %s", action);
+		respondFault(fd, 401, "Invalid Action");
+	}
+}
+
+
+/* the headers and as much body as Content-Length says, '\0' terminated.
+ * Returns where the body starts, NULL if the request never completed */
+static char* readRequest(const int fd, char* const buf, const int size)
+{
+	int len = 0;
+	char* body = NULL;
+	long want = 0;
+
+	while (body == NULL || (buf + len) - body < want) {
+		const ssize_t n = recv(fd, &buf[len], size - 1 - len, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+		len += n;
+		buf[len] = '\0';
+
+		if (body == NULL && (body = strstr(buf, "\r\n\r\n")) != NULL) {
+			body += 4;
+			const char* const cl = strcasestr(buf, "\r\nContent-Length:");
+			want = cl != NULL && cl < body ? strtol(cl + 17, NULL, 10) : 0;
+		}
+		if (len == size - 1)
+			return body;   // cut, the arguments are near the start anyway
+	}
+	return body;
+}
+
+
+static void serve(const int fd)
+{
+	char buf[IGD_REQUEST_SIZE];
+	const char* const body = readRequest(fd, buf, IGD_REQUEST_SIZE);
+	if (body == NULL)
+		return;
+
+	char method[8], path[256];
+	if (sscanf(buf, "%7s %255s", method, path) != 2) {
+		respond(fd, "400 Bad Request", "text/plain", "");
+		return;
+	}
+
+	if (strcmp(method, "GET") == 0 && strcmp(path, "/rootDesc.xml") == 0) {
+		logEvent("root description");
+		respond(fd, "200 OK", "text/xml; charset=\"utf-8\"", root_desc);
+		return;
+	}
+
+	// SOAPAction: "urn:schemas-upnp-org:service:WANIPConnection:1#AddPortMapping"
+	const char* const soap = strcasestr(buf, "\r\nSOAPAction:");
+	const char* const hash = soap != NULL ? strchr(soap, '#') : NULL;
+	if (strcmp(method, "POST") != 0 || strncmp(path, "/ctl", 4) != 0 || hash == NULL || hash > body) {
+		respond(fd, "404 Not Found", "text/plain", "");
+		return;
+	}
+
+	char action[IGD_ARG_SIZE];
+	snprintf(action, sizeof(action), "%.*s", (int) strcspn(hash + 1, "\"\r\n"), hash + 1);
+	control(fd, action, body);
+}
+
+
+// what chat tries before SSDP, so it comes straight here
+static bool writeCache(const int port)
+{
+	char dir[512], path[600];
+	const char* const xdg = getenv("XDG_CACHE_HOME");
+	const char* const home = getenv("HOME");
+	if (xdg != NULL && xdg[0] != '\0')
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	else if (home != NULL)
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	else
+		return false;
+
+	snprintf(path, sizeof(path), "%s/chat-igd", dir);
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		perror("Couldn't create the cache directory");
+		return false;
+	}
+
+	FILE* const file = fopen(path, "w");
+	if (file == NULL) {
+		perror("Couldn't write the IGD cache");
+		return false;
+	}
+	fprintf(file, "http://127.0.0.1:%d/ctl\n" IGD_SERVICE "\n127.0.0.1\n", port);
+	fclose(file);
+	printf("IGD cache written to %s\n", path);
+	return true;
+}
+
+
+static int listenOn(const int port)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("Couldn't create socket");
+		return -1;
+	}
+
+	const int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 8) == -1) {
+		perror("Couldn't listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int main(const int argc, char* const* const argv)
+{
+	int port = IGD_PORT;
+	bool cache = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:cP")) != -1) {
+		switch (c) {
+		case 'p': port = strtol(optarg, NULL, 10); break;
+		case 'c': cache = true; break;
+		case 'P': igd.permanent_only = true; break;
+		default: goto Lusage;
+		}
+	}
+	if (port <= 0 || port > 65535 || optind != argc)
+		goto Lusage;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	const int fd = listenOn(port);
+	if (fd == -1 || (cache && !writeCache(port)))
+		return EXIT_FAILURE;
+	printf("Fake IGD on http://127.0.0.1:%d/rootDesc.xml\n", port);
+
+	// wakes up every second to expire the leases
+	for (;;) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		const int n = poll(&pfd, 1, 1000);
+		expireMappings();
+		if (n == -1 && errno != EINTR) {
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+		if (n <= 0)
+			continue;
+
+		const int clifd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (clifd == -1)
+			continue;
+
+		const struct timeval tv = {.tv_sec = IGD_TIMEOUT_MS / 1000,
+		                           .tv_usec = (IGD_TIMEOUT_MS % 1000) * 1000};
+		setsockopt(clifd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		serve(clifd);
+		close(clifd);
+	}
+
+Lusage:
+	fprintf(stderr, "Usage: %s [-p port] [-c] [-P]\n"
+	                "  -p     port on 127.0.0.1 (%d)\n"
+	                "  -c     write the IGD cache chat reads, pointing here\n"
+	                "  -P     only accept permanent leases, like some routers\n", argv[0], IGD_PORT);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,683 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "metrics.h"
+#include "report.h"
+
+
+/* The log is a ring of segments. Each segment holds up to
+ * HISTORY_SEG_RECORDS records, so the segment of a sequence number
+ * is seq / HISTORY_SEG_RECORDS and its slot in the segment index is
+ * seq % HISTORY_SEG_RECORDS. A segment is a pair of files:
+ *   <segno>.log - the records, frame header followed by the payload
+ *   <segno>.idx - fixed size entries with the offset of each record
+ * Both are kept mapped, so appends are plain stores into the page cache
+ * and replays go straight out of the .log file, with sendfile() on plain TCP.
+ * Growing a .log and opening the next segment, page faults and all, would
+ * stall the loop that appends, so a helper thread does both once the
+ * current segment is half full, and the loop swaps the results in. When
+ * one isn't ready by the time it's needed, the loop waits for it.
+ * */
+#define HISTORY_SEG_RECORDS ((uint64_t)4096)
+#define HISTORY_MAX_SEGS    ((int)8)
+#define HISTORY_DATA_SIZE   ((size_t)1 << 20)   // initial .log size, doubles when full
+#define HISTORY_NAME_SIZE   ((int)32)
+
+
+struct IndexEntry {
+	uint64_t offset;  // of the record in the .log file
+	uint32_t len;     // header + payload, 0 for an empty slot
+	uint32_t reserved;
+};
+
+
+struct Segment {
+	struct IndexEntry* idx;
+	char* data;
+	size_t data_size;  // mapped size of the .log
+	size_t data_len;   // bytes in use
+	uint64_t segno;
+	int idx_fd;
+	int data_fd;
+};
+
+
+static struct History {
+	struct Segment segs[HISTORY_MAX_SEGS];  // ring, segno % HISTORY_MAX_SEGS
+	uint64_t first_seg;
+	uint64_t end;       // next sequence number
+	int dirfd;          // -1 if anonymous
+} history = { .dirfd = -1 };
+
+
+static struct Helper {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;       // a job for the helper, or a result for the loop
+	struct Segment next;       // next.idx is NULL if it couldn't be opened
+	uint64_t next_segno;
+	char* grown;               // the .log of grow_segno mapped at grow_size
+	size_t grow_size;
+	size_t grow_from;          // its old size, the pages before are faulted in
+	uint64_t grow_segno;
+	int grow_fd;               // -1 when there's no growing to do
+	char* retired;             // a mapping the loop is done with
+	size_t retired_size;
+	bool next_wanted;
+	bool next_done;
+	bool grow_done;
+	bool next_pending;         // asked and not swapped in yet, loop only
+	bool grow_pending;         // same
+	bool started;
+	bool stop;
+} helper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.grow_fd = -1
+};
+
+
+#define IDX_SIZE (HISTORY_SEG_RECORDS * sizeof(struct IndexEntry))
+
+
+static inline struct Segment* getSegment(const uint64_t segno)
+{
+	return &history.segs[segno % HISTORY_MAX_SEGS];
+}
+
+
+static int openSegmentFile(const uint64_t segno, const char* const ext, const bool create)
+{
+	char name[HISTORY_NAME_SIZE];
+	sprintf(name, "%010llu.%s", (unsigned long long) segno, ext);
+
+	if (history.dirfd == -1)
+		return create ? memfd_create(name, 0) : -1;
+
+	return openat(history.dirfd, name, O_RDWR | (create ? O_CREAT : 0), 0600);
+}
+
+
+static void unlinkSegmentFiles(const uint64_t segno)
+{
+	if (history.dirfd == -1)
+		return;
+
+	char name[HISTORY_NAME_SIZE];
+	sprintf(name, "%010llu.idx", (unsigned long long) segno);
+	unlinkat(history.dirfd, name, 0);
+	sprintf(name, "%010llu.log", (unsigned long long) segno);
+	unlinkat(history.dirfd, name, 0);
+}
+
+
+static void closeSegment(struct Segment* const seg)
+{
+	if (seg->idx == NULL)
+		return;
+
+	munmap(seg->idx, IDX_SIZE);
+	munmap(seg->data, seg->data_size);
+	close(seg->idx_fd);
+	close(seg->data_fd);
+	seg->idx = NULL;
+}
+
+
+/* maps segment segno into seg, returns the number of records it holds or -1 */
+static int openSegment(struct Segment* const seg, const uint64_t segno, const bool create)
+{
+	struct stat st;
+
+	seg->segno = segno;
+	seg->idx_fd = openSegmentFile(segno, "idx", create);
+	if (seg->idx_fd == -1)
+		return -1;
+
+	seg->data_fd = openSegmentFile(segno, "log", create);
+	if (seg->data_fd == -1)
+		goto Lclose_idx_fd;
+
+	if (fstat(seg->data_fd, &st) == -1)
+		goto Lclose_data_fd;
+
+	seg->data_size = st.st_size > 0 ? (size_t) st.st_size : HISTORY_DATA_SIZE;
+	if (ftruncate(seg->idx_fd, IDX_SIZE) == -1 || ftruncate(seg->data_fd, seg->data_size) == -1)
+		goto Lclose_data_fd;
+
+	seg->idx = mmap(NULL, IDX_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, seg->idx_fd, 0);
+	if (seg->idx == MAP_FAILED)
+		goto Lclose_data_fd;
+
+	seg->data = mmap(NULL, seg->data_size, PROT_READ|PROT_WRITE, MAP_SHARED, seg->data_fd, 0);
+	if (seg->data == MAP_FAILED)
+		goto Lunmap_idx;
+
+	// entries are written after their records, the first empty one ends the segment
+	int lo = 0, hi = HISTORY_SEG_RECORDS;
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+		if (seg->idx[mid].len != 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	seg->data_len = lo > 0 ? seg->idx[lo - 1].offset + seg->idx[lo - 1].len : 0;
+	return lo;
+
+Lunmap_idx:
+	munmap(seg->idx, IDX_SIZE);
+Lclose_data_fd:
+	close(seg->data_fd);
+Lclose_idx_fd:
+	close(seg->idx_fd);
+	seg->idx = NULL;
+	return -1;
+}
+
+
+// maps the pages in writable ahead of the loop storing there, from from on at least
+static void prefault(char* const addr, const size_t from, const size_t size)
+{
+	if (madvise(addr, size, MADV_POPULATE_WRITE) == 0)
+		return;
+
+	// kernels before 5.14, the loop isn't storing there yet
+	const size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t off = from; off < size; off += page)
+		((volatile char*) addr)[off] = addr[off];
+}
+
+
+static char* growData(const int fd, const size_t from, const size_t size)
+{
+	if (ftruncate(fd, size) == -1)
+		return MAP_FAILED;
+
+	char* const data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data != MAP_FAILED)
+		prefault(data, from, size);
+	return data;
+}
+
+
+static void* helperThread(void* const unused)
+{
+	((void)unused);
+
+	// signals are for the loop's thread
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&helper.lock);
+	for (;;) {
+		while (!helper.stop && helper.retired == NULL && helper.grow_fd == -1 && !helper.next_wanted)
+			pthread_cond_wait(&helper.cond, &helper.lock);
+		if (helper.stop)
+			break;
+
+		if (helper.retired != NULL) {
+			char* const addr = helper.retired;
+			const size_t size = helper.retired_size;
+			helper.retired = NULL;
+			pthread_mutex_unlock(&helper.lock);
+			munmap(addr, size);
+			pthread_mutex_lock(&helper.lock);
+		} else if (helper.grow_fd != -1) {
+			const int fd = helper.grow_fd;
+			const size_t from = helper.grow_from, size = helper.grow_size;
+			pthread_mutex_unlock(&helper.lock);
+			char* const data = growData(fd, from, size);
+			pthread_mutex_lock(&helper.lock);
+			helper.grown = data;
+			helper.grow_fd = -1;
+			helper.grow_done = true;
+			pthread_cond_broadcast(&helper.cond);
+		} else {
+			const uint64_t segno = helper.next_segno;
+			struct Segment seg;
+			pthread_mutex_unlock(&helper.lock);
+			if (openSegment(&seg, segno, true) != -1) {
+				prefault((char*) seg.idx, 0, IDX_SIZE);
+				prefault(seg.data, 0, seg.data_size);
+			}
+			pthread_mutex_lock(&helper.lock);
+			helper.next = seg;
+			helper.next_wanted = false;
+			helper.next_done = true;
+			pthread_cond_broadcast(&helper.cond);
+		}
+	}
+	pthread_mutex_unlock(&helper.lock);
+	return NULL;
+}
+
+
+static bool startHelper(void)
+{
+	helper.stop = false;
+	const int error = pthread_create(&helper.thread, NULL, &helperThread, NULL);
+	if (error != 0) {
+		errno = error;
+		return false;
+	}
+
+	helper.started = true;
+	return true;
+}
+
+
+// whatever the helper made and the loop didn't take is dropped
+static void stopHelper(void)
+{
+	if (!helper.started)
+		return;
+
+	pthread_mutex_lock(&helper.lock);
+	helper.stop = true;
+	pthread_cond_signal(&helper.cond);
+	pthread_mutex_unlock(&helper.lock);
+	pthread_join(helper.thread, NULL);
+	helper.started = false;
+
+	if (helper.retired != NULL)
+		munmap(helper.retired, helper.retired_size);
+	if (helper.grow_done && helper.grown != MAP_FAILED)
+		munmap(helper.grown, helper.grow_size);
+	if (helper.next_done)
+		closeSegment(&helper.next);
+
+	helper.retired = NULL;
+	helper.grow_fd = -1;
+	helper.next_wanted = helper.next_done = helper.grow_done = false;
+	helper.next_pending = helper.grow_pending = false;
+}
+
+
+static void retire(char* const addr, const size_t size)
+{
+	pthread_mutex_lock(&helper.lock);
+	const bool busy = helper.retired != NULL;
+	if (!busy) {
+		helper.retired = addr;
+		helper.retired_size = size;
+		pthread_cond_signal(&helper.cond);
+	}
+	pthread_mutex_unlock(&helper.lock);
+
+	if (busy)
+		munmap(addr, size);
+}
+
+
+static void askGrow(const struct Segment* const seg)
+{
+	pthread_mutex_lock(&helper.lock);
+	helper.grow_fd = seg->data_fd;
+	helper.grow_from = seg->data_size;
+	helper.grow_size = seg->data_size * 2;
+	helper.grow_segno = seg->segno;
+	pthread_cond_signal(&helper.cond);
+	pthread_mutex_unlock(&helper.lock);
+	helper.grow_pending = true;
+}
+
+
+static void askNext(const uint64_t segno)
+{
+	pthread_mutex_lock(&helper.lock);
+	helper.next_segno = segno;
+	helper.next_wanted = true;
+	pthread_cond_signal(&helper.cond);
+	pthread_mutex_unlock(&helper.lock);
+	helper.next_pending = true;
+}
+
+
+// puts the bigger mapping in place of the old one, false if there's none
+static bool swapGrown(void)
+{
+	if (!helper.grow_pending)
+		return false;
+	helper.grow_pending = false;
+
+	pthread_mutex_lock(&helper.lock);
+	while (!helper.grow_done)
+		pthread_cond_wait(&helper.cond, &helper.lock);
+	char* const data = helper.grown;
+	helper.grow_done = false;
+	pthread_mutex_unlock(&helper.lock);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	struct Segment* const seg = getSegment(helper.grow_segno);
+	retire(seg->data, seg->data_size);
+	seg->data = data;
+	seg->data_size = helper.grow_size;
+	return true;
+}
+
+
+// the segment the helper opened into its slot, false if there's none
+static bool swapNext(const uint64_t segno)
+{
+	if (!helper.next_pending)
+		return false;
+	helper.next_pending = false;
+
+	pthread_mutex_lock(&helper.lock);
+	while (!helper.next_done)
+		pthread_cond_wait(&helper.cond, &helper.lock);
+	struct Segment next = helper.next;
+	helper.next_done = false;
+	pthread_mutex_unlock(&helper.lock);
+
+	if (next.idx == NULL)
+		return false;
+	if (next.segno != segno) {
+		closeSegment(&next);
+		return false;
+	}
+
+	*getSegment(segno) = next;
+	return true;
+}
+
+
+static bool findLastSegment(uint64_t* const segno)
+{
+	DIR* const dir = fdopendir(dup(history.dirfd));
+	if (dir == NULL)
+		return false;
+
+	bool found = false;
+	const struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL) {
+		unsigned long long n;
+		char ext[4];
+		if (sscanf(ent->d_name, "%llu.%3s", &n, ext) == 2 && strcmp(ext, "idx") == 0) {
+			if (!found || n > *segno)
+				*segno = n;
+			found = true;
+		}
+	}
+
+	closedir(dir);
+	return found;
+}
+
+
+bool initializeHistory(const char* const dirpath)
+{
+	uint64_t last = 0;
+	int count;
+
+	if (dirpath != NULL) {
+		if (mkdir(dirpath, 0700) == -1 && errno != EEXIST) {
+			reportError("Couldn't create history directory");
+			return false;
+		}
+
+		history.dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
+		if (history.dirfd == -1) {
+			reportError("Couldn't open history directory");
+			return false;
+		}
+	}
+
+	if (history.dirfd == -1 || !findLastSegment(&last)) {
+		if ((count = openSegment(getSegment(0), 0, true)) == -1)
+			goto Lerror;
+	} else {
+		if ((count = openSegment(getSegment(last), last, false)) == -1)
+			goto Lerror;
+		// the helper may have made the next segment before anything went in it
+		const int prev = count == 0 && last > 0 ? openSegment(getSegment(last - 1), last - 1, false) : -1;
+		if (prev != -1) {
+			closeSegment(getSegment(last--));
+			count = prev;
+		}
+	}
+
+	history.first_seg = last;
+	while (history.first_seg > 0 && last - history.first_seg + 1 < HISTORY_MAX_SEGS &&
+	       openSegment(getSegment(history.first_seg - 1), history.first_seg - 1, false) != -1) {
+		--history.first_seg;
+	}
+
+	if (!startHelper()) {
+		reportError("Couldn't start the history thread");
+		terminateHistory();
+		return false;
+	}
+
+	history.end = last * HISTORY_SEG_RECORDS + count;
+	return true;
+
+Lerror:
+	reportError("Couldn't open history segment");
+	if (history.dirfd != -1)
+		close(history.dirfd);
+	history.dirfd = -1;
+	return false;
+}
+
+
+void terminateHistory(void)
+{
+	stopHelper();
+	for (int i = 0; i < HISTORY_MAX_SEGS; ++i)
+		closeSegment(&history.segs[i]);
+
+	if (history.dirfd != -1) {
+		close(history.dirfd);
+		history.dirfd = -1;
+	}
+}
+
+
+uint64_t historyBegin(void)
+{
+	return history.first_seg * HISTORY_SEG_RECORDS;
+}
+
+
+uint64_t historyEnd(void)
+{
+	return history.end;
+}
+
+
+/* returns space for a size bytes record at the tail of the log */
+static char* reserve(const size_t size)
+{
+	uint64_t segno = history.end / HISTORY_SEG_RECORDS;
+	struct Segment* seg = getSegment(segno);
+
+	if (seg->idx == NULL || seg->segno != segno) {
+		// rolls over to a new segment, dropping the oldest one if the ring is full
+		if (segno - history.first_seg >= (uint64_t) HISTORY_MAX_SEGS) {
+			closeSegment(seg);
+			unlinkSegmentFiles(history.first_seg++);
+		}
+		// a .log still growing belongs to the previous segment
+		swapGrown();
+		if (!swapNext(segno) && openSegment(seg, segno, true) == -1)
+			return NULL;
+	}
+
+	if (seg->data_len + size > seg->data_size && (!swapGrown() || seg->data_len + size > seg->data_size)) {
+		size_t newsize = seg->data_size * 2;
+		while (seg->data_len + size > newsize)
+			newsize *= 2;
+
+		if (ftruncate(seg->data_fd, newsize) == -1)
+			return NULL;
+
+		char* const data = mremap(seg->data, seg->data_size, newsize, MREMAP_MAYMOVE);
+		if (data == MAP_FAILED)
+			return NULL;
+
+		seg->data = data;
+		seg->data_size = newsize;
+	}
+
+	return seg->data + seg->data_len;
+}
+
+
+static void commit(const size_t size)
+{
+	struct Segment* const seg = getSegment(history.end / HISTORY_SEG_RECORDS);
+	struct IndexEntry* const entry = &seg->idx[history.end % HISTORY_SEG_RECORDS];
+	entry->offset = seg->data_len;
+	entry->len = size;
+	seg->data_len += size;
+	++history.end;
+
+	if (helper.started && !helper.grow_pending && seg->data_len > seg->data_size / 2)
+		askGrow(seg);
+	if (helper.started && !helper.next_pending && history.end % HISTORY_SEG_RECORDS >= HISTORY_SEG_RECORDS / 2)
+		askNext(history.end / HISTORY_SEG_RECORDS + 1);
+}
+
+
+bool historyPrintf(const enum FrameType type, const uint16_t channel, const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	if (len > FRAME_MAX_PAYLOAD)
+		return false;
+
+	// one extra byte for vsnprintf's terminator, it's overwritten by the next record
+	const size_t size = sizeof(struct FrameHeader) + len;
+	char* const rec = reserve(size + 1);
+	if (rec == NULL)
+		return false;
+
+	va_start(args, fmt);
+	vsnprintf(rec + sizeof(struct FrameHeader), len + 1, fmt, args);
+	va_end(args);
+
+	setFrameHeader((struct FrameHeader*) rec, type, len);
+	setFrameChannel((struct FrameHeader*) rec, channel);
+	commit(size);
+	return true;
+}
+
+
+bool historyAppend(const struct FrameHeader* const hdr, const void* const payload)
+{
+	const uint32_t len = getFrameLen(hdr);
+	const size_t size = sizeof(*hdr) + len;
+	char* const rec = reserve(size);
+	if (rec == NULL)
+		return false;
+
+	memcpy(rec, hdr, sizeof(*hdr));
+	memcpy(rec + sizeof(*hdr), payload, len);
+	commit(size);
+	return true;
+}
+
+
+static inline const struct FrameHeader* getRecord(const uint64_t seq)
+{
+	const struct Segment* const seg = getSegment(seq / HISTORY_SEG_RECORDS);
+	return (struct FrameHeader*) (seg->data + seg->idx[seq % HISTORY_SEG_RECORDS].offset);
+}
+
+
+enum FrameType historyGet(const uint64_t seq, const char** const payload, int* const len)
+{
+	const struct FrameHeader* const hdr = getRecord(seq);
+
+	*payload = (const char*) (hdr + 1);
+	*len = getFrameLen(hdr);
+	return (enum FrameType) hdr->type;
+}
+
+
+uint16_t historyChannel(const uint64_t seq)
+{
+	return getFrameChannel(getRecord(seq));
+}
+
+
+// local notices stay on the host, the client would drop them anyway
+static inline bool isReplayed(const struct ChannelSet* const filter, const uint64_t seq)
+{
+	const struct FrameHeader* const hdr = getRecord(seq);
+	return hdr->type != FRAME_INFO && channelSetHas(filter, getFrameChannel(hdr));
+}
+
+
+uint64_t historyTail(const struct ChannelSet* const filter, uint64_t count)
+{
+	uint64_t seq = history.end;
+	while (count > 0 && seq > historyBegin()) {
+		if (isReplayed(filter, --seq))
+			--count;
+	}
+
+	return seq;
+}
+
+
+/* sends the records [from, end) of the channels in filter as frames, one
+ * transport sendFile per run of consecutive ones, so a segment with no
+ * notices or unfollowed channels in it still takes a single call */
+bool historyReplay(struct Transport* const transport, uint64_t from,
+                   const struct ChannelSet* const filter)
+{
+	if (from < historyBegin())
+		from = historyBegin();
+
+	while (from < history.end) {
+		const uint64_t segno = from / HISTORY_SEG_RECORDS;
+		const struct Segment* const seg = getSegment(segno);
+		const uint64_t next = (segno + 1) * HISTORY_SEG_RECORDS;
+		const uint64_t last = next < history.end ? next : history.end;
+
+		while (from < last && !isReplayed(filter, from))
+			++from;
+		if (from == last)
+			continue;
+
+		uint64_t end = from + 1;
+		while (end < last && isReplayed(filter, end))
+			++end;
+
+		const off_t offset = seg->idx[from % HISTORY_SEG_RECORDS].offset;
+		const size_t size = end < last ? seg->idx[end % HISTORY_SEG_RECORDS].offset - offset
+		                               : seg->data_len - offset;
+		if (!transportSendFile(transport, seg->data_fd, offset, size)) {
+			reportError("Couldn't replay history");
+			return false;
+		}
+
+		metricsAdd(METRIC_SEND_CALLS, 1);
+		metricsAdd(METRIC_BYTES_OUT, size);
+		metricsAdd(METRIC_FRAMES_OUT, end - from);
+		from = end;
+	}
+
+	return true;
+}
@@ -0,0 +1,30 @@
+#ifndef CHAT_HISTORY_H_
+#define CHAT_HISTORY_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "proto.h"
+#include "transport.h"
+#include "channels.h"
+
+
+/* dirpath == NULL keeps the log in anonymous memory (memfd) */
+extern bool initializeHistory(const char* dirpath);
+extern void terminateHistory(void);
+
+extern uint64_t historyBegin(void);  // oldest sequence number still stored
+extern uint64_t historyEnd(void);    // sequence number of the next record
+
+extern bool historyPrintf(enum FrameType type, uint16_t channel, const char* fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+extern bool historyAppend(const struct FrameHeader* hdr, const void* payload);
+extern enum FrameType historyGet(uint64_t seq, const char** payload, int* len);
+extern uint16_t historyChannel(uint64_t seq);
+
+/* where the last count records of the channels in filter begin, FRAME_INFO
+ * ones aren't counted, nor replayed */
+extern uint64_t historyTail(const struct ChannelSet* filter, uint64_t count);
+/* sends the records of the channels in filter from from on */
+extern bool historyReplay(struct Transport* transport, uint64_t from, const struct ChannelSet* filter);
+
+
+#endif
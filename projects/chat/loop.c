@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "utils/debug.h"
+#include "loop.h"
+#include "report.h"
+
+
+#define LOOP_MAX_SOURCES ((int)32)
+#define LOOP_MAX_EVENTS  ((int)16)
+
+
+enum SourceKind {
+	SOURCE_NONE,
+	SOURCE_FD,      // fd owned by the caller
+	SOURCE_TIMER,   // timerfd, owned by the loop
+	SOURCE_WAKEUP   // eventfd, owned by the loop
+};
+
+
+/* a slot freed by a handler can be taken again before the rest of its
+ * batch is dispatched, so the events carry the slot's generation too */
+struct Source {
+	LoopHandler handler;
+	void* arg;
+	int fd;
+	uint32_t gen;         // bumped each time the slot is taken
+	enum SourceKind kind;
+};
+
+
+static struct Loop {
+	struct Source sources[LOOP_MAX_SOURCES];
+	LoopHandler on_interrupt;
+	void* on_interrupt_arg;
+	LoopHandler on_idle;
+	void* on_idle_arg;
+	int epfd;
+} loop = { .epfd = -1 };
+
+
+bool initializeLoop(void)
+{
+	memset(loop.sources, 0, sizeof(loop.sources));
+	loop.on_interrupt = NULL;
+	loop.on_idle = NULL;
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop.epfd == -1) {
+		reportError("Couldn't create epoll instance");
+		return false;
+	}
+	return true;
+}
+
+
+void terminateLoop(void)
+{
+	for (int i = 0; i < LOOP_MAX_SOURCES; ++i) {
+		struct Source* const src = &loop.sources[i];
+		if (src->kind == SOURCE_TIMER || src->kind == SOURCE_WAKEUP)
+			close(src->fd);
+		src->kind = SOURCE_NONE;
+	}
+
+	close(loop.epfd);
+	loop.epfd = -1;
+}
+
+
+static struct Source* findSource(const int fd)
+{
+	for (int i = 0; i < LOOP_MAX_SOURCES; ++i)
+		if (loop.sources[i].kind != SOURCE_NONE && loop.sources[i].fd == fd)
+			return &loop.sources[i];
+	return NULL;
+}
+
+
+static bool addSource(const int fd, const enum SourceKind kind, const uint32_t events,
+                      const LoopHandler handler, void* const arg)
+{
+	int slot = 0;
+	while (slot < LOOP_MAX_SOURCES && loop.sources[slot].kind != SOURCE_NONE)
+		++slot;
+
+	if (slot == LOOP_MAX_SOURCES) {
+		reportf("Too many event loop sources.");
+		return false;
+	}
+
+	struct Source* const src = &loop.sources[slot];
+	const uint32_t gen = src->gen + 1;
+	struct epoll_event ev = { .events = events, .data = { .u64 = (uint64_t) gen << 32 | slot } };
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		reportError("Couldn't add fd to epoll");
+		return false;
+	}
+
+	src->gen = gen;
+	src->handler = handler;
+	src->arg = arg;
+	src->fd = fd;
+	src->kind = kind;
+	return true;
+}
+
+
+static void removeSource(struct Source* const src)
+{
+	epoll_ctl(loop.epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	if (src->kind == SOURCE_TIMER || src->kind == SOURCE_WAKEUP)
+		close(src->fd);
+	src->kind = SOURCE_NONE;
+}
+
+
+bool loopAddFd(const int fd, const LoopHandler handler, void* const arg)
+{
+	return addSource(fd, SOURCE_FD, EPOLLIN, handler, arg);
+}
+
+
+bool loopAddWritable(const int fd, const LoopHandler handler, void* const arg)
+{
+	return addSource(fd, SOURCE_FD, EPOLLOUT, handler, arg);
+}
+
+
+void loopRemoveFd(const int fd)
+{
+	struct Source* const src = findSource(fd);
+	if (src != NULL)
+		removeSource(src);
+}
+
+
+int loopAddTimer(const int ms, const bool periodic, const LoopHandler handler, void* const arg)
+{
+	const int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (tfd == -1) {
+		reportError("Couldn't create timer");
+		return -1;
+	}
+
+	const struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	const struct itimerspec its = {
+		.it_interval = periodic ? ts : (struct timespec){ 0, 0 },
+		.it_value = ts
+	};
+
+	if (timerfd_settime(tfd, 0, &its, NULL) == -1 ||
+	    !addSource(tfd, SOURCE_TIMER, EPOLLIN, handler, arg)) {
+		close(tfd);
+		return -1;
+	}
+
+	return tfd;
+}
+
+
+int loopAddWakeup(const LoopHandler handler, void* const arg)
+{
+	const int efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (efd == -1) {
+		reportError("Couldn't create eventfd");
+		return -1;
+	}
+
+	if (!addSource(efd, SOURCE_WAKEUP, EPOLLIN, handler, arg)) {
+		close(efd);
+		return -1;
+	}
+
+	return efd;
+}
+
+
+void loopWakeup(const int efd)
+{
+	const uint64_t one = 1;
+	while (write(efd, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+}
+
+
+void loopCancel(const int fd)
+{
+	loopRemoveFd(fd);
+}
+
+
+void loopOnInterrupt(const LoopHandler handler, void* const arg)
+{
+	loop.on_interrupt = handler;
+	loop.on_interrupt_arg = arg;
+}
+
+
+void loopOnIdle(const LoopHandler handler, void* const arg)
+{
+	loop.on_idle = handler;
+	loop.on_idle_arg = arg;
+}
+
+
+static bool dispatch(struct Source* const src)
+{
+	if (src->kind == SOURCE_TIMER || src->kind == SOURCE_WAKEUP) {
+		// timerfd expirations and eventfd counters must be consumed
+		uint64_t count;
+		if (read(src->fd, &count, sizeof(count)) != sizeof(count))
+			return true;
+	}
+
+	return src->handler(src->fd, src->arg);
+}
+
+
+void runLoop(void)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+
+	for (;;) {
+		const int n = epoll_wait(loop.epfd, events, LOOP_MAX_EVENTS, -1);
+
+		if (n == -1) {
+			if (errno != EINTR) {
+				reportError("epoll_wait");
+				return;
+			}
+			if (loop.on_interrupt != NULL && !loop.on_interrupt(-1, loop.on_interrupt_arg))
+				return;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			struct Source* const src = &loop.sources[(uint32_t) events[i].data.u64];
+			// a previous handler of this batch may have removed it, or reused the slot
+			if (src->kind == SOURCE_NONE || src->gen != (uint32_t)(events[i].data.u64 >> 32))
+				continue;
+			TRACE_SPAN("dispatch", src->fd, src->kind);
+			if (!dispatch(src))
+				return;
+		}
+
+		if (loop.on_idle != NULL && !loop.on_idle(-1, loop.on_idle_arg))
+			return;
+	}
+}
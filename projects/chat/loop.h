@@ -0,0 +1,36 @@
+#ifndef CHAT_LOOP_H_
+#define CHAT_LOOP_H_
+#include <stdbool.h>
+
+
+/* handlers return false to stop runLoop() */
+typedef bool (*LoopHandler)(int fd, void* arg);
+
+
+extern bool initializeLoop(void);
+extern void terminateLoop(void);
+
+extern bool loopAddFd(int fd, LoopHandler handler, void* arg);
+/* like loopAddFd(), but for when fd becomes writable, e.g. a connect() finishing */
+extern bool loopAddWritable(int fd, LoopHandler handler, void* arg);
+extern void loopRemoveFd(int fd);
+
+/* timerfd based, returns the timer's fd (usable with loopCancel) or -1 */
+extern int loopAddTimer(int ms, bool periodic, LoopHandler handler, void* arg);
+/* eventfd based, returns the fd to pass to loopWakeup() or -1.
+ * loopWakeup() is safe to call from any thread */
+extern int loopAddWakeup(LoopHandler handler, void* arg);
+extern void loopWakeup(int efd);
+extern void loopCancel(int fd);
+
+/* called when a signal interrupts the wait, e.g. SIGWINCH */
+extern void loopOnInterrupt(LoopHandler handler, void* arg);
+
+/* called once after each batch of events, e.g. to flush queued writes */
+extern void loopOnIdle(LoopHandler handler, void* arg);
+
+/* blocks in epoll_wait until a handler returns false */
+extern void runLoop(void);
+
+
+#endif
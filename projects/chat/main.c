@@ -1,19 +1,299 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include "chat.h"
 
 
-int main(const int argc, const char* const * const argv)
+#define CONFIG_LINE_SIZE ((int)256)
+#define PATH_SIZE        ((int)4096)
+
+
+static const char* const short_opts = "u:p:H:nc:l:ztC:K:A:M:SD:L:";
+static const struct option long_opts[] = {
+	{"user", required_argument, NULL, 'u'},
+	{"port", required_argument, NULL, 'p'},
+	{"host", required_argument, NULL, 'H'},
+	{"no-upnp", no_argument, NULL, 'n'},
+	{"config", required_argument, NULL, 'c'},
+	{"history", required_argument, NULL, 'l'},
+	{"no-compress", no_argument, NULL, 'z'},
+	{"tls", no_argument, NULL, 't'},
+	{"cert", required_argument, NULL, 'C'},
+	{"key", required_argument, NULL, 'K'},
+	{"ca", required_argument, NULL, 'A'},
+	{"metrics", required_argument, NULL, 'M'},
+	{"no-shm", no_argument, NULL, 'S'},
+	{"downloads", required_argument, NULL, 'D'},
+	{"log", required_argument, NULL, 'L'},
+	{NULL, 0, NULL, 0}
+};
+
+static char cfg_uname[UNAME_SIZE];
+static char cfg_port[PORT_STR_SIZE];
+static char cfg_host[HOST_STR_SIZE];
+static char cfg_history[PATH_SIZE];
+static char cfg_cert[PATH_SIZE];
+static char cfg_key[PATH_SIZE];
+static char cfg_ca[PATH_SIZE];
+static char cfg_metrics[PATH_SIZE];
+static char cfg_downloads[PATH_SIZE];
+static char cfg_log[PATH_SIZE];
+
+
+static bool setOpt(char* const dest, const char* const src, const int size, const char* const name)
 {
-	if (argc > 1) {
-		if (strcmp(argv[1], "client") == 0)
-			return chat(CONMODE_CLIENT);
-		else if (strcmp(argv[1], "host") == 0)
-			return chat(CONMODE_HOST);
+	if ((int)strlen(src) >= size) {
+		fprintf(stderr, "Value for \'%s\' is too long (max %d).\n", name, size - 1);
+		return false;
 	}
+	strcpy(dest, src);
+	return true;
+}
 
-	fprintf(stderr, "Usage: %s [type: host, client]\n", argv[0]);
-	return EXIT_FAILURE;
+
+static char* trim(char* str)
+{
+	while (isspace((unsigned char)*str))
+		++str;
+	char* end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		--end;
+	*end = '\0';
+	return str;
+}
+
+
+/* config file format: one "key = value" pair per line, '#' starts a comment.
+ * keys: user, port, host, history, upnp (yes/no), compress (yes/no),
+ * tls (yes/no), cert, key, ca, metrics, shm (yes/no), downloads, log.
+ * Values already given on the command line take precedence over the file.
+ * */
+static bool loadConfig(const char* const path, struct ConnectionConfig* const cfg, const bool required)
+{
+	FILE* const file = fopen(path, "r");
+	if (file == NULL) {
+		if (required)
+			perror(path);
+		return !required;
+	}
+
+	char line[CONFIG_LINE_SIZE];
+	int lineno = 0;
+	bool ret = true;
+
+	while (ret && fgets(line, sizeof(line), file) != NULL) {
+		++lineno;
+		char* const comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+
+		char* const eq = strchr(line, '=');
+		if (eq == NULL) {
+			if (*trim(line) != '\0') {
+				fprintf(stderr, "%s:%d: expected \'key = value\'.\n", path, lineno);
+				ret = false;
+			}
+			continue;
+		}
+
+		*eq = '\0';
+		const char* const key = trim(line);
+		const char* const val = trim(eq + 1);
+
+		if (strcmp(key, "user") == 0) {
+			if (cfg->uname == NULL && (ret = setOpt(cfg_uname, val, UNAME_SIZE, key)))
+				cfg->uname = cfg_uname;
+		} else if (strcmp(key, "port") == 0) {
+			if (cfg->port == NULL && (ret = setOpt(cfg_port, val, PORT_STR_SIZE, key)))
+				cfg->port = cfg_port;
+		} else if (strcmp(key, "host") == 0) {
+			if (cfg->host == NULL && (ret = setOpt(cfg_host, val, HOST_STR_SIZE, key)))
+				cfg->host = cfg_host;
+		} else if (strcmp(key, "history") == 0) {
+			if (cfg->history == NULL && (ret = setOpt(cfg_history, val, PATH_SIZE, key)))
+				cfg->history = cfg_history;
+		} else if (strcmp(key, "upnp") == 0) {
+			if (strcmp(val, "no") == 0 || strcmp(val, "0") == 0)
+				cfg->upnp = false;
+		} else if (strcmp(key, "compress") == 0) {
+			if (strcmp(val, "no") == 0 || strcmp(val, "0") == 0)
+				cfg->compress = false;
+		} else if (strcmp(key, "shm") == 0) {
+			if (strcmp(val, "no") == 0 || strcmp(val, "0") == 0)
+				cfg->shm = false;
+		} else if (strcmp(key, "tls") == 0) {
+			if (strcmp(val, "yes") == 0 || strcmp(val, "1") == 0)
+				cfg->tls = true;
+		} else if (strcmp(key, "cert") == 0) {
+			if (cfg->cert == NULL && (ret = setOpt(cfg_cert, val, PATH_SIZE, key)))
+				cfg->cert = cfg_cert;
+		} else if (strcmp(key, "key") == 0) {
+			if (cfg->key == NULL && (ret = setOpt(cfg_key, val, PATH_SIZE, key)))
+				cfg->key = cfg_key;
+		} else if (strcmp(key, "ca") == 0) {
+			if (cfg->ca == NULL && (ret = setOpt(cfg_ca, val, PATH_SIZE, key)))
+				cfg->ca = cfg_ca;
+		} else if (strcmp(key, "downloads") == 0) {
+			if (cfg->downloads == NULL && (ret = setOpt(cfg_downloads, val, PATH_SIZE, key)))
+				cfg->downloads = cfg_downloads;
+		} else if (strcmp(key, "metrics") == 0) {
+			if (cfg->metrics == NULL && (ret = setOpt(cfg_metrics, val, PATH_SIZE, key)))
+				cfg->metrics = cfg_metrics;
+		} else if (strcmp(key, "log") == 0) {
+			if (cfg->log == NULL && (ret = setOpt(cfg_log, val, PATH_SIZE, key)))
+				cfg->log = cfg_log;
+		} else {
+			fprintf(stderr, "%s:%d: unknown key \'%s\'.\n", path, lineno, key);
+			ret = false;
+		}
+	}
+
+	fclose(file);
+	return ret;
 }
 
+
+static bool getOpts(const int argc, char* const* argv, struct ConnectionConfig* const cfg)
+{
+	const char* config_path = NULL;
+	int c;
+
+	while ((c = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!setOpt(cfg_uname, optarg, UNAME_SIZE, "user"))
+				return false;
+			cfg->uname = cfg_uname;
+			break;
+		case 'p':
+			if (!setOpt(cfg_port, optarg, PORT_STR_SIZE, "port"))
+				return false;
+			cfg->port = cfg_port;
+			break;
+		case 'H':
+			if (!setOpt(cfg_host, optarg, HOST_STR_SIZE, "host"))
+				return false;
+			cfg->host = cfg_host;
+			break;
+		case 'l':
+			if (!setOpt(cfg_history, optarg, PATH_SIZE, "history"))
+				return false;
+			cfg->history = cfg_history;
+			break;
+		case 'C':
+			if (!setOpt(cfg_cert, optarg, PATH_SIZE, "cert"))
+				return false;
+			cfg->cert = cfg_cert;
+			break;
+		case 'K':
+			if (!setOpt(cfg_key, optarg, PATH_SIZE, "key"))
+				return false;
+			cfg->key = cfg_key;
+			break;
+		case 'A':
+			if (!setOpt(cfg_ca, optarg, PATH_SIZE, "ca"))
+				return false;
+			cfg->ca = cfg_ca;
+			break;
+		case 'D':
+			if (!setOpt(cfg_downloads, optarg, PATH_SIZE, "downloads"))
+				return false;
+			cfg->downloads = cfg_downloads;
+			break;
+		case 'M':
+			if (!setOpt(cfg_metrics, optarg, PATH_SIZE, "metrics"))
+				return false;
+			cfg->metrics = cfg_metrics;
+			break;
+		case 'L':
+			if (!setOpt(cfg_log, optarg, PATH_SIZE, "log"))
+				return false;
+			cfg->log = cfg_log;
+			break;
+		case 'n': cfg->upnp = false; break;
+		case 't': cfg->tls = true; break;
+		case 'z': cfg->compress = false; break;
+		case 'S': cfg->shm = false; break;
+		case 'c': config_path = optarg; break;
+		default: return false;
+		}
+	}
+
+	const char* const home = getenv("HOME");
+
+	if (config_path != NULL) {
+		if (!loadConfig(config_path, cfg, true))
+			return false;
+	} else if (home != NULL) {
+		char path[strlen(home) + sizeof("/.chatrc")];
+		sprintf(path, "%s/.chatrc", home);
+		if (!loadConfig(path, cfg, false))
+			return false;
+	}
+
+	if (cfg->history == NULL) {
+		snprintf(cfg_history, PATH_SIZE, "%s/.chat_history", home != NULL ? home : ".");
+		cfg->history = cfg_history;
+	}
+
+	// ~/Downloads if there is one
+	if (cfg->downloads == NULL) {
+		struct stat st;
+		snprintf(cfg_downloads, PATH_SIZE, "%s/Downloads", home != NULL ? home : ".");
+		if (stat(cfg_downloads, &st) == -1 || !S_ISDIR(st.st_mode))
+			snprintf(cfg_downloads, PATH_SIZE, ".");
+		cfg->downloads = cfg_downloads;
+	}
+
+	return true;
+}
+
+
+int main(const int argc, char* const* const argv)
+{
+	struct ConnectionConfig cfg = {
+		.uname = NULL,
+		.port = NULL,
+		.host = NULL,
+		.history = NULL,
+		.upnp = true,
+		.compress = true,
+		.tls = false,
+		.cert = NULL,
+		.key = NULL,
+		.ca = NULL,
+		.metrics = NULL,
+		.shm = true,
+		.downloads = NULL,
+		.log = NULL
+	};
+
+	if (getOpts(argc, argv, &cfg) && optind < argc) {
+		if (strcmp(argv[optind], "client") == 0)
+			return chat(CONMODE_CLIENT, &cfg);
+		else if (strcmp(argv[optind], "host") == 0)
+			return chat(CONMODE_HOST, &cfg);
+	}
+
+	fprintf(stderr, "Usage: %s [type: host, client] [options]\n"
+	                "  -u, --user NAME     username\n"
+	                "  -p, --port PORT     connection port\n"
+	                "  -H, --host ADDR     host address to connect to (client)\n"
+	                "  -n, --no-upnp       skip UPnP port mapping (host)\n"
+	                "  -z, --no-compress   don't compress messages\n"
+	                "  -S, --no-shm        always use TCP, even with a peer on this machine\n"
+	                "  -t, --tls           encrypt the connection, both ends need it\n"
+	                "  -C, --cert FILE     TLS certificate chain (host, default self-signed)\n"
+	                "  -K, --key FILE      TLS private key (host, default in --cert)\n"
+	                "  -A, --ca FILE       verify the host's certificate against FILE (client)\n"
+	                "  -M, --metrics PATH  serve Prometheus metrics on unix socket PATH\n"
+	                "  -D, --downloads DIR files sent by the peer go here (default ~/Downloads)\n"
+	                "  -l, --history DIR   history log directory (host, default ~/.chat_history)\n"
+	                "  -L, --log FILE      append connection events to FILE\n"
+	                "  -c, --config FILE   read options from FILE (default ~/.chatrc)\n",
+	                argv[0]);
+	return EXIT_FAILURE;
+}
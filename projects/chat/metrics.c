@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+#include "loop.h"
+
+
+/* Every thread that records something gets its own slot, aligned to a cache
+ * line so no two threads ever write the same line, and updates it with
+ * plain (relaxed) loads and stores. Scrapes add the slots up, a value read
+ * mid-update is just one event behind. Threads past the last slot share it
+ * with atomic adds. Timings go in log2 buckets from 1us to 0.5s.
+ * */
+#define METRICS_MAX_THREADS ((int)8)
+#define METRICS_MAX_CLIENTS ((int)4)
+#define METRICS_TEXT_SIZE   ((int)(32 * 1024))
+#define HIST_BUCKETS        ((int)20)    // le 2^10 ns .. le 2^29 ns, then +Inf
+#define HIST_SHIFT          ((int)10)
+#define CACHE_LINE          64
+#define PEER_SIZE           ((int)32)
+
+
+struct Slot {
+	uint64_t counters[METRIC_COUNT];
+	uint64_t buckets[TIMING_COUNT][HIST_BUCKETS + 1];
+	uint64_t sum_ns[TIMING_COUNT];
+} __attribute__((aligned(CACHE_LINE)));
+
+
+struct CounterInfo {
+	const char* name;
+	const char* label;
+	const char* help;
+	bool per_connection;
+};
+
+
+static const struct CounterInfo counter_info[METRIC_COUNT] = {
+	[METRIC_BYTES_IN] = { "chat_bytes_total", "direction=\"in\"", "Bytes through the transport.", true },
+	[METRIC_BYTES_OUT] = { "chat_bytes_total", "direction=\"out\"", NULL, true },
+	[METRIC_FRAMES_IN] = { "chat_frames_total", "direction=\"in\"", "Frames of any type.", true },
+	[METRIC_FRAMES_OUT] = { "chat_frames_total", "direction=\"out\"", NULL, true },
+	[METRIC_MSGS_IN] = { "chat_messages_total", "direction=\"in\"", "Chat messages.", true },
+	[METRIC_MSGS_OUT] = { "chat_messages_total", "direction=\"out\"", NULL, true },
+	[METRIC_RECV_CALLS] = { "chat_transport_calls_total", "call=\"recv\"", "Transport recv/send calls.", true },
+	[METRIC_SEND_CALLS] = { "chat_transport_calls_total", "call=\"send\"", NULL, true },
+	[METRIC_LOOP_TICKS] = { "chat_loop_ticks_total", NULL, "Event loop wakeups.", false },
+	[METRIC_CONNECTIONS] = { "chat_connections_total", NULL, "Sessions started or resumed.", false }
+};
+
+
+static const char* const gauge_info[GAUGE_COUNT][2] = {
+	[GAUGE_CONNECTED] = { "chat_connected", "1 while the peer is connected." },
+	[GAUGE_RECV_BUFFERED] = { "chat_recv_buffered_bytes", "Partial frames waiting for the rest." },
+	[GAUGE_SENDQ_BATCH] = { "chat_sendq_batch_bytes", "Size of the last send queue flush." },
+	[GAUGE_OUTBOX] = { "chat_outbox_messages", "Messages kept to resend on a resume." }
+};
+
+
+static const char* const timing_info[TIMING_COUNT][2] = {
+	[TIMING_READ] = { "chat_read_seconds", "One transport recv." },
+	[TIMING_PARSE] = { "chat_parse_seconds", "Handling one incoming frame." },
+	[TIMING_FANOUT] = { "chat_fanout_seconds", "Flushing the send queue." },
+	[TIMING_RENDER] = { "chat_render_seconds", "Redrawing the screen." }
+};
+
+
+static struct Metrics {
+	struct Slot slots[METRICS_MAX_THREADS];
+	int nslots;                          // claimed, may run past METRICS_MAX_THREADS
+	int64_t gauges[GAUGE_COUNT];
+	uint64_t mark[METRIC_COUNT];         // totals when the connection started
+	char peer[PEER_SIZE];                // label value, escaped
+	int clients[METRICS_MAX_CLIENTS];    // scrapes waiting for their request
+	int next_client;
+	int listen_fd;
+	int dump_efd;
+	void (*notify)(const char* msg);
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	char text[METRICS_TEXT_SIZE];
+	int len;
+} metrics = { .listen_fd = -1, .dump_efd = -1 };
+
+
+static __thread struct Slot* self = NULL;
+static __thread bool shared = false;
+
+
+static inline struct Slot* getSlot(void)
+{
+	if (self == NULL) {
+		const int i = __atomic_fetch_add(&metrics.nslots, 1, __ATOMIC_RELAXED);
+		shared = i >= METRICS_MAX_THREADS - 1;
+		self = &metrics.slots[shared ? METRICS_MAX_THREADS - 1 : i];
+	}
+	return self;
+}
+
+
+static inline void bump(uint64_t* const p, const uint64_t value)
+{
+	if (shared)
+		__atomic_fetch_add(p, value, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+
+void metricsAdd(const enum Metric metric, const uint64_t value)
+{
+	struct Slot* const slot = getSlot();
+	bump(&slot->counters[metric], value);
+}
+
+
+void metricsSet(const enum Gauge gauge, const int64_t value)
+{
+	__atomic_store_n(&metrics.gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+
+uint64_t metricsClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void metricsObserve(const enum Timing timing, const uint64_t start)
+{
+	const uint64_t ns = metricsClock() - start;
+	int bucket = 0;
+	if (ns > (1ull << HIST_SHIFT)) {
+		bucket = 64 - __builtin_clzll(ns - 1) - HIST_SHIFT;
+		if (bucket > HIST_BUCKETS)
+			bucket = HIST_BUCKETS;
+	}
+
+	struct Slot* const slot = getSlot();
+	bump(&slot->buckets[timing][bucket], 1);
+	bump(&slot->sum_ns[timing], ns);
+}
+
+
+static uint64_t sumSlots(const uint64_t* const first)
+{
+	// same offset in every slot
+	const size_t offset = (const char*) first - (const char*) &metrics.slots[0];
+	int n = __atomic_load_n(&metrics.nslots, __ATOMIC_RELAXED);
+	if (n > METRICS_MAX_THREADS)
+		n = METRICS_MAX_THREADS;
+
+	uint64_t sum = 0;
+	for (int i = 0; i < n; ++i)
+		sum += __atomic_load_n((const uint64_t*)((const char*) &metrics.slots[i] + offset),
+		                       __ATOMIC_RELAXED);
+	return sum;
+}
+
+
+void metricsMarkConnection(const char* const peer)
+{
+	for (int i = 0; i < METRIC_COUNT; ++i)
+		metrics.mark[i] = sumSlots(&metrics.slots[0].counters[i]);
+
+	// label values need \, " and newlines escaped
+	int len = 0;
+	for (const char* c = peer; *c != '\0' && len < PEER_SIZE - 3; ++c) {
+		if (*c == '\\' || *c == '"' || *c == '\n')
+			metrics.peer[len++] = '\\';
+		metrics.peer[len++] = *c == '\n' ? 'n' : *c;
+	}
+	metrics.peer[len] = '\0';
+}
+
+
+static void appendf(const char* const fmt, ...)
+{
+	if (metrics.len >= METRICS_TEXT_SIZE - 1)
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	const int n = vsnprintf(&metrics.text[metrics.len], METRICS_TEXT_SIZE - metrics.len, fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		metrics.len += n < METRICS_TEXT_SIZE - metrics.len ? n : METRICS_TEXT_SIZE - 1 - metrics.len;
+}
+
+
+static void formatCounters(const bool per_connection)
+{
+	for (int i = 0; i < METRIC_COUNT; ++i) {
+		const struct CounterInfo* const info = &counter_info[i];
+		if (per_connection && !info->per_connection)
+			continue;
+
+		uint64_t value = sumSlots(&metrics.slots[0].counters[i]);
+		char name[64];
+		if (per_connection) {
+			snprintf(name, sizeof(name), "chat_connection_%s", info->name + strlen("chat_"));
+			value -= metrics.mark[i];
+		} else {
+			snprintf(name, sizeof(name), "%s", info->name);
+		}
+
+		if (info->help != NULL)
+			appendf("# HELP %s %s%s\n# TYPE %s counter\n", name, info->help,
+			        per_connection ? " Current connection." : "", name);
+
+		if (per_connection)
+			appendf("%s{peer=\"%s\",%s} %llu\n", name, metrics.peer, info->label,
+			        (unsigned long long) value);
+		else if (info->label != NULL)
+			appendf("%s{%s} %llu\n", name, info->label, (unsigned long long) value);
+		else
+			appendf("%s %llu\n", name, (unsigned long long) value);
+	}
+}
+
+
+static void formatHistogram(const enum Timing timing)
+{
+	const char* const name = timing_info[timing][0];
+	appendf("# HELP %s %s\n# TYPE %s histogram\n", name, timing_info[timing][1], name);
+
+	uint64_t count = 0;
+	for (int i = 0; i < HIST_BUCKETS; ++i) {
+		count += sumSlots(&metrics.slots[0].buckets[timing][i]);
+		appendf("%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ull << (HIST_SHIFT + i)) / 1e9,
+		        (unsigned long long) count);
+	}
+
+	count += sumSlots(&metrics.slots[0].buckets[timing][HIST_BUCKETS]);
+	appendf("%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+	appendf("%s_sum %.9f\n", name, (double) sumSlots(&metrics.slots[0].sum_ns[timing]) / 1e9);
+	appendf("%s_count %llu\n", name, (unsigned long long) count);
+}
+
+
+// Prometheus text exposition format into metrics.text
+static void formatMetrics(void)
+{
+	metrics.len = 0;
+	formatCounters(false);
+	if (metrics.peer[0] != '\0')
+		formatCounters(true);
+
+	for (int i = 0; i < GAUGE_COUNT; ++i) {
+		const char* const name = gauge_info[i][0];
+		appendf("# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, gauge_info[i][1], name, name,
+		        (long long) __atomic_load_n(&metrics.gauges[i], __ATOMIC_RELAXED));
+	}
+
+	for (int i = 0; i < TIMING_COUNT; ++i)
+		formatHistogram((enum Timing) i);
+}
+
+
+static bool writeAll(const int fd, const char* buf, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+static void closeClient(const int i)
+{
+	loopRemoveFd(metrics.clients[i]);
+	close(metrics.clients[i]);
+	metrics.clients[i] = -1;
+}
+
+
+// the request itself doesn't matter, every one gets the metrics
+static bool onRequest(const int fd, void* const arg)
+{
+	const int i = (int)(intptr_t) arg;
+	char request[1024];
+	if (read(fd, request, sizeof(request)) > 0) {
+		formatMetrics();
+		char header[128];
+		const int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+		                       "Content-Type: text/plain; version=0.0.4\r\n"
+		                       "Content-Length: %d\r\n\r\n", metrics.len);
+		// a few KiB into an idle unix socket, this doesn't block for long
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		if (writeAll(fd, header, n))
+			writeAll(fd, metrics.text, metrics.len);
+	}
+
+	closeClient(i);
+	return true;
+}
+
+
+static bool onScrape(const int fd, void* const arg)
+{
+	((void)arg);
+	const int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (client == -1)
+		return true;
+
+	// a scraper that never sends its request makes room for the next one
+	const int i = metrics.next_client;
+	metrics.next_client = (i + 1) % METRICS_MAX_CLIENTS;
+	if (metrics.clients[i] != -1)
+		closeClient(i);
+
+	if (!loopAddFd(client, onRequest, (void*)(intptr_t) i)) {
+		close(client);
+		return true;
+	}
+
+	metrics.clients[i] = client;
+	return true;
+}
+
+
+static bool onDump(const int fd, void* const arg)
+{
+	((void)fd);
+	((void)arg);
+	formatMetrics();
+
+	// stderr is under ncurses when it's the terminal
+	if (!isatty(STDERR_FILENO)) {
+		writeAll(STDERR_FILENO, metrics.text, metrics.len);
+		return true;
+	}
+
+	const char* const dir = getenv("XDG_RUNTIME_DIR");
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/chat-%d.metrics", dir != NULL ? dir : "/tmp", (int) getpid());
+
+	char msg[4200];
+	const int out = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (out == -1 || !writeAll(out, metrics.text, metrics.len))
+		snprintf(msg, sizeof(msg), "Couldn't write metrics to %s: %s.", path, strerror(errno));
+	else
+		snprintf(msg, sizeof(msg), "Metrics written to %s.", path);
+
+	if (out != -1)
+		close(out);
+	if (metrics.notify != NULL)
+		metrics.notify(msg);
+	return true;
+}
+
+
+static void onSigusr1(const int sig)
+{
+	((void)sig);
+	const int saved = errno;
+	loopWakeup(metrics.dump_efd);
+	errno = saved;
+}
+
+
+static bool listenMetrics(const char* const path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Metrics socket path is too long: %s\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	// a socket left behind by a crash, but nothing else
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	metrics.listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (metrics.listen_fd == -1) {
+		perror("Couldn't create metrics socket");
+		return false;
+	}
+
+	// created 0600, it's never there for anybody else to connect to
+	const mode_t mask = umask(0177);
+	const int bound = bind(metrics.listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+	umask(mask);
+	if (bound == -1) {
+		perror(path);
+		goto Lclose_fd;
+	}
+
+	strcpy(metrics.path, path);
+
+	if (listen(metrics.listen_fd, METRICS_MAX_CLIENTS) == -1) {
+		perror("Couldn't listen on metrics socket");
+		goto Lunlink;
+	}
+
+	if (!loopAddFd(metrics.listen_fd, onScrape, NULL))
+		goto Lunlink;
+
+	return true;
+
+Lunlink:
+	unlink(metrics.path);
+	metrics.path[0] = '\0';
+Lclose_fd:
+	close(metrics.listen_fd);
+	metrics.listen_fd = -1;
+	return false;
+}
+
+
+bool initializeMetrics(const char* const path, void (*const notify)(const char* msg))
+{
+	metrics.notify = notify;
+	metrics.peer[0] = '\0';
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+		metrics.clients[i] = -1;
+
+	if ((metrics.dump_efd = loopAddWakeup(onDump, NULL)) == -1)
+		return false;
+
+	if (path != NULL && !listenMetrics(path)) {
+		loopCancel(metrics.dump_efd);
+		metrics.dump_efd = -1;
+		return false;
+	}
+
+	struct sigaction sa = { .sa_handler = onSigusr1, .sa_flags = SA_RESTART };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	return true;
+}
+
+
+void terminateMetrics(void)
+{
+	signal(SIGUSR1, SIG_DFL);
+
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+		if (metrics.clients[i] != -1)
+			closeClient(i);
+
+	if (metrics.listen_fd != -1) {
+		loopRemoveFd(metrics.listen_fd);
+		close(metrics.listen_fd);
+		unlink(metrics.path);
+		metrics.listen_fd = -1;
+		metrics.path[0] = '\0';
+	}
+
+	if (metrics.dump_efd != -1) {
+		loopCancel(metrics.dump_efd);
+		metrics.dump_efd = -1;
+	}
+
+	metrics.notify = NULL;
+}
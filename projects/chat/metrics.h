@@ -0,0 +1,56 @@
+#ifndef CHAT_METRICS_H_
+#define CHAT_METRICS_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+
+enum Metric {
+	METRIC_BYTES_IN,      // read from the transport
+	METRIC_BYTES_OUT,     // written to it, headers included
+	METRIC_FRAMES_IN,
+	METRIC_FRAMES_OUT,
+	METRIC_MSGS_IN,       // FRAME_MSG frames
+	METRIC_MSGS_OUT,
+	METRIC_RECV_CALLS,    // transport recv/send calls
+	METRIC_SEND_CALLS,
+	METRIC_LOOP_TICKS,    // event loop batches
+	METRIC_CONNECTIONS,   // sessions started or resumed
+	METRIC_COUNT
+};
+
+
+enum Gauge {
+	GAUGE_CONNECTED,      // 1 while the peer is connected
+	GAUGE_RECV_BUFFERED,  // bytes of partial frames waiting for the rest
+	GAUGE_SENDQ_BATCH,    // bytes in the last send queue flush
+	GAUGE_OUTBOX,         // messages kept for a resume
+	GAUGE_COUNT
+};
+
+
+enum Timing {
+	TIMING_READ,          // one transport recv
+	TIMING_PARSE,         // handling one frame
+	TIMING_FANOUT,        // flushing the send queue
+	TIMING_RENDER,        // redrawing the screen
+	TIMING_COUNT
+};
+
+
+/* path is the unix socket that serves the Prometheus text format, NULL for
+ * none. Needs the event loop, SIGUSR1 dumps the same text to stderr, or to
+ * a file when stderr is the terminal; notify says where (from the loop) */
+extern bool initializeMetrics(const char* path, void (*notify)(const char* msg));
+extern void terminateMetrics(void);
+
+/* cheap enough for the hot path, and safe from any thread */
+extern void metricsAdd(enum Metric metric, uint64_t value);
+extern void metricsSet(enum Gauge gauge, int64_t value);
+extern uint64_t metricsClock(void);                        // monotonic ns
+extern void metricsObserve(enum Timing timing, uint64_t start);  // start from metricsClock()
+
+/* counters from here on are reported per connection too, labeled peer */
+extern void metricsMarkConnection(const char* peer);
+
+
+#endif
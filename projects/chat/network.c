@@ -1,24 +1,226 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <endian.h>
 #include "utils/io.h"
 #include "network.h"
 #include "upnp.h"
+#include "connector.h"
+#include "shm.h"
+#include "report.h"
 
+/* the whole handshake, TLS included. Reconnects run it inside the event
+ * loop, a peer that stops halfway mustn't freeze the chat for longer */
+#define HANDSHAKE_TIMEOUT_MS ((int)5000)
 
-static inline bool host(void);
+
+static inline bool host(bool upnp);
+static inline bool acceptClient(void);
 static inline bool client(void);
-void upnpSigHandler(int sig);
+static bool clientConnected(int fd);
+
+
+static struct ConnectionInfo cinfo = { .local_fd = -1, .remote_fd = -1 };
+static const struct ConnectionConfig* config = NULL;  // kept for reconnects
+static char conn_host[HOST_STR_SIZE];                 // client, the host to (re)connect to
+static ReconnectDone reconnect_done = NULL;           // client, pending async reconnect
+static uint64_t reconnect_seq = 0;
+
+
+/* last part of the handshake, the client tells which session it had and
+ * how many messages of it arrived, the host answers the same way */
+struct SessionHello {
+	uint8_t token[SESSION_TOKEN_SIZE];
+	uint64_t recv_seq;   // network byte order
+};
+
+
+/* numeric form of addr, IPv4 clients of the dual-stack socket
+ * show up as ::ffff:a.b.c.d and are printed as a.b.c.d */
+static bool formatAddr(const struct sockaddr* const addr, const socklen_t len, char* const dest)
+{
+	if (getnameinfo(addr, len, dest, IP_STR_SIZE, NULL, 0, NI_NUMERICHOST) != 0)
+		return false;
+
+	if (strncmp(dest, "::ffff:", 7) == 0 && strchr(dest, '.') != NULL)
+		memmove(dest, dest + 7, strlen(dest + 7) + 1);
+	return true;
+}
 
 
-static struct ConnectionInfo cinfo;
+/* frames are batched per loop tick by the send queue, so Nagle would
+ * only add delayed-ACK stalls on top of it */
+static bool setNoDelay(const int fd)
+{
+	const int optionval = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optionval, sizeof(int)) == -1) {
+		reportError("Couldn't set TCP_NODELAY");
+		return false;
+	}
+	return true;
+}
 
 
-const struct ConnectionInfo* initializeConnection(const enum ConnectionMode mode)
+// both ends of fd have the same address, the peer runs on this machine
+static bool isLocalPeer(const int fd)
+{
+	struct sockaddr_storage local, peer;
+	socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+	char local_ip[IP_STR_SIZE], peer_ip[IP_STR_SIZE];
+
+	return getsockname(fd, (struct sockaddr*)&local, &local_len) == 0 &&
+	       getpeername(fd, (struct sockaddr*)&peer, &peer_len) == 0 &&
+	       formatAddr((struct sockaddr*)&local, local_len, local_ip) &&
+	       formatAddr((struct sockaddr*)&peer, peer_len, peer_ip) &&
+	       strcmp(local_ip, peer_ip) == 0;
+}
+
+
+static void copyOrAsk(const char* const msg, char* const dest, const char* const src, const int size)
+{
+	if (src != NULL)
+		snprintf(dest, size, "%s", src);
+	else
+		askUserFor(msg, dest, size);
+}
+
+
+static bool openTransport(const struct ConnectionConfig* const cfg)
+{
+	cinfo.tls_info[0] = '\0';
+	if (!cfg->tls) {
+		cinfo.transport = openPlainTransport(cinfo.remote_fd);
+		return true;
+	}
+
+	char peer[IP_STR_SIZE + PORT_STR_SIZE + 1];
+	snprintf(peer, sizeof(peer), "%s:%s", cinfo.host_ip, cinfo.port);
+	const struct TlsConfig tlscfg = {
+		.cert = cfg->cert,
+		.key = cfg->key,
+		.ca = cfg->ca,
+		.peer = peer,
+		.host = conn_host
+	};
+
+	cinfo.transport = openTlsTransport(cinfo.remote_fd, cinfo.mode == CONMODE_HOST, &tlscfg,
+	                                   cinfo.tls_info, TLS_INFO_SIZE);
+	return cinfo.transport != NULL;
+}
+
+
+/* opens the transport on the fresh remote_fd and runs the handshake
+ * through it: usernames, addresses, features, then the session */
+static bool handshake(const uint64_t recv_seq)
+{
+	if (!openTransport(config))
+		return false;
+
+	struct Transport* const t = cinfo.transport;
+	const bool shm = config->shm && !config->tls && isLocalPeer(cinfo.remote_fd);
+	const uint32_t offer = htonl((config->compress ? FEATURE_DEFLATE : 0) | (shm ? FEATURE_SHM : 0));
+	uint32_t peer_offer = 0;
+	struct SessionHello hello, peer_hello;
+	bool ret;
+
+	memcpy(hello.token, cinfo.session_token, SESSION_TOKEN_SIZE);
+	hello.recv_seq = htobe64(recv_seq);
+
+	if (cinfo.mode == CONMODE_HOST) {
+		ret = transportWriteAll(t, cinfo.host_uname, UNAME_SIZE) &&
+		      transportReadAll(t, cinfo.client_uname, UNAME_SIZE) &&
+		      transportWriteAll(t, cinfo.client_ip, IP_STR_SIZE) &&
+		      transportReadAll(t, cinfo.host_ip, IP_STR_SIZE) &&
+		      transportWriteAll(t, &offer, sizeof(offer)) &&
+		      transportReadAll(t, &peer_offer, sizeof(peer_offer)) &&
+		      transportReadAll(t, &peer_hello, sizeof(peer_hello));
+		if (ret) {
+			// the host's token decides, a client without it starts over
+			static const uint8_t none[SESSION_TOKEN_SIZE] = { 0 };
+			cinfo.resumed = memcmp(hello.token, none, SESSION_TOKEN_SIZE) != 0 &&
+			                memcmp(hello.token, peer_hello.token, SESSION_TOKEN_SIZE) == 0;
+			if (!cinfo.resumed) {
+				if (getrandom(cinfo.session_token, SESSION_TOKEN_SIZE, 0) != SESSION_TOKEN_SIZE) {
+					reportError("Couldn't get a session token");
+					return false;
+				}
+				memcpy(hello.token, cinfo.session_token, SESSION_TOKEN_SIZE);
+				hello.recv_seq = 0;
+				peer_hello.recv_seq = 0;
+			}
+			ret = transportWriteAll(t, &hello, sizeof(hello));
+		}
+	} else {
+		ret = transportReadAll(t, cinfo.host_uname, UNAME_SIZE) &&
+		      transportWriteAll(t, cinfo.client_uname, UNAME_SIZE) &&
+		      transportReadAll(t, cinfo.client_ip, IP_STR_SIZE) &&
+		      transportWriteAll(t, cinfo.host_ip, IP_STR_SIZE) &&
+		      transportReadAll(t, &peer_offer, sizeof(peer_offer)) &&
+		      transportWriteAll(t, &offer, sizeof(offer)) &&
+		      transportWriteAll(t, &hello, sizeof(hello)) &&
+		      transportReadAll(t, &peer_hello, sizeof(peer_hello));
+		if (ret) {
+			cinfo.resumed = memcmp(hello.token, peer_hello.token, SESSION_TOKEN_SIZE) == 0;
+			memcpy(cinfo.session_token, peer_hello.token, SESSION_TOKEN_SIZE);
+		}
+	}
+
+	if (!ret) {
+		reportError("Handshake failed");
+		return false;
+	}
+
+	cinfo.host_uname[UNAME_SIZE - 1] = '\0';
+	cinfo.client_uname[UNAME_SIZE - 1] = '\0';
+	cinfo.host_ip[IP_STR_SIZE - 1] = '\0';
+	cinfo.client_ip[IP_STR_SIZE - 1] = '\0';
+	cinfo.features = ntohl(offer) & ntohl(peer_offer);
+	cinfo.peer_recv_seq = be64toh(peer_hello.recv_seq);
+
+	// past this point nothing is compressed between local peers
+	if ((cinfo.features & FEATURE_SHM) != 0) {
+		struct Transport* const upgraded = upgradeToShm(t, cinfo.mode == CONMODE_HOST);
+		if (upgraded == NULL) {
+			reportError("Handshake failed");
+			return false;
+		}
+
+		if (upgraded != t) {
+			closeTransport(t);
+			cinfo.transport = upgraded;
+			cinfo.features &= ~FEATURE_DEFLATE;
+		} else {
+			cinfo.features &= ~FEATURE_SHM;
+		}
+	}
+
+	return true;
+}
+
+
+static bool exchangeInfo(const uint64_t recv_seq)
+{
+	if (!transportSetDeadline(cinfo.remote_fd, HANDSHAKE_TIMEOUT_MS)) {
+		reportError("Couldn't set the handshake timeout");
+		return false;
+	}
+
+	// past it the loop only reads when there's data, and sends may block
+	const bool ret = handshake(recv_seq);
+	return transportSetDeadline(cinfo.remote_fd, 0) && ret;
+}
+
+
+const struct ConnectionInfo* initializeConnection(const enum ConnectionMode mode,
+                                                  const struct ConnectionConfig* const cfg)
 {
 	if (mode == CONMODE_HOST) {
 		cinfo.local_uname = cinfo.host_uname;
@@ -32,49 +234,124 @@ const struct ConnectionInfo* initializeConnection(const enum ConnectionMode mode
 	}
 
 	cinfo.mode = mode;
-	askUserFor("Enter your username: ", cinfo.local_uname, UNAME_SIZE);
-	askUserFor("Enter the connection port: ", cinfo.port, PORT_STR_SIZE);
+	config = cfg;
+	copyOrAsk("Enter your username: ", cinfo.local_uname, cfg->uname, UNAME_SIZE);
+	copyOrAsk("Enter the connection port: ", cinfo.port, cfg->port, PORT_STR_SIZE);
 	
 	if (mode == CONMODE_HOST) {
-		if (!host())
+		if (!host(cfg->upnp))
 			return NULL;
-		write(cinfo.remote_fd, cinfo.host_uname, UNAME_SIZE);
-		read(cinfo.remote_fd, cinfo.client_uname, UNAME_SIZE);
-		write(cinfo.remote_fd, cinfo.client_ip, IP_STR_SIZE);
-		read(cinfo.remote_fd, cinfo.host_ip, IP_STR_SIZE);
 	} else {
+		copyOrAsk("Enter the host IP: ", conn_host, cfg->host, HOST_STR_SIZE);
 		if (!client())
 			return NULL;
-		read(cinfo.remote_fd, cinfo.host_uname, UNAME_SIZE);
-		write(cinfo.remote_fd, cinfo.client_uname, UNAME_SIZE);
-		read(cinfo.remote_fd, cinfo.client_ip, IP_STR_SIZE);
-		write(cinfo.remote_fd, cinfo.host_ip, IP_STR_SIZE);
 	}
-	
+
+	if (!exchangeInfo(0))
+		goto Lterminate_connection;
+
 	return &cinfo;
+
+Lterminate_connection:
+	terminateConnection(&cinfo);
+	return NULL;
+}
+
+
+void dropConnection(void)
+{
+	if (cinfo.transport != NULL)
+		closeTransport(cinfo.transport);
+	if (cinfo.remote_fd != -1)
+		close(cinfo.remote_fd);
+	cinfo.transport = NULL;
+	cinfo.remote_fd = -1;
+}
+
+
+static void onClientConnected(const int fd, const char* const error, void* const arg)
+{
+	((void)arg);
+	const ReconnectDone done = reconnect_done;
+	reconnect_done = NULL;
+
+	if (fd == -1) {
+		reportMsg("Couldn't connect", error);
+		done(false);
+		return;
+	}
+
+	const bool ret = clientConnected(fd) && exchangeInfo(reconnect_seq);
+	if (!ret)
+		dropConnection();
+	done(ret);
+}
+
+
+bool reconnectConnection(const uint64_t recv_seq, const ReconnectDone done)
+{
+	dropConnection();
+
+	if (cinfo.mode == CONMODE_CLIENT) {
+		reconnect_done = done;
+		reconnect_seq = recv_seq;
+		if (connectAsync(conn_host, cinfo.port, onClientConnected, NULL))
+			return true;
+		reconnect_done = NULL;
+		reportMsg("Couldn't connect", "the lookup didn't start");
+		return false;
+	}
+
+	const bool ret = acceptClient() && exchangeInfo(recv_seq);
+	if (!ret)
+		dropConnection();
+	done(ret);
+	return true;
 }
 
 
 void terminateConnection(const struct ConnectionInfo* const cinfo)
 {
+	cancelConnect();
+	dropConnection();
+	terminateTls();   // no-op without TLS
+
 	if (cinfo->mode == CONMODE_HOST) {
-		close(cinfo->remote_fd);
 		close(cinfo->local_fd);
-		terminate_upnp();
-	} else if (cinfo->mode == CONMODE_CLIENT) {
-		close(cinfo->remote_fd);
+		terminate_upnp(); // no-op if UPnP wasn't started
 	}
 }
 
 
-static inline bool host(void)
+void setConnectionNotify(void (*const notify)(const char* msg))
 {
-	if (!initialize_upnp(cinfo.port))
+	set_upnp_notify(notify);
+}
+
+
+int connectionSignalFd(void)
+{
+	return upnp_signal_fd();
+}
+
+
+static inline bool host(const bool upnp)
+{
+	/* discovery and port mapping run in the background,
+	 * so we can bind and accept right away */
+	if (upnp && !initialize_upnp(cinfo.port))
 		return false;
 
 	/* socket(), creates an endpoint for communication and returns a
-	 * file descriptor that refers to that endpoint                */
-	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	 * file descriptor that refers to that endpoint. An IPv6 socket
+	 * with IPV6_V6ONLY off takes IPv4 clients as well, IPv4 alone is
+	 * the fallback for kernels without IPv6                        */
+	bool ipv6 = true;
+	int fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd == -1 && errno == EAFNOSUPPORT) {
+		ipv6 = false;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+	}
 
 	if (fd == -1) {
 		perror("Couldn't open socket");
@@ -87,8 +364,9 @@ static inline bool host(void)
 	 * for the socket associated with the file descriptor specified by the socket
 	 * argument
 	 * */
-	const int optionval = 1;
-	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optionval, sizeof(int)) == -1) {
+	const int optionval = 1, v6only = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optionval, sizeof(int)) == -1 ||
+	    (ipv6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) == -1)) {
 		perror("Couldn't set socket opt");
 		goto Lclose_fd;
 	}
@@ -100,16 +378,29 @@ static inline bool host(void)
 	 * are initially unnamed; they are identified only by their 
 	 * address family
 	 * */
-	struct sockaddr_in servaddr;
-	memset(&servaddr, 0, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;          // IPv4 protocol
-	servaddr.sin_addr.s_addr = INADDR_ANY;  // bind to any interface
-	servaddr.sin_port = htons(strtoll(cinfo.port, NULL, 0));
+	const in_port_t port = htons(strtoll(cinfo.port, NULL, 0));
 	                                        /* htons() converts the unsigned short 
 	                                         * int from hostbyte order to
 						 * network byte order
 						 * */
-	if (bind(fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) == -1) {
+	struct sockaddr_storage servaddr;
+	socklen_t servlen;
+	memset(&servaddr, 0, sizeof(servaddr));
+	if (ipv6) {
+		struct sockaddr_in6* const sin6 = (struct sockaddr_in6*) &servaddr;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;     // bind to any interface
+		sin6->sin6_port = port;
+		servlen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in* const sin = (struct sockaddr_in*) &servaddr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = INADDR_ANY;
+		sin->sin_port = port;
+		servlen = sizeof(*sin);
+	}
+
+	if (bind(fd, (struct sockaddr*)&servaddr, servlen) == -1) {
 		perror("Couldn't bind");
 		goto Lclose_fd;
 	}
@@ -124,7 +415,24 @@ static inline bool host(void)
 
 	puts("Waiting for client...");
 
-	struct sockaddr_in cliaddr;
+	cinfo.local_fd = fd;
+	if (!acceptClient())
+		goto Lclose_fd;
+
+	return true;
+
+Lclose_fd:
+	close(fd);
+	cinfo.local_fd = -1;
+Lterminate_upnp:
+	terminate_upnp();
+	return false;
+}
+
+
+static inline bool acceptClient(void)
+{
+	struct sockaddr_storage cliaddr;
 	socklen_t clilen = sizeof(cliaddr);
 
 	/* the accept() system call is used with connection-based socket types
@@ -134,64 +442,61 @@ static inline bool host(void)
 	 * descriptor referring to that socket. The newly created socket is not
 	 * listening state. The original socket sockfd is unaffected by this call
 	 * */
-	const int clifd = accept(fd, (struct sockaddr*)&cliaddr, &clilen);
+	const int clifd = accept(cinfo.local_fd, (struct sockaddr*)&cliaddr, &clilen);
 
 	if (clifd == -1) {
-		perror("Couldn't accept socket");
-		goto Lclose_fd;
+		reportError("Couldn't accept socket");
+		return false;
 	}
 
-	if (inet_ntop(AF_INET, &cliaddr.sin_addr, cinfo.client_ip, IP_STR_SIZE) == NULL) {
-		perror("Couldn't get client ip");
+	if (!formatAddr((struct sockaddr*)&cliaddr, clilen, cinfo.client_ip)) {
+		reportError("Couldn't get client ip");
 		goto Lclose_clifd;
 	}
 
-	cinfo.local_fd = fd;
+	if (!setNoDelay(clifd))
+		goto Lclose_clifd;
+
 	cinfo.remote_fd = clifd;
 	return true;
 
 Lclose_clifd:
 	close(clifd);
-Lclose_fd:
-	close(fd);
-Lterminate_upnp:
-	terminate_upnp();
 	return false;
 }
 
 
 static inline bool client(void)
 {
-	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	/* getaddrinfo() gives every IPv4 and IPv6 address of the host,
+	 * the connector races connects to them (happy eyeballs). This
+	 * is the first connection, before the event loop runs, so it
+	 * may block; reconnects go through connectAsync() instead.
+	 * */
+	const char* error = NULL;
+	const int fd = connectBlocking(conn_host, cinfo.port, &error);
 	if (fd == -1) {
-		perror("Couldn't open socket");
+		reportMsg("Couldn't connect", error);
 		return false;
 	}
-	
-	/* The gethostbyname() function returns a struct of type hostent
-	 * for the given host name. Here name is either a hostname or an
-	 * IPv4 address.
-	 * */
-	askUserFor("Enter the host IP: ", cinfo.host_ip, IP_STR_SIZE);
-	struct hostent *hostent = gethostbyname(cinfo.host_ip);
-	if (hostent == NULL) {
-		perror("Couldn't get host by name");
+
+	return clientConnected(fd);
+}
+
+
+static bool clientConnected(const int fd)
+{
+	struct sockaddr_storage hostaddr;
+	socklen_t hostlen = sizeof(hostaddr);
+
+	if (getpeername(fd, (struct sockaddr*)&hostaddr, &hostlen) == -1 ||
+	    !formatAddr((struct sockaddr*)&hostaddr, hostlen, cinfo.host_ip)) {
+		reportError("Couldn't get host ip");
 		goto Lclose_fd;
 	}
 
-	/* The connect() function shall attempt to make a connection on a 
-	 * mode socket or to set or reset the peer address of a connectionless
-	 * mode socket.
-	 * */
-	struct sockaddr_in hostaddr;
-	memset(&hostaddr, 0, sizeof(hostaddr));
-	hostaddr.sin_family = AF_INET;
-	hostaddr.sin_port = htons(strtol(cinfo.port, NULL, 0));
-	memcpy(&hostaddr.sin_addr.s_addr, hostent->h_addr_list[0], hostent->h_length);
-	if (connect(fd, (struct sockaddr*)&hostaddr, sizeof(hostaddr)) == -1) {
-		perror("Couldn't connect");
+	if (!setNoDelay(fd))
 		goto Lclose_fd;
-	}
 
 	cinfo.remote_fd = fd;
 	return true;
@@ -200,4 +505,3 @@ Lclose_fd:
 	close(fd);
 	return false;
 }
-
@@ -1,9 +1,20 @@
 #ifndef CHAT_NETWORK_H_
 #define CHAT_NETWORK_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "transport.h"
+#include "tls.h"
 
 #define UNAME_SIZE    ((int)24)
-#define IP_STR_SIZE   ((int)24)
+#define IP_STR_SIZE   ((int)48)   // INET6_ADDRSTRLEN, rounded up
 #define PORT_STR_SIZE ((int)6)
+#define HOST_STR_SIZE ((int)256)
+#define SESSION_TOKEN_SIZE ((int)16)
+
+
+// optional protocol features, both ends must offer them to be used
+#define FEATURE_DEFLATE ((uint32_t)0x01)
+#define FEATURE_SHM     ((uint32_t)0x02)   // shared memory, offered to peers on this machine
 
 
 enum ConnectionMode {
@@ -12,6 +23,24 @@ enum ConnectionMode {
 };
 
 
+struct ConnectionConfig {
+	const char* uname;    // NULL to ask the user
+	const char* port;     // NULL to ask the user
+	const char* host;     // client only, NULL to ask the user
+	const char* history;  // host only, history log directory
+	bool upnp;            // host only, map the port through UPnP
+	bool compress;        // offer FEATURE_DEFLATE
+	bool tls;             // run everything over TLS, both ends must agree
+	const char* cert;     // host, TLS certificate chain, NULL for a self-signed one
+	const char* key;      // host, TLS private key, NULL if it's in cert
+	const char* ca;       // client, CA/certificate the host must present
+	const char* metrics;  // unix socket serving metrics, NULL for none
+	bool shm;             // offer FEATURE_SHM when the peer is local, never with tls
+	const char* downloads;  // where files the peer sends end up
+	const char* log;      // appends connection events to it, NULL for none
+};
+
+
 struct ConnectionInfo {
 	char host_uname[UNAME_SIZE];
 	char client_uname[UNAME_SIZE];
@@ -22,13 +51,37 @@ struct ConnectionInfo {
 	char* remote_uname;
 	int local_fd;
 	int remote_fd;
+	char tls_info[TLS_INFO_SIZE];  // empty without TLS
+	struct Transport* transport;   // on top of remote_fd, NULL while disconnected
+	uint8_t session_token[SESSION_TOKEN_SIZE];  // issued by the host
+	uint64_t peer_recv_seq;        // messages of this session the peer already got
+	bool resumed;                  // the last handshake continued the previous session
+	uint32_t features;    // FEATURE_* agreed on in the handshake
 	enum ConnectionMode mode;
 };
 
 
-extern const struct ConnectionInfo* initializeConnection(enum ConnectionMode mode);
+extern const struct ConnectionInfo* initializeConnection(enum ConnectionMode mode,
+                                                          const struct ConnectionConfig* cfg);
 extern void terminateConnection(const struct ConnectionInfo* cinfo);
 
+/* closes the transport and remote_fd, local_fd keeps listening on the host */
+extern void dropConnection(void);
+/* the client connects again, resolving and connecting inside the event
+ * loop. The host accepts on local_fd (blocking, so wait until it's
+ * readable). recv_seq is how many messages of the session this end got,
+ * the peer's count ends up in peer_recv_seq. done gets the outcome, right
+ * away on the host. Returns false if nothing could be started */
+typedef void (*ReconnectDone)(bool ok);
+extern bool reconnectConnection(uint64_t recv_seq, ReconnectDone done);
+/* the UPnP thread's status messages, notify is called from that thread.
+ * The other errors go through report.h */
+extern void setConnectionNotify(void (*notify)(const char* msg));
+/* readable when a signal asks to quit and the connection must be torn
+ * down first (a UPnP mapping to remove), a byte with the signal's number.
+ * -1 when there's nothing to watch */
+extern int connectionSignalFd(void);
+
 
 
 #endif
@@ -0,0 +1,109 @@
+#include <string.h>
+#include "outbox.h"
+
+
+/* Every message sent in the current session is kept, uncompressed, until
+ * OUTBOX_SIZE bytes of newer ones push it out, so a peer that reconnects
+ * gets exactly what it missed. Entries are packed back to back in one
+ * buffer, the live ones between head and tail; when the tail would run
+ * past the end they are moved back to the start.
+ * */
+#define OUTBOX_SIZE ((uint32_t)(256 * 1024))
+
+
+struct Entry {
+	uint32_t len;
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t channel;
+	char payload[];
+};
+
+
+static struct Outbox {
+	char buffer[OUTBOX_SIZE];
+	uint32_t head;    // offset of the oldest entry
+	uint32_t tail;    // offset past the newest one
+	uint64_t begin;   // seq of the entry at head
+	uint64_t end;     // seq of the next entry
+} outbox;
+
+
+static inline uint32_t entrySize(const uint32_t len)
+{
+	return (sizeof(struct Entry) + len + 7) & ~7u;
+}
+
+
+static inline struct Entry* entryAt(const uint32_t offset)
+{
+	return (struct Entry*) &outbox.buffer[offset];
+}
+
+
+void resetOutbox(void)
+{
+	outbox.head = outbox.tail = 0;
+	outbox.begin = outbox.end = 0;
+}
+
+
+uint64_t outboxBegin(void)
+{
+	return outbox.begin;
+}
+
+
+uint64_t outboxEnd(void)
+{
+	return outbox.end;
+}
+
+
+static void dropOldest(void)
+{
+	outbox.head += entrySize(entryAt(outbox.head)->len);
+	++outbox.begin;
+	if (outbox.head == outbox.tail)
+		outbox.head = outbox.tail = 0;
+}
+
+
+void outboxPush(const enum FrameType type, const uint16_t channel, const void* const payload,
+                const uint32_t len)
+{
+	// payloads are at most FRAME_MAX_PAYLOAD, so this always ends
+	const uint32_t size = entrySize(len);
+	while (outbox.tail - outbox.head + size > OUTBOX_SIZE)
+		dropOldest();
+
+	if (outbox.tail + size > OUTBOX_SIZE) {
+		memmove(outbox.buffer, &outbox.buffer[outbox.head], outbox.tail - outbox.head);
+		outbox.tail -= outbox.head;
+		outbox.head = 0;
+	}
+
+	struct Entry* const entry = entryAt(outbox.tail);
+	entry->len = len;
+	entry->type = (uint8_t) type;
+	entry->channel = channel;
+	memcpy(entry->payload, payload, len);
+	outbox.tail += size;
+	++outbox.end;
+}
+
+
+int64_t outboxResend(const uint64_t seq, const OutboxSender send)
+{
+	uint64_t cur = outbox.begin;
+	uint32_t offset = outbox.head;
+
+	for (; cur < outbox.end; ++cur) {
+		const struct Entry* const entry = entryAt(offset);
+		if (cur >= seq && !send((enum FrameType) entry->type, entry->channel, entry->payload, entry->len))
+			return -1;
+		offset += entrySize(entry->len);
+	}
+
+	return seq < outbox.begin ? (int64_t)(outbox.begin - seq) : 0;
+}
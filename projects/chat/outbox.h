@@ -0,0 +1,24 @@
+#ifndef CHAT_OUTBOX_H_
+#define CHAT_OUTBOX_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "proto.h"
+
+
+typedef bool (*OutboxSender)(enum FrameType type, uint16_t channel, const void* payload, uint32_t len);
+
+
+/* forgets everything, the next message pushed gets sequence number 0 */
+extern void resetOutbox(void);
+
+extern uint64_t outboxBegin(void);  // oldest message still kept
+extern uint64_t outboxEnd(void);    // sequence number of the next message
+
+extern void outboxPush(enum FrameType type, uint16_t channel, const void* payload, uint32_t len);
+
+/* hands the kept messages from seq onwards to send, returns how many
+ * of them are gone already (seq < outboxBegin()), or -1 if send failed */
+extern int64_t outboxResend(uint64_t seq, OutboxSender send);
+
+
+#endif
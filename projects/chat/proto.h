@@ -0,0 +1,84 @@
+#ifndef CHAT_PROTO_H_
+#define CHAT_PROTO_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+
+#define FRAME_MAX_PAYLOAD ((int)65536)
+
+#define FRAME_FLAG_DEFLATE ((uint8_t)0x01)  // payload is a chunk of the connection's deflate stream
+
+
+enum FrameType {
+	FRAME_MSG,       // chat message or command typed by the peer
+	FRAME_HISTORY,   // "uname: msg" line from the host's history log
+	FRAME_INFO,      // local notice, only kept in the history log
+	FRAME_FILE_OFFER,   // struct FileOffer, a file the peer wants to send
+	FRAME_FILE_ACK,     // struct FileControl, bytes of it the receiver has
+	FRAME_FILE_DATA,    // the next bytes of the file, nothing else
+	FRAME_FILE_END,     // struct FileControl, the sender is done
+	FRAME_FILE_CANCEL,  // struct FileControl, either side gives up
+	FRAME_JOIN,      // client, the "#name" of a channel to follow
+	FRAME_JOINED,    // host, the channel's id in the header and its "#name", empty if refused
+	FRAME_PART       // client, stops following the channel in the header
+};
+
+
+/* file transfer payloads, integers in network byte order */
+struct FileOffer {
+	uint32_t id;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t mtime;   // ns since the epoch, with size tells a .part of it from another file's
+	char name[];      // not terminated, up to the end of the payload
+};
+
+
+struct FileControl {
+	uint32_t id;
+	uint32_t reserved;
+	uint64_t offset;
+};
+
+
+/* every message after the handshake is sent as a header followed
+ * by len bytes of payload. History records are stored on disk with
+ * the very same layout, so they can be replayed without re-framing. */
+struct FrameHeader {
+	uint32_t len;     // payload size in network byte order
+	uint8_t type;     // enum FrameType
+	uint8_t flags;
+	uint16_t channel; // channel id in network byte order, 0 is the lobby
+};
+
+
+static inline void setFrameHeader(struct FrameHeader* const hdr, const enum FrameType type,
+                                  const uint32_t len)
+{
+	hdr->len = htonl(len);
+	hdr->type = (uint8_t) type;
+	hdr->flags = 0;
+	hdr->channel = 0;
+}
+
+
+static inline void setFrameChannel(struct FrameHeader* const hdr, const uint16_t channel)
+{
+	hdr->channel = htons(channel);
+}
+
+
+static inline uint16_t getFrameChannel(const struct FrameHeader* const hdr)
+{
+	return ntohs(hdr->channel);
+}
+
+
+static inline uint32_t getFrameLen(const struct FrameHeader* const hdr)
+{
+	return ntohl(hdr->len);
+}
+
+
+#endif
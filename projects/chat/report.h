@@ -0,0 +1,56 @@
+#ifndef CHAT_REPORT_H_
+#define CHAT_REPORT_H_
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+
+/* Errors and status messages of the chat modules. The terminal belongs to
+ * ncurses while the chat runs, so in the meantime they go to the notify
+ * hook (which may be called from any thread), and to stderr before and
+ * after. The hook is weak, one for all the translation units.
+ * */
+#define REPORT_MSG_SIZE ((int)512)
+
+
+__attribute__((weak)) void (*report_notify)(const char* msg) = NULL;
+
+
+static inline void setReportNotify(void (*const notify)(const char* msg))
+{
+	__atomic_store_n(&report_notify, notify, __ATOMIC_RELEASE);
+}
+
+
+__attribute__((format(printf, 1, 2)))
+static inline void reportf(const char* const fmt, ...)
+{
+	char msg[REPORT_MSG_SIZE];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	void (*const notify)(const char*) = __atomic_load_n(&report_notify, __ATOMIC_ACQUIRE);
+	if (notify != NULL)
+		notify(msg);
+	else
+		fprintf(stderr, "%s\n", msg);
+}
+
+
+static inline void reportMsg(const char* const what, const char* const why)
+{
+	reportf("%s: %s", what, why);
+}
+
+
+// like perror()
+static inline void reportError(const char* const what)
+{
+	reportMsg(what, strerror(errno));
+}
+
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sendq.h"
+#include "metrics.h"
+#include "report.h"
+
+
+/* Frames are built back to back in a single buffer, header and payload
+ * together, and the whole batch goes out with one send() when the event
+ * loop is done with the current tick. If a burst doesn't fit, what is
+ * already queued is sent with more set (MSG_MORE on plain TCP, buffered
+ * records on TLS), so the tail is held until the rest of the burst follows.
+ * */
+#define SENDQ_SIZE ((int)(2 * (sizeof(struct FrameHeader) + FRAME_MAX_PAYLOAD)))
+
+
+static struct SendQueue {
+	char buffer[SENDQ_SIZE];
+	struct SendStats stats;
+	struct Transport* transport;
+	int len;
+} sendq = { .transport = NULL };
+
+
+void initializeSendQueue(struct Transport* const transport)
+{
+	sendq.transport = transport;
+	sendq.len = 0;
+	memset(&sendq.stats, 0, sizeof(sendq.stats));
+}
+
+
+static bool sendAll(const bool more)
+{
+	int pos = 0;
+	metricsSet(GAUGE_SENDQ_BATCH, sendq.len);
+	while (pos < sendq.len) {
+		const ssize_t n = transportSend(sendq.transport, &sendq.buffer[pos], sendq.len - pos, more);
+
+		++sendq.stats.syscalls;
+		metricsAdd(METRIC_SEND_CALLS, 1);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			reportError("Couldn't send");
+			sendq.len = 0;
+			return false;
+		}
+
+		pos += n;
+	}
+
+	sendq.stats.bytes += sendq.len;
+	metricsAdd(METRIC_BYTES_OUT, sendq.len);
+	++sendq.stats.flushes;
+	sendq.len = 0;
+	return true;
+}
+
+
+char* sendQueueReserve(const uint32_t maxlen)
+{
+	if (maxlen > (uint32_t) FRAME_MAX_PAYLOAD)
+		return NULL;
+
+	const int needed = sizeof(struct FrameHeader) + maxlen;
+	if (sendq.len + needed > SENDQ_SIZE && !sendAll(true))
+		return NULL;
+
+	return &sendq.buffer[sendq.len + sizeof(struct FrameHeader)];
+}
+
+
+void sendQueueCommit(const enum FrameType type, const uint16_t channel, const uint8_t flags,
+                     const uint32_t len)
+{
+	struct FrameHeader* const hdr = (struct FrameHeader*) &sendq.buffer[sendq.len];
+	setFrameHeader(hdr, type, len);
+	setFrameChannel(hdr, channel);
+	hdr->flags = flags;
+	sendq.len += sizeof(struct FrameHeader) + len;
+	++sendq.stats.frames;
+	metricsAdd(METRIC_FRAMES_OUT, 1);
+}
+
+
+bool sendQueueFrame(const enum FrameType type, const uint16_t channel, const void* const payload,
+                    const uint32_t len)
+{
+	char* const dest = sendQueueReserve(len);
+	if (dest == NULL)
+		return false;
+
+	memcpy(dest, payload, len);
+	sendQueueCommit(type, channel, 0, len);
+	return true;
+}
+
+
+bool sendQueueFile(const enum FrameType type, const int in_fd, const off_t offset, const uint32_t len)
+{
+	if (sendq.len + (int) sizeof(struct FrameHeader) > SENDQ_SIZE && !sendAll(true))
+		return false;
+
+	// the header rides along with whatever is queued, the payload follows it
+	setFrameHeader((struct FrameHeader*) &sendq.buffer[sendq.len], type, len);
+	sendq.len += sizeof(struct FrameHeader);
+	++sendq.stats.frames;
+	metricsAdd(METRIC_FRAMES_OUT, 1);
+	if (!sendAll(true))
+		return false;
+
+	metricsAdd(METRIC_SEND_CALLS, 1);
+	if (!transportSendFile(sendq.transport, in_fd, offset, len)) {
+		reportError("Couldn't send file");
+		return false;
+	}
+
+	metricsAdd(METRIC_BYTES_OUT, len);
+	sendq.stats.bytes += len;
+	return true;
+}
+
+
+bool flushSendQueue(void)
+{
+	return sendq.len == 0 || sendAll(false);
+}
+
+
+void getSendStats(struct SendStats* const stats)
+{
+	*stats = sendq.stats;
+}
@@ -0,0 +1,35 @@
+#ifndef CHAT_SENDQ_H_
+#define CHAT_SENDQ_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "proto.h"
+#include "transport.h"
+
+
+struct SendStats {
+	uint64_t frames;     // frames queued
+	uint64_t bytes;      // bytes written, headers included
+	uint64_t syscalls;   // transport send calls
+	uint64_t flushes;    // flushSendQueue() calls that had something to send
+};
+
+
+/* send errors go through report.h */
+extern void initializeSendQueue(struct Transport* transport);
+
+/* space for a payload of up to maxlen bytes, to be built in place
+ * and then queued with sendQueueCommit(). NULL if maxlen is too big */
+extern char* sendQueueReserve(uint32_t maxlen);
+extern void sendQueueCommit(enum FrameType type, uint16_t channel, uint8_t flags, uint32_t len);
+extern bool sendQueueFrame(enum FrameType type, uint16_t channel, const void* payload, uint32_t len);
+
+/* sends what is queued, then a frame whose payload is len bytes of in_fd
+ * at offset, straight from the file (sendfile on plain TCP) */
+extern bool sendQueueFile(enum FrameType type, int in_fd, off_t offset, uint32_t len);
+
+/* sends everything queued so far, meant to run once per loop tick */
+extern bool flushSendQueue(void);
+extern void getSendStats(struct SendStats* stats);
+
+
+#endif
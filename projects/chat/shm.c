@@ -0,0 +1,621 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include "shm.h"
+
+
+/* Two single-producer single-consumer rings in a sealed memfd, one per
+ * direction. head and tail run freely and are only ever written by the
+ * reader and the writer respectively, each on its own cache line. A side
+ * that finds nothing to do sets its waiting flag and looks again (the
+ * other side publishes, then checks the flag), and only then does the
+ * other side pay for an eventfd write. A busy reader gets its data with no
+ * syscall at all.
+ * The memfd and both eventfds go to the client over an abstract unix
+ * socket. Anyone on the machine can list those names and connect, so the
+ * name is a fresh random nonce that only travels over the TCP connection,
+ * and the host only hands the fds to a peer of its own uid whose pid is
+ * the one the client gave over TCP. The TCP connection stays open, it's
+ * how each side learns the other one is gone.
+ * */
+#define SHM_RING_SIZE ((uint32_t)(1u << 20))
+#define SHM_SEALS     (F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL)
+#define CACHE_LINE    64
+#define SHM_NONCE_SIZE 16
+
+
+struct Ring {
+	uint32_t head __attribute__((aligned(CACHE_LINE)));  // read up to here
+	uint32_t tail __attribute__((aligned(CACHE_LINE)));  // written up to here
+	uint32_t reader_waiting __attribute__((aligned(CACHE_LINE)));  // wants a wakeup for data
+	uint32_t writer_waiting;                                       // and for space
+	char data[SHM_RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+};
+
+
+struct Region {
+	struct Ring rings[2];   // host to client, client to host
+};
+
+
+// host to client, ok == 0 when the host can't offer it
+struct ShmOffer {
+	uint8_t nonce[SHM_NONCE_SIZE];   // names the unix socket
+	uint8_t ok;
+};
+
+
+// client to host, network byte order
+struct ShmConnected {
+	uint32_t pid;   // what the host expects on the unix socket
+	uint32_t ok;
+};
+
+
+enum ShmFd {
+	SHMFD_MEM,
+	SHMFD_HOST,     // eventfd waking the host up
+	SHMFD_CLIENT,   // and the client
+	SHMFD_COUNT
+};
+
+
+static struct Shm {
+	struct Region* region;
+	struct Ring* in;
+	struct Ring* out;
+	int efd;        // ours: data in `in` or room in `out`
+	int peer_efd;
+	int tcp_fd;     // only watched for the peer closing it
+} shm = { .region = NULL, .efd = -1, .peer_efd = -1, .tcp_fd = -1 };
+
+
+static void signalFd(const int fd)
+{
+	const uint64_t one = 1;
+	while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR)
+		;
+}
+
+
+// after publishing, wakes the other side if it said it sleeps
+static void wake(uint32_t* const waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) != 0 &&
+	    __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED) != 0)
+		signalFd(shm.peer_efd);
+}
+
+
+static inline uint32_t used(const struct Ring* const r)
+{
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+
+// the reader is about to sleep, false if data showed up meanwhile
+static bool armReader(struct Ring* const r)
+{
+	__atomic_store_n(&r->reader_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return used(r) == 0;
+}
+
+
+static bool peerGone(void)
+{
+	char c;
+	const ssize_t n = recv(shm.tcp_fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	return n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR);
+}
+
+
+// blocks until the out ring has room, returns how much or 0 on error
+static uint32_t waitForSpace(void)
+{
+	struct Ring* const r = shm.out;
+	bool ate_wakeup = false;
+	uint32_t space;
+
+	while ((space = SHM_RING_SIZE - used(r)) == 0) {
+		// the reader must see what's there before it can make room
+		wake(&r->reader_waiting);
+
+		__atomic_store_n(&r->writer_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (used(r) < SHM_RING_SIZE)
+			continue;
+
+		struct pollfd pfds[2] = {
+			{ .fd = shm.efd, .events = POLLIN },
+			{ .fd = shm.tcp_fd, .events = POLLRDHUP }
+		};
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+
+		if (pfds[1].revents != 0 && peerGone()) {
+			errno = EPIPE;
+			return 0;
+		}
+
+		uint64_t count;
+		if (read(shm.efd, &count, sizeof(count)) == sizeof(count))
+			ate_wakeup = true;
+	}
+
+	// it may have been for incoming data, the event loop gets it back
+	if (ate_wakeup)
+		signalFd(shm.efd);
+	return space;
+}
+
+
+static ssize_t shmSend(struct Transport* const t, const void* const buf,
+                       const size_t len, const bool more)
+{
+	((void)t);
+	struct Ring* const r = shm.out;
+	const uint32_t space = waitForSpace();
+	if (space == 0)
+		return -1;
+
+	const uint32_t n = len < space ? len : space;
+	const uint32_t pos = r->tail & (SHM_RING_SIZE - 1);
+	const uint32_t first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+	memcpy(&r->data[pos], buf, first);
+	memcpy(r->data, (const char*) buf + first, n - first);
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+
+	if (!more)
+		wake(&r->reader_waiting);
+	return n;
+}
+
+
+/* the in ring is empty: 0 at EOF, -1 with EAGAIN once the writer
+ * knows to wake us up, 1 if data showed up in the meantime */
+static int readerIdle(void)
+{
+	// level-triggered, a wakeup left unread would spin the event loop
+	uint64_t count;
+	const ssize_t drained = read(shm.efd, &count, sizeof(count));
+	((void)drained);
+
+	if (!armReader(shm.in))
+		return 1;
+	if (peerGone())
+		return 0;
+	errno = EAGAIN;
+	return -1;
+}
+
+
+static ssize_t shmRecv(struct Transport* const t, void* const buf, const size_t len)
+{
+	((void)t);
+	struct Ring* const r = shm.in;
+
+	uint32_t avail = used(r);
+	if (avail == 0) {
+		const int idle = readerIdle();
+		if (idle != 1)
+			return idle;
+		avail = used(r);
+	}
+
+	const uint32_t n = len < avail ? len : avail;
+	const uint32_t pos = r->head & (SHM_RING_SIZE - 1);
+	const uint32_t first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+	memcpy(buf, &r->data[pos], first);
+	memcpy((char*) buf + first, r->data, n - first);
+	__atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+
+	wake(&r->writer_waiting);
+	return n;
+}
+
+
+// straight from the file into the ring
+static bool shmSendFile(struct Transport* const t, const int in_fd, off_t offset, size_t count)
+{
+	((void)t);
+	struct Ring* const r = shm.out;
+
+	while (count > 0) {
+		const uint32_t space = waitForSpace();
+		if (space == 0)
+			return false;
+
+		const uint32_t pos = r->tail & (SHM_RING_SIZE - 1);
+		size_t chunk = space < SHM_RING_SIZE - pos ? space : SHM_RING_SIZE - pos;
+		if (chunk > count)
+			chunk = count;
+
+		const ssize_t n = pread(in_fd, &r->data[pos], chunk, offset);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+
+		__atomic_store_n(&r->tail, r->tail + (uint32_t) n, __ATOMIC_RELEASE);
+		offset += n;
+		count -= n;
+	}
+
+	wake(&r->reader_waiting);
+	return true;
+}
+
+
+// straight from the ring into the file
+static ssize_t shmRecvFile(struct Transport* const t, const int out_fd, const off_t offset,
+                           const size_t count)
+{
+	((void)t);
+	struct Ring* const r = shm.in;
+
+	uint32_t avail = used(r);
+	if (avail == 0) {
+		const int idle = readerIdle();
+		if (idle != 1)
+			return idle;
+		avail = used(r);
+	}
+
+	const uint32_t pos = r->head & (SHM_RING_SIZE - 1);
+	size_t chunk = avail < SHM_RING_SIZE - pos ? avail : SHM_RING_SIZE - pos;
+	if (chunk > count)
+		chunk = count;
+
+	ssize_t n;
+	while ((n = pwrite(out_fd, &r->data[pos], chunk, offset)) == -1 && errno == EINTR)
+		;
+	if (n <= 0)
+		return -1;
+
+	__atomic_store_n(&r->head, r->head + (uint32_t) n, __ATOMIC_RELEASE);
+	wake(&r->writer_waiting);
+	return n;
+}
+
+
+// false means the caller may sleep, the writer will wake it up
+static bool shmPending(const struct Transport* const t)
+{
+	((void)t);
+	return !armReader(shm.in);
+}
+
+
+static void shmClose(struct Transport* const t)
+{
+	munmap(shm.region, sizeof(struct Region));
+	close(shm.efd);
+	close(shm.peer_efd);
+	close(t->fd);
+	shm.region = NULL;
+	shm.efd = shm.peer_efd = shm.tcp_fd = -1;
+	t->fd = -1;
+}
+
+
+static struct Transport shm_transport = {
+	.name = "shm",
+	.send = shmSend,
+	.recv = shmRecv,
+	.sendFile = shmSendFile,
+	.recvFile = shmRecvFile,
+	.pending = shmPending,
+	.close = shmClose,
+	.ctx = NULL,
+	.fd = -1
+};
+
+
+static void closeFds(int* const fds)
+{
+	for (int i = 0; i < SHMFD_COUNT; ++i) {
+		if (fds[i] != -1)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+
+static struct Region* mapRegion(const int memfd)
+{
+	void* const addr = mmap(NULL, sizeof(struct Region), PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	return addr != MAP_FAILED ? addr : NULL;
+}
+
+
+// host, the memfd already mapped and both eventfds
+static bool createRegion(int* const fds)
+{
+	fds[SHMFD_MEM] = memfd_create("chat-shm", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	fds[SHMFD_HOST] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	fds[SHMFD_CLIENT] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+	// sealed, so the peer can't shrink it under us
+	if (fds[SHMFD_MEM] == -1 || fds[SHMFD_HOST] == -1 || fds[SHMFD_CLIENT] == -1 ||
+	    ftruncate(fds[SHMFD_MEM], sizeof(struct Region)) == -1 ||
+	    fcntl(fds[SHMFD_MEM], F_ADD_SEALS, SHM_SEALS) == -1 ||
+	    (shm.region = mapRegion(fds[SHMFD_MEM])) == NULL) {
+		closeFds(fds);
+		return false;
+	}
+
+	// both readers start out idle
+	shm.region->rings[0].reader_waiting = 1;
+	shm.region->rings[1].reader_waiting = 1;
+	return true;
+}
+
+
+// client, refuses anything it could fault on
+static bool attachRegion(const int* const fds)
+{
+	struct stat st;
+	const int seals = fcntl(fds[SHMFD_MEM], F_GET_SEALS);
+	if (fstat(fds[SHMFD_MEM], &st) == -1 || st.st_size != (off_t) sizeof(struct Region) ||
+	    seals == -1 || (seals & F_SEAL_SHRINK) == 0)
+		return false;
+
+	return (shm.region = mapRegion(fds[SHMFD_MEM])) != NULL;
+}
+
+
+static struct Transport* openShm(int* const fds, const bool host, const int tcp_fd)
+{
+	shm.in = &shm.region->rings[host ? 1 : 0];
+	shm.out = &shm.region->rings[host ? 0 : 1];
+	shm.efd = fds[host ? SHMFD_HOST : SHMFD_CLIENT];
+	shm.peer_efd = fds[host ? SHMFD_CLIENT : SHMFD_HOST];
+	shm.tcp_fd = tcp_fd;
+	close(fds[SHMFD_MEM]);   // the mapping keeps it alive
+	for (int i = 0; i < SHMFD_COUNT; ++i)
+		fds[i] = -1;
+
+	// one fd for the event loop, readable on data/room or the peer leaving
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event evs[2] = {
+		{ .events = EPOLLIN, .data = { .fd = shm.efd } },
+		{ .events = EPOLLRDHUP, .data = { .fd = tcp_fd } }
+	};
+	if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, shm.efd, &evs[0]) == -1 ||
+	    epoll_ctl(epfd, EPOLL_CTL_ADD, tcp_fd, &evs[1]) == -1) {
+		if (epfd != -1)
+			close(epfd);
+		shm_transport.fd = -1;
+		shmClose(&shm_transport);
+		return NULL;
+	}
+
+	shm_transport.fd = epfd;
+	return &shm_transport;
+}
+
+
+static socklen_t socketName(struct sockaddr_un* const addr, const uint8_t* const nonce)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	// abstract, gone with the socket, and private to this network namespace
+	int len = 1 + sprintf(&addr->sun_path[1], "chat-shm-");
+	for (int i = 0; i < SHM_NONCE_SIZE; ++i)
+		len += sprintf(&addr->sun_path[len], "%02x", nonce[i]);
+
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+
+static int listenNamed(const uint8_t* const nonce)
+{
+	struct sockaddr_un addr;
+	const socklen_t len = socketName(&addr, nonce);
+	const int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr*) &addr, len) == -1 || listen(fd, 1) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static int connectNamed(const uint8_t* const nonce)
+{
+	struct sockaddr_un addr;
+	const socklen_t len = socketName(&addr, nonce);
+	const int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr*) &addr, len) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static bool sendFds(const int sock, const int* const fds)
+{
+	char byte = 0;
+	char control[CMSG_SPACE(SHMFD_COUNT * sizeof(int))];
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+
+	memset(control, 0, sizeof(control));
+	struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(SHMFD_COUNT * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, SHMFD_COUNT * sizeof(int));
+
+	ssize_t n;
+	while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+		;
+	return n == 1;
+}
+
+
+static bool recvFds(const int sock, int* const fds)
+{
+	char byte;
+	char control[CMSG_SPACE(SHMFD_COUNT * sizeof(int))];
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		;
+
+	const struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != 1 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(SHMFD_COUNT * sizeof(int)))
+		return false;
+
+	memcpy(fds, CMSG_DATA(cmsg), SHMFD_COUNT * sizeof(int));
+	return true;
+}
+
+
+// the process at the other end of the unix socket is the one at the other end of TCP
+static bool isPeer(const int sock, const uint32_t pid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+
+	return cred.uid == geteuid() && (uint32_t) cred.pid == pid;
+}
+
+
+/* host: offer (region ready, socket nonce) -> client: connected (its pid)
+ * -> host: fds on the unix socket -> client: attached. Either side saying
+ * no keeps TCP */
+static struct Transport* hostUpgrade(struct Transport* const tcp)
+{
+	int fds[SHMFD_COUNT] = { -1, -1, -1 };
+	int lfd = -1;
+	struct ShmOffer offer;
+	struct ShmConnected connected = { .ok = 0 };
+	uint8_t attached = 0;
+	struct Transport* ret = NULL;
+
+	offer.ok = getrandom(offer.nonce, sizeof(offer.nonce), 0) == sizeof(offer.nonce) &&
+	           createRegion(fds) && (lfd = listenNamed(offer.nonce)) != -1;
+	if (!offer.ok)
+		memset(offer.nonce, 0, sizeof(offer.nonce));
+
+	if (!transportWriteAll(tcp, &offer, sizeof(offer)) ||
+	    (offer.ok && !transportReadAll(tcp, &connected, sizeof(connected))))
+		goto Lcleanup;
+
+	if (connected.ok) {
+		// the client connected before it said so, this doesn't wait
+		const int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd != -1) {
+			if (isPeer(cfd, ntohl(connected.pid)))
+				sendFds(cfd, fds);
+			close(cfd);
+		}
+		if (!transportReadAll(tcp, &attached, 1))
+			goto Lcleanup;
+	}
+
+	ret = tcp;
+	if (attached && (ret = openShm(fds, true, tcp->fd)) != NULL) {
+		close(lfd);
+		return ret;
+	}
+
+Lcleanup:
+	if (lfd != -1)
+		close(lfd);
+	if (shm.region != NULL)
+		munmap(shm.region, sizeof(struct Region));
+	shm.region = NULL;
+	closeFds(fds);
+	return ret;
+}
+
+
+static struct Transport* clientUpgrade(struct Transport* const tcp)
+{
+	int fds[SHMFD_COUNT] = { -1, -1, -1 };
+	struct ShmOffer offer;
+	if (!transportReadAll(tcp, &offer, sizeof(offer)))
+		return NULL;
+	if (!offer.ok)
+		return tcp;
+
+	const int sock = connectNamed(offer.nonce);
+	const struct ShmConnected connected = { .pid = htonl(getpid()), .ok = htonl(sock != -1) };
+	if (!transportWriteAll(tcp, &connected, sizeof(connected))) {
+		if (sock != -1)
+			close(sock);
+		return NULL;
+	}
+	if (sock == -1)
+		return tcp;
+
+	uint8_t attached = recvFds(sock, fds);
+	close(sock);
+	if (attached && !attachRegion(fds)) {
+		closeFds(fds);
+		attached = 0;
+	}
+
+	if (!transportWriteAll(tcp, &attached, 1)) {
+		if (attached) {
+			munmap(shm.region, sizeof(struct Region));
+			shm.region = NULL;
+			closeFds(fds);
+		}
+		return NULL;
+	}
+
+	return attached ? openShm(fds, false, tcp->fd) : tcp;
+}
+
+
+struct Transport* upgradeToShm(struct Transport* const tcp, const bool host)
+{
+	return host ? hostUpgrade(tcp) : clientUpgrade(tcp);
+}
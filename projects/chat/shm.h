@@ -0,0 +1,16 @@
+#ifndef CHAT_SHM_H_
+#define CHAT_SHM_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "transport.h"
+
+
+/* moves a connection between two processes of the same machine off TCP,
+ * onto a pair of rings in a memfd both of them map. Runs a short handshake
+ * over tcp, which is kept open to notice the peer going away. Returns the
+ * shared memory transport, tcp itself if either end couldn't set it up
+ * (or the peers are different users), or NULL if tcp broke in the meantime */
+extern struct Transport* upgradeToShm(struct Transport* tcp, bool host);
+
+
+#endif
@@ -0,0 +1,265 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "textbox.h"
+
+
+/* The text box is a gap buffer: the text before the cursor lives at
+ * [0, gap_start) and the text after it at [gap_end, size). Edits at the
+ * cursor only move gap_start or gap_end, and moving the cursor moves
+ * one char across the gap. The display width of the text before the
+ * cursor is kept up to date on every edit, so finding the cursor cell
+ * never rescans the text.
+ * */
+#define TEXTBOX_INITIAL_SIZE ((int)512)
+
+
+static struct TextBox {
+	char* data;
+	int size;
+	int gap_start;
+	int gap_end;
+	int cells_before;   // display width of [0, gap_start)
+} tb = { .data = NULL };
+
+
+int utf8CharWidth(const char* const str, const int len, int* const nbytes)
+{
+	const unsigned char c = (unsigned char) str[0];
+
+	// ASCII fast path, control chars (e.g. pasted '\n') take one cell
+	if (c < 0x80) {
+		*nbytes = 1;
+		return 1;
+	}
+
+	int n;
+	wchar_t wc;
+	if ((c & 0xE0) == 0xC0) {
+		n = 2;
+		wc = c & 0x1F;
+	} else if ((c & 0xF0) == 0xE0) {
+		n = 3;
+		wc = c & 0x0F;
+	} else if ((c & 0xF8) == 0xF0) {
+		n = 4;
+		wc = c & 0x07;
+	} else {
+		*nbytes = 1;   // stray continuation byte
+		return 1;
+	}
+
+	if (n > len) {
+		*nbytes = len;
+		return 1;
+	}
+
+	for (int i = 1; i < n; ++i)
+		wc = (wc << 6) | (str[i] & 0x3F);
+
+	*nbytes = n;
+	const int width = wcwidth(wc);
+	return width >= 0 ? width : 1;
+}
+
+
+static int encodeUTF8(const wchar_t ch, char* const dest)
+{
+	const unsigned int c = (unsigned int) ch;
+	if (c < 0x80) {
+		dest[0] = (char) c;
+		return 1;
+	} else if (c < 0x800) {
+		dest[0] = (char) (0xC0 | (c >> 6));
+		dest[1] = (char) (0x80 | (c & 0x3F));
+		return 2;
+	} else if (c < 0x10000) {
+		dest[0] = (char) (0xE0 | (c >> 12));
+		dest[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+		dest[2] = (char) (0x80 | (c & 0x3F));
+		return 3;
+	} else if (c < 0x110000) {
+		dest[0] = (char) (0xF0 | (c >> 18));
+		dest[1] = (char) (0x80 | ((c >> 12) & 0x3F));
+		dest[2] = (char) (0x80 | ((c >> 6) & 0x3F));
+		dest[3] = (char) (0x80 | (c & 0x3F));
+		return 4;
+	}
+	return 0;
+}
+
+
+// size of the char that ends at gap_start
+static int prevCharSize(void)
+{
+	int i = tb.gap_start - 1;
+	while (i > 0 && (tb.data[i] & 0xC0) == 0x80 && tb.gap_start - i < 4)
+		--i;
+	return tb.gap_start - i;
+}
+
+
+bool initializeTextBox(void)
+{
+	tb.data = malloc(TEXTBOX_INITIAL_SIZE);
+	if (tb.data == NULL) {
+		perror("Couldn't allocate text box");
+		return false;
+	}
+
+	tb.size = TEXTBOX_INITIAL_SIZE;
+	textBoxClear();
+	return true;
+}
+
+
+void terminateTextBox(void)
+{
+	free(tb.data);
+	tb.data = NULL;
+}
+
+
+static bool grow(const int needed)
+{
+	const int after = tb.size - tb.gap_end;
+	int newsize = tb.size * 2;
+	while (newsize - (tb.gap_start + after) < needed)
+		newsize *= 2;
+
+	char* const data = realloc(tb.data, newsize);
+	if (data == NULL)
+		return false;
+
+	memmove(&data[newsize - after], &data[tb.gap_end], after);
+	tb.data = data;
+	tb.gap_end = newsize - after;
+	tb.size = newsize;
+	return true;
+}
+
+
+bool textBoxInsert(const wchar_t ch)
+{
+	char bytes[4];
+	const int n = encodeUTF8(ch, bytes);
+	if (n == 0)
+		return false;
+
+	// one byte is kept free for textBoxText()'s terminator
+	if (tb.gap_end - tb.gap_start <= n && !grow(n + 1))
+		return false;
+
+	int nbytes;
+	memcpy(&tb.data[tb.gap_start], bytes, n);
+	tb.cells_before += utf8CharWidth(bytes, n, &nbytes);
+	tb.gap_start += n;
+	return true;
+}
+
+
+void textBoxBackspace(void)
+{
+	if (tb.gap_start == 0)
+		return;
+
+	int nbytes;
+	const int n = prevCharSize();
+	tb.cells_before -= utf8CharWidth(&tb.data[tb.gap_start - n], n, &nbytes);
+	tb.gap_start -= n;
+}
+
+
+void textBoxDelete(void)
+{
+	if (tb.gap_end == tb.size)
+		return;
+
+	int n;
+	utf8CharWidth(&tb.data[tb.gap_end], tb.size - tb.gap_end, &n);
+	tb.gap_end += n;
+}
+
+
+void textBoxLeft(void)
+{
+	if (tb.gap_start == 0)
+		return;
+
+	int nbytes;
+	const int n = prevCharSize();
+	tb.gap_start -= n;
+	tb.gap_end -= n;
+	memmove(&tb.data[tb.gap_end], &tb.data[tb.gap_start], n);
+	tb.cells_before -= utf8CharWidth(&tb.data[tb.gap_end], n, &nbytes);
+}
+
+
+void textBoxRight(void)
+{
+	if (tb.gap_end == tb.size)
+		return;
+
+	int n;
+	const int width = utf8CharWidth(&tb.data[tb.gap_end], tb.size - tb.gap_end, &n);
+	memmove(&tb.data[tb.gap_start], &tb.data[tb.gap_end], n);
+	tb.gap_start += n;
+	tb.gap_end += n;
+	tb.cells_before += width;
+}
+
+
+void textBoxHome(void)
+{
+	const int n = tb.gap_start;
+	memmove(&tb.data[tb.gap_end - n], tb.data, n);
+	tb.gap_start = 0;
+	tb.gap_end -= n;
+	tb.cells_before = 0;
+}
+
+
+void textBoxEnd(void)
+{
+	const int n = tb.size - tb.gap_end;
+	for (int i = 0, nbytes; i < n; i += nbytes)
+		tb.cells_before += utf8CharWidth(&tb.data[tb.gap_end + i], n - i, &nbytes);
+
+	memmove(&tb.data[tb.gap_start], &tb.data[tb.gap_end], n);
+	tb.gap_start += n;
+	tb.gap_end = tb.size;
+}
+
+
+void textBoxClear(void)
+{
+	tb.gap_start = 0;
+	tb.gap_end = tb.size;
+	tb.cells_before = 0;
+}
+
+
+int textBoxLength(void)
+{
+	return tb.gap_start + (tb.size - tb.gap_end);
+}
+
+
+/* moves the cursor to the end, so the text is contiguous */
+const char* textBoxText(void)
+{
+	textBoxEnd();
+	tb.data[tb.gap_start] = '\0';   // the gap is never empty
+	return tb.data;
+}
+
+
+void textBoxView(struct TextBoxView* const view)
+{
+	view->before = tb.data;
+	view->before_len = tb.gap_start;
+	view->after = &tb.data[tb.gap_end];
+	view->after_len = tb.size - tb.gap_end;
+	view->cursor_cells = tb.cells_before;
+}
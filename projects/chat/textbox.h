@@ -0,0 +1,37 @@
+#ifndef CHAT_TEXTBOX_H_
+#define CHAT_TEXTBOX_H_
+#include <stdbool.h>
+#include <wchar.h>
+
+
+/* the text around the cursor, for drawing. Only valid until the next edit */
+struct TextBoxView {
+	const char* before;   // text before the cursor
+	const char* after;    // text after the cursor
+	int before_len;
+	int after_len;
+	int cursor_cells;     // display width of the text before the cursor
+};
+
+
+extern bool initializeTextBox(void);
+extern void terminateTextBox(void);
+
+extern bool textBoxInsert(wchar_t ch);
+extern void textBoxBackspace(void);
+extern void textBoxDelete(void);
+extern void textBoxLeft(void);
+extern void textBoxRight(void);
+extern void textBoxHome(void);
+extern void textBoxEnd(void);
+extern void textBoxClear(void);
+
+extern int textBoxLength(void);          // in bytes
+extern const char* textBoxText(void);    // contiguous and '\0' terminated
+extern void textBoxView(struct TextBoxView* view);
+
+/* display width of the UTF-8 char at str, its size in bytes goes to *nbytes */
+extern int utf8CharWidth(const char* str, int len, int* nbytes);
+
+
+#endif
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include "tls.h"
+#include "report.h"
+
+
+/* TLS 1.3 only. The context outlives the connection: on the host it holds
+ * the session ticket key, so a client reconnecting to the same process
+ * resumes with an abbreviated handshake. The client keeps the last ticket
+ * in memory and in the cache dir, tagged with the host it came from.
+ * Records are written through a buffer BIO and flushed when a send comes
+ * without more, so a batch from the send queue still leaves in one write()
+ * however many records it takes.
+ * */
+#define TLS_WBUF_SIZE  ((int)(160 * 1024))   // a full send queue plus record overhead
+#define TLS_CHUNK_SIZE ((int)16384)          // one record of plaintext
+#define TLS_PATH_SIZE  ((int)4096)
+#define TLS_PEER_SIZE  ((int)300)
+#define TLS_CERT_DAYS  ((long)30)
+
+
+static struct Tls {
+	SSL_CTX* ctx;
+	SSL* ssl;
+	SSL_SESSION* session;       // client, latest ticket from peer
+	char peer[TLS_PEER_SIZE];
+	bool server;
+} tls = { .ctx = NULL, .ssl = NULL, .session = NULL };
+
+
+static bool getCacheDir(char* const dest, const int size)
+{
+	const char* const xdg = getenv("XDG_CACHE_HOME");
+	if (xdg != NULL && xdg[0] != '\0')
+		return snprintf(dest, size, "%s", xdg) < size;
+
+	const char* const home = getenv("HOME");
+	if (home == NULL)
+		return false;
+
+	return snprintf(dest, size, "%s/.cache", home) < size;
+}
+
+
+static bool getCachePath(char* const dest, const int size)
+{
+	char dir[TLS_PATH_SIZE];
+	return getCacheDir(dir, TLS_PATH_SIZE) && snprintf(dest, size, "%s/chat-tls-session", dir) < size;
+}
+
+
+/* cache format: the peer on the first line, then the PEM session */
+static SSL_SESSION* loadSession(void)
+{
+	char path[TLS_PATH_SIZE];
+	if (!getCachePath(path, TLS_PATH_SIZE))
+		return NULL;
+
+	FILE* const file = fopen(path, "r");
+	if (file == NULL)
+		return NULL;
+
+	SSL_SESSION* sess = NULL;
+	char line[TLS_PEER_SIZE];
+	if (fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strcmp(line, tls.peer) == 0)
+			sess = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+	}
+
+	fclose(file);
+	return sess;
+}
+
+
+/* the session holds the resumption secret, the file is the user's alone.
+ * fchmod for one an older version left readable */
+static void saveSession(SSL_SESSION* const sess)
+{
+	char dir[TLS_PATH_SIZE], path[TLS_PATH_SIZE];
+	if (!getCacheDir(dir, TLS_PATH_SIZE) || !getCachePath(path, TLS_PATH_SIZE))
+		return;
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return;
+
+	const int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd == -1)
+		return;
+
+	FILE* const file = fdopen(fd, "w");
+	if (fchmod(fd, 0600) == -1 || file == NULL) {
+		if (file != NULL)
+			fclose(file);
+		else
+			close(fd);
+		return;
+	}
+
+	fprintf(file, "%s\n", tls.peer);
+	PEM_write_SSL_SESSION(file, sess);
+	fclose(file);
+}
+
+
+/* tickets arrive after the handshake, whenever the client next reads.
+ * Sessions only cross into and out of a connection as copies: one that
+ * fails or drops can leave its own session unusable for resumption */
+static int onNewSession(SSL* const ssl, SSL_SESSION* const sess)
+{
+	((void)ssl);
+	SSL_SESSION* const copy = SSL_SESSION_dup(sess);
+	if (copy == NULL)
+		return 0;
+
+	if (tls.session != NULL)
+		SSL_SESSION_free(tls.session);
+	tls.session = copy;
+	saveSession(copy);
+	return 0;
+}
+
+
+static bool useEphemeralCert(SSL_CTX* const ctx)
+{
+	EVP_PKEY* const pkey = EVP_EC_gen("P-256");
+	X509* const cert = X509_new();
+	bool ret = false;
+
+	if (pkey == NULL || cert == NULL)
+		goto Lfree;
+
+	X509_NAME* const name = X509_get_subject_name(cert);
+	ret = X509_set_version(cert, 2) &&
+	      ASN1_INTEGER_set(X509_get_serialNumber(cert), (long) time(NULL)) &&
+	      X509_gmtime_adj(X509_getm_notBefore(cert), 0) != NULL &&
+	      X509_gmtime_adj(X509_getm_notAfter(cert), TLS_CERT_DAYS * 24 * 3600) != NULL &&
+	      X509_set_pubkey(cert, pkey) &&
+	      X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	                                 (const unsigned char*) "chat", -1, -1, 0) &&
+	      X509_set_issuer_name(cert, name) &&
+	      X509_sign(cert, pkey, EVP_sha256()) &&
+	      SSL_CTX_use_certificate(ctx, cert) &&
+	      SSL_CTX_use_PrivateKey(ctx, pkey);
+
+Lfree:
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	return ret;
+}
+
+
+/* SNI for a name, and with a CA the certificate has to be for it: the
+ * address is checked against the IP SANs, a name against the DNS ones */
+static bool setPeerHost(SSL* const ssl, const char* const host, const bool verify)
+{
+	X509_VERIFY_PARAM* const param = SSL_get0_param(ssl);
+	if (host == NULL || host[0] == '\0')
+		return !verify;
+
+	if (X509_VERIFY_PARAM_set1_ip_asc(param, host) == 1)
+		return true;
+
+	X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+	return SSL_set_tlsext_host_name(ssl, host) == 1 && (!verify || SSL_set1_host(ssl, host) == 1);
+}
+
+
+static SSL_CTX* createContext(const bool server, const struct TlsConfig* const cfg)
+{
+	SSL_CTX* const ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	if (ctx == NULL)
+		return NULL;
+
+	if (!SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION))
+		goto Lfree_ctx;
+
+	// a lone ticket or key update must not block the event loop in SSL_read
+	SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+
+	if (server) {
+		SSL_CTX_set_num_tickets(ctx, 1);
+		if (cfg->cert == NULL) {
+			if (!useEphemeralCert(ctx))
+				goto Lfree_ctx;
+		} else if (SSL_CTX_use_certificate_chain_file(ctx, cfg->cert) != 1 ||
+		           SSL_CTX_use_PrivateKey_file(ctx, cfg->key != NULL ? cfg->key : cfg->cert,
+		                                       SSL_FILETYPE_PEM) != 1 ||
+		           SSL_CTX_check_private_key(ctx) != 1) {
+			goto Lfree_ctx;
+		}
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+		if (cfg->ca != NULL) {
+			if (SSL_CTX_load_verify_locations(ctx, cfg->ca, NULL) != 1)
+				goto Lfree_ctx;
+			SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		}
+	}
+
+	return ctx;
+
+Lfree_ctx:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+
+static void fingerprint(X509* const cert, char* const dest, const int size)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+	dest[0] = '\0';
+	if (cert == NULL || !X509_digest(cert, EVP_sha256(), md, &mdlen))
+		return;
+
+	int pos = 0;
+	for (unsigned int i = 0; i < mdlen && pos + 3 < size; ++i)
+		pos += sprintf(&dest[pos], i > 0 ? ":%02X" : "%02X", md[i]);
+}
+
+
+/* what, with OpenSSL's error queue (emptied) after it, or with errno when
+ * the queue is empty */
+static void reportSsl(const char* const what)
+{
+	char why[REPORT_MSG_SIZE];
+	int pos = 0;
+	unsigned long err;
+	why[0] = '\0';
+
+	while ((err = ERR_get_error()) != 0) {
+		if (pos > 0 && pos < REPORT_MSG_SIZE - 2) {
+			why[pos++] = ';';
+			why[pos++] = ' ';
+		}
+		if (pos < REPORT_MSG_SIZE - 1) {
+			ERR_error_string_n(err, &why[pos], REPORT_MSG_SIZE - pos);
+			pos += strlen(&why[pos]);
+		}
+	}
+
+	reportMsg(what, pos > 0 ? why : strerror(errno));
+}
+
+
+// maps a failed SSL call to what a socket call would have returned
+static ssize_t sslFail(const int ret)
+{
+	switch (SSL_get_error(tls.ssl, ret)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		if (errno == 0)
+			return 0;   // EOF without close_notify
+		return -1;
+	default:
+		reportSsl("TLS error");
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+
+static bool flushRecords(void)
+{
+	BIO* const wbio = SSL_get_wbio(tls.ssl);
+	while (BIO_flush(wbio) <= 0) {
+		if (!BIO_should_retry(wbio))
+			return false;
+	}
+	return true;
+}
+
+
+static ssize_t tlsSend(struct Transport* const t, const void* const buf,
+                       const size_t len, const bool more)
+{
+	((void)t);
+	size_t written = 0;
+
+	ERR_clear_error();
+	errno = 0;
+	if (len > 0) {
+		const int ret = SSL_write_ex(tls.ssl, buf, len, &written);
+		if (ret != 1)
+			return sslFail(ret);
+	}
+
+	if (!more && !flushRecords())
+		return -1;
+
+	return written;
+}
+
+
+static ssize_t tlsRecv(struct Transport* const t, void* const buf, const size_t len)
+{
+	((void)t);
+	size_t nread = 0;
+
+	ERR_clear_error();
+	errno = 0;
+	const int ret = SSL_read_ex(tls.ssl, buf, len, &nread);
+	if (ret != 1)
+		return sslFail(ret);
+
+	return nread;
+}
+
+
+static bool tlsSendFile(struct Transport* const t, const int in_fd, off_t offset, size_t count)
+{
+	char chunk[TLS_CHUNK_SIZE];
+
+	while (count > 0) {
+		const ssize_t n = pread(in_fd, chunk, count < sizeof(chunk) ? count : sizeof(chunk), offset);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		if (tlsSend(t, chunk, n, true) != n)
+			return false;
+		offset += n;
+		count -= n;
+	}
+
+	return flushRecords();
+}
+
+
+static ssize_t tlsRecvFile(struct Transport* const t, const int out_fd, off_t offset,
+                           const size_t count)
+{
+	char chunk[TLS_CHUNK_SIZE];
+	const ssize_t n = tlsRecv(t, chunk, count < sizeof(chunk) ? count : sizeof(chunk));
+
+	for (ssize_t pos = 0; pos < n;) {
+		const ssize_t m = pwrite(out_fd, &chunk[pos], n - pos, offset);
+		if (m == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += m;
+		offset += m;
+	}
+
+	return n;
+}
+
+
+static bool tlsPending(const struct Transport* const t)
+{
+	((void)t);
+	return SSL_pending(tls.ssl) > 0;
+}
+
+
+static void tlsClose(struct Transport* const t)
+{
+	((void)t);
+	if (tls.ssl == NULL)
+		return;
+
+	SSL_shutdown(tls.ssl);   // sends close_notify, doesn't wait for the peer's
+	flushRecords();
+	SSL_free(tls.ssl);
+	tls.ssl = NULL;
+}
+
+
+static struct Transport tls_transport = {
+	.name = "tls",
+	.send = tlsSend,
+	.recv = tlsRecv,
+	.sendFile = tlsSendFile,
+	.recvFile = tlsRecvFile,
+	.pending = tlsPending,
+	.close = tlsClose,
+	.ctx = &tls,
+	.fd = -1
+};
+
+
+static void describeSession(const struct TlsConfig* const cfg, char* const info, const int infosize)
+{
+	char fp[EVP_MAX_MD_SIZE * 3 + 1];
+	X509* const peer_cert = tls.server ? NULL : SSL_get1_peer_certificate(tls.ssl);
+
+	fingerprint(tls.server ? SSL_get_certificate(tls.ssl) : peer_cert, fp, sizeof(fp));
+	snprintf(info, infosize, "%s %s, %s, %s certificate %s%s",
+	         SSL_get_version(tls.ssl), SSL_get_cipher_name(tls.ssl),
+	         SSL_session_reused(tls.ssl) ? "resumed" : "full handshake",
+	         tls.server ? "own" : "host", fp,
+	         !tls.server && cfg->ca == NULL ? " (unverified)" : "");
+
+	X509_free(peer_cert);
+}
+
+
+struct Transport* openTlsTransport(const int fd, const bool server, const struct TlsConfig* const cfg,
+                                   char* const info, const int infosize)
+{
+	// the socket BIO writes without MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
+
+	if (tls.ctx == NULL) {
+		tls.server = server;
+		if ((tls.ctx = createContext(server, cfg)) == NULL) {
+			reportSsl("Couldn't set up TLS");
+			return NULL;
+		}
+	}
+
+	if ((tls.ssl = SSL_new(tls.ctx)) == NULL) {
+		reportSsl("Couldn't set up TLS");
+		return NULL;
+	}
+
+	BIO* const rbio = BIO_new_socket(fd, BIO_NOCLOSE);
+	BIO* const sock = BIO_new_socket(fd, BIO_NOCLOSE);
+	BIO* const wbuf = BIO_new(BIO_f_buffer());
+	if (rbio == NULL || sock == NULL || wbuf == NULL ||
+	    BIO_set_write_buffer_size(wbuf, TLS_WBUF_SIZE) != 1) {
+		BIO_free(rbio);
+		BIO_free(sock);
+		BIO_free(wbuf);
+		reportSsl("Couldn't set up TLS");
+		goto Lfree_ssl;
+	}
+	SSL_set_bio(tls.ssl, rbio, BIO_push(wbuf, sock));
+
+	int ret;
+	if (server) {
+		ret = SSL_accept(tls.ssl);
+	} else {
+		snprintf(tls.peer, TLS_PEER_SIZE, "%s", cfg->peer != NULL ? cfg->peer : "");
+		if (!setPeerHost(tls.ssl, cfg->host, cfg->ca != NULL)) {
+			char what[TLS_PEER_SIZE + 64];
+			snprintf(what, sizeof(what), "Couldn't set the host to verify (%s)", cfg->host != NULL ? cfg->host : "");
+			reportSsl(what);
+			goto Lfree_ssl;
+		}
+		if (tls.session == NULL)
+			tls.session = loadSession();
+		if (tls.session != NULL) {
+			SSL_SESSION* const copy = SSL_SESSION_dup(tls.session);
+			SSL_set_session(tls.ssl, copy);
+			SSL_SESSION_free(copy);
+		}
+		ret = SSL_connect(tls.ssl);
+	}
+
+	if (ret != 1) {
+		reportSsl("TLS handshake failed");
+		goto Lfree_ssl;
+	}
+
+	describeSession(cfg, info, infosize);
+	tls_transport.fd = fd;
+	return &tls_transport;
+
+Lfree_ssl:
+	SSL_free(tls.ssl);
+	tls.ssl = NULL;
+	return NULL;
+}
+
+
+void terminateTls(void)
+{
+	if (tls.session != NULL)
+		SSL_SESSION_free(tls.session);
+	if (tls.ctx != NULL)
+		SSL_CTX_free(tls.ctx);
+	tls.session = NULL;
+	tls.ctx = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef CHAT_TLS_H_
+#define CHAT_TLS_H_
+#include <stdbool.h>
+#include "transport.h"
+
+
+#define TLS_INFO_SIZE ((int)192)
+
+
+struct TlsConfig {
+	const char* cert;  // host, PEM chain. NULL for an ephemeral self-signed one
+	const char* key;   // host, PEM key. NULL if it's in cert
+	const char* ca;    // client, PEM to verify the host with. NULL to only show its fingerprint
+	const char* peer;  // client, "host:port" the cached session belongs to
+	const char* host;  // client, the name or address the host's certificate must be for
+};
+
+
+/* runs a TLS 1.3 handshake over fd, resuming the last session with the
+ * same peer when there is one. info gets a one line summary of it */
+extern struct Transport* openTlsTransport(int fd, bool server, const struct TlsConfig* cfg,
+                                          char* info, int infosize);
+/* frees what is kept across connections, the context and the session */
+extern void terminateTls(void);
+
+
+#endif
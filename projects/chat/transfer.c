@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "transfer.h"
+#include "sendq.h"
+#include "loop.h"
+#include "channels.h"
+#include "metrics.h"
+
+
+/* One file each way at a time, multiplexed with the chat on the same
+ * connection. The sender offers it, the receiver answers with how much of
+ * it it already has (its .part file, if the .part.id next to it names the
+ * same size and mtime), and the data follows as frames whose
+ * payload is nothing but file bytes: sendfile() straight after the header
+ * on the way out, and on the way in whatever part of a chunk isn't in the
+ * frame buffer yet goes from the transport to the file (splice() on plain
+ * TCP). At most TRANSFER_BURST chunks leave per loop tick, so messages
+ * typed meanwhile go out between them, and at most TRANSFER_WINDOW bytes
+ * are unacknowledged. A dropped connection is resumed on the next one.
+ * */
+#define TRANSFER_CHUNK     ((uint32_t) FRAME_MAX_PAYLOAD)
+#define TRANSFER_WINDOW    ((uint64_t)(1024 * 1024))
+#define TRANSFER_ACK       ((uint64_t)(256 * 1024))    // the receiver acks this often
+#define TRANSFER_BURST     ((int)4)
+#define TRANSFER_NAME_SIZE ((int)256)
+#define TRANSFER_PATH_SIZE ((int)4096)
+#define TRANSFER_MSG_SIZE  ((int)512)
+
+
+static struct Outgoing {
+	int fd;              // -1 when idle
+	uint32_t id;         // of the current offer
+	uint64_t size;
+	uint64_t mtime;      // ns, sent along with size so a resume picks the right .part
+	uint64_t next;       // offset of the next chunk
+	uint64_t acked;      // bytes the receiver has
+	uint64_t first;      // where this connection's run started
+	uint64_t start_ns;
+	bool accepted;       // the receiver answered the offer
+	bool ended;          // FRAME_FILE_END is out
+	char name[TRANSFER_NAME_SIZE];
+} out = { .fd = -1 };
+
+
+static struct Incoming {
+	int fd;              // the .part file, -1 when idle
+	uint32_t id;
+	uint64_t size;
+	uint64_t offset;     // bytes in the file
+	uint64_t acked;      // offset last acknowledged
+	uint64_t first;
+	uint64_t start_ns;
+	uint32_t remaining;  // of the FRAME_FILE_DATA payload being taken from the transport
+	char name[TRANSFER_NAME_SIZE];
+	char part[TRANSFER_PATH_SIZE];
+	char part_id[TRANSFER_PATH_SIZE];   // "size mtime" of the file in .part
+} in = { .fd = -1 };
+
+
+static struct Transfers {
+	const char* dir;
+	void (*info)(const char* msg);
+	int efd;             // ticks the loop again while the window is open
+	uint32_t next_id;
+	bool connected;
+	char scratch[TRANSFER_CHUNK];   // data of a transfer that was given up
+} xfer = { .efd = -1 };
+
+
+static void infof(const char* const fmt, ...)
+{
+	char msg[TRANSFER_MSG_SIZE];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	xfer.info(msg);
+}
+
+
+static const char* formatSize(const uint64_t bytes, char* const dest, const int size)
+{
+	if (bytes < 1024)
+		snprintf(dest, size, "%llu bytes", (unsigned long long) bytes);
+	else if (bytes < 1024 * 1024)
+		snprintf(dest, size, "%.1f KiB", bytes / 1024.0);
+	else
+		snprintf(dest, size, "%.1f MiB", bytes / (1024.0 * 1024.0));
+	return dest;
+}
+
+
+static void reportRate(const char* const what, const char* const name, const uint64_t bytes,
+                       const uint64_t start_ns)
+{
+	char size[32];
+	const double secs = (metricsClock() - start_ns) / 1e9;
+	infof("%s %s, %s in %.2fs (%.1f MiB/s).", what, name, formatSize(bytes, size, sizeof(size)),
+	      secs, secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0);
+}
+
+
+static bool sendControl(const enum FrameType type, const uint32_t id, const uint64_t offset)
+{
+	const struct FileControl ctl = {
+		.id = htonl(id),
+		.reserved = 0,
+		.offset = htobe64(offset)
+	};
+	return sendQueueFrame(type, CHANNEL_LOBBY, &ctl, sizeof(ctl));
+}
+
+
+static bool sendOffer(void)
+{
+	const size_t namelen = strlen(out.name);
+	char payload[sizeof(struct FileOffer) + TRANSFER_NAME_SIZE];
+	struct FileOffer* const offer = (struct FileOffer*) payload;
+
+	out.id = ++xfer.next_id;
+	out.accepted = false;
+	out.ended = false;
+	offer->id = htonl(out.id);
+	offer->reserved = 0;
+	offer->size = htobe64(out.size);
+	offer->mtime = htobe64(out.mtime);
+	memcpy(offer->name, out.name, namelen);
+	return sendQueueFrame(FRAME_FILE_OFFER, CHANNEL_LOBBY, payload, sizeof(*offer) + namelen);
+}
+
+
+static void closeOutgoing(void)
+{
+	if (out.fd != -1)
+		close(out.fd);
+	out.fd = -1;
+}
+
+
+static void closeIncoming(void)
+{
+	if (in.fd != -1)
+		close(in.fd);
+	in.fd = -1;
+}
+
+
+bool transferSend(const char* const path)
+{
+	if (out.fd != -1) {
+		infof("Still sending %s, one file at a time.", out.name);
+		return false;
+	}
+
+	const int fd = open(path, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		infof("Couldn't open %s: %s.", path, strerror(errno));
+		goto Lclose_fd;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		infof("%s is not a regular file.", path);
+		goto Lclose_fd;
+	}
+
+	const char* const slash = strrchr(path, '/');
+	snprintf(out.name, sizeof(out.name), "%s", slash != NULL ? slash + 1 : path);
+	out.fd = fd;
+	out.size = st.st_size;
+	out.mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000u + st.st_mtim.tv_nsec;
+
+	char size[32];
+	infof("Offering %s (%s).", out.name, formatSize(out.size, size, sizeof(size)));
+	if (xfer.connected)
+		sendOffer();
+	return true;
+
+Lclose_fd:
+	if (fd != -1)
+		close(fd);
+	return false;
+}
+
+
+void transferConnected(void)
+{
+	xfer.connected = true;
+	closeIncoming();
+	in.remaining = 0;
+
+	// the receiver's answer says where to pick it up
+	if (out.fd != -1)
+		sendOffer();
+}
+
+
+void transferDisconnected(void)
+{
+	xfer.connected = false;
+	out.accepted = false;
+	closeIncoming();
+	in.remaining = 0;
+}
+
+
+bool transferPump(void)
+{
+	if (!xfer.connected || out.fd == -1 || !out.accepted || out.ended)
+		return true;
+
+	for (int i = 0; i < TRANSFER_BURST && out.next < out.size &&
+	                out.next - out.acked < TRANSFER_WINDOW; ++i) {
+		const uint32_t len = out.size - out.next < TRANSFER_CHUNK ? out.size - out.next : TRANSFER_CHUNK;
+		if (!sendQueueFile(FRAME_FILE_DATA, out.fd, out.next, len))
+			return false;
+		out.next += len;
+	}
+
+	if (out.next == out.size) {
+		out.ended = true;
+		return sendControl(FRAME_FILE_END, out.id, out.size);
+	}
+
+	// another round once the rest of this tick is out
+	if (out.next - out.acked < TRANSFER_WINDOW)
+		loopWakeup(xfer.efd);
+	return true;
+}
+
+
+// keeps only the last path component, printable
+static bool setIncomingName(const char* const name, uint32_t len)
+{
+	if (len > (uint32_t)(TRANSFER_NAME_SIZE - 1))
+		len = TRANSFER_NAME_SIZE - 1;
+
+	const char* start = name;
+	for (uint32_t i = 0; i < len; ++i)
+		if (name[i] == '/')
+			start = &name[i + 1];
+	len -= start - name;
+
+	for (uint32_t i = 0; i < len; ++i)
+		in.name[i] = (unsigned char) start[i] < ' ' ? '_' : start[i];
+	in.name[len] = '\0';
+
+	return in.name[0] != '\0' && strcmp(in.name, ".") != 0 && strcmp(in.name, "..") != 0;
+}
+
+
+// whether the .part holds the start of this very file, see writePartId()
+static bool samePartId(const uint64_t size, const uint64_t mtime)
+{
+	FILE* const file = fopen(in.part_id, "re");
+	if (file == NULL)
+		return false;
+
+	unsigned long long have_size, have_mtime;
+	const bool same = fscanf(file, "%llu %llu", &have_size, &have_mtime) == 2 &&
+	                  have_size == size && have_mtime == mtime;
+	fclose(file);
+	return same;
+}
+
+
+static bool writePartId(const uint64_t size, const uint64_t mtime)
+{
+	FILE* const file = fopen(in.part_id, "we");
+	if (file == NULL)
+		return false;
+
+	fprintf(file, "%llu %llu\n", (unsigned long long) size, (unsigned long long) mtime);
+	return fclose(file) == 0;
+}
+
+
+static void receiveOffer(const struct FileOffer* const offer, const uint32_t len)
+{
+	const uint32_t id = ntohl(offer->id);
+	if (in.fd != -1) {
+		infof("The peer offered another file while %s is coming, refused.", in.name);
+		sendControl(FRAME_FILE_CANCEL, id, 0);
+		return;
+	}
+
+	if (!setIncomingName(offer->name, len - sizeof(*offer))) {
+		sendControl(FRAME_FILE_CANCEL, id, 0);
+		return;
+	}
+
+	snprintf(in.part, sizeof(in.part), "%s/%s.part", xfer.dir, in.name);
+	snprintf(in.part_id, sizeof(in.part_id), "%s/%s.part.id", xfer.dir, in.name);
+	const int fd = open(in.part, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		infof("Couldn't receive %s: %s: %s.", in.name, in.part, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		sendControl(FRAME_FILE_CANCEL, id, 0);
+		return;
+	}
+
+	in.fd = fd;
+	in.id = id;
+	in.size = be64toh(offer->size);
+	in.offset = (uint64_t) st.st_size;
+
+	// another file's leftovers, or a .part from before the ids, start over
+	const uint64_t mtime = be64toh(offer->mtime);
+	if (in.offset > in.size || !samePartId(in.size, mtime)) {
+		in.offset = 0;
+		if (ftruncate(fd, 0) == -1 || !writePartId(in.size, mtime)) {
+			infof("Couldn't start %s: %s.", in.part, strerror(errno));
+			closeIncoming();
+			sendControl(FRAME_FILE_CANCEL, id, 0);
+			return;
+		}
+	}
+
+	in.acked = in.first = in.offset;
+	in.start_ns = metricsClock();
+	sendControl(FRAME_FILE_ACK, id, in.offset);
+
+	char size[32], have[32];
+	if (in.offset > 0)
+		infof("Receiving %s (%s), resuming after %s.", in.name,
+		      formatSize(in.size, size, sizeof(size)), formatSize(in.offset, have, sizeof(have)));
+	else
+		infof("Receiving %s (%s).", in.name, formatSize(in.size, size, sizeof(size)));
+}
+
+
+static void failIncoming(const char* const why)
+{
+	infof("Receiving %s failed: %s, the partial file is kept.", in.name, why);
+	closeIncoming();
+	sendControl(FRAME_FILE_CANCEL, in.id, 0);
+}
+
+
+// the ack for the whole file waits for FRAME_FILE_END, see finishIncoming()
+static void ackIncoming(void)
+{
+	if (in.offset - in.acked >= TRANSFER_ACK && in.offset < in.size) {
+		sendControl(FRAME_FILE_ACK, in.id, in.offset);
+		in.acked = in.offset;
+	}
+}
+
+
+static void writeIncoming(const char* buf, uint32_t len)
+{
+	if (in.fd == -1)
+		return;
+
+	if (in.offset + len > in.size) {
+		failIncoming("more data than offered");
+		return;
+	}
+
+	while (len > 0) {
+		const ssize_t n = pwrite(in.fd, buf, len, in.offset);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			failIncoming(strerror(errno));
+			return;
+		}
+		buf += n;
+		len -= n;
+		in.offset += n;
+	}
+
+	ackIncoming();
+}
+
+
+static void finishIncoming(const uint32_t id, const uint64_t size)
+{
+	if (in.fd == -1 || id != in.id)
+		return;
+
+	if (size != in.size || in.offset != in.size) {
+		failIncoming("it ended early");
+		return;
+	}
+
+	closeIncoming();
+
+	// never over an existing file, name.1, name.2... instead
+	char path[TRANSFER_PATH_SIZE];
+	snprintf(path, sizeof(path), "%s/%s", xfer.dir, in.name);
+	for (int i = 1; renameat2(AT_FDCWD, in.part, AT_FDCWD, path, RENAME_NOREPLACE) == -1; ++i) {
+		if (errno != EEXIST || i > 99) {
+			infof("Couldn't rename %s: %s.", in.part, strerror(errno));
+			sendControl(FRAME_FILE_CANCEL, id, 0);
+			return;
+		}
+		snprintf(path, sizeof(path), "%s/%s.%d", xfer.dir, in.name, i);
+	}
+	unlink(in.part_id);
+
+	sendControl(FRAME_FILE_ACK, id, size);
+	reportRate("Received", path, in.size - in.first, in.start_ns);
+}
+
+
+static void receiveAck(const uint32_t id, const uint64_t offset)
+{
+	if (out.fd == -1 || id != out.id)
+		return;
+
+	if (offset > out.size) {
+		sendControl(FRAME_FILE_CANCEL, id, 0);
+		infof("The peer is confused about %s, gave up.", out.name);
+		closeOutgoing();
+		return;
+	}
+
+	if (!out.accepted) {
+		out.accepted = true;
+		out.next = out.acked = out.first = offset;
+		out.start_ns = metricsClock();
+		char have[32];
+		if (offset > 0)
+			infof("Resuming %s after %s.", out.name, formatSize(offset, have, sizeof(have)));
+		return;
+	}
+
+	if (offset > out.acked)
+		out.acked = offset;
+
+	if (out.ended && offset == out.size) {
+		reportRate("Sent", out.name, out.size - out.first, out.start_ns);
+		closeOutgoing();
+	}
+}
+
+
+void transferFrame(const struct FrameHeader* const hdr, const char* const payload, const uint32_t len)
+{
+	if (hdr->type == FRAME_FILE_DATA) {
+		writeIncoming(payload, len);
+		return;
+	}
+
+	if (hdr->type == FRAME_FILE_OFFER) {
+		if (len >= sizeof(struct FileOffer))
+			receiveOffer((const struct FileOffer*) payload, len);
+		return;
+	}
+
+	if (len < sizeof(struct FileControl))
+		return;
+
+	const struct FileControl* const ctl = (const struct FileControl*) payload;
+	const uint32_t id = ntohl(ctl->id);
+	switch ((enum FrameType) hdr->type) {
+	case FRAME_FILE_ACK:
+		receiveAck(id, be64toh(ctl->offset));
+		break;
+	case FRAME_FILE_END:
+		finishIncoming(id, be64toh(ctl->offset));
+		break;
+	case FRAME_FILE_CANCEL:
+		if (out.fd != -1 && id == out.id) {
+			infof("The peer didn't take %s.", out.name);
+			closeOutgoing();
+		} else if (in.fd != -1 && id == in.id) {
+			infof("The peer stopped sending %s, the partial file is kept.", in.name);
+			closeIncoming();
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+void transferBeginData(const char* const have, const uint32_t havelen, const uint32_t len)
+{
+	if (in.fd != -1 && in.offset + len > in.size)
+		failIncoming("more data than offered");
+	writeIncoming(have, havelen);
+	in.remaining = len - havelen;
+}
+
+
+bool transferReceiving(void)
+{
+	return in.remaining > 0;
+}
+
+
+bool transferReceive(struct Transport* const transport)
+{
+	ssize_t n;
+	if (in.fd != -1)
+		n = transportRecvFile(transport, in.fd, in.offset, in.remaining);
+	else
+		n = transportRecv(transport, xfer.scratch, in.remaining);
+
+	if (n == 0)
+		return false;
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return true;
+		if (in.fd != -1)
+			infof("Receiving %s failed: %s.", in.name, strerror(errno));
+		return false;
+	}
+
+	in.remaining -= n;
+	if (in.fd != -1) {
+		in.offset += n;
+		ackIncoming();
+	}
+	return true;
+}
+
+
+static bool onMore(const int fd, void* const arg)
+{
+	// transferPump() runs when the loop goes idle
+	((void)fd);
+	((void)arg);
+	return true;
+}
+
+
+bool initializeTransfers(const char* const dir, void (*const info)(const char* msg))
+{
+	xfer.dir = dir;
+	xfer.info = info;
+	xfer.connected = false;
+	xfer.efd = loopAddWakeup(onMore, NULL);
+	return xfer.efd != -1;
+}
+
+
+void terminateTransfers(void)
+{
+	closeOutgoing();
+	closeIncoming();
+	in.remaining = 0;
+	if (xfer.efd != -1)
+		loopCancel(xfer.efd);
+	xfer.efd = -1;
+}
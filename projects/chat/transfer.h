@@ -0,0 +1,34 @@
+#ifndef CHAT_TRANSFER_H_
+#define CHAT_TRANSFER_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "proto.h"
+#include "transport.h"
+
+
+/* files received go to dir, info gets progress messages. Needs the loop */
+extern bool initializeTransfers(const char* dir, void (*info)(const char* msg));
+extern void terminateTransfers(void);
+
+/* /send, offers path to the peer (again on every reconnect until done) */
+extern bool transferSend(const char* path);
+
+/* connection state, a new connection resumes where the last one stopped */
+extern void transferConnected(void);
+extern void transferDisconnected(void);
+
+/* sends the next chunks the window allows, once per loop tick */
+extern bool transferPump(void);
+
+/* FRAME_FILE_* frames that arrived whole */
+extern void transferFrame(const struct FrameHeader* hdr, const char* payload, uint32_t len);
+
+/* a FRAME_FILE_DATA frame of len bytes, of which only the first have ones
+ * arrived. The rest is taken with transferReceive() straight from the
+ * transport, as long as transferReceiving() says so */
+extern void transferBeginData(const char* have, uint32_t havelen, uint32_t len);
+extern bool transferReceiving(void);
+extern bool transferReceive(struct Transport* transport);  // false if the connection failed
+
+
+#endif
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include "transport.h"
+#include "metrics.h"
+
+
+static bool plain_is_socket = true;   // false once send() said ENOTSOCK, e.g. a pipe
+static int plain_pipe[2] = { -1, -1 };  // recvFile, socket -> pipe -> file with splice
+static uint64_t deadline_ns = 0;        // when the blocking helpers give up, 0 for never
+
+
+static ssize_t plainSend(struct Transport* const t, const void* const buf,
+                         const size_t len, const bool more)
+{
+	if (plain_is_socket) {
+		const ssize_t n = send(t->fd, buf, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (n != -1 || errno != ENOTSOCK)
+			return n;
+		plain_is_socket = false;
+	}
+
+	return write(t->fd, buf, len);
+}
+
+
+static ssize_t plainRecv(struct Transport* const t, void* const buf, const size_t len)
+{
+	return read(t->fd, buf, len);
+}
+
+
+static bool plainSendFile(struct Transport* const t, const int in_fd, off_t offset, size_t count)
+{
+	while (count > 0) {
+		const ssize_t n = sendfile(t->fd, in_fd, &offset, count);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		count -= n;
+	}
+
+	return true;
+}
+
+
+static ssize_t plainRecvFile(struct Transport* const t, const int out_fd, off_t offset,
+                             size_t count)
+{
+	// what's there already, so the blocking socket doesn't block
+	int avail = 0;
+	if (ioctl(t->fd, FIONREAD, &avail) == -1)
+		return -1;
+	if (avail == 0) {
+		char c;
+		const ssize_t n = recv(t->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+		if (n != 0 && (n != -1 || errno == ENOTSOCK))
+			errno = EAGAIN;
+		return n == 0 ? 0 : -1;
+	}
+	if (count > (size_t) avail)
+		count = avail;
+
+	if (plain_pipe[0] == -1 && pipe2(plain_pipe, O_CLOEXEC) == -1)
+		return -1;
+
+	const ssize_t n = splice(t->fd, NULL, plain_pipe[1], NULL, count, SPLICE_F_MOVE);
+	if (n <= 0)
+		return n;
+
+	// all of it, or the stream is out of step with the frames
+	for (ssize_t left = n; left > 0;) {
+		const ssize_t m = splice(plain_pipe[0], NULL, out_fd, &offset, left, SPLICE_F_MOVE);
+		if (m <= 0) {
+			if (m == -1 && errno == EINTR)
+				continue;
+			if (m == 0)
+				errno = EIO;
+			return -1;
+		}
+		left -= m;
+	}
+
+	return n;
+}
+
+
+static bool plainPending(const struct Transport* const t)
+{
+	((void)t);
+	return false;
+}
+
+
+static void plainClose(struct Transport* const t)
+{
+	((void)t);
+	if (plain_pipe[0] != -1) {
+		close(plain_pipe[0]);
+		close(plain_pipe[1]);
+		plain_pipe[0] = plain_pipe[1] = -1;
+	}
+}
+
+
+static struct Transport plain = {
+	.name = "tcp",
+	.send = plainSend,
+	.recv = plainRecv,
+	.sendFile = plainSendFile,
+	.recvFile = plainRecvFile,
+	.pending = plainPending,
+	.close = plainClose,
+	.ctx = NULL,
+	.fd = -1
+};
+
+
+struct Transport* openPlainTransport(const int fd)
+{
+	plain.fd = fd;
+	plain_is_socket = true;
+	return &plain;
+}
+
+
+static bool setTimeouts(const int fd, const uint64_t ns)
+{
+	const struct timeval tv = { .tv_sec = ns / 1000000000, .tv_usec = ns % 1000000000 / 1000 };
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0)
+		return true;
+	return errno == ENOTSOCK;
+}
+
+
+bool transportSetDeadline(const int fd, const int timeout_ms)
+{
+	const uint64_t ns = (uint64_t) timeout_ms * 1000000;
+	deadline_ns = timeout_ms > 0 ? metricsClock() + ns : 0;
+	return setTimeouts(fd, ns);
+}
+
+
+// the next wait on fd ends by the deadline, false with ETIMEDOUT past it
+static bool armDeadline(const int fd)
+{
+	if (deadline_ns == 0)
+		return true;
+
+	const uint64_t now = metricsClock();
+	if (now >= deadline_ns) {
+		errno = ETIMEDOUT;
+		return false;
+	}
+
+	// a zero timeout would wait forever
+	const uint64_t left = deadline_ns - now;
+	return setTimeouts(fd, left < 1000 ? 1000 : left);
+}
+
+
+bool transportWriteAll(struct Transport* const t, const void* const buf, const size_t len)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		if (!armDeadline(t->fd))
+			return false;
+
+		const ssize_t n = transportSend(t, (const char*) buf + pos, len - pos, false);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return false;
+		}
+		pos += n;
+	}
+
+	return true;
+}
+
+
+bool transportReadAll(struct Transport* const t, void* const buf, const size_t len)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		if (!armDeadline(t->fd))
+			return false;
+
+		const ssize_t n = transportRecv(t, (char*) buf + pos, len - pos);
+		if (n == 0) {
+			errno = ECONNRESET;
+			return false;
+		} else if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return false;
+		}
+		pos += n;
+	}
+
+	return true;
+}
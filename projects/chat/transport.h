@@ -0,0 +1,80 @@
+#ifndef CHAT_TRANSPORT_H_
+#define CHAT_TRANSPORT_H_
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+/* The byte stream under the chat frames. The handshake, chat.c, the send
+ * queue and the history replay only go through it, so plain TCP and TLS
+ * can be swapped underneath them.
+ * send/recv return what send()/recv() would. recv fails with EAGAIN when
+ * what arrived wasn't for the application (e.g. a TLS session ticket).
+ * more == true asks to hold the data back until a send without it.
+ * recvFile moves up to count bytes of what already arrived to out_fd at
+ * offset, without blocking, and returns like recv.
+ * */
+struct Transport {
+	const char* name;
+	ssize_t (*send)(struct Transport* t, const void* buf, size_t len, bool more);
+	ssize_t (*recv)(struct Transport* t, void* buf, size_t len);
+	bool (*sendFile)(struct Transport* t, int in_fd, off_t offset, size_t count);
+	ssize_t (*recvFile)(struct Transport* t, int out_fd, off_t offset, size_t count);
+	bool (*pending)(const struct Transport* t);  // data buffered above the socket
+	void (*close)(struct Transport* t);          // leaves fd open
+	void* ctx;
+	int fd;
+};
+
+
+extern struct Transport* openPlainTransport(int fd);
+
+/* blocking helpers for the handshake, false with errno set (ECONNRESET when
+ * the peer closed, ETIMEDOUT past the deadline) */
+extern bool transportWriteAll(struct Transport* t, const void* buf, size_t len);
+extern bool transportReadAll(struct Transport* t, void* buf, size_t len);
+
+/* the helpers, and every blocking read or write on the socket fd, give up
+ * timeout_ms from now. 0 takes the deadline and the socket timeouts away */
+extern bool transportSetDeadline(int fd, int timeout_ms);
+
+
+static inline ssize_t transportSend(struct Transport* const t, const void* const buf,
+                                    const size_t len, const bool more)
+{
+	return t->send(t, buf, len, more);
+}
+
+
+static inline ssize_t transportRecv(struct Transport* const t, void* const buf, const size_t len)
+{
+	return t->recv(t, buf, len);
+}
+
+
+static inline bool transportSendFile(struct Transport* const t, const int in_fd,
+                                     const off_t offset, const size_t count)
+{
+	return t->sendFile(t, in_fd, offset, count);
+}
+
+
+static inline ssize_t transportRecvFile(struct Transport* const t, const int out_fd,
+                                        const off_t offset, const size_t count)
+{
+	return t->recvFile(t, out_fd, offset, count);
+}
+
+
+static inline bool transportPending(const struct Transport* const t)
+{
+	return t->pending(t);
+}
+
+
+static inline void closeTransport(struct Transport* const t)
+{
+	t->close(t);
+}
+
+
+#endif
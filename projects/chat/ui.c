@@ -0,0 +1,267 @@
+#define NCURSES_WIDECHAR 1
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <locale.h>
+#include <ncurses.h>
+#include "ui.h"
+#include "history.h"
+#include "channels.h"
+#include "textbox.h"
+
+
+/* screen layout:
+ *   header  - HEADER_ROWS, connection info and a separator
+ *   history - a scrolling window with the tail of the history log
+ *   input   - INPUT_ROWS, a separator and the text box
+ * Each part is redrawn only when damaged and all of them reach the
+ * terminal in a single doupdate(), so typing repaints the text box only
+ * and a new message costs a scroll plus one line.
+ * */
+#define HEADER_ROWS ((int)2)
+#define INPUT_ROWS  ((int)3)
+#define PROMPT      "> "
+#define PROMPT_LEN  ((int)(sizeof(PROMPT) - 1))
+#define ESC_DELAY   ((int)25)   // ms to wait for the rest of an escape sequence
+
+
+static struct UI {
+	const struct ConnectionInfo* cinfo;
+	WINDOW* header;
+	WINDOW* history;
+	WINDOW* input;
+	uint64_t drawn_end;   // history records below this one are on screen
+	bool history_empty;
+	int damage;
+} ui = { .header = NULL, .history = NULL, .input = NULL };
+
+
+static void createWindows(void)
+{
+	const int hist_rows = LINES - HEADER_ROWS - INPUT_ROWS;
+
+	ui.header = newwin(HEADER_ROWS, COLS, 0, 0);
+	ui.history = newwin(hist_rows > 1 ? hist_rows : 1, COLS, HEADER_ROWS, 0);
+	ui.input = newwin(INPUT_ROWS, COLS, LINES - INPUT_ROWS, 0);
+
+	scrollok(ui.history, TRUE);
+	keypad(ui.input, TRUE);
+	nodelay(ui.input, TRUE);   // the event loop tells when keys are available
+}
+
+
+static void destroyWindows(void)
+{
+	delwin(ui.header);
+	delwin(ui.history);
+	delwin(ui.input);
+}
+
+
+void initializeUI(const struct ConnectionInfo* const cinfo)
+{
+	setlocale(LC_ALL, "");
+	initscr();
+	cbreak();
+	noecho();
+	intrflush(stdscr, FALSE);
+	set_escdelay(ESC_DELAY);
+	refresh();   // stdscr is never drawn, but it must not be refreshed over the windows later
+
+	// bracketed paste, so pasted newlines don't submit the text box
+	define_key("\033[200~", UI_KEY_PASTE_BEGIN);
+	define_key("\033[201~", UI_KEY_PASTE_END);
+	fputs("\033[?2004h", stdout);
+	fflush(stdout);
+
+	ui.cinfo = cinfo;
+	createWindows();
+	ui.damage = UI_ALL;
+}
+
+
+void terminateUI(void)
+{
+	fputs("\033[?2004l", stdout);
+	fflush(stdout);
+	destroyWindows();
+	endwin();
+}
+
+
+void uiDamage(const int flags)
+{
+	ui.damage |= flags;
+}
+
+
+void uiResize(void)
+{
+	// ncurses already resized the screen when it reported KEY_RESIZE
+	destroyWindows();
+	createWindows();
+	ui.damage = UI_ALL;
+}
+
+
+static void drawHeader(void)
+{
+	werase(ui.header);
+	mvwprintw(ui.header, 0, 0, "Host: %s (%s). Client: %s (%s). Channel: %s.",
+	          ui.cinfo->host_uname, ui.cinfo->host_ip,
+	          ui.cinfo->client_uname, ui.cinfo->client_ip, channelName(channelCurrent()));
+	mvwhline(ui.header, 1, 0, '=', COLS);
+	wnoutrefresh(ui.header);
+}
+
+
+static void drawHistory(const bool full)
+{
+	const struct ChannelSet* const followed = channelsFollowed();
+	const uint64_t end = historyEnd();
+	const uint64_t rows = getmaxy(ui.history);
+	uint64_t seq = ui.drawn_end;
+
+	if (full || seq < historyBegin() || end - seq > rows) {
+		// records of channels not followed take no row
+		uint64_t shown = 0;
+		for (seq = end; shown < rows && seq > historyBegin(); ) {
+			if (channelSetHas(followed, historyChannel(--seq)))
+				++shown;
+		}
+		// the newest record sits at the bottom
+		werase(ui.history);
+		wmove(ui.history, rows - shown, 0);
+		ui.history_empty = true;
+	}
+
+	for (; seq < end; ++seq) {
+		if (!channelSetHas(followed, historyChannel(seq)))
+			continue;
+
+		const char* line;
+		int len;
+		historyGet(seq, &line, &len);
+
+		// the cursor rests after the last line, the next one scrolls the window
+		if (!ui.history_empty)
+			waddch(ui.history, '\n');
+		waddnstr(ui.history, line, len);
+		ui.history_empty = false;
+	}
+
+	ui.drawn_end = end;
+	wnoutrefresh(ui.history);
+}
+
+
+/* draws up to cells cells of text, returns how many were drawn */
+static int drawText(const char* const text, const int len, const int cells)
+{
+	int drawn = 0;
+	int i = 0;
+
+	while (i < len && drawn < cells) {
+		int nbytes;
+		const int width = utf8CharWidth(&text[i], len - i, &nbytes);
+		if ((unsigned char) text[i] < ' ')
+			waddch(ui.input, '~' | A_REVERSE);   // e.g. a pasted newline
+		else
+			waddnstr(ui.input, &text[i], nbytes);
+		drawn += width;
+		i += nbytes;
+	}
+
+	return drawn;
+}
+
+
+/* shows the rows of the text box around the cursor. Only the visible
+ * part of the text is scanned, however long the text is */
+static void drawInput(void)
+{
+	struct TextBoxView view;
+	textBoxView(&view);
+
+	const int cols = COLS > 0 ? COLS : 1;
+	const int rows = INPUT_ROWS - 1;
+	const int cursor_cell = PROMPT_LEN + view.cursor_cells;
+	const int cursor_row = cursor_cell / cols;
+	const int first_row = cursor_row >= rows ? cursor_row - rows + 1 : 0;
+
+	werase(ui.input);
+	mvwhline(ui.input, 0, 0, '=', cols);
+	wmove(ui.input, 1, 0);
+
+	// walks back from the cursor to the first visible cell
+	int cells = cursor_cell - first_row * cols;
+	int start = view.before_len;
+	if (first_row == 0) {
+		waddstr(ui.input, PROMPT);
+		cells -= PROMPT_LEN;
+		start = 0;
+	} else {
+		for (int back = 0; start > 0 && back < cells; ) {
+			int nbytes;
+			do {
+				--start;
+			} while (start > 0 && (view.before[start] & 0xC0) == 0x80);
+			back += utf8CharWidth(&view.before[start], view.before_len - start, &nbytes);
+		}
+	}
+
+	const int visible = rows * cols - (first_row == 0 ? PROMPT_LEN : 0);
+	const int drawn = drawText(&view.before[start], view.before_len - start, visible);
+	drawText(view.after, view.after_len, visible - drawn);
+
+	wmove(ui.input, 1 + cursor_row - first_row, cursor_cell % cols);
+	wnoutrefresh(ui.input);
+}
+
+
+void uiRender(void)
+{
+	const int damage = ui.damage;
+	if (damage == 0)
+		return;
+
+	ui.damage = 0;
+
+	if (damage & (UI_ALL|UI_HEADER))
+		drawHeader();
+	if (damage & (UI_ALL|UI_HISTORY))
+		drawHistory((damage & UI_ALL) != 0);
+
+	// the input window goes last, so the cursor ends in the text box
+	if (damage & (UI_ALL|UI_INPUT))
+		drawInput();
+	else
+		wnoutrefresh(ui.input);
+
+	doupdate();
+}
+
+
+enum UIKeyKind uiGetKey(int* const key)
+{
+	wint_t ch;
+	switch (wget_wch(ui.input, &ch)) {
+	case OK:
+		*key = (int) ch;
+		return UI_KEY_CHAR;
+	case KEY_CODE_YES:
+		*key = (int) ch;
+		return UI_KEY_CODE;
+	default:
+		return UI_KEY_NONE;
+	}
+}
+
+
+void uiWaitKey(void)
+{
+	wint_t ch;
+	nodelay(ui.input, FALSE);
+	wget_wch(ui.input, &ch);
+	nodelay(ui.input, TRUE);
+}
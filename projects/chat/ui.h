@@ -0,0 +1,39 @@
+#ifndef CHAT_UI_H_
+#define CHAT_UI_H_
+#include "network.h"
+
+
+enum UIDamage {
+	UI_HEADER  = 0x01,
+	UI_HISTORY = 0x02,   // only new history records get drawn, unless UI_ALL
+	UI_INPUT   = 0x04,
+	UI_ALL     = 0x08    // everything, from scratch (e.g. after a resize)
+};
+
+
+enum UIKeyKind {
+	UI_KEY_NONE,   // no key available
+	UI_KEY_CHAR,   // a wide char
+	UI_KEY_CODE    // a KEY_* code, or one of the UI_KEY_* below
+};
+
+
+// bracketed paste markers, text in between is pasted, not typed
+#define UI_KEY_PASTE_BEGIN ((int)0x1000)
+#define UI_KEY_PASTE_END   ((int)0x1001)
+
+
+extern void initializeUI(const struct ConnectionInfo* cinfo);
+extern void terminateUI(void);
+
+extern void uiDamage(int flags);
+extern void uiResize(void);
+
+/* redraws the damaged windows, with a single doupdate() */
+extern void uiRender(void);
+
+extern enum UIKeyKind uiGetKey(int* key);
+extern void uiWaitKey(void);  // blocks until a key is pressed
+
+
+#endif
@@ -1,7 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/upnpcommands.h>
 #include <miniupnpc/upnperrors.h>
@@ -9,68 +20,233 @@
 #include "network.h"
 
 
+#define UPNP_URL_SIZE     ((int)512)
+#define UPNP_LEASE_SECS   ((int)600)   // mappings expire by themselves if we die uncleanly
+#define UPNP_ONLY_PERMANENT_LEASES ((int)725)
+#define UPNP_MSG_SIZE     ((int)256)
+
+
 static struct UPNPInfo {
-	struct UPNPDev* dev;
-	struct UPNPUrls urls;
-	struct IGDdatas data;
+	char control_url[UPNP_URL_SIZE];
+	char service_type[UPNP_URL_SIZE];
+	char lan_addr[IP_STR_SIZE];
 	char* port;
 	const char* proto;
-} upnp_info = { .dev = NULL, .port = NULL, .proto = NULL };
+	int lease;            // seconds, 0 if the IGD only supports permanent mappings
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;  // wakes the renewal timer on termination
+	bool started;         // background thread was spawned
+	bool mapped;          // port mapping is in place
+	bool stop;            // renewal timer must exit
+	bool done;            // the thread is past discovery and mapping
+	bool detached;        // terminate_upnp() didn't wait, the thread cleans up
+	int signal_pipe[2];   // the numbers of the signals caught while mapped
+	void (*notify)(const char* msg);   // under lock, none in flight once cleared
+} upnp_info = {
+	.port = NULL, .proto = NULL, .started = false, .mapped = false, .stop = false,
+	.done = false, .detached = false, .signal_pipe = { -1, -1 }, .notify = NULL,
+	.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER
+};
+
+// SIGKILL can't be trapped, the finite lease takes care of it
+#define UPNP_SIGNUMS_SIZE ((int)2)
+static const int signums[UPNP_SIGNUMS_SIZE] = { SIGINT, SIGTERM };
+static struct sigaction prev_sig_actions[UPNP_SIGNUMS_SIZE];
+
 
-#define UPNP_SIGNUMS_SIZE ((int)3)
-static const int signums[UPNP_SIGNUMS_SIZE] = { SIGINT, SIGKILL, SIGTERM };
-static void(*prev_sig_handlers[UPNP_SIGNUMS_SIZE])(int) = { NULL };
+/* the mapping can't be removed from a signal handler (locks, a join, an
+ * HTTP request), so it only passes the signal on to the main thread. No
+ * SA_RESTART: a blocking accept() or read() there returns EINTR */
+static void upnpSigHandler(const int sig)
+{
+	const int saved = errno;
+	const unsigned char num = sig;
+	while (write(upnp_info.signal_pipe[1], &num, 1) == -1 && errno == EINTR)
+		;
+	errno = saved;
+}
 
 
 static inline void installUPNPSigHandler(void)
 {
-	void upnpSigHandler(int);
+	struct sigaction sa = { .sa_handler = upnpSigHandler, .sa_flags = 0 };
+	sigemptyset(&sa.sa_mask);
 	for (int i = 0; i < UPNP_SIGNUMS_SIZE; ++i)
-		prev_sig_handlers[i] = signal(signums[i], upnpSigHandler);
+		sigaction(signums[i], &sa, &prev_sig_actions[i]);
 }
 
 
 static inline void uninstallUPNPSigHandler(void)
 {
 	for (int i = 0; i < UPNP_SIGNUMS_SIZE; ++i)
-		signal(signums[i], prev_sig_handlers[i]);
+		sigaction(signums[i], &prev_sig_actions[i], NULL);
 }
 
 
-void upnpSigHandler(const int sig)
+static void report(const char* const fmt, ...)
 {
-	// remove port forwarding
-	terminate_upnp();
+	char msg[UPNP_MSG_SIZE];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
 
-	// get the prev handler for this particular sig 
-	void(*prev_handler)(int) = NULL;
+	pthread_mutex_lock(&upnp_info.lock);
+	void (*const notify)(const char*) = upnp_info.notify;
+	if (notify != NULL)
+		notify(msg);
+	pthread_mutex_unlock(&upnp_info.lock);
 
-	for (int i = 0; i < UPNP_SIGNUMS_SIZE; ++i) {
-		if (sig == signums[i]) {
-			prev_handler = prev_sig_handlers[i];
-			break;
-		}
+	if (notify == NULL)
+		fprintf(stderr, "%s\n", msg);
+}
+
+
+static bool isStopping(void)
+{
+	pthread_mutex_lock(&upnp_info.lock);
+	const bool stop = upnp_info.stop;
+	pthread_mutex_unlock(&upnp_info.lock);
+	return stop;
+}
+
+
+static bool getCacheDir(char* const dest, const int size)
+{
+	const char* const xdg = getenv("XDG_CACHE_HOME");
+	if (xdg != NULL && xdg[0] != '\0')
+		return snprintf(dest, size, "%s", xdg) < size;
+
+	const char* const home = getenv("HOME");
+	if (home == NULL)
+		return false;
+
+	return snprintf(dest, size, "%s/.cache", home) < size;
+}
+
+
+// with its missing parents, 0700 as XDG wants them
+static bool makeCacheDir(char* const dir)
+{
+	for (char* slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		const bool ok = mkdir(dir, 0700) == 0 || errno == EEXIST;
+		*slash = '/';
+		if (!ok)
+			return false;
 	}
+	return mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
 
-	uninstallUPNPSigHandler();
 
-	if (prev_handler == NULL)
-		exit(sig);
+static bool getCachePath(char* const dest, const int size)
+{
+	char dir[UPNP_URL_SIZE];
+	return getCacheDir(dir, UPNP_URL_SIZE) && snprintf(dest, size, "%s/chat-igd", dir) < size;
+}
 
-	prev_handler(sig);
+
+static bool readLine(FILE* const file, char* const dest, const int size)
+{
+	if (fgets(dest, size, file) == NULL)
+		return false;
+	dest[strcspn(dest, "\n")] = '\0';
+	return dest[0] != '\0';
 }
 
 
-bool initialize_upnp(const char* const port)
+/* cache format: control URL, service type and LAN address, one per line */
+static bool loadCache(void)
+{
+	char path[UPNP_URL_SIZE];
+	if (!getCachePath(path, UPNP_URL_SIZE))
+		return false;
+
+	FILE* const file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+
+	const bool ret = readLine(file, upnp_info.control_url, UPNP_URL_SIZE) &&
+	                 readLine(file, upnp_info.service_type, UPNP_URL_SIZE) &&
+	                 readLine(file, upnp_info.lan_addr, IP_STR_SIZE);
+	fclose(file);
+	return ret;
+}
+
+
+static void saveCache(void)
+{
+	char dir[UPNP_URL_SIZE], path[UPNP_URL_SIZE];
+	if (!getCacheDir(dir, UPNP_URL_SIZE) || !getCachePath(path, UPNP_URL_SIZE))
+		return;
+
+	// a fresh home may not have it yet
+	if (!makeCacheDir(dir))
+		return;
+
+	FILE* const file = fopen(path, "w");
+	if (file == NULL)
+		return;
+
+	fprintf(file, "%s\n%s\n%s\n", upnp_info.control_url,
+	        upnp_info.service_type, upnp_info.lan_addr);
+	fclose(file);
+}
+
+
+/* finds which local address routes to the gateway in the control URL,
+ * connecting an UDP socket sends nothing, it only selects the route */
+static bool getRouteLanAddr(char* const dest)
+{
+	char host[IP_STR_SIZE];
+	int port = 80;
+	if (sscanf(upnp_info.control_url, "http://%23[0-9.]:%d", host, &port) < 1)
+		return false;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+		return false;
+
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return false;
+
+	socklen_t len = sizeof(addr);
+	const bool ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+	                 getsockname(fd, (struct sockaddr*)&addr, &len) == 0 &&
+	                 inet_ntop(AF_INET, &addr.sin_addr, dest, IP_STR_SIZE) != NULL;
+	close(fd);
+	return ret;
+}
+
+
+/* a single SOAP call tells whether the cached IGD still answers */
+static bool verifyCachedIGD(void)
 {
-	int error = 0;
 	char lan_addr[IP_STR_SIZE];
 	char wan_addr[IP_STR_SIZE];
-	upnp_info.port = malloc(strlen(port) + 1);
-	strcpy(upnp_info.port, port);
-	upnp_info.proto = "TCP";
 
-	upnp_info.dev = upnpDiscover(
+	if (!getRouteLanAddr(lan_addr) || strcmp(lan_addr, upnp_info.lan_addr) != 0)
+		return false;
+
+	return UPNP_GetExternalIPAddress(upnp_info.control_url, upnp_info.service_type,
+	                                 wan_addr) == UPNPCOMMAND_SUCCESS;
+}
+
+
+static bool discoverIGD(void)
+{
+	struct UPNPDev* dev;
+	struct UPNPUrls urls;
+	struct IGDdatas data;
+	char wan_addr[IP_STR_SIZE];
+	int error = 0;
+
+	dev = upnpDiscover(
 	        4500   , // time to wait (milliseconds)
 	        NULL   , // multicast interface (or null defaults to 239.255.255.250)
 	        NULL   , // path to minissdpd socket (or null defaults to /var/run/minissdpd.sock)
@@ -82,71 +258,238 @@ bool initialize_upnp(const char* const port)
 	        &error); // error condition
 
 	if (error != UPNPDISCOVER_SUCCESS) {
-		fprintf(stderr, "Couldn't set UPnP: %s\n", strupnperror(error));
+		report("Couldn't set UPnP: %s", strupnperror(error));
 		return false;
 	}
 
-	const int status = UPNP_GetValidIGD(upnp_info.dev, &upnp_info.urls, &upnp_info.data,
-	                                    lan_addr, sizeof(lan_addr));
+	const int status = UPNP_GetValidIGD(dev, &urls, &data, upnp_info.lan_addr,
+	                                    IP_STR_SIZE);
+	freeUPNPDevlist(dev);
+
 	// look up possible "status" values, the number "1" indicates a valid IGD was found
 	if (status == 0) {
-		fprintf(stderr, "Couldn't find a valid IGD.\n");
-		goto Lfree_upnp_dev;
+		report("Couldn't find a valid IGD.");
+		return false;
 	}
-	
+
+	snprintf(upnp_info.control_url, UPNP_URL_SIZE, "%s", urls.controlURL);
+	snprintf(upnp_info.service_type, UPNP_URL_SIZE, "%s", data.first.servicetype);
+	FreeUPNPUrls(&urls);
 
 	// get the external (WAN) IP address
-	error = UPNP_GetExternalIPAddress(upnp_info.urls.controlURL,
-	                                  upnp_info.data.first.servicetype,
+	error = UPNP_GetExternalIPAddress(upnp_info.control_url,
+	                                  upnp_info.service_type,
 				          wan_addr);
 
-	if (error != UPNPCOMMAND_SUCCESS)
-		goto Lupnp_command_error;
+	if (error != UPNPCOMMAND_SUCCESS) {
+		report("Couldn't set UPnP: %s", strupnperror(error));
+		return false;
+	}
+
+	saveCache();
+	return true;
+}
+
+
+static int addMapping(void)
+{
+	char lease[16];
+	sprintf(lease, "%d", upnp_info.lease);
+
+	return UPNP_AddPortMapping(
+	            upnp_info.control_url,
+	            upnp_info.service_type,
+	            upnp_info.port     ,  // external (WAN) port requested
+	            upnp_info.port     ,  // internal (LAN) port to which packets will be redirected
+	            upnp_info.lan_addr ,  // internal (LAN) address to which packets will be redirected
+	            "Chat"             ,  // text description to indicate why or who is responsible for the port mapping
+	            upnp_info.proto    ,  // protocol must be either TCP or UDP
+	            NULL               ,  // remote (peer) host address or nullptr for no restriction
+	            lease              ); // port map lease duration (in seconds) or zero for "as long as possible"
+}
+
+
+static bool mapPort(void)
+{
+	// the SSDP discovery is only a fallback for a missing or stale cache
+	if (!(loadCache() && verifyCachedIGD()) && !discoverIGD())
+		return false;
+
+	// terminate_upnp() gave up waiting for the discovery
+	if (isStopping())
+		return false;
+
+	upnp_info.lease = UPNP_LEASE_SECS;
+	int error = addMapping();
 
-	// add a new TCP port mapping from WAN port 12345 to local host port 24680
-	error = UPNP_AddPortMapping(
-	            upnp_info.urls.controlURL,
-	            upnp_info.data.first.servicetype,
-	            upnp_info.port ,  // external (WAN) port requested
-	            upnp_info.port ,  // internal (LAN) port to which packets will be redirected
-	            lan_addr       ,  // internal (LAN) address to which packets will be redirected
-	            "Chat"         ,  // text description to indicate why or who is responsible for the port mapping
-	            upnp_info.proto,  // protocol must be either TCP or UDP
-	            NULL           ,  // remote (peer) host address or nullptr for no restriction
-	            NULL           ); // port map lease duration (in seconds) or zero for "as long as possible"
+	if (error == UPNP_ONLY_PERMANENT_LEASES) {
+		upnp_info.lease = 0;
+		error = addMapping();
+	}
 
-	if (error != UPNPCOMMAND_SUCCESS)
-		goto Lupnp_command_error;
+	if (error != UPNPCOMMAND_SUCCESS) {
+		report("Couldn't set UPnP: %s", strupnperror(error));
+		return false;
+	}
 
 	// prevent the keeping of port forwarding
 	// if a signal is received
+	pthread_mutex_lock(&upnp_info.lock);
+	upnp_info.mapped = true;
+	pthread_mutex_unlock(&upnp_info.lock);
 	installUPNPSigHandler();
+	report("UPnP: port %s mapped to %s.", upnp_info.port, upnp_info.lan_addr);
 	return true;
+}
+
 
-Lupnp_command_error:
-	fprintf(stderr, "Couldn't set UPnP: %s\n", strupnperror(error));
-	FreeUPNPUrls(&upnp_info.urls);
-Lfree_upnp_dev:
-	freeUPNPDevlist(upnp_info.dev);
-	return false;
+/* re-adds the mapping at half the lease, until terminate_upnp() */
+static void renewMapping(void)
+{
+	pthread_mutex_lock(&upnp_info.lock);
+
+	while (!upnp_info.stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += upnp_info.lease / 2;
+
+		int ret = 0;
+		while (!upnp_info.stop && ret != ETIMEDOUT)
+			ret = pthread_cond_timedwait(&upnp_info.cond, &upnp_info.lock, &deadline);
+
+		if (upnp_info.stop)
+			break;
+
+		pthread_mutex_unlock(&upnp_info.lock);
+		const int error = addMapping();
+		if (error != UPNPCOMMAND_SUCCESS)
+			report("Couldn't renew port mapping: %s", strupnperror(error));
+		pthread_mutex_lock(&upnp_info.lock);
+	}
+
+	pthread_mutex_unlock(&upnp_info.lock);
 }
 
 
-void terminate_upnp(void)
+/* by whichever thread is last: terminate_upnp() after the join, or the
+ * UPnP thread once it's detached */
+static void releaseMapping(void)
 {
-	const int error = UPNP_DeletePortMapping(upnp_info.urls.controlURL,
-	                       upnp_info.data.first.servicetype,
-			       upnp_info.port,
-			       upnp_info.proto,
-			       NULL);
-	
-	freeUPNPDevlist(upnp_info.dev);
-	FreeUPNPUrls(&upnp_info.urls);
+	// a signal caught from here on is left in the pipe, unread
+	if (upnp_info.mapped)
+		uninstallUPNPSigHandler();
+	close(upnp_info.signal_pipe[0]);
+	close(upnp_info.signal_pipe[1]);
+	upnp_info.signal_pipe[0] = upnp_info.signal_pipe[1] = -1;
+
+	if (upnp_info.mapped) {
+		upnp_info.mapped = false;
+		const int error = UPNP_DeletePortMapping(upnp_info.control_url,
+		                                         upnp_info.service_type,
+		                                         upnp_info.port,
+		                                         upnp_info.proto,
+		                                         NULL);
+		if (error != 0)
+			report("Couldn't delete port mapping: %s", strupnperror(error));
+	}
+
 	free(upnp_info.port);
+	upnp_info.port = NULL;
+}
+
 
+static void* upnpThread(void* const unused)
+{
+	((void)unused);
+
+	// signals go to the main thread, it does the cleanup
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (mapPort() && upnp_info.lease > 0)
+		renewMapping();
+
+	pthread_mutex_lock(&upnp_info.lock);
+	upnp_info.done = true;
+	const bool detached = upnp_info.detached;
+	pthread_mutex_unlock(&upnp_info.lock);
+
+	if (detached)
+		releaseMapping();
+	return NULL;
+}
+
+
+/* discovery can block for seconds, so it runs in a background
+ * thread and the caller is free to bind and accept right away */
+bool initialize_upnp(const char* const port)
+{
+	upnp_info.port = malloc(strlen(port) + 1);
+	strcpy(upnp_info.port, port);
+	upnp_info.proto = "TCP";
+	upnp_info.mapped = false;
+	upnp_info.stop = false;
+	upnp_info.done = false;
+	upnp_info.detached = false;
+
+	if (pipe2(upnp_info.signal_pipe, O_CLOEXEC|O_NONBLOCK) == -1) {
+		perror("Couldn't create the UPnP signal pipe");
+		free(upnp_info.port);
+		return false;
+	}
+
+	const int error = pthread_create(&upnp_info.thread, NULL, &upnpThread, NULL);
 	if (error != 0) {
-		fprintf(stderr, "Couldn't delete port mapping: %s",
-		        strupnperror(error));
+		fprintf(stderr, "Couldn't start UPnP thread: %s\n", strerror(error));
+		close(upnp_info.signal_pipe[0]);
+		close(upnp_info.signal_pipe[1]);
+		upnp_info.signal_pipe[0] = upnp_info.signal_pipe[1] = -1;
+		free(upnp_info.port);
+		return false;
 	}
+
+	upnp_info.started = true;
+	return true;
+}
+
+
+int upnp_signal_fd(void)
+{
+	return upnp_info.signal_pipe[0];
+}
+
+
+void set_upnp_notify(void (*const notify)(const char* msg))
+{
+	pthread_mutex_lock(&upnp_info.lock);
+	upnp_info.notify = notify;
+	pthread_mutex_unlock(&upnp_info.lock);
 }
 
+
+/* the discovery can take seconds, so rather than wait for it the thread
+ * is left to finish and clean up by itself. If the process exits first
+ * there's no mapping, or one being added that the lease expires */
+void terminate_upnp(void)
+{
+	if (!upnp_info.started)
+		return;
+
+	upnp_info.started = false;
+
+	pthread_mutex_lock(&upnp_info.lock);
+	upnp_info.stop = true;
+	pthread_cond_signal(&upnp_info.cond);
+	upnp_info.detached = !upnp_info.mapped && !upnp_info.done;
+	const bool detached = upnp_info.detached;
+	pthread_mutex_unlock(&upnp_info.lock);
+
+	if (detached) {
+		pthread_detach(upnp_info.thread);
+		return;
+	}
+
+	pthread_join(upnp_info.thread, NULL);
+	releaseMapping();
+}
@@ -6,6 +6,13 @@
 
 extern bool initialize_upnp(const char* const port);
 extern void terminate_upnp(void);
+/* readable once SIGINT or SIGTERM is caught while the port is mapped,
+ * one byte per signal, its number. The process is left running: the
+ * owner reads it, calls terminate_upnp() and exits. -1 when not started */
+extern int upnp_signal_fd(void);
+/* status messages from the UPnP thread go to notify, or stderr if NULL.
+ * notify is called from the UPnP thread */
+extern void set_upnp_notify(void (*notify)(const char* msg));
 
 
 
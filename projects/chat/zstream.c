@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "zstream.h"
+#include "sendq.h"
+#include "report.h"
+
+
+/* Each direction of a connection is one raw deflate stream that lives as
+ * long as the connection, primed with the same dictionary on both ends.
+ * Every compressed frame is a Z_SYNC_FLUSH chunk of that stream, so a
+ * short message still finds its matches in the previous ones. The
+ * 00 00 ff ff trailer of each sync flush is implied and not sent.
+ * Frames are deflated straight into the send queue's buffer.
+ * */
+#define ZSTREAM_MIN_SIZE ((uint32_t)48)   // smaller payloads aren't worth it
+#define ZSTREAM_LEVEL    ((int)6)
+#define ZSTREAM_WBITS    ((int)-15)       // raw deflate, no zlib header
+
+
+static const char dictionary[] =
+	"/quit /stats http://https://www. .com .org error warning failed "
+	"what where when how why who which would could should have has had "
+	"think know about there their they them then than that this with "
+	"from your you are not but just like yeah okay ok lol thanks thank "
+	"hello hi hey good great sure please sorry time today tomorrow "
+	"the and for is it in to of a I ";
+
+static const unsigned char sync_trailer[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+
+static struct ZStream {
+	z_stream def;
+	z_stream inf;
+	struct ZStreamStats stats;
+	char out[FRAME_MAX_PAYLOAD + 1];   // inflated payload, plus a spare byte
+	bool enabled;
+} zs = { .enabled = false };
+
+
+static inline uint64_t cpuTimeNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+bool initializeZStream(const bool enabled)
+{
+	memset(&zs.stats, 0, sizeof(zs.stats));
+	zs.enabled = false;
+	if (!enabled)
+		return true;
+
+	memset(&zs.def, 0, sizeof(zs.def));
+	memset(&zs.inf, 0, sizeof(zs.inf));
+
+	if (deflateInit2(&zs.def, ZSTREAM_LEVEL, Z_DEFLATED, ZSTREAM_WBITS, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		reportMsg("Couldn't initialize deflate", zs.def.msg != NULL ? zs.def.msg : "no memory");
+		return false;
+	}
+
+	if (inflateInit2(&zs.inf, ZSTREAM_WBITS) != Z_OK) {
+		reportMsg("Couldn't initialize inflate", zs.inf.msg != NULL ? zs.inf.msg : "no memory");
+		goto Ldeflate_end;
+	}
+
+	if (deflateSetDictionary(&zs.def, (const Bytef*) dictionary, sizeof(dictionary) - 1) != Z_OK ||
+	    inflateSetDictionary(&zs.inf, (const Bytef*) dictionary, sizeof(dictionary) - 1) != Z_OK) {
+		reportMsg("Couldn't set the deflate dictionary", "zlib refused it");
+		goto Linflate_end;
+	}
+
+	zs.enabled = true;
+	return true;
+
+Linflate_end:
+	inflateEnd(&zs.inf);
+Ldeflate_end:
+	deflateEnd(&zs.def);
+	return false;
+}
+
+
+void terminateZStream(void)
+{
+	if (!zs.enabled)
+		return;
+
+	deflateEnd(&zs.def);
+	inflateEnd(&zs.inf);
+	zs.enabled = false;
+}
+
+
+bool zstreamQueueFrame(const enum FrameType type, const uint16_t channel, const void* const payload,
+                       const uint32_t len)
+{
+	// stored blocks are the worst case, a few bytes per 16K plus the flush
+	const uint32_t bound = len + len / 8 + 64;
+
+	if (!zs.enabled || len < ZSTREAM_MIN_SIZE || bound > (uint32_t) FRAME_MAX_PAYLOAD)
+		return sendQueueFrame(type, channel, payload, len);
+
+	char* const dest = sendQueueReserve(bound);
+	if (dest == NULL)
+		return false;
+
+	const uint64_t start = cpuTimeNs();
+
+	zs.def.next_in = (Bytef*) payload;
+	zs.def.avail_in = len;
+	zs.def.next_out = (Bytef*) dest;
+	zs.def.avail_out = bound;
+
+	const int ret = deflate(&zs.def, Z_SYNC_FLUSH);
+	if (ret != Z_OK || zs.def.avail_in != 0 || zs.def.avail_out == 0) {
+		reportMsg("Couldn't deflate frame", zs.def.msg != NULL ? zs.def.msg : "no room");
+		return false;
+	}
+
+	const uint32_t outlen = bound - zs.def.avail_out - sizeof(sync_trailer);
+	sendQueueCommit(type, channel, FRAME_FLAG_DEFLATE, outlen);
+
+	zs.stats.deflate_ns += cpuTimeNs() - start;
+	zs.stats.bytes_in += len;
+	zs.stats.bytes_out += outlen;
+	++zs.stats.frames;
+	return true;
+}
+
+
+static bool inflateChunk(const void* const in, const uint32_t len)
+{
+	zs.inf.next_in = (Bytef*) in;
+	zs.inf.avail_in = len;
+
+	while (zs.inf.avail_in > 0) {
+		if (zs.inf.avail_out == 0)
+			return false;   // more than FRAME_MAX_PAYLOAD
+		const int ret = inflate(&zs.inf, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return false;
+		if (ret == Z_BUF_ERROR && zs.inf.avail_in > 0 && zs.inf.avail_out > 0)
+			return false;
+	}
+
+	return true;
+}
+
+
+bool zstreamInflate(const struct FrameHeader* const hdr, const char* const payload,
+                    char** const out, uint32_t* const outlen)
+{
+	if (!zs.enabled)
+		return false;
+
+	const uint64_t start = cpuTimeNs();
+
+	zs.inf.next_out = (Bytef*) zs.out;
+	zs.inf.avail_out = FRAME_MAX_PAYLOAD;
+
+	if (!inflateChunk(payload, getFrameLen(hdr)) ||
+	    !inflateChunk(sync_trailer, sizeof(sync_trailer))) {
+		reportMsg("Couldn't inflate frame", zs.inf.msg != NULL ? zs.inf.msg : "too big");
+		return false;
+	}
+
+	*out = zs.out;
+	*outlen = FRAME_MAX_PAYLOAD - zs.inf.avail_out;
+	zs.stats.inflate_ns += cpuTimeNs() - start;
+	return true;
+}
+
+
+void getZStreamStats(struct ZStreamStats* const stats)
+{
+	*stats = zs.stats;
+}
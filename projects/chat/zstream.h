@@ -0,0 +1,32 @@
+#ifndef CHAT_ZSTREAM_H_
+#define CHAT_ZSTREAM_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include "proto.h"
+
+
+struct ZStreamStats {
+	uint64_t frames;      // frames that went through deflate
+	uint64_t bytes_in;    // their payload size before deflate
+	uint64_t bytes_out;   // and after
+	uint64_t deflate_ns;  // thread CPU time spent compressing
+	uint64_t inflate_ns;  // and decompressing
+};
+
+
+/* zlib errors go through report.h */
+extern bool initializeZStream(bool enabled);
+extern void terminateZStream(void);
+
+/* queues a frame on the send queue, compressed if enabled and worth it */
+extern bool zstreamQueueFrame(enum FrameType type, uint16_t channel, const void* payload, uint32_t len);
+
+/* for FRAME_FLAG_DEFLATE frames, inflates the payload into an internal
+ * buffer valid until the next call, with a spare byte after *out */
+extern bool zstreamInflate(const struct FrameHeader* hdr, const char* payload,
+                           char** out, uint32_t* outlen);
+
+extern void getZStreamStats(struct ZStreamStats* stats);
+
+
+#endif
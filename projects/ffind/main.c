@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -12,6 +13,7 @@
 #include <fts.h>
 #include <pthread.h>
 #include <utils/debug.h>
+#include <utils/log.h>
 
 
 static inline int strcomp(const char* a, const char* b)
@@ -48,6 +50,7 @@ static inline int stfind(char* const rootdir, const char* const target)
 		if (parent->fts_info != FTS_D)
 			continue;
 
+		TRACE_SPAN("scan");
 		const FTSENT* child = fts_children(ftsp, 0);
 		for ( ; child != NULL; child = child->fts_link)
 			if (strcomp(child->fts_name, target) == 0)
@@ -62,13 +65,14 @@ static inline int stfind(char* const rootdir, const char* const target)
 
 static inline void parsen(const char* const target, const FTSENT* child, const int begin, const int end)
 {
+	TRACE_SPAN("parse", begin, end);
 	int i;
 	for (i = 0; i < begin; ++i)
 		child = child->fts_link;
 
 	for (; i < end; ++i) {
 		if (strcomp(target, child->fts_name) == 0)
-			printf("FOUND: %s%s\n", child->fts_parent->fts_path, child->fts_name);
+			MYLOG("FOUND: %s%s\n", child->fts_parent->fts_path, child->fts_name);
 		child = child->fts_link;
 	}
 }
@@ -107,7 +111,7 @@ static inline int mtfind(char* const rootdir, const char* const target)
 		if (parent->fts_info != FTS_D)
 			continue;
 
-		//dprintf("SCANNING %s\n LINKS %u\n", parent->fts_path, parent->fts_statp->st_nlink);
+		TRACE_SPAN("scan");
 		const FTSENT* const child = fts_children(ftsp, FTS_NAMEONLY);
 		
 		int i = 0;
@@ -131,13 +135,56 @@ static inline int mtfind(char* const rootdir, const char* const target)
 }
 
 
-int main(const int argc, char* const* argv)
+/* the workers only queue what they find, the logging thread prints it.
+ * verbose reports what the logging cost them */
+static inline int mtfindLogged(char* const rootdir, const char* const target, const bool verbose)
 {
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s [directory] [file]\n", argv[0]);
+	if (!initializeLogging(NULL, LOG_POLICY_BLOCK))
 		return EXIT_FAILURE;
+
+	const int ret = mtfind(rootdir, target);
+
+	if (verbose) {
+		struct LogStats stats;
+		logStats(&stats);
+		fprintf(stderr, "log: %" PRIu64 " calls, %" PRIu64 " ns avg, p50 <= %" PRIu64 " ns, "
+		                "p99 <= %" PRIu64 " ns, %" PRIu64 " waited\n",
+		        stats.calls, stats.ns_avg, stats.ns_p50, stats.ns_p99, stats.waited);
 	}
 
-	return stfind(argv[1], argv[2]);
+	terminateLogging();
+	return ret;
+}
+
+
+int main(const int argc, char* const* argv)
+{
+	bool threaded = false, verbose = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "tv")) != -1) {
+		switch (c) {
+		case 't': threaded = true; break;
+		case 'v': verbose = true; break;
+		default: goto Lusage;
+		}
+	}
+	if (argc - optind < 2)
+		goto Lusage;
+
+	if (!initializeTracing())
+		return EXIT_FAILURE;
+
+	char* const rootdir = argv[optind];
+	const char* const target = argv[optind + 1];
+	const int ret = threaded ? mtfindLogged(rootdir, target, verbose) : stfind(rootdir, target);
+	terminateTracing();
+	return ret;
+
+Lusage:
+	fprintf(stderr, "Usage: %s [-t] [-v] [directory] [file]\n"
+	                "  -t  split large directories between two threads\n"
+	                "  -v  with -t, report the logging latency of the threads\n", argv[0]);
+	return EXIT_FAILURE;
 }
 
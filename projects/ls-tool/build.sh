@@ -4,6 +4,6 @@ CC="$1"
 CFLAGS="$2"
 OUTDIR="$3"
 
-echo "${CC} ${CFLAGS} ${PROJDIR}/main.c -o ${OUTDIR}"
-$CC $CFLAGS $PROJDIR/main.c -o $OUTDIR
+echo "${CC} ${CFLAGS} ${PROJDIR}/main.c ${PROJDIR}/colors.c -o ${OUTDIR}"
+$CC $CFLAGS $PROJDIR/main.c $PROJDIR/colors.c -o $OUTDIR
 
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "colors.h"
+
+
+/* LS_COLORS is read once. File types get their whole escape sequence
+ * (lc, the color, rc) built up front. Suffix rules (*.tar=...) go in an
+ * open addressing table hashed from the last byte backwards, so a name
+ * is hashed in one pass from its end and looked up only at the lengths
+ * some rule has; the longest matching suffix wins, case insensitively.
+ * */
+#define COLOR_SEQ_MAX    ((int)64)       // built sequences, longer entries are dropped
+#define SUFFIX_LEN_MAX   ((int)32)
+#define SUFFIX_BUCKETS   ((uint32_t)1024) // a power of 2, four times dircolors' rules
+#define FNV_OFFSET       ((uint32_t)2166136261u)
+#define FNV_PRIME        ((uint32_t)16777619u)
+
+
+enum ColorType {
+	COLOR_NORMAL,
+	COLOR_FILE,
+	COLOR_DIR,
+	COLOR_LINK,
+	COLOR_FIFO,
+	COLOR_SOCK,
+	COLOR_BLK,
+	COLOR_CHR,
+	COLOR_EXEC,
+	COLOR_SETUID,
+	COLOR_SETGID,
+	COLOR_STICKY,
+	COLOR_OTHER_WRITABLE,
+	COLOR_STICKY_OTHER_WRITABLE,
+	COLOR_LEFT,           // lc, rc, ec and rs only make up the others
+	COLOR_RIGHT,
+	COLOR_END,
+	COLOR_RESET,
+	COLOR_TYPES
+};
+
+
+struct Suffix {
+	uint32_t hash;
+	int len;              // 0 for an empty bucket
+	char text[SUFFIX_LEN_MAX];
+	char seq[COLOR_SEQ_MAX];
+};
+
+
+static const char* const type_keys[COLOR_TYPES] = {
+	"no", "fi", "di", "ln", "pi", "so", "bd", "cd", "ex", "su", "sg", "st", "ow", "tw",
+	"lc", "rc", "ec", "rs"
+};
+
+// GNU ls' when LS_COLORS doesn't say
+static const char* const type_defaults[COLOR_TYPES] = {
+	[COLOR_DIR] = "01;34", [COLOR_LINK] = "01;36", [COLOR_FIFO] = "33", [COLOR_SOCK] = "01;35",
+	[COLOR_BLK] = "01;33", [COLOR_CHR] = "01;33", [COLOR_EXEC] = "01;32",
+	[COLOR_SETUID] = "37;41", [COLOR_SETGID] = "30;43", [COLOR_STICKY] = "37;44",
+	[COLOR_OTHER_WRITABLE] = "34;42", [COLOR_STICKY_OTHER_WRITABLE] = "30;42",
+	[COLOR_LEFT] = "\033[", [COLOR_RIGHT] = "m", [COLOR_RESET] = "0"
+};
+
+
+static struct Colors {
+	char raw[COLOR_TYPES][COLOR_SEQ_MAX];    // as given, unescaped
+	char seq[COLOR_TYPES][COLOR_SEQ_MAX];    // lc + raw + rc, "" for no color
+	bool link_target;                        // ln=target, links look like what they point to
+	struct Suffix suffixes[SUFFIX_BUCKETS];
+	uint32_t nsuffixes;
+	uint64_t lengths;                        // bit len - 1 is set when a suffix is that long
+	int len_max;
+} colors;
+
+
+static inline uint32_t hashStep(const uint32_t h, const char c)
+{
+	const unsigned char lower = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+	return (h ^ lower) * FNV_PRIME;
+}
+
+
+/* one value up to ':' or the end, with \-escapes and ^X for control
+ * characters. Returns its length, -1 when it doesn't fit or is broken */
+static int parseValue(const char** const str, char* const out, const int size)
+{
+	const char* p = *str;
+	int len = 0;
+
+	for (; *p != ':' && *p != '\0'; ++len) {
+		if (len + 1 >= size)
+			return -1;
+
+		if (*p == '^' && p[1] != '\0') {
+			out[len] = p[1] == '?' ? 127 : (p[1] & 0x1F);
+			p += 2;
+		} else if (*p == '\\' && p[1] >= '0' && p[1] <= '7') {
+			int c = 0;
+			++p;
+			for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; ++i, ++p)
+				c = c * 8 + (*p - '0');
+			out[len] = (char) c;
+		} else if (*p == '\\' && p[1] != '\0') {
+			const char* const from = "eabfnrtv_";
+			const char* const to = "\033\a\b\f\n\r\t\v ";
+			const char* const esc = strchr(from, p[1]);
+			out[len] = esc != NULL ? to[esc - from] : p[1];
+			p += 2;
+		} else if (*p == '\\') {
+			return -1;
+		} else {
+			out[len] = *p++;
+		}
+	}
+
+	out[len] = '\0';
+	*str = p;
+	return len;
+}
+
+
+static bool addSuffix(const char* const text, const int len, const char* const raw)
+{
+	if (len == 0 || len >= SUFFIX_LEN_MAX || colors.nsuffixes >= SUFFIX_BUCKETS / 2)
+		return false;
+
+	uint32_t h = FNV_OFFSET;
+	for (int i = len - 1; i >= 0; --i)
+		h = hashStep(h, text[i]);
+
+	// a later rule for the same suffix replaces the earlier one
+	struct Suffix* s = &colors.suffixes[h & (SUFFIX_BUCKETS - 1)];
+	while (s->len != 0 && !(s->hash == h && s->len == len && strncasecmp(s->text, text, len) == 0))
+		s = &colors.suffixes[(s - colors.suffixes + 1) & (SUFFIX_BUCKETS - 1)];
+
+	if (snprintf(s->seq, sizeof(s->seq), "%s%s%s", colors.raw[COLOR_LEFT], raw,
+	             colors.raw[COLOR_RIGHT]) >= (int) sizeof(s->seq))
+		return false;
+	if (s->len == 0)
+		++colors.nsuffixes;
+	s->hash = h;
+	s->len = len;
+	memcpy(s->text, text, len);
+	colors.lengths |= (uint64_t) 1 << (len - 1);
+	if (len > colors.len_max)
+		colors.len_max = len;
+	return true;
+}
+
+
+static const char* suffixColor(const char* const name)
+{
+	const int len = strlen(name);
+	const int max = len < colors.len_max ? len : colors.len_max;
+	const char* found = NULL;
+	uint32_t h = FNV_OFFSET;
+
+	for (int l = 1; l <= max; ++l) {
+		h = hashStep(h, name[len - l]);
+		if ((colors.lengths & ((uint64_t) 1 << (l - 1))) == 0)
+			continue;
+
+		for (const struct Suffix* s = &colors.suffixes[h & (SUFFIX_BUCKETS - 1)]; s->len != 0;
+		     s = &colors.suffixes[(s - colors.suffixes + 1) & (SUFFIX_BUCKETS - 1)]) {
+			if (s->hash == h && s->len == l && strncasecmp(s->text, &name[len - l], l) == 0) {
+				found = s->seq;
+				break;
+			}
+		}
+	}
+
+	return found;
+}
+
+
+/* Suffix rules are kept aside until lc and rc are known, they can come
+ * anywhere in LS_COLORS */
+static bool parseColors(const char* const env)
+{
+	char* const pending = malloc(strlen(env) + 1);
+	char* pend = pending;
+	const char* p = env;
+	bool ok = pending != NULL;
+
+	while (ok && *p != '\0') {
+		if (*p == ':') {
+			++p;
+			continue;
+		}
+
+		if (*p == '*') {
+			// "*suffix=value", unescaped into pending as "suffix\0value\0"
+			++p;
+			char* const suffix = pend;
+			for (; *p != '=' && *p != ':' && *p != '\0'; ++p)
+				*pend++ = *p;
+			*pend++ = '\0';
+			const int len = pend - suffix - 1;
+			if (*p++ != '=' || len == 0) {
+				ok = false;
+				break;
+			}
+			char value[COLOR_SEQ_MAX];
+			if (parseValue(&p, value, sizeof(value)) < 0) {
+				ok = false;
+				break;
+			}
+			pend = stpcpy(pend, value) + 1;
+			continue;
+		}
+
+		if (p[0] == '\0' || p[1] == '\0' || p[2] != '=') {
+			ok = false;
+			break;
+		}
+
+		int type = 0;
+		while (type < COLOR_TYPES && strncmp(type_keys[type], p, 2) != 0)
+			++type;
+		p += 3;
+
+		char value[COLOR_SEQ_MAX];
+		if (parseValue(&p, value, sizeof(value)) < 0) {
+			ok = false;
+		} else if (type == COLOR_LINK && strcmp(value, "target") == 0) {
+			colors.link_target = true;
+			colors.raw[type][0] = '\0';
+		} else if (type < COLOR_TYPES) {
+			// keys this doesn't know (mi, or, ca, mh, ...) are skipped
+			strcpy(colors.raw[type], value);
+		}
+	}
+
+	for (const char* s = pending; ok && s < pend; ) {
+		const char* const value = s + strlen(s) + 1;
+		addSuffix(s, strlen(s), value);
+		s = value + strlen(value) + 1;
+	}
+
+	free(pending);
+	return ok;
+}
+
+
+bool initializeColors(void)
+{
+	for (int i = 0; i < COLOR_TYPES; ++i)
+		strcpy(colors.raw[i], type_defaults[i] != NULL ? type_defaults[i] : "");
+
+	const char* const env = getenv("LS_COLORS");
+	const bool ok = env == NULL || parseColors(env);
+	if (!ok) {
+		fprintf(stderr, "Unparsable value for LS_COLORS, no colors\n");
+		memset(&colors, 0, sizeof(colors));
+		return false;
+	}
+
+	for (int i = 0; i < COLOR_LEFT; ++i) {
+		if (colors.raw[i][0] != '\0' &&
+		    snprintf(colors.seq[i], COLOR_SEQ_MAX, "%s%s%s", colors.raw[COLOR_LEFT], colors.raw[i],
+		             colors.raw[COLOR_RIGHT]) >= COLOR_SEQ_MAX)
+			colors.seq[i][0] = '\0';
+	}
+
+	if (colors.raw[COLOR_END][0] != '\0')
+		strcpy(colors.seq[COLOR_END], colors.raw[COLOR_END]);
+	else if (snprintf(colors.seq[COLOR_END], COLOR_SEQ_MAX, "%s%s%s", colors.raw[COLOR_LEFT],
+	                  colors.raw[COLOR_RESET], colors.raw[COLOR_RIGHT]) >= COLOR_SEQ_MAX)
+		strcpy(colors.seq[COLOR_END], "\033[0m");
+	return true;
+}
+
+
+static inline const char* typeColor(const enum ColorType type)
+{
+	return colors.seq[type][0] != '\0' ? colors.seq[type] : NULL;
+}
+
+
+static const char* regularColor(const char* const name)
+{
+	const char* const seq = suffixColor(name);
+	if (seq != NULL)
+		return seq;
+	return typeColor(colors.seq[COLOR_FILE][0] != '\0' ? COLOR_FILE : COLOR_NORMAL);
+}
+
+
+const char* colorByType(const unsigned char d_type, const char* const name)
+{
+	switch (d_type) {
+	case DT_DIR:  return typeColor(COLOR_DIR);
+	case DT_LNK:  return colors.link_target ? regularColor(name) : typeColor(COLOR_LINK);
+	case DT_FIFO: return typeColor(COLOR_FIFO);
+	case DT_SOCK: return typeColor(COLOR_SOCK);
+	case DT_BLK:  return typeColor(COLOR_BLK);
+	case DT_CHR:  return typeColor(COLOR_CHR);
+	default:      return regularColor(name);
+	}
+}
+
+
+// the special kinds only when they have a color of their own, like GNU ls
+#define HAS_COLOR(type) (colors.seq[type][0] != '\0')
+
+const char* colorByMode(const mode_t mode, const char* const name)
+{
+	if (S_ISREG(mode)) {
+		if ((mode & S_ISUID) != 0 && HAS_COLOR(COLOR_SETUID))
+			return typeColor(COLOR_SETUID);
+		if ((mode & S_ISGID) != 0 && HAS_COLOR(COLOR_SETGID))
+			return typeColor(COLOR_SETGID);
+		if ((mode & (S_IXUSR|S_IXGRP|S_IXOTH)) != 0 && HAS_COLOR(COLOR_EXEC))
+			return typeColor(COLOR_EXEC);
+		return regularColor(name);
+	}
+
+	if (S_ISDIR(mode)) {
+		const bool sticky = (mode & S_ISVTX) != 0;
+		const bool writable = (mode & S_IWOTH) != 0;
+		if (sticky && writable && HAS_COLOR(COLOR_STICKY_OTHER_WRITABLE))
+			return typeColor(COLOR_STICKY_OTHER_WRITABLE);
+		if (writable && HAS_COLOR(COLOR_OTHER_WRITABLE))
+			return typeColor(COLOR_OTHER_WRITABLE);
+		if (sticky && HAS_COLOR(COLOR_STICKY))
+			return typeColor(COLOR_STICKY);
+		return typeColor(COLOR_DIR);
+	}
+
+	if (S_ISLNK(mode))
+		return typeColor(COLOR_LINK);
+	if (S_ISFIFO(mode))
+		return typeColor(COLOR_FIFO);
+	if (S_ISSOCK(mode))
+		return typeColor(COLOR_SOCK);
+	if (S_ISBLK(mode))
+		return typeColor(COLOR_BLK);
+	if (S_ISCHR(mode))
+		return typeColor(COLOR_CHR);
+	return typeColor(COLOR_NORMAL);
+}
+
+#undef HAS_COLOR
+
+
+const char* colorEnd(void)
+{
+	return colors.seq[COLOR_END];
+}
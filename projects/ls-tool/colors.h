@@ -0,0 +1,18 @@
+#ifndef LS_TOOL_COLORS_H_
+#define LS_TOOL_COLORS_H_
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+/* parses LS_COLORS over the built-in defaults, false (and no colors)
+ * when it can't be */
+extern bool initializeColors(void);
+
+/* the escape sequence that starts name's color, NULL for none. ByType
+ * takes a dirent d_type, and can't tell executables, setuid/setgid or
+ * sticky and other-writable directories without the mode */
+extern const char* colorByType(unsigned char d_type, const char* name);
+extern const char* colorByMode(mode_t mode, const char* name);
+extern const char* colorEnd(void);
+
+#endif
@@ -8,12 +8,14 @@
 #include <errno.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
+#include "colors.h"
 
 
 struct File {
@@ -38,6 +40,7 @@ struct Paddings {
 };
 
 
+static const unsigned char kOptColor = 0x08;
 static const unsigned char kOptAll  = 0x04;
 static const unsigned char kOptLong = 0x02;
 static const unsigned char kOptDir  = 0x01;
@@ -47,6 +50,7 @@ static const struct option long_opts[] = {
 	{"long", no_argument, NULL, 'l'},
 	{"all", no_argument, NULL, 'a'},
 	{"directory", no_argument, NULL, 'd'},
+	{"color", optional_argument, NULL, 'c'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -74,6 +78,22 @@ static inline void catbuffer(const char* const fmt, ...)
 }
 
 
+// --color[=WHEN] like GNU ls, WHEN is always by default
+static inline bool usecolor(const char* const when)
+{
+	if (when == NULL || strcmp(when, "always") == 0 || strcmp(when, "yes") == 0 ||
+	    strcmp(when, "force") == 0)
+		return true;
+	if (strcmp(when, "auto") == 0 || strcmp(when, "tty") == 0 || strcmp(when, "if-tty") == 0)
+		return isatty(STDOUT_FILENO);
+	if (strcmp(when, "never") == 0 || strcmp(when, "no") == 0 || strcmp(when, "none") == 0)
+		return false;
+
+	fprintf(stderr, "Invalid argument for --color: %s\n", when);
+	exit(EXIT_FAILURE);
+}
+
+
 static inline unsigned char get_opts(const int argc, char* const* argv)
 {
 	unsigned char r = 0;
@@ -86,6 +106,10 @@ static inline unsigned char get_opts(const int argc, char* const* argv)
 			case 'a': r |= kOptAll; break;
 			case 'l': r |= kOptLong; break;
 			case 'd': r |= kOptDir; break;
+			case 'c':
+				if (usecolor(optarg))
+					r |= kOptColor;
+				break;
 		}
 	}
 	return r;
@@ -169,19 +193,37 @@ static inline struct Paddings getpaddings(const struct File* p)
 }
 
 
-static inline int lsshort(DIR* const dir, const bool all)
+// colors come from d_type, the file system has to leave it unknown for a stat
+static inline const char* shortcolor(DIR* const dir, const struct dirent* const ent)
+{
+	struct stat st;
+	if (ent->d_type != DT_UNKNOWN)
+		return colorByType(ent->d_type, ent->d_name);
+	if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		return colorByMode(st.st_mode, ent->d_name);
+	return NULL;
+}
+
+
+static inline int lsshort(DIR* const dir, const bool all, const bool color)
 {
 	const struct dirent* ent;
 	while ((ent = readdir(dir)) != NULL) {
 		if (!all && ent->d_name[0] == '.')
 			continue;
-		catbuffer("%s\n", ent->d_name);
+
+		const char* const seq = color ? shortcolor(dir, ent) : NULL;
+		if (seq != NULL)
+			catbuffer("%s%s%s\n", seq, ent->d_name, colorEnd());
+		else
+			catbuffer("%s\n", ent->d_name);
 	}
 	return EXIT_SUCCESS;
 }
 
 
-static inline int lslong(DIR* const dir, const char* const basepath, const bool all)
+static inline int lslong(DIR* const dir, const char* const basepath, const bool all,
+                         const bool color)
 {
 	// format: permissions - links - user - user group - size - last modified date - file name
 	const struct FileList* const fl = mkfilelist(dir, basepath);
@@ -204,12 +246,15 @@ static inline int lslong(DIR* const dir, const char* const basepath, const bool
 		perm[8] = (p->stat.st_mode&S_IWOTH) ? 'w' : '-';
 		perm[9] = (p->stat.st_mode&S_IXOTH) ? 'x' : '-';
 		strftime(date, 20, "%b %d %H:%M", localtime(&p->stat.st_ctime));
-		catbuffer("%s %*d %*s %*s %*ld %s %-*s\n",
+		// the padding goes after the color ends
+		const char* const seq = color ? colorByMode(p->stat.st_mode, p->name) : NULL;
+		catbuffer("%s %*d %*s %*s %*ld %s %s%s%s%*s\n",
 		          perm, pad.links, p->stat.st_nlink,
 			  pad.usr, getpwuid(p->stat.st_uid)->pw_name,
 			  pad.ugrp, getgrgid(p->stat.st_gid)->gr_name,
 			  pad.size, p->stat.st_size,
-			  date, pad.name, p->name);
+			  date, seq != NULL ? seq : "", p->name, seq != NULL ? colorEnd() : "",
+			  pad.name - (int) strlen(p->name), "");
 	}
 
 	rmfilelist(fl);
@@ -225,14 +270,17 @@ static inline int ls(const char* const dirname, const unsigned char opts)
 		return EXIT_FAILURE;
 	}
 
+	const bool color = (opts&kOptColor) && initializeColors();
+	const char* const seq = color ? colorByType(DT_DIR, dirname) : NULL;
+
 	int ret;
 	if (opts&kOptDir) {
-		catbuffer("%s\n", dirname);
+		catbuffer("%s%s%s\n", seq != NULL ? seq : "", dirname, seq != NULL ? colorEnd() : "");
 		ret = EXIT_SUCCESS;	
 	} else if (opts&kOptLong) {
-		ret = lslong(dir, dirname, (opts&kOptAll) != 0);
+		ret = lslong(dir, dirname, (opts&kOptAll) != 0, color);
 	} else {
-		ret = lsshort(dir, (opts&kOptAll) != 0);
+		ret = lsshort(dir, (opts&kOptAll) != 0, color);
 	}
 	
 	flushbuffer();
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "utils/myprintf.h"
+
+
+/* myprintf against glibc. "bench" runs a corpus of formats through
+ * every printf flavour of both and reports ns/call, output bytes/s and
+ * write syscalls/call. "check" formats random conversions with both and
+ * reports every output that differs, exiting with a failure if any does.
+ * */
+#define BENCH_CALLS   ((long)200000)
+#define BENCH_WARMUP  ((long)1000)
+#define CHECK_FORMATS ((long)1000000)
+#define CHECK_BUFSIZE ((int)1024)
+
+
+enum Impl {
+	IMPL_PRINTF,       // stdio, buffered
+	IMPL_DPRINTF,      // one write per call
+	IMPL_SNPRINTF,
+	IMPL_MYPRINTF,     // MyStream, buffered
+	IMPL_MYPRINTF_C,   // MYFPRINTF, precompiled
+	IMPL_MYDPRINTF,
+	IMPL_MYSNPRINTF,
+	IMPL_MYSNPRINTF_C,
+	IMPL_COUNT
+};
+
+
+static const char* const impl_names[IMPL_COUNT] = {
+	"printf", "dprintf", "snprintf", "myprintf", "MYPRINTF", "mydprintf", "mysnprintf",
+	"MYSNPRINTF"
+};
+
+
+static struct Bench {
+	int fd;                  // /dev/null
+	FILE* file;              // on fd, for glibc
+	struct MyStream stream;  // on fd, for myprintf
+	char buf[MYPRINTF_BUFSIZE];
+	char line[CHECK_BUFSIZE];
+	uint64_t rng;
+	long fails;
+} bench;
+
+
+static const char* const words[] = { "GET", "POST", "worker-17", "" };
+static const char* const long_str =
+	"/usr/share/doc/some-package/examples/configuration/very/deeply/nested/directory/"
+	"with/a/rather/long/path/name/that/keeps/going/and/going/until/it/is/long/enough.conf";
+
+
+/* one function per corpus entry, formatting its arguments for iteration
+ * i with the given implementation. Returns the bytes it produced */
+#define BENCH_CASE(name, fmt, ...) \
+static int name(const enum Impl impl, const long i) \
+{ \
+	((void)i); \
+	switch (impl) { \
+	case IMPL_PRINTF: return fprintf(bench.file, fmt, ##__VA_ARGS__); \
+	case IMPL_DPRINTF: return dprintf(bench.fd, fmt, ##__VA_ARGS__); \
+	case IMPL_SNPRINTF: return snprintf(bench.line, sizeof(bench.line), fmt, ##__VA_ARGS__); \
+	case IMPL_MYPRINTF: return myfprintf(&bench.stream, fmt, ##__VA_ARGS__); \
+	case IMPL_MYPRINTF_C: return MYFPRINTF(&bench.stream, fmt, ##__VA_ARGS__); \
+	case IMPL_MYDPRINTF: return mydprintf(bench.fd, fmt, ##__VA_ARGS__); \
+	case IMPL_MYSNPRINTF: return mysnprintf(bench.line, sizeof(bench.line), fmt, ##__VA_ARGS__); \
+	case IMPL_MYSNPRINTF_C: return MYSNPRINTF(bench.line, sizeof(bench.line), fmt, ##__VA_ARGS__); \
+	case IMPL_COUNT: break; \
+	} \
+	return 0; \
+}
+
+BENCH_CASE(caseLiteral, "Hello, world! A short line without conversions.\n")
+BENCH_CASE(caseShortInt, "%d\n", (int) i)
+BENCH_CASE(caseIntegers, "%d %ld %u %x %lu %lld %o\n", (int) i, i * 7919, (unsigned) i * 2654435761u,
+           (unsigned) i, (unsigned long) i << 20, -(long long) i * 1000003, (unsigned) i)
+BENCH_CASE(casePadded, "[%08d] [%-10u] [%+6d] [%#10x] [%*d]\n", (int) i, (unsigned) i, (int) -i,
+           (unsigned) i, (int)(i % 12), (int) i)
+BENCH_CASE(caseStrings, "%s %s: %s (%.20s)\n", words[i & 3], long_str, long_str + (i & 63), long_str)
+BENCH_CASE(caseMixed, "%s:%ld: %-9s %5.1f%% %c %p\n", "bench.c", i, words[i & 3], (double) i * 0.37,
+           (char)('a' + i % 26), (void*)(uintptr_t)(i * 4096))
+BENCH_CASE(caseFloats, "%.2f %g %e\n", (double) i * 0.01 + 0.005, (double) i / 7, (double) i * 1e-7)
+BENCH_CASE(caseExact, "%.17g %.25f\n", (double) i * 0.1, 1.0 / (double)(i + 1))
+
+
+static const struct BenchCase {
+	const char* name;
+	int (*run)(enum Impl impl, long i);
+} cases[] = {
+	{ "literal", caseLiteral },
+	{ "short int", caseShortInt },
+	{ "integers", caseIntegers },
+	{ "padded", casePadded },
+	{ "strings", caseStrings },
+	{ "mixed", caseMixed },
+	{ "floats", caseFloats },
+	{ "exact floats", caseExact }
+};
+
+
+static uint64_t clockNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+
+// write(2)-like syscalls made so far, -1 without task I/O accounting
+static long writeSyscalls(void)
+{
+	FILE* const io = fopen("/proc/self/io", "r");
+	if (io == NULL)
+		return -1;
+
+	char line[64];
+	long count = -1;
+	while (fgets(line, sizeof(line), io) != NULL) {
+		if (sscanf(line, "syscw: %ld", &count) == 1)
+			break;
+	}
+	fclose(io);
+	return count;
+}
+
+
+static void flushImpl(const enum Impl impl)
+{
+	if (impl == IMPL_PRINTF)
+		fflush(bench.file);
+	else if (impl == IMPL_MYPRINTF || impl == IMPL_MYPRINTF_C)
+		myflush(&bench.stream);
+}
+
+
+static void runCase(const struct BenchCase* const c, const long calls)
+{
+	// the corpus is checked too, outside of the timing
+	char expect[CHECK_BUFSIZE];
+	c->run(IMPL_SNPRINTF, 12345);
+	strcpy(expect, bench.line);
+	c->run(IMPL_MYSNPRINTF_C, 12345);
+	const bool same = strcmp(expect, bench.line) == 0;
+	if (!same)
+		++bench.fails;
+
+	myprintf("%-13s%s\n", c->name, same ? "" : "  (differs from glibc!)");
+	for (int impl = 0; impl < IMPL_COUNT; ++impl) {
+		for (long i = 0; i < BENCH_WARMUP; ++i)
+			c->run(impl, i);
+		flushImpl(impl);
+
+		const long sys_start = writeSyscalls();
+		const uint64_t start = clockNs();
+		uint64_t bytes = 0;
+		for (long i = 0; i < calls; ++i)
+			bytes += c->run(impl, i);
+		flushImpl(impl);
+		const uint64_t ns = clockNs() - start;
+		const long sys_end = writeSyscalls();
+
+		myprintf("  %-12s %9.1f ns/call %9.1f MB/s", impl_names[impl], (double) ns / calls,
+		         ns > 0 ? bytes * 1000.0 / ns : 0.0);
+		if (sys_start >= 0 && sys_end >= 0)
+			myprintf(" %9.4f syscalls/call\n", (double)(sys_end - sys_start) / calls);
+		else
+			myprintf("         - syscalls/call\n");
+	}
+	myflush(mystdout());
+}
+
+
+static int runBench(const long calls)
+{
+	bench.fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+	if (bench.fd == -1) {
+		perror("/dev/null");
+		return EXIT_FAILURE;
+	}
+
+	bench.file = fdopen(dup(bench.fd), "w");
+	if (bench.file == NULL) {
+		perror("fdopen");
+		close(bench.fd);
+		return EXIT_FAILURE;
+	}
+
+	myStreamInit(&bench.stream, bench.fd, bench.buf, sizeof(bench.buf));
+	myprintf("%ld calls per implementation, output to /dev/null\n\n", calls);
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+		runCase(&cases[i], calls);
+
+	fclose(bench.file);
+	close(bench.fd);
+	return bench.fails == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static uint64_t rnd(void)
+{
+	// xorshift64
+	bench.rng ^= bench.rng << 13;
+	bench.rng ^= bench.rng >> 7;
+	bench.rng ^= bench.rng << 17;
+	return bench.rng;
+}
+
+
+/* formats fmt into a size bytes buffer with glibc, myprintf and a fresh
+ * precompiled descriptor, and reports any difference */
+static void checkFormat(const int size, const char* const fmt, ...)
+{
+	char expect[CHECK_BUFSIZE], got[CHECK_BUFSIZE], compiled[CHECK_BUFSIZE];
+	va_list args, copy;
+	va_start(args, fmt);
+
+	va_copy(copy, args);
+	const int expect_len = vsnprintf(expect, size, fmt, copy);
+	va_end(copy);
+
+	va_copy(copy, args);
+	const int got_len = myvsnprintf(got, size, fmt, copy);
+	va_end(copy);
+
+	struct FmtCompiled c = { .state = FMT_STATE_NEW };
+	struct MyStream s;
+	myStreamInit(&s, -1, compiled, size - 1);
+	va_copy(copy, args);
+	const int compiled_len = myvfprintfcc(&s, &c, fmt, copy);
+	compiled[s.len] = '\0';
+	va_end(copy);
+	va_end(args);
+
+	if (expect_len == got_len && expect_len == compiled_len && strcmp(expect, got) == 0 &&
+	    strcmp(expect, compiled) == 0)
+		return;
+
+	if (++bench.fails <= 20) {
+		myprintf("\"%s\" (%d bytes):\n  glibc      [%s] %d\n  myprintf   [%s] %d\n"
+		         "  precompiled [%s] %d\n", fmt, size, expect, expect_len, got, got_len, compiled,
+		         compiled_len);
+	}
+}
+
+
+static double randomDouble(void)
+{
+	const uint64_t r = rnd();
+	double v;
+	switch (r % 4) {
+	case 0:   // any bit pattern, nan and inf included
+		memcpy(&v, &r, sizeof(v));
+		return v;
+	case 1:   // a price, a measurement...
+		return (double)(int64_t)(rnd() % 100000000 - 50000000) / 100;
+	case 2:   // halfway cases
+		return (double)(rnd() % 100000) + 0.5;
+	default:
+		return (double)(int64_t)(rnd() >> (rnd() % 64)) / (double)((uint64_t)1 << (rnd() % 60));
+	}
+}
+
+
+// passes the * width and precision the format asks for in front of its argument
+#define CHECK_ARGS(...) \
+	(stars == 0 ? checkFormat(size, fmt, __VA_ARGS__) : \
+	 stars == 1 ? checkFormat(size, fmt, width, __VA_ARGS__) : \
+	 stars == 2 ? checkFormat(size, fmt, prec, __VA_ARGS__) : \
+	              checkFormat(size, fmt, width, prec, __VA_ARGS__))
+
+
+/* one random conversion between random literals, with random flags,
+ * width, precision and length, into a buffer that may be too small */
+static void checkRandom(void)
+{
+	static const char* const literals[] = { "", "x", "%% ", "[", "a longer literal: " };
+	static const char* const lengths[] = { "", "hh", "h", "l", "ll", "j", "z", "t" };
+	static const char convs[] = "diuoxXcspfFeEgG";
+	static const char* const strs[] = { "", "a", "hello", "a longer string, with spaces", NULL };
+
+	char fmt[96];
+	int n = sprintf(fmt, "%s%%", literals[rnd() % 5]);
+	for (const char* flag = "-+ #0"; *flag != '\0'; ++flag) {
+		if (rnd() % 4 == 0)
+			fmt[n++] = *flag;
+	}
+
+	int stars = 0, width = 0, prec = 0;
+	switch (rnd() % 4) {
+	case 0: break;
+	case 1: n += sprintf(&fmt[n], "%d", (int)(rnd() % 40)); break;
+	case 2: fmt[n++] = '*'; stars |= 1; width = (int)(rnd() % 60) - 20; break;
+	default: n += sprintf(&fmt[n], "%d", (int)(rnd() % 8)); break;
+	}
+	switch (rnd() % 4) {
+	case 0: break;
+	case 1: n += sprintf(&fmt[n], ".%d", (int)(rnd() % 30)); break;
+	case 2: n += sprintf(&fmt[n], ".*"); stars |= 2; prec = (int)(rnd() % 40) - 10; break;
+	default: fmt[n++] = '.'; break;
+	}
+
+	const char conv = convs[rnd() % (sizeof(convs) - 1)];
+	const char* const length = strchr("diuoxX", conv) != NULL ? lengths[rnd() % 8] : "";
+	sprintf(&fmt[n], "%s%c%s", length, conv, literals[rnd() % 5]);
+
+	const int size = rnd() % 8 == 0 ? (int)(rnd() % 24) + 1 : CHECK_BUFSIZE;
+	const uint64_t r = rnd() >> (rnd() % 64);
+	const int64_t v = rnd() % 3 == 0 ? -(int64_t) r : (int64_t) r;
+
+	switch (conv) {
+	case 'c': CHECK_ARGS((int)(r % 94 + 33)); break;
+	case 's': CHECK_ARGS(strs[r % 5]); break;
+	case 'p': CHECK_ARGS((void*)(uintptr_t) r); break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': CHECK_ARGS(randomDouble()); break;
+	default:
+		if (length[0] == 'l' && length[1] == 'l')
+			CHECK_ARGS((long long) v);
+		else if (length[0] == 'l')
+			CHECK_ARGS((long) v);
+		else if (length[0] == 'j')
+			CHECK_ARGS((intmax_t) v);
+		else if (length[0] == 'z')
+			CHECK_ARGS((ssize_t) v);
+		else if (length[0] == 't')
+			CHECK_ARGS((ptrdiff_t) v);
+		else
+			CHECK_ARGS((int) v);
+		break;
+	}
+}
+
+
+static int runCheck(const long formats, const uint64_t seed)
+{
+	bench.rng = seed != 0 ? seed : 88172645463325252ull;
+	for (long i = 0; i < formats; ++i)
+		checkRandom();
+
+	myprintf("%ld random formats (seed %llu), %ld differ from glibc\n", formats,
+	         (unsigned long long) seed, bench.fails);
+	return bench.fails == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+int main(const int argc, char* const* const argv)
+{
+	long count = 0;
+	uint64_t seed = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n': count = strtol(optarg, NULL, 10); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		default: goto Lusage;
+		}
+	}
+
+	const char* const cmd = optind < argc ? argv[optind] : "bench";
+	if (strcmp(cmd, "bench") == 0)
+		return runBench(count > 0 ? count : BENCH_CALLS);
+	if (strcmp(cmd, "check") == 0)
+		return runCheck(count > 0 ? count : CHECK_FORMATS, seed);
+
+Lusage:
+	fprintf(stderr, "Usage: %s [-n count] [-s seed] [bench, check]\n"
+	                "  bench  time the corpus with glibc and myprintf (default)\n"
+	                "  check  compare random conversions with glibc's output\n"
+	                "  -n     calls per implementation, or formats to check\n"
+	                "  -s     seed of the random formats\n", argv[0]);
+	return EXIT_FAILURE;
+}
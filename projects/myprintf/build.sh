@@ -7,3 +7,6 @@ OUTDIR="$3"
 echo "${CC} ${CFLAGS} ${PROJDIR}/main.c -o ${OUTDIR}"
 $CC $CFLAGS $PROJDIR/main.c -o $OUTDIR
 
+
+echo "${CC} ${CFLAGS} ${PROJDIR}/bench.c -o ${OUTDIR}-bench"
+$CC $CFLAGS $PROJDIR/bench.c -o $OUTDIR-bench
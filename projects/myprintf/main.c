@@ -1,54 +1,17 @@
-#include <string.h>
-#include <unistd.h>
-#include <stdarg.h>
+#include <stdlib.h>
+#include "utils/myprintf.h"
 
 
-static void myprintf(const char* const fmt, ...)
-{
-	va_list args;
-	va_start(args, fmt);
-
-	const int fd = STDOUT_FILENO;
-
-	const char *pw = fmt, *p = fmt;
-	while (*p != '\0') {
-		if (*p != '%' || *(p + 1) == '%' || *(p + 1) == '\0') {
-			++p;
-			continue;
-		}
-
-		write(fd, pw, p - pw);
-
-		switch (*(p + 1)) {
-		case 'd': {
-			char buffer[128];
-			int buffidx = 128;
-			for (int num = va_arg(args, int); num > 0; num /= 10)
-				buffer[--buffidx] = "0123456789"[num % 10];
-			write(fd, &buffer[buffidx], 128 - buffidx);
-			p += 2;
-			break; 
-		        }
-		case 's': {
-			const char* const str = va_arg(args, const char*);
-			write(fd, str, strlen(str));
-			p += 2;
-			break;
-			}
-		}
-
-		pw = p;
-	}
-
-	if ((p - pw) > 0)
-		write(STDOUT_FILENO, pw, p - pw);
-
-	va_end(args);
-}
-
 int main(void)
 {
+	// parsed once, on the first call
+	MYPRINTF("Hello %d World!! %d\n%s\n", 888, 555, "GoodBye World!!");
+	myprintf("%-8s|%08.3f|%+d|%#x|%zu|%p\n", "fmt", 3.14159, 0, 255u, sizeof(struct MyStream),
+	         (void*) main);
+
+	char line[32];
+	const int len = mysnprintf(line, sizeof(line), "%e, %g and %.2g", 1e21, 0.0001, 1234.5);
+	mydprintf(STDERR_FILENO, "snprintf: \"%s\" (%d bytes)\n", line, len);
 
-	myprintf("Hello %d World!! %d\n%s\n", 888, 555, "GoodBye World!!");
-	return 0;
+	return myflush(mystdout()) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -3,7 +3,8 @@ PROJDIR=$(dirname "$0")
 CC="$1"
 CFLAGS="$2"
 OUTDIR="$3"
+CLIBS="-lpthread"
 
-echo "${CC} ${CFLAGS} ${PROJDIR}/main.c -o ${OUTDIR}"
-$CC $CFLAGS $PROJDIR/main.c -o $OUTDIR
+echo "${CC} ${CFLAGS} ${CLIBS} ${PROJDIR}/main.c ${PROJDIR}/generator.c -o ${OUTDIR}"
+$CC $CLIBS $CFLAGS $PROJDIR/main.c $PROJDIR/generator.c -o $OUTDIR
 
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "generator.h"
+#include "utils/numconv.h"
+
+
+/* The template is compiled once into literal and field ops. Records are
+ * rendered in chunks of about CHUNK_BYTES by the workers, chunk c by
+ * worker c % threads, which takes turns between its two slots: while the
+ * main thread writes one out the other is being filled. The main thread
+ * writes the chunks in order, so the output is the same as one thread's.
+ * Time fields are read once per chunk.
+ * */
+#define CHUNK_BYTES ((size_t)1 << 20)
+#define THREADS_MAX ((int)64)
+#define WIDTH_MAX   ((uint64_t)64)
+#define ISO_LEN     ((int)20)                  // 2026-10-19T12:34:56Z
+#define SPLITMIX_STEP 0x9e3779b97f4a7c15ull
+
+
+enum OpKind {
+	OP_LITERAL,
+	OP_COUNTER,
+	OP_RAND,
+	OP_RAND_BELOW,
+	OP_HEX,
+	OP_TIME,
+	OP_MS,
+	OP_ISO
+};
+
+
+struct Op {
+	enum OpKind kind;
+	size_t width;         // literal length, zero padding, hex digits
+	size_t offset;        // literal text in gen.text
+	uint64_t arg;         // counter start, random bound
+	uint64_t salt;        // which random field of the record
+};
+
+
+struct Clock {
+	uint64_t sec;
+	uint64_t ms;
+	char iso[ISO_LEN];
+};
+
+
+struct Slot {
+	char* buf;
+	size_t len;
+	bool ready;           // rendered and not written yet
+	struct Clock clock;   // for the chunk it gets next, read in chunk order
+};
+
+
+static struct Generator {
+	struct Op* ops;
+	int nops;
+	char* text;
+	size_t record_max;    // longest a record can render to, newline included
+	uint64_t nrand;       // random fields per record
+	uint64_t seed;
+	uint64_t count;
+	uint64_t chunk_records;
+	uint64_t chunks;
+	int threads;
+	struct Slot* slots;   // two per worker, chunk c goes to slot c % (2 * threads)
+	struct Clock clock;   // the latest one handed to a slot
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	pthread_cond_t free_cond;
+	bool stop;
+} gen;
+
+
+// decimal digits only, false when there are none or they overflow
+static bool parseNumber(const char** const str, const char* const end, uint64_t* const value)
+{
+	const char* p = *str;
+	*value = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+		if (*value > (UINT64_MAX - (*p - '0')) / 10)
+			return false;
+		*value = *value * 10 + (*p - '0');
+	}
+
+	const bool ok = p > *str;
+	*str = p;
+	return ok;
+}
+
+
+// str is the placeholder's name and arguments, without the braces
+static bool parseField(const char* str, const char* const end, struct Op* const op)
+{
+	const char* name_end = str;
+	while (name_end < end && *name_end != ':' && *name_end != '+')
+		++name_end;
+	const size_t name_len = name_end - str;
+	const char* p = name_end;
+	uint64_t value;
+
+#define NAME_IS(name) (name_len == sizeof(name) - 1 && memcmp(str, name, name_len) == 0)
+	if (NAME_IS("n")) {
+		op->kind = OP_COUNTER;
+		if (p < end && *p == '+') {
+			++p;
+			if (!parseNumber(&p, end, &op->arg))
+				return false;
+		}
+		if (p < end && *p == ':') {
+			++p;
+			if (!parseNumber(&p, end, &value) || value > WIDTH_MAX)
+				return false;
+			op->width = value;
+		}
+	} else if (NAME_IS("rand")) {
+		op->kind = OP_RAND;
+		op->salt = gen.nrand++;
+		if (p < end && *p == ':') {
+			++p;
+			if (!parseNumber(&p, end, &op->arg) || op->arg == 0)
+				return false;
+			op->kind = OP_RAND_BELOW;
+		}
+	} else if (NAME_IS("hex")) {
+		op->kind = OP_HEX;
+		op->salt = gen.nrand++;
+		if (p == end || *p++ != ':' || !parseNumber(&p, end, &value) || value == 0 || value > 16)
+			return false;
+		op->width = value;
+	} else if (NAME_IS("time")) {
+		op->kind = OP_TIME;
+	} else if (NAME_IS("ms")) {
+		op->kind = OP_MS;
+	} else if (NAME_IS("iso")) {
+		op->kind = OP_ISO;
+	} else {
+		return false;
+	}
+#undef NAME_IS
+
+	return p == end;
+}
+
+
+static size_t fieldMax(const struct Op* const op)
+{
+	switch (op->kind) {
+	case OP_LITERAL:
+	case OP_HEX:
+		return op->width;
+	case OP_COUNTER:
+		return op->width > 20 ? op->width : 20;
+	case OP_RAND_BELOW:
+		return numDigits10(op->arg - 1);
+	case OP_ISO:
+		return ISO_LEN;
+	default:
+		return 20;
+	}
+}
+
+
+/* Splits the template into ops, literal runs are copied into gen.text
+ * with the escapes resolved and the newline added to the last one */
+static bool compileTemplate(const char* const template)
+{
+	const size_t len = strlen(template);
+	size_t text_len = 0;
+	size_t literal = 0;   // where the current literal run starts
+
+	// every field takes 3 characters at least, and there's a literal between two
+	gen.ops = calloc(len + 2, sizeof(*gen.ops));
+	gen.text = malloc(len + 1);
+	if (gen.ops == NULL || gen.text == NULL) {
+		perror("Couldn't allocate the template");
+		return false;
+	}
+
+	for (const char* p = template; ; ) {
+		const bool field = *p == '{' && p[1] != '{';
+		if ((field || *p == '\0') && text_len > literal) {
+			gen.ops[gen.nops++] = (struct Op) {
+				.kind = OP_LITERAL, .width = text_len - literal, .offset = literal
+			};
+			literal = text_len;
+		}
+
+		if (*p == '\0') {
+			break;
+		} else if (field) {
+			const char* const end = strchr(p, '}');
+			if (end == NULL || !parseField(p + 1, end, &gen.ops[gen.nops])) {
+				fprintf(stderr, "Invalid placeholder: %.*s\n",
+				        end == NULL ? (int) strlen(p) : (int)(end - p + 1), p);
+				return false;
+			}
+			++gen.nops;
+			p = end + 1;
+		} else {
+			// {{ and }} are single braces
+			gen.text[text_len++] = *p;
+			p += (*p == '{' || *p == '}') && p[1] == *p ? 2 : 1;
+		}
+	}
+
+	gen.text[text_len] = '\n';
+	if (gen.nops > 0 && gen.ops[gen.nops - 1].kind == OP_LITERAL)
+		++gen.ops[gen.nops - 1].width;
+	else
+		gen.ops[gen.nops++] = (struct Op) {.kind = OP_LITERAL, .width = 1, .offset = text_len};
+
+	gen.record_max = 0;
+	for (int i = 0; i < gen.nops; ++i)
+		gen.record_max += fieldMax(&gen.ops[i]);
+	return true;
+}
+
+
+/* the (n * nrand + salt)th output of splitmix64, so records don't
+ * depend on each other and can be rendered in any order */
+static inline uint64_t randomField(const uint64_t n, const uint64_t salt)
+{
+	uint64_t z = gen.seed + (n * gen.nrand + salt + 1) * SPLITMIX_STEP;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+
+static char* renderRecord(char* p, const uint64_t n, const struct Clock* const clock)
+{
+	for (int i = 0; i < gen.nops; ++i) {
+		const struct Op* const op = &gen.ops[i];
+		uint64_t value;
+
+		switch (op->kind) {
+		case OP_LITERAL:
+			memcpy(p, &gen.text[op->offset], op->width);
+			p += op->width;
+			break;
+		case OP_COUNTER: {
+			value = op->arg + n;
+			const size_t digits = numDigits10(value);
+			const size_t width = digits > op->width ? digits : op->width;
+			memset(p, '0', width - digits);
+			p += width;
+			numToDecBackward(p, value);
+			break;
+		}
+		case OP_RAND:
+			p += numToDec(p, randomField(n, op->salt));
+			break;
+		case OP_RAND_BELOW:
+			// multiply and keep the high word, unbiased enough and no division
+			value = (uint64_t)(((unsigned __int128) randomField(n, op->salt) * op->arg) >> 64);
+			p += numToDec(p, value);
+			break;
+		case OP_HEX:
+			value = randomField(n, op->salt);
+			for (size_t d = op->width; d > 0; --d, value >>= 4)
+				p[d - 1] = "0123456789abcdef"[value & 0xF];
+			p += op->width;
+			break;
+		case OP_TIME:
+			p += numToDec(p, clock->sec);
+			break;
+		case OP_MS:
+			p += numToDec(p, clock->ms);
+			break;
+		case OP_ISO:
+			memcpy(p, clock->iso, ISO_LEN);
+			p += ISO_LEN;
+			break;
+		}
+	}
+
+	return p;
+}
+
+
+static void readClock(struct Clock* const clock)
+{
+	struct timespec now;
+	struct tm tm;
+	char iso[ISO_LEN + 1];
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock->sec = now.tv_sec;
+	clock->ms = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	memcpy(clock->iso, iso, ISO_LEN);
+}
+
+
+/* The chunks render out of order, so the clock is read when a slot is
+ * handed its next chunk, in chunk order, and never goes back even if the
+ * system clock is set back meanwhile. Called with the lock held once the
+ * workers run.
+ * */
+static void stampSlot(struct Slot* const slot, const struct Clock* const now)
+{
+	if (now->ms >= gen.clock.ms)
+		gen.clock = *now;
+	slot->clock = gen.clock;
+}
+
+
+static void* workerMain(void* const arg)
+{
+	const int nslots = 2 * gen.threads;
+
+	for (uint64_t c = (uintptr_t) arg; c < gen.chunks; c += gen.threads) {
+		struct Slot* const slot = &gen.slots[c % nslots];
+
+		pthread_mutex_lock(&gen.lock);
+		while (slot->ready && !gen.stop)
+			pthread_cond_wait(&gen.free_cond, &gen.lock);
+		const bool stop = gen.stop;
+		pthread_mutex_unlock(&gen.lock);
+		if (stop)
+			break;
+
+		const uint64_t first = c * gen.chunk_records;
+		const uint64_t last = gen.count - first < gen.chunk_records ? gen.count : first + gen.chunk_records;
+		char* p = slot->buf;
+		for (uint64_t n = first; n < last; ++n)
+			p = renderRecord(p, n, &slot->clock);
+
+		pthread_mutex_lock(&gen.lock);
+		slot->len = p - slot->buf;
+		slot->ready = true;
+		pthread_cond_signal(&gen.ready_cond);
+		pthread_mutex_unlock(&gen.lock);
+	}
+
+	return NULL;
+}
+
+
+static bool writeAll(const int fd, const char* buf, size_t len)
+{
+	while (len > 0) {
+		const ssize_t written = write(fd, buf, len);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("Couldn't write");
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
+
+
+// the chunks in order, as the workers finish them
+static bool writeChunks(const int fd)
+{
+	const int nslots = 2 * gen.threads;
+
+	for (uint64_t c = 0; c < gen.chunks; ++c) {
+		struct Slot* const slot = &gen.slots[c % nslots];
+
+		pthread_mutex_lock(&gen.lock);
+		while (!slot->ready)
+			pthread_cond_wait(&gen.ready_cond, &gen.lock);
+		pthread_mutex_unlock(&gen.lock);
+
+		if (!writeAll(fd, slot->buf, slot->len))
+			return false;
+
+		struct Clock now;
+		readClock(&now);
+		pthread_mutex_lock(&gen.lock);
+		stampSlot(slot, &now);
+		slot->ready = false;
+		pthread_cond_broadcast(&gen.free_cond);
+		pthread_mutex_unlock(&gen.lock);
+	}
+
+	return true;
+}
+
+
+bool generate(const int fd, const char* const template, const uint64_t count, int threads,
+              const uint64_t seed)
+{
+	bool ok = false;
+	pthread_t workers[THREADS_MAX];
+	int started = 0;
+
+	gen.seed = seed;
+	gen.count = count;
+	if (!compileTemplate(template))
+		goto Lfree_template;
+	if (count == 0) {
+		ok = true;
+		goto Lfree_template;
+	}
+
+	gen.chunk_records = CHUNK_BYTES / gen.record_max > 0 ? CHUNK_BYTES / gen.record_max : 1;
+	if (gen.chunk_records > count)
+		gen.chunk_records = count;
+	gen.chunks = (count - 1) / gen.chunk_records + 1;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > THREADS_MAX)
+		threads = THREADS_MAX;
+	if ((uint64_t) threads > gen.chunks)
+		threads = gen.chunks;
+	gen.threads = threads > 0 ? threads : 1;
+
+	gen.slots = calloc(2 * gen.threads, sizeof(*gen.slots));
+	if (gen.slots == NULL) {
+		perror("Couldn't allocate the buffers");
+		goto Lfree_template;
+	}
+	for (int i = 0; i < 2 * gen.threads; ++i) {
+		gen.slots[i].buf = malloc(gen.chunk_records * gen.record_max);
+		if (gen.slots[i].buf == NULL) {
+			perror("Couldn't allocate the buffers");
+			goto Lfree_slots;
+		}
+	}
+
+	gen.clock = (struct Clock) { 0 };
+	for (int i = 0; i < 2 * gen.threads; ++i) {
+		struct Clock now;
+		readClock(&now);
+		stampSlot(&gen.slots[i], &now);
+	}
+
+	pthread_mutex_init(&gen.lock, NULL);
+	pthread_cond_init(&gen.ready_cond, NULL);
+	pthread_cond_init(&gen.free_cond, NULL);
+	gen.stop = false;
+
+	for (; started < gen.threads; ++started) {
+		const int err = pthread_create(&workers[started], NULL, workerMain, (void*)(uintptr_t) started);
+		if (err != 0) {
+			fprintf(stderr, "Couldn't start a worker: %s\n", strerror(err));
+			break;
+		}
+	}
+
+	// every worker has its own chunks, all of them have to be there
+	ok = started == gen.threads && writeChunks(fd);
+
+	pthread_mutex_lock(&gen.lock);
+	gen.stop = true;
+	pthread_cond_broadcast(&gen.free_cond);
+	pthread_mutex_unlock(&gen.lock);
+	for (int i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	pthread_cond_destroy(&gen.free_cond);
+	pthread_cond_destroy(&gen.ready_cond);
+	pthread_mutex_destroy(&gen.lock);
+Lfree_slots:
+	for (int i = 0; i < 2 * gen.threads; ++i)
+		free(gen.slots[i].buf);
+	free(gen.slots);
+Lfree_template:
+	free(gen.text);
+	free(gen.ops);
+	return ok;
+}
@@ -0,0 +1,19 @@
+#ifndef PRINT_GENERATOR_H_
+#define PRINT_GENERATOR_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Writes count records of the template to fd, one per line. Placeholders:
+ *   {n} {n:W} {n+K} {n+K:W}  record number from 0 (or K), zero padded to W
+ *   {rand} {rand:N}          random 64-bit number, or one below N
+ *   {hex:W}                  W random hex digits, up to 16
+ *   {time} {ms} {iso}        seconds, milliseconds since the epoch, ISO 8601 UTC,
+ *                            read once per chunk of records and never decreasing
+ *   {{ }}                    literal braces
+ * Random fields depend on seed and the record number only, the same seed
+ * gives the same output whatever the thread count. threads 0 is one per CPU.
+ * */
+extern bool generate(int fd, const char* template, uint64_t count, int threads, uint64_t seed);
+
+#endif
@@ -1,19 +1,251 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "generator.h"
+
+
+/* The line is repeated into one block of whole lines, built once, and
+ * the output is that block over and over plus a tail of the lines left:
+ * up to IOV_MAX blocks per writev(2), or vmsplice(2) into a pipe, which
+ * hands the pages to the pipe instead of copying them. When the block
+ * can be a multiple of the page size it's gifted (SPLICE_F_GIFT), it's
+ * never written to again.
+ * */
+#define BLOCK_TARGET ((size_t)1 << 20)   // about this big, whole lines
+#define BLOCK_LCM_MAX ((size_t)4 << 20)  // largest page aligned block for long lines
+#define PIPE_SIZE ((int)1 << 20)         // asked for, the default 64 KiB is one block at best
+
+
+struct Output {
+	int fd;
+	bool pipe;
+	bool gift;            // block is page aligned, in length too
+	size_t page;
+	const char* block;
+	size_t block_len;
+	uint64_t blocks;      // whole blocks left
+	size_t tail;          // then the first tail bytes of the block
+	size_t done;          // of the current one, after a short write
+};
+
+
+// strtoull() would take "-1" as 2^64 - 1
+static bool parseCount(const char* const str, uint64_t* const count)
+{
+	char* end;
+	errno = 0;
+	*count = strtoull(str, &end, 0);
+	return str[0] >= '0' && str[0] <= '9' && *end == '\0' && errno == 0;
+}
+
+
+static size_t gcd(size_t a, size_t b)
+{
+	while (b != 0) {
+		const size_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+
+/* the block's size: whole lines, and a multiple of the page size too
+ * when that doesn't make it too large */
+static size_t blockSize(const size_t line_len, const size_t page, bool* const aligned)
+{
+	const size_t lcm = line_len / gcd(line_len, page) * page;
+	*aligned = lcm <= BLOCK_LCM_MAX;
+	const size_t unit = *aligned ? lcm : line_len;
+	return unit >= BLOCK_TARGET ? unit : BLOCK_TARGET / unit * unit;
+}
+
+
+// the next iovecs to send, gifted ones leave the tail out
+static int nextIov(const struct Output* const out, struct iovec* const iov, const bool gift)
+{
+	int n = 0;
+	size_t skip = out->done;
+
+	for (uint64_t b = 0; b < out->blocks && n < IOV_MAX; ++b, skip = 0) {
+		iov[n].iov_base = (char*) out->block + skip;
+		iov[n++].iov_len = out->block_len - skip;
+	}
+
+	if (out->blocks == 0 && out->tail > 0 && !gift) {
+		iov[n].iov_base = (char*) out->block + skip;
+		iov[n++].iov_len = out->tail - skip;
+	} else if (n < IOV_MAX && out->tail > 0 && !gift) {
+		iov[n].iov_base = (char*) out->block;
+		iov[n++].iov_len = out->tail;
+	}
+
+	return n;
+}
+
+
+static void advance(struct Output* const out, size_t written)
+{
+	while (written > 0) {
+		const size_t left = (out->blocks > 0 ? out->block_len : out->tail) - out->done;
+		if (written < left) {
+			out->done += written;
+			return;
+		}
+
+		written -= left;
+		out->done = 0;
+		if (out->blocks > 0)
+			--out->blocks;
+		else
+			out->tail = 0;
+	}
+}
+
+
+static bool emit(struct Output* const out)
+{
+	static struct iovec iov[IOV_MAX];
+
+	while (out->blocks > 0 || out->tail > 0) {
+		// only whole pages can be gifted, the pipe takes the block a page at a time
+		const bool gift = out->pipe && out->gift && out->done % out->page == 0 && out->blocks > 0;
+		const int n = nextIov(out, iov, gift);
+		ssize_t written;
+
+		if (out->pipe) {
+			written = vmsplice(out->fd, iov, n, gift ? SPLICE_F_GIFT : 0);
+			if (written == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				out->pipe = false;
+				continue;
+			}
+		} else {
+			written = writev(out->fd, iov, n);
+		}
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("Couldn't write");
+			return false;
+		}
+		advance(out, written);
+	}
+
+	return true;
+}
+
+
+static void usage(const char* const name)
+{
+	fprintf(stderr, "Usage example: %s 3 \"Hello World\"\n"
+	        "   or: %s -g [-j THREADS] [-s SEED] 1000 \"{n:08},{hex:12},{rand:100},{iso}\"\n"
+	        "Options go before the count, anything after it is the line\n",
+	        name, name);
+}
 
 
 int main(const int argc, const char* const * const argv)
 {
-	if (argc < 3) {
-		fprintf(stderr, "Usage example: %s 3 \"Hello World\"\n", argv[0]);
+	uint64_t count;
+	uint64_t seed = 0;
+	uint64_t threads = 0;
+	bool generator = false;
+	int opt;
+
+	// options end at the count, or at "--" for a count that looks like one
+	while ((opt = getopt(argc, (char* const*) argv, "+gj:s:")) != -1) {
+		switch (opt) {
+		case 'g':
+			generator = true;
+			break;
+		case 'j':
+			if (!parseCount(optarg, &threads) || threads > INT_MAX) {
+				fprintf(stderr, "Invalid thread count: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (!parseCount(optarg, &seed)) {
+				fprintf(stderr, "Invalid seed: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char* const line = argv[optind + 1];
+
+	if (!parseCount(argv[optind], &count)) {
+		fprintf(stderr, "Invalid count: %s\n", argv[optind]);
 		return EXIT_FAILURE;
 	}
 
-	const int times = (int) strtoll(argv[1], NULL, 0);
+	struct stat st;
+	const bool pipe = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+	if (pipe)
+		fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE);
 
-	for (int i = 0; i < times; ++i)
-		printf("%s\n", argv[2]);
+	if (generator)
+		return generate(STDOUT_FILENO, line, count, threads, seed) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-	return EXIT_SUCCESS;
-}
+	const size_t line_len = strlen(line) + 1;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	bool aligned;
+	size_t block_len = blockSize(line_len, page, &aligned);
+	const uint64_t lines = block_len / line_len;
 
+	// no bigger than the whole output
+	if (count < lines) {
+		block_len = count * line_len;
+		aligned = false;
+	}
+	if (block_len == 0)
+		return EXIT_SUCCESS;
+
+	char* const block = mmap(NULL, block_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+	                         -1, 0);
+	if (block == MAP_FAILED) {
+		perror("Couldn't allocate the block");
+		return EXIT_FAILURE;
+	}
+
+	// one line, then doubled until the block is full
+	memcpy(block, line, line_len - 1);
+	block[line_len - 1] = '\n';
+	for (size_t filled = line_len; filled < block_len; filled *= 2)
+		memcpy(&block[filled], block, filled < block_len - filled ? filled : block_len - filled);
+
+	struct Output out = {
+		.fd = STDOUT_FILENO,
+		.pipe = pipe,
+		.gift = aligned,
+		.page = page,
+		.block = block,
+		.block_len = block_len,
+		.blocks = count / (block_len / line_len),
+		.tail = (count % (block_len / line_len)) * line_len,
+		.done = 0
+	};
+
+	const bool ok = emit(&out);
+	munmap(block, block_len);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,11 +1,284 @@
 #ifndef DEBUG_H_
 #define DEBUG_H_
-#ifdef DEBUG_
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef DEBUG_
 #include <assert.h>
 #define dprintf(...) printf(__VA_ARGS__)
 #else
 #define dprintf(...)
 #endif
+
+
+/* Tracing, compiled in and off unless TRACE_FILE names where the trace
+ * goes. A disabled trace point is one load and a branch. Each thread
+ * writes fixed-size events (a TSC timestamp, the name's address as the
+ * id, up to two arguments) to its own ring, overwriting the oldest, with
+ * no lock or atomic read-modify-write; a thread that exits hands its ring
+ * to the next one. traceExport() writes the Chrome trace / Perfetto JSON.
+ * The state is weak, one for the whole program whichever translation
+ * units include this.
+ * */
+#define TRACE_EVENTS      ((uint64_t)1 << 15)   // per thread, a power of 2
+#define TRACE_THREADS_MAX ((int)64)             // at once, the others aren't traced
+#define TRACE_ENV         "TRACE_FILE"
+
+
+struct TraceEvent {
+	uint64_t tsc;
+	const char* name;     // a string literal, its address is the id
+	uint64_t args[2];
+	uint8_t phase;        // Chrome's: 'B'egin, 'E'nd, 'i'nstant, 'C'ounter
+	uint8_t nargs;
+	uint32_t tid;         // rings change hands
+};
+
+
+struct TraceRing {
+	uint64_t head;        // events ever written, by the owner only
+	uint32_t tid;
+	bool used;
+	struct TraceEvent events[TRACE_EVENTS];
+};
+
+
+struct Tracing {
+	bool enabled;
+	bool exported;
+	const char* path;
+	int nrings;
+	struct TraceRing* rings[TRACE_THREADS_MAX];
+	pthread_mutex_t lock;           // for the rings array
+	pthread_key_t key;              // gives the ring back on thread exit
+	uint64_t tsc0;                  // for the TSC frequency at export
+	uint64_t ns0;
+};
+
+
+__attribute__((weak)) struct Tracing trace_state = {.lock = PTHREAD_MUTEX_INITIALIZER};
+__attribute__((weak)) __thread struct TraceRing* trace_ring = NULL;
+
+
+#define TRACE_ON() __builtin_expect(trace_state.enabled, 0)
+
+// an array of the arguments after a placeholder 0, and how many there are
+#define TRACE_ARGS_(...) \
+	(const uint64_t[]){0, ##__VA_ARGS__}, sizeof((const uint64_t[]){0, ##__VA_ARGS__}) / sizeof(uint64_t) - 1
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+
+#define TRACE_INSTANT(name, ...) \
+	do { if (TRACE_ON()) traceEvent('i', name, TRACE_ARGS_(__VA_ARGS__)); } while (0)
+#define TRACE_COUNTER(name, value) \
+	do { if (TRACE_ON()) traceEvent('C', name, TRACE_ARGS_(value)); } while (0)
+#define TRACE_BEGIN(name, ...) \
+	do { if (TRACE_ON()) traceEvent('B', name, TRACE_ARGS_(__VA_ARGS__)); } while (0)
+#define TRACE_END(name) \
+	do { if (TRACE_ON()) traceEvent('E', name, TRACE_ARGS_()); } while (0)
+
+// from here to the end of the scope
+#define TRACE_SPAN(name, ...) \
+	const char* const TRACE_CAT(trace_span_, __LINE__) __attribute__((cleanup(traceSpanEnd), unused)) = \
+		TRACE_ON() ? traceBegin(name, TRACE_ARGS_(__VA_ARGS__)) : NULL
+
+
+static inline uint64_t traceClockNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline uint64_t traceClock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return traceClockNs();
 #endif
+}
+
+
+static inline void traceRelease(void* const ring)
+{
+	pthread_mutex_lock(&trace_state.lock);
+	((struct TraceRing*) ring)->used = false;
+	pthread_mutex_unlock(&trace_state.lock);
+}
+
+
+// the thread's first event: a ring left by an exited thread, or a new one
+static inline struct TraceRing* traceClaim(void)
+{
+	struct TraceRing* ring = NULL;
+
+	pthread_mutex_lock(&trace_state.lock);
+	for (int i = 0; i < trace_state.nrings && ring == NULL; ++i)
+		if (!trace_state.rings[i]->used)
+			ring = trace_state.rings[i];
+
+	if (ring == NULL && trace_state.nrings < TRACE_THREADS_MAX &&
+	    (ring = calloc(1, sizeof(*ring))) != NULL)
+		trace_state.rings[trace_state.nrings++] = ring;
 
+	if (ring != NULL) {
+		ring->used = true;
+		ring->tid = syscall(SYS_gettid);
+		pthread_setspecific(trace_state.key, ring);
+	}
+	pthread_mutex_unlock(&trace_state.lock);
+
+	return trace_ring = ring;
+}
+
+
+// args[0] is TRACE_ARGS_'s placeholder
+static inline void traceEvent(const char phase, const char* const name, const uint64_t* const args,
+                              const size_t nargs)
+{
+	struct TraceRing* const ring = trace_ring != NULL ? trace_ring : traceClaim();
+	if (ring == NULL)
+		return;
+
+	struct TraceEvent* const e = &ring->events[ring->head & (TRACE_EVENTS - 1)];
+	e->tsc = traceClock();
+	e->name = name;
+	e->phase = phase;
+	e->nargs = nargs < 2 ? nargs : 2;
+	e->tid = ring->tid;
+	for (size_t i = 0; i < e->nargs; ++i)
+		e->args[i] = args[i + 1];
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+
+static inline const char* traceBegin(const char* const name, const uint64_t* const args,
+                                     const size_t nargs)
+{
+	traceEvent('B', name, args, nargs);
+	return name;
+}
+
+
+// NULL when tracing was off at the start of the span
+static inline void traceSpanEnd(const char* const* const name)
+{
+	if (*name != NULL)
+		traceEvent('E', *name, NULL, 0);
+}
+
+
+static inline void traceWriteEvent(FILE* const f, const struct TraceEvent* const e,
+                                   const double ticks_per_us, const int pid, const bool first)
+{
+	fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u%s",
+	        first ? "" : ",\n", e->name, e->phase, (e->tsc - trace_state.tsc0) / ticks_per_us,
+	        pid, e->tid, e->phase == 'i' ? ",\"s\":\"t\"" : "");
+
+	if (e->phase == 'C')
+		fprintf(f, ",\"args\":{\"value\":%llu}", (unsigned long long) e->args[0]);
+	else if (e->nargs == 1)
+		fprintf(f, ",\"args\":{\"a\":%llu}", (unsigned long long) e->args[0]);
+	else if (e->nargs == 2)
+		fprintf(f, ",\"args\":{\"a\":%llu,\"b\":%llu}", (unsigned long long) e->args[0],
+		        (unsigned long long) e->args[1]);
+	fputc('}', f);
+}
+
+
+/* Writes what the rings hold now, threads keep tracing meanwhile. Events
+ * the owner may have overwritten while they were copied are left out */
+static inline bool traceExport(const char* const path)
+{
+	const uint64_t ns = traceClockNs() - trace_state.ns0;
+	const uint64_t ticks = traceClock() - trace_state.tsc0;
+	const double ticks_per_us = ns > 0 && ticks > 0 ? ticks * 1000.0 / ns : 1000.0;
+	const int pid = getpid();
+	bool first = true;
+
+	struct TraceEvent* const copy = malloc(TRACE_EVENTS * sizeof(*copy));
+	FILE* const f = fopen(path, "w");
+	if (copy == NULL || f == NULL) {
+		perror("Couldn't write the trace");
+		free(copy);
+		if (f != NULL)
+			fclose(f);
+		return false;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+	pthread_mutex_lock(&trace_state.lock);
+	for (int i = 0; i < trace_state.nrings; ++i) {
+		const struct TraceRing* const ring = trace_state.rings[i];
+		const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t begin = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+		for (uint64_t n = begin; n < head; ++n)
+			copy[n & (TRACE_EVENTS - 1)] = ring->events[n & (TRACE_EVENTS - 1)];
+
+		// the owner may be writing its next event over the oldest one copied
+		const uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+		if (now > TRACE_EVENTS && now - TRACE_EVENTS > begin)
+			begin = now - TRACE_EVENTS;
+
+		for (uint64_t n = begin; n < head; ++n, first = false)
+			traceWriteEvent(f, &copy[n & (TRACE_EVENTS - 1)], ticks_per_us, pid, first);
+	}
+	pthread_mutex_unlock(&trace_state.lock);
+	fputs("\n]}\n", f);
+
+	const bool ok = fclose(f) == 0;
+	if (!ok)
+		perror("Couldn't write the trace");
+	free(copy);
+	return ok;
+}
+
+
+/* turns tracing on when TRACE_FILE is set, terminateTracing() writes the
+ * trace there. false only when it couldn't be */
+static inline bool initializeTracing(void)
+{
+	const char* const path = getenv(TRACE_ENV);
+	if (path == NULL || path[0] == '\0' || trace_state.enabled)
+		return true;
+
+	const int err = pthread_key_create(&trace_state.key, traceRelease);
+	if (err != 0) {
+		fprintf(stderr, "Couldn't start tracing: %s\n", strerror(err));
+		return false;
+	}
+
+	trace_state.path = path;
+	trace_state.ns0 = traceClockNs();
+	trace_state.tsc0 = traceClock();
+	__atomic_store_n(&trace_state.enabled, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/* Stops tracing and writes the trace. The rings stay allocated, threads
+ * still running may be between the flag and their ring */
+static inline void terminateTracing(void)
+{
+	if (!trace_state.enabled || trace_state.exported)
+		return;
+
+	__atomic_store_n(&trace_state.enabled, false, __ATOMIC_RELEASE);
+	trace_state.exported = true;
+	traceExport(trace_state.path);
+}
+
+
+#endif
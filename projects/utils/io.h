@@ -1,23 +1,225 @@
 #ifndef UTILS_IO_H_
 #define UTILS_IO_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 
-static inline bool readInto(char* const dest, const int fdsrc, const int maxsize)
+/* Buffered input split into lines or length-prefixed frames. The buffer
+ * grows by doubling up to a limit, and is compacted only when it has to
+ * read, so the frames handed out are views into it, valid until the next
+ * call. A blocking reader reads until it has a whole frame; a nonblocking
+ * one (an event loop's) only hands out what's buffered, and its owner
+ * calls readerFill once per wakeup, which takes EAGAIN for "nothing more".
+ * One byte past the end of the data is always there to be written to.
+ * */
+#define READER_SIZE ((size_t)64 << 10)   // to start with, capped at the limit
+
+
+enum ReadStatus {
+	READ_OK,          // a frame, or readerFill() got data
+	READ_AGAIN,       // nonblocking and no whole frame buffered
+	READ_EOF,         // nothing left, a last line without '\n' comes before it
+	READ_ERROR        // errno is set, EMSGSIZE for frames past the limit
+};
+
+
+struct Reader {
+	char* buf;
+	size_t start;     // first byte not handed out
+	size_t end;       // of the data
+	size_t scan;      // start + how far there's no '\n'
+	size_t size;      // buf has one more byte
+	size_t max;       // the longest frame, or line with its '\n'
+	int fd;
+	ssize_t (*read)(void* src, void* buf, size_t len);   // instead of read(fd), like read()
+	void* src;
+	bool blocking;
+	bool eof;
+};
+
+
+struct View {
+	char* data;
+	size_t len;
+};
+
+
+/* fd's O_NONBLOCK picks how it reads. readfn, when not NULL, is called
+ * instead of read(2) on fd, and the reader counts as nonblocking */
+static inline bool initializeReader(struct Reader* const r, const int fd,
+                                    ssize_t (*readfn)(void*, void*, size_t), void* const src,
+                                    const size_t max)
 {
-	int n;
-	if ((n = read(fdsrc, dest, maxsize - 1)) <= 0) {
-		perror("read");
+	*r = (struct Reader) {
+		.size = max < READER_SIZE ? max : READER_SIZE,
+		.max = max,
+		.fd = fd,
+		.read = readfn,
+		.src = src,
+		.blocking = readfn == NULL && (fcntl(fd, F_GETFL) & O_NONBLOCK) == 0
+	};
+
+	if ((r->buf = malloc(r->size + 1)) == NULL) {
+		perror("Couldn't allocate the read buffer");
 		return false;
 	}
+	return true;
+}
 
-	if (dest[n - 1] == '\n')
-		--n;
 
-	dest[n] = '\0';
-	return true;
+static inline void terminateReader(struct Reader* const r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+
+// drops whatever is buffered, for a new stream
+static inline void readerReset(struct Reader* const r)
+{
+	r->start = r->end = r->scan = 0;
+	r->eof = false;
+}
+
+
+// the bytes not handed out yet, a frame still arriving for one
+static inline struct View readerPending(const struct Reader* const r)
+{
+	return (struct View) {.data = &r->buf[r->start], .len = r->end - r->start};
+}
+
+
+static inline void readerConsume(struct Reader* const r, const size_t n)
+{
+	r->start += n;
+	if (r->scan < r->start)
+		r->scan = r->start;
+}
+
+
+/* one read into the free space, after making some: the data is moved to
+ * the front, or the buffer doubled once it starts there */
+static inline enum ReadStatus readerFill(struct Reader* const r)
+{
+	if (r->end == r->size) {
+		if (r->start > 0) {
+			memmove(r->buf, &r->buf[r->start], r->end - r->start);
+			r->end -= r->start;
+			r->scan -= r->start;
+			r->start = 0;
+		} else if (r->size < r->max) {
+			const size_t size = r->size > r->max / 2 ? r->max : r->size * 2;
+			char* const buf = realloc(r->buf, size + 1);
+			if (buf == NULL)
+				return READ_ERROR;
+			r->buf = buf;
+			r->size = size;
+		} else {
+			errno = EMSGSIZE;
+			return READ_ERROR;
+		}
+	}
+
+	const ssize_t n = r->read != NULL ? r->read(r->src, &r->buf[r->end], r->size - r->end)
+	                                  : read(r->fd, &r->buf[r->end], r->size - r->end);
+	if (n > 0) {
+		r->end += n;
+		return READ_OK;
+	}
+
+	if (n == 0) {
+		r->eof = true;
+		return READ_EOF;
+	}
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? READ_AGAIN : READ_ERROR;
+}
+
+
+/* what the frame calls do when the buffer runs out: fill it if blocking,
+ * READ_AGAIN otherwise, READ_EOF at the end (or an error) */
+static inline enum ReadStatus readerMore(struct Reader* const r)
+{
+	if (r->eof)
+		return READ_EOF;
+	if (!r->blocking)
+		return READ_AGAIN;
+
+	enum ReadStatus status;
+	while ((status = readerFill(r)) == READ_AGAIN)
+		;
+	return status;
+}
+
+
+/* the next line, without its '\n' and with a '\0' in its place. The
+ * last one doesn't need a '\n' */
+static inline enum ReadStatus readerLine(struct Reader* const r, struct View* const line)
+{
+	for (;;) {
+		const char* const nl = memchr(&r->buf[r->scan], '\n', r->end - r->scan);
+		if (nl != NULL) {
+			line->data = &r->buf[r->start];
+			line->len = nl - line->data;
+			line->data[line->len] = '\0';
+			readerConsume(r, line->len + 1);
+			return READ_OK;
+		}
+		r->scan = r->end;
+
+		const enum ReadStatus status = readerMore(r);
+		if (status == READ_EOF && r->end > r->start) {
+			line->data = &r->buf[r->start];
+			line->len = r->end - r->start;
+			line->data[line->len] = '\0';
+			readerConsume(r, line->len);
+			return READ_OK;
+		}
+		if (status != READ_OK)
+			return status;
+	}
+}
+
+
+/* the next header and payload, length tells the payload's size from the
+ * header, SIZE_MAX when it's bad (READ_ERROR with EPROTO) */
+static inline enum ReadStatus readerFrame(struct Reader* const r, const size_t header,
+                                          size_t (*length)(const char* header),
+                                          struct View* const frame)
+{
+	for (;;) {
+		const size_t have = r->end - r->start;
+		if (have >= header) {
+			const size_t len = length(&r->buf[r->start]);
+			if (len == SIZE_MAX) {
+				errno = EPROTO;
+				return READ_ERROR;
+			}
+			if (len > r->max - header) {
+				errno = EMSGSIZE;
+				return READ_ERROR;
+			}
+			if (have >= header + len) {
+				frame->data = &r->buf[r->start];
+				frame->len = header + len;
+				readerConsume(r, frame->len);
+				return READ_OK;
+			}
+		}
+
+		const enum ReadStatus status = readerMore(r);
+		if (status == READ_EOF && have > 0) {
+			errno = EPROTO;   // cut short
+			return READ_ERROR;
+		}
+		if (status != READ_OK)
+			return status;
+	}
 }
 
 
@@ -31,10 +233,23 @@ static inline bool writeInto(const int fd_dest, const char* const src)
 }
 
 
+/* Lines typed (or piped) ahead are kept for the next question. dest is
+ * empty at the end of the input */
 static inline void askUserFor(const char* const msg, char* const dest, const int size)
 {
+	static struct Reader input = {.buf = NULL};
+	struct View line;
+
+	dest[0] = '\0';
 	writeInto(STDOUT_FILENO, msg);
-	readInto(dest, STDIN_FILENO, size);
+	if (input.buf == NULL && !initializeReader(&input, STDIN_FILENO, NULL, NULL, (size_t) 1 << 20))
+		return;
+
+	const enum ReadStatus status = readerLine(&input, &line);
+	if (status == READ_ERROR)
+		perror("Couldn't read the answer");
+	else if (status == READ_OK)
+		snprintf(dest, size, "%s", line.data);
 }
 
 
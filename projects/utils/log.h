@@ -0,0 +1,742 @@
+#ifndef UTILS_LOG_H_
+#define UTILS_LOG_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "myprintf.h"
+
+
+/* Asynchronous logging on top of myprintf. A MYLOG() call doesn't format
+ * anything: it copies the format's precompiled descriptor and the raw
+ * arguments into a ring of its own thread, strings included since they
+ * may be gone by the time they're printed. The logging thread formats
+ * the records and writes them out in batches, up to LOG_BLOCKS blocks
+ * per writev(2). Each ring has a single producer and a single consumer,
+ * so neither side takes a lock or makes a syscall, except a thread's
+ * first call, which claims its ring. When a ring is full the record is
+ * dropped or the caller waits for room, as initializeLogging() was told.
+ * A record bigger than a block is formatted by the caller instead, and
+ * whatever can't fit a block ends in LOG_CUT_MARK. With nothing to do
+ * the logging thread sleeps on a futex; a call wakes it only when it
+ * finds its ring was empty and the thread asleep.
+ * The state lives in weak symbols, so all the files of a program that
+ * include this share the one logger.
+ * */
+#define LOG_RING_SIZE   ((uint32_t)1 << 16)  // bytes per thread, a power of two
+#define LOG_THREADS_MAX ((int)64)            // threads logging at the same time
+#define LOG_ARGS_MAX    ((int)(FMT_OPS_MAX * 3))  // every conversion with a * width and precision
+#define LOG_BLOCKS      ((int)16)
+#define LOG_BLOCK_SIZE  ((size_t)16384)      // the longest line, and record, written
+#define LOG_CUT_MARK    "[...]\n"            // ends a line cut to LOG_BLOCK_SIZE
+
+
+enum LogPolicy {
+	LOG_POLICY_DROP,    // a full ring loses the record, the caller never waits
+	LOG_POLICY_BLOCK    // the caller waits until the logging thread makes room
+};
+
+
+enum LogRecordKind {
+	LOG_RECORD_FORMAT,  // count arguments and their strings
+	LOG_RECORD_TEXT,    // count bytes, already formatted
+	LOG_RECORD_WRAP     // the rest of the ring is unused, go on from its start
+};
+
+
+struct LogRecord {
+	uint32_t size;      // the whole record, a multiple of 8
+	uint16_t kind;      // enum LogRecordKind
+	uint16_t count;
+	const struct FmtCompiled* fmt;
+};
+
+
+enum LogRingState {
+	LOG_RING_FREE,
+	LOG_RING_USED,
+	LOG_RING_RETIRED    // its thread is gone, free again once drained
+};
+
+
+struct LogRing {
+	// written by the producer
+	uint64_t head;          // bytes ever written, published with each record
+	uint64_t tail_seen;     // tail when the producer last looked
+	uint64_t calls;
+	uint64_t dropped;
+	uint64_t waited;
+	uint64_t ns_total;
+	uint64_t ns_max;
+	uint64_t ns_hist[64];   // calls by the bit length of their latency
+	// written by the logging thread
+	uint64_t tail __attribute__((aligned(64)));   // bytes ever consumed
+	int state;              // enum LogRingState
+	char data[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+
+struct LogStats {
+	uint64_t calls;         // records that made it into a ring
+	uint64_t dropped;       // full ring with LOG_POLICY_DROP, or no ring left
+	uint64_t waited;        // full ring with LOG_POLICY_BLOCK
+	uint64_t ns_avg;        // producer latency per call
+	uint64_t ns_max;
+	uint64_t ns_p50;        // upper bounds, to a power of two
+	uint64_t ns_p99;
+};
+
+
+struct Logging {
+	bool running;
+	bool stop;
+	enum LogPolicy policy;
+	int fd;
+	bool own_fd;
+	int generation;         // bumped by every initializeLogging()
+	uint64_t lost;          // calls from threads that got no ring
+	uint64_t flush_req;
+	uint64_t flush_done;
+	uint32_t sleeping;      // futex, 1 while the logging thread waits for work
+	uint32_t flushed;       // futex, bumped when flush_done moves
+	pthread_t thread;
+	pthread_key_t key;      // retires a thread's ring when it exits
+	pthread_mutex_t lock;   // handing out new rings
+	struct LogRing* rings[LOG_THREADS_MAX];
+	int nrings;
+	// the logging thread's output
+	char* blocks;           // LOG_BLOCKS of LOG_BLOCK_SIZE
+	size_t lens[LOG_BLOCKS];
+	int cur;
+	bool failed;            // a write failed, reported once
+};
+
+
+struct LogThread {
+	struct LogRing* ring;
+	int generation;         // of the logger the ring belongs to
+};
+
+
+__attribute__((weak)) struct Logging log_state = { .lock = PTHREAD_MUTEX_INITIALIZER };
+__attribute__((weak)) __thread struct LogThread log_thread;
+
+
+static inline struct Logging* logState(void)
+{
+	return &log_state;
+}
+
+
+static inline struct LogThread* logThread(void)
+{
+	return &log_thread;
+}
+
+
+static inline uint64_t logClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+
+static inline void logFutexWait(uint32_t* const word, const uint32_t val)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+
+static inline void logFutexWake(uint32_t* const word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+
+// wakes the logging thread if it's asleep, a syscall only then
+static inline void logWake(void)
+{
+	struct Logging* const logging = logState();
+	if (__atomic_load_n(&logging->sleeping, __ATOMIC_SEQ_CST) != 0 &&
+	    __atomic_exchange_n(&logging->sleeping, 0, __ATOMIC_SEQ_CST) != 0)
+		logFutexWake(&logging->sleeping);
+}
+
+
+// the producer is the only writer of its counters, others only read them
+static inline void logBump(uint64_t* const counter, const uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+static inline void logRetire(void* const ring)
+{
+	__atomic_store_n(&((struct LogRing*) ring)->state, LOG_RING_RETIRED, __ATOMIC_RELEASE);
+}
+
+
+/* the calling thread's ring, claimed on its first call: one a finished
+ * thread left or a new one. NULL if all LOG_THREADS_MAX are taken */
+static inline struct LogRing* logRing(void)
+{
+	struct Logging* const logging = logState();
+	struct LogThread* const self = logThread();
+	if (self->ring != NULL && self->generation == logging->generation)
+		return self->ring;
+
+	struct LogRing* ring = NULL;
+	pthread_mutex_lock(&logging->lock);
+	for (int i = 0; i < logging->nrings && ring == NULL; ++i) {
+		int state = LOG_RING_FREE;
+		if (__atomic_compare_exchange_n(&logging->rings[i]->state, &state, LOG_RING_USED, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			ring = logging->rings[i];
+	}
+
+	if (ring == NULL && logging->nrings < LOG_THREADS_MAX &&
+	    (ring = aligned_alloc(64, sizeof(*ring))) != NULL) {
+		memset(ring, 0, offsetof(struct LogRing, data));
+		ring->state = LOG_RING_USED;
+		logging->rings[logging->nrings] = ring;
+		__atomic_store_n(&logging->nrings, logging->nrings + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&logging->lock);
+
+	if (ring != NULL) {
+		pthread_setspecific(logging->key, ring);
+		self->ring = ring;
+		self->generation = logging->generation;
+	}
+	return ring;
+}
+
+
+/* room for a record of size bytes, NULL if it must be dropped. The
+ * record is published by logCommit() */
+static inline struct LogRecord* logReserve(struct LogRing* const ring, const uint32_t size)
+{
+	const struct Logging* const logging = logState();
+	const uint32_t off = ring->head & (LOG_RING_SIZE - 1);
+	const uint32_t pad = off + size > LOG_RING_SIZE ? LOG_RING_SIZE - off : 0;
+	const uint64_t end = ring->head + pad + size;
+	bool waited = false;
+
+	while (end - ring->tail_seen > LOG_RING_SIZE) {
+		ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (end - ring->tail_seen <= LOG_RING_SIZE)
+			break;
+		if (logging->policy == LOG_POLICY_DROP || !__atomic_load_n(&logging->running, __ATOMIC_RELAXED)) {
+			logBump(&ring->dropped, 1);
+			return NULL;
+		}
+		if (!waited) {
+			waited = true;
+			logBump(&ring->waited, 1);
+		}
+		sched_yield();
+	}
+
+	if (pad > 0) {
+		struct LogRecord* const wrap = (struct LogRecord*) &ring->data[off];
+		wrap->size = pad;
+		wrap->kind = LOG_RECORD_WRAP;
+	}
+
+	return (struct LogRecord*) &ring->data[(ring->head + pad) & (LOG_RING_SIZE - 1)];
+}
+
+
+static inline void logCommit(struct LogRing* const ring, const struct LogRecord* const rec)
+{
+	// a wrap marker in front of the record goes out with it
+	const uint32_t off = ring->head & (LOG_RING_SIZE - 1);
+	const uint32_t pad = (const char*) rec == &ring->data[off] ? 0 : LOG_RING_SIZE - off;
+	const uint64_t head = ring->head;
+	__atomic_store_n(&ring->head, head + pad + rec->size, __ATOMIC_SEQ_CST);
+
+	// a ring that had something already is seen before the thread sleeps
+	if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+		logWake();
+}
+
+
+// the latency of one call, ns after start
+static inline void logObserve(struct LogRing* const ring, const uint64_t start)
+{
+	const uint64_t ns = logClock() - start;
+	logBump(&ring->calls, 1);
+	logBump(&ring->ns_total, ns);
+	if (ns > ring->ns_max)
+		__atomic_store_n(&ring->ns_max, ns, __ATOMIC_RELAXED);
+	logBump(&ring->ns_hist[63 - __builtin_clzll(ns | 1)], 1);
+}
+
+
+// a cut line keeps LOG_CUT_MARK at its end
+static inline void logMarkCut(char* const line, const size_t len)
+{
+	memcpy(&line[len - (sizeof(LOG_CUT_MARK) - 1)], LOG_CUT_MARK, sizeof(LOG_CUT_MARK) - 1);
+}
+
+
+/* formats the record here, for formats that can't be compiled and records
+ * too big to pass raw. false if it was dropped */
+static inline bool logText(struct LogRing* const ring, const char* const fmt, va_list args)
+{
+	va_list ap;
+	va_copy(ap, args);
+	const int total = myvsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	const size_t len = total < 0 ? 0 : (size_t) total < LOG_BLOCK_SIZE ? (size_t) total : LOG_BLOCK_SIZE;
+	// one more byte for myvsnprintf's '\0'
+	const uint32_t size = (sizeof(struct LogRecord) + len + 1 + 7) & ~(uint32_t)7;
+	struct LogRecord* const rec = logReserve(ring, size);
+	if (rec == NULL)
+		return false;
+
+	rec->size = size;
+	rec->kind = LOG_RECORD_TEXT;
+	rec->count = len;
+	myvsnprintf((char*)(rec + 1), len + 1, fmt, args);
+	if (len < (size_t) total)
+		logMarkCut((char*)(rec + 1), len);
+
+	logCommit(ring, rec);
+	return true;
+}
+
+
+static inline void logvWrite(struct FmtCompiled* const c, const char* const fmt, va_list args)
+{
+	struct Logging* const logging = logState();
+	if (!__atomic_load_n(&logging->running, __ATOMIC_ACQUIRE))
+		return;
+
+	const uint64_t start = logClock();
+	struct LogRing* const ring = logRing();
+	if (ring == NULL) {
+		__atomic_add_fetch(&logging->lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct LogRecord* rec;
+	if (!fmtCompiledReady(c, fmt)) {
+		if (logText(ring, fmt, args))
+			logObserve(ring, start);
+		return;
+	}
+
+	// the arguments as the conversions take them, * ones first
+	union FmtArg argv[LOG_ARGS_MAX];
+	const char* strs[FMT_OPS_MAX];
+	size_t lens[FMT_OPS_MAX];
+	int nargs = 0, nstrs = 0;
+	size_t size = sizeof(*rec);
+	va_list ap;
+	va_copy(ap, args);
+
+	for (const struct FmtOp* op = c->ops; op < &c->ops[c->nops]; ++op) {
+		if (op->kind == FMT_OP_LITERAL)
+			continue;
+
+		int prec = op->spec.prec;
+		if (op->spec.width == -2)
+			argv[nargs++].i = va_arg(ap, int);
+		if (op->spec.prec == -2)
+			argv[nargs++].i = prec = va_arg(ap, int);
+
+		const union FmtArg arg = argv[nargs++] = fmtFetchArg(&op->spec, &ap);
+		if (op->spec.conv == 's' && arg.s != NULL) {
+			strs[nstrs] = arg.s;
+			lens[nstrs] = prec >= 0 ? strnlen(arg.s, prec) : strlen(arg.s);
+			size += lens[nstrs++] + 1;
+		}
+	}
+	va_end(ap);
+
+	size = (size + nargs * sizeof(union FmtArg) + 7) & ~(size_t)7;
+	if (size > LOG_BLOCK_SIZE) {
+		if (logText(ring, fmt, args))
+			logObserve(ring, start);
+		return;
+	}
+	if ((rec = logReserve(ring, size)) == NULL)
+		return;
+
+	rec->size = size;
+	rec->kind = LOG_RECORD_FORMAT;
+	rec->count = nargs;
+	rec->fmt = c;
+	memcpy(rec + 1, argv, nargs * sizeof(union FmtArg));
+	char* dest = (char*)(rec + 1) + nargs * sizeof(union FmtArg);
+	for (int i = 0; i < nstrs; ++i) {
+		memcpy(dest, strs[i], lens[i]);
+		dest[lens[i]] = '\0';
+		dest += lens[i] + 1;
+	}
+
+	logCommit(ring, rec);
+	logObserve(ring, start);
+}
+
+
+static inline void logWrite(struct FmtCompiled* const c, const char* const fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static inline void logWrite(struct FmtCompiled* const c, const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	logvWrite(c, fmt, args);
+	va_end(args);
+}
+
+
+/* fmt must be a string literal (or live as long as the program) */
+#define MYLOG(fmt, ...) \
+	do { static struct FmtCompiled fmtc_; logWrite(&fmtc_, fmt, ##__VA_ARGS__); } while (0)
+
+
+/* the logging thread's side: formats a record like myvfprintfc() would
+ * have, from the arguments it took */
+static inline void logFormat(struct MyStream* const s, const struct LogRecord* const rec)
+{
+	if (rec->kind == LOG_RECORD_TEXT) {
+		fmtPut(s, (const char*)(rec + 1), rec->count);
+		return;
+	}
+
+	const union FmtArg* arg = (const union FmtArg*)(rec + 1);
+	const char* str = (const char*)(arg + rec->count);
+	const struct FmtCompiled* const c = rec->fmt;
+
+	for (const struct FmtOp* op = c->ops; op < &c->ops[c->nops]; ++op) {
+		fmtPut(s, op->lit, op->lit_len);
+		if (op->kind == FMT_OP_LITERAL)
+			continue;
+
+		struct FmtSpec spec = op->spec;
+		if (spec.width == -2) {
+			spec.width = (int) (arg++)->i;
+			if (spec.width < 0) {
+				spec.flags |= FMT_LEFT;
+				spec.width = -spec.width;
+			}
+		}
+		if (spec.prec == -2) {
+			spec.prec = (int) (arg++)->i;
+			if (spec.prec < 0)
+				spec.prec = -1;
+		}
+
+		union FmtArg val = *arg++;
+		if (spec.conv == 's' && val.s != NULL) {
+			val.s = str;
+			str += strlen(str) + 1;
+		}
+		fmtConvert(s, &spec, val);
+	}
+}
+
+
+static inline void logFlushBlocks(void)
+{
+	struct Logging* const logging = logState();
+	struct iovec iov[LOG_BLOCKS];
+	int n = 0;
+
+	for (int i = 0; i < LOG_BLOCKS && logging->lens[i] > 0; ++i) {
+		iov[n].iov_base = &logging->blocks[i * LOG_BLOCK_SIZE];
+		iov[n++].iov_len = logging->lens[i];
+		logging->lens[i] = 0;
+	}
+	logging->cur = 0;
+
+	for (struct iovec* v = iov; n > 0; ) {
+		ssize_t done = writev(logging->fd, v, n);
+		if (done == -1) {
+			if (errno == EINTR)
+				continue;
+			if (!logging->failed)
+				perror("Couldn't write log");
+			logging->failed = true;
+			return;
+		}
+
+		for (; n > 0 && (size_t) done >= v->iov_len; --n, ++v)
+			done -= v->iov_len;
+		if (n > 0) {
+			v->iov_base = (char*) v->iov_base + done;
+			v->iov_len -= done;
+		}
+	}
+}
+
+
+// formats a record at the end of the current block, or in the next one
+static inline void logEmit(const struct LogRecord* const rec)
+{
+	struct Logging* const logging = logState();
+
+	for (;;) {
+		size_t* const len = &logging->lens[logging->cur];
+		struct MyStream s;
+		myStreamInit(&s, -1, &logging->blocks[logging->cur * LOG_BLOCK_SIZE + *len], LOG_BLOCK_SIZE - *len);
+		logFormat(&s, rec);
+		if (s.total == s.len || *len == 0) {
+			if (s.total != s.len)
+				logMarkCut(s.buf, s.len);
+			*len += s.len;
+			return;
+		}
+
+		if (++logging->cur == LOG_BLOCKS)
+			logFlushBlocks();
+	}
+}
+
+
+// formats what the ring has, returns false if it had nothing
+static inline bool logDrain(struct LogRing* const ring)
+{
+	const int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+	const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+
+	if (tail == head) {
+		if (state == LOG_RING_RETIRED)
+			__atomic_store_n(&ring->state, LOG_RING_FREE, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	while (tail != head) {
+		const struct LogRecord* const rec =
+			(const struct LogRecord*) &ring->data[tail & (LOG_RING_SIZE - 1)];
+		if (rec->kind != LOG_RECORD_WRAP)
+			logEmit(rec);
+		tail += rec->size;
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+// whether a producer, a flush or terminateLogging() has something for us
+static inline bool logHasWork(void)
+{
+	struct Logging* const logging = logState();
+	if (__atomic_load_n(&logging->stop, __ATOMIC_SEQ_CST) ||
+	    __atomic_load_n(&logging->flush_req, __ATOMIC_SEQ_CST) !=
+	    __atomic_load_n(&logging->flush_done, __ATOMIC_RELAXED))
+		return true;
+
+	const int nrings = __atomic_load_n(&logging->nrings, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nrings; ++i) {
+		const struct LogRing* const ring = logging->rings[i];
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail ||
+		    __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == LOG_RING_RETIRED)
+			return true;
+	}
+	return false;
+}
+
+
+/* Sleeping is announced before looking for work one last time, and a
+ * producer publishes before looking for a sleeper, so one of the two
+ * always sees the other */
+static inline void logSleep(void)
+{
+	struct Logging* const logging = logState();
+	__atomic_store_n(&logging->sleeping, 1, __ATOMIC_SEQ_CST);
+	while (!logHasWork() && __atomic_load_n(&logging->sleeping, __ATOMIC_SEQ_CST) != 0)
+		logFutexWait(&logging->sleeping, 1);
+	__atomic_store_n(&logging->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+
+static inline void* logMain(void* const arg)
+{
+	((void)arg);
+	struct Logging* const logging = logState();
+
+	for (;;) {
+		const bool stop = __atomic_load_n(&logging->stop, __ATOMIC_ACQUIRE);
+		const uint64_t req = __atomic_load_n(&logging->flush_req, __ATOMIC_ACQUIRE);
+		const int nrings = __atomic_load_n(&logging->nrings, __ATOMIC_ACQUIRE);
+		bool busy = false;
+
+		for (int i = 0; i < nrings; ++i)
+			busy |= logDrain(logging->rings[i]);
+
+		if (logging->lens[0] > 0)
+			logFlushBlocks();
+		if (req != logging->flush_done) {
+			__atomic_store_n(&logging->flush_done, req, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&logging->flushed, 1, __ATOMIC_SEQ_CST);
+			logFutexWake(&logging->flushed);
+		}
+
+		if (!busy) {
+			if (stop)
+				break;
+			logSleep();
+		}
+	}
+
+	return NULL;
+}
+
+
+/* returns once everything logged before the call is written out */
+static inline void logFlush(void)
+{
+	struct Logging* const logging = logState();
+	if (!logging->running)
+		return;
+
+	const uint64_t req = __atomic_add_fetch(&logging->flush_req, 1, __ATOMIC_SEQ_CST);
+	logWake();
+	for (;;) {
+		const uint32_t flushed = __atomic_load_n(&logging->flushed, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&logging->flush_done, __ATOMIC_ACQUIRE) >= req)
+			break;
+		logFutexWait(&logging->flushed, flushed);
+	}
+}
+
+
+static inline void logStats(struct LogStats* const stats)
+{
+	struct Logging* const logging = logState();
+	uint64_t hist[64] = { 0 };
+	uint64_t ns_total = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->dropped = __atomic_load_n(&logging->lost, __ATOMIC_RELAXED);
+
+	const int nrings = __atomic_load_n(&logging->nrings, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nrings; ++i) {
+		const struct LogRing* const ring = logging->rings[i];
+		stats->calls += __atomic_load_n(&ring->calls, __ATOMIC_RELAXED);
+		stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		stats->waited += __atomic_load_n(&ring->waited, __ATOMIC_RELAXED);
+		ns_total += __atomic_load_n(&ring->ns_total, __ATOMIC_RELAXED);
+		const uint64_t ns_max = __atomic_load_n(&ring->ns_max, __ATOMIC_RELAXED);
+		if (ns_max > stats->ns_max)
+			stats->ns_max = ns_max;
+		for (int b = 0; b < 64; ++b)
+			hist[b] += __atomic_load_n(&ring->ns_hist[b], __ATOMIC_RELAXED);
+	}
+
+	if (stats->calls == 0)
+		return;
+
+	stats->ns_avg = ns_total / stats->calls;
+	uint64_t seen = 0;
+	for (int b = 0; b < 64; ++b) {
+		seen += hist[b];
+		const uint64_t bound = b < 63 ? (uint64_t)2 << b : UINT64_MAX;
+		if (stats->ns_p50 == 0 && seen * 2 >= stats->calls)
+			stats->ns_p50 = bound;
+		if (stats->ns_p99 == 0 && seen * 100 >= stats->calls * 99)
+			stats->ns_p99 = bound;
+	}
+}
+
+
+/* starts the logging thread, writing to path (appended to) or to stdout
+ * if it's NULL. Calls made before this or after terminateLogging() are
+ * ignored */
+static inline bool initializeLogging(const char* const path, const enum LogPolicy policy)
+{
+	struct Logging* const logging = logState();
+	if (logging->running)
+		return true;
+
+	logging->fd = path != NULL ? open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644) : STDOUT_FILENO;
+	if (logging->fd == -1) {
+		perror(path);
+		return false;
+	}
+
+	logging->own_fd = path != NULL;
+	logging->policy = policy;
+	logging->stop = false;
+	logging->failed = false;
+	logging->lost = 0;
+	logging->flush_req = logging->flush_done = 0;
+	logging->sleeping = logging->flushed = 0;
+	logging->cur = 0;
+	memset(logging->lens, 0, sizeof(logging->lens));
+	++logging->generation;
+
+	int error;
+	if ((logging->blocks = malloc(LOG_BLOCKS * LOG_BLOCK_SIZE)) == NULL) {
+		perror("Couldn't allocate log buffers");
+		goto Lclose_fd;
+	}
+
+	if ((error = pthread_key_create(&logging->key, logRetire)) != 0) {
+		fprintf(stderr, "Couldn't create log thread key: %s\n", strerror(error));
+		goto Lfree_blocks;
+	}
+
+	if ((error = pthread_create(&logging->thread, NULL, logMain, NULL)) != 0) {
+		fprintf(stderr, "Couldn't start logging thread: %s\n", strerror(error));
+		goto Ldelete_key;
+	}
+
+	__atomic_store_n(&logging->running, true, __ATOMIC_RELEASE);
+	return true;
+
+Ldelete_key:
+	pthread_key_delete(logging->key);
+Lfree_blocks:
+	free(logging->blocks);
+Lclose_fd:
+	if (logging->own_fd)
+		close(logging->fd);
+	return false;
+}
+
+
+/* writes out what's left and stops the logging thread. The other
+ * threads must be done logging by then */
+static inline void terminateLogging(void)
+{
+	struct Logging* const logging = logState();
+	if (!logging->running)
+		return;
+
+	__atomic_store_n(&logging->running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&logging->stop, true, __ATOMIC_SEQ_CST);
+	logWake();
+	pthread_join(logging->thread, NULL);
+
+	// no destructor may touch the rings once they're freed
+	pthread_key_delete(logging->key);
+	for (int i = 0; i < logging->nrings; ++i)
+		free(logging->rings[i]);
+	logging->nrings = 0;
+
+	free(logging->blocks);
+	if (logging->own_fd)
+		close(logging->fd);
+}
+
+
+#endif
@@ -0,0 +1,1247 @@
+#ifndef UTILS_MYPRINTF_H_
+#define UTILS_MYPRINTF_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "numconv.h"
+
+
+/* A printf that formats into a stream buffer and writes it out with
+ * a single write(2) when it's full or flushed, instead of one per piece.
+ * Output matches glibc's printf byte for byte for the conversions below:
+ *   flags  - + space # 0, width and precision (also as *)
+ *   length hh h l ll j z t
+ *   conv   d i u o x X c s p f F e E g G %
+ * Floating point is converted exactly, from the binary value, and rounded
+ * to nearest-even like glibc does in the default rounding mode. Anything
+ * else (%n, %a, wide strings, L) is copied to the output as it is.
+ * */
+#define MYPRINTF_BUFSIZE ((size_t)8192)
+
+#define FMT_LEFT  ((int)0x01)   // '-'
+#define FMT_PLUS  ((int)0x02)   // '+'
+#define FMT_SPACE ((int)0x04)   // ' '
+#define FMT_ALT   ((int)0x08)   // '#'
+#define FMT_ZERO  ((int)0x10)   // '0'
+
+
+struct MyStream {
+	char* buf;
+	size_t size;     // capacity of buf
+	size_t len;      // bytes waiting in buf
+	size_t total;    // bytes the current call produced, written or not
+	int fd;          // -1 for a string, what doesn't fit is dropped
+	bool error;      // a write failed, errno tells why
+};
+
+
+enum FmtLength {
+	FMT_LEN_NONE,
+	FMT_LEN_HH,
+	FMT_LEN_H,
+	FMT_LEN_L,
+	FMT_LEN_LL,
+	FMT_LEN_J,
+	FMT_LEN_Z,
+	FMT_LEN_T
+};
+
+
+/* a parsed conversion, width and prec are -1 when not given
+ * and -2 when they come from the arguments (*) */
+struct FmtSpec {
+	int flags;
+	int width;
+	int prec;
+	uint8_t length;   // enum FmtLength
+	char conv;
+};
+
+
+union FmtArg {
+	intmax_t i;
+	uintmax_t u;
+	double f;
+	const char* s;
+	const void* p;
+};
+
+
+static inline void myStreamInit(struct MyStream* const s, const int fd, char* const buf,
+                                const size_t size)
+{
+	s->buf = buf;
+	s->size = size;
+	s->len = 0;
+	s->total = 0;
+	s->fd = fd;
+	s->error = false;
+}
+
+
+static inline bool myflush(struct MyStream* const s)
+{
+	size_t pos = 0;
+	while (s->fd != -1 && pos < s->len && !s->error) {
+		const ssize_t n = write(s->fd, &s->buf[pos], s->len - pos);
+		if (n == -1 && errno != EINTR)
+			s->error = true;
+		else if (n > 0)
+			pos += n;
+	}
+
+	s->len = 0;
+	return !s->error;
+}
+
+
+static inline void fmtPut(struct MyStream* const s, const char* src, size_t n)
+{
+	s->total += n;
+	while (n > 0) {
+		if (s->len == s->size) {
+			if (s->fd == -1)
+				return;
+			myflush(s);
+		}
+
+		const size_t room = s->size - s->len;
+		const size_t chunk = n < room ? n : room;
+		memcpy(&s->buf[s->len], src, chunk);
+		s->len += chunk;
+		src += chunk;
+		n -= chunk;
+	}
+}
+
+
+static inline void fmtPad(struct MyStream* const s, const char c, size_t n)
+{
+	s->total += n;
+	while (n > 0) {
+		if (s->len == s->size) {
+			if (s->fd == -1)
+				return;
+			myflush(s);
+		}
+
+		const size_t room = s->size - s->len;
+		const size_t chunk = n < room ? n : room;
+		memset(&s->buf[s->len], c, chunk);
+		s->len += chunk;
+		n -= chunk;
+	}
+}
+
+
+/* lays out [prefix][zeros][body][suffix_zeros][suffix] in a field of
+ * spec->width, where zeros pad the number itself (precision) */
+static inline void fmtField(struct MyStream* const s, const struct FmtSpec* const spec,
+                            const char* const prefix, const size_t prefix_len, size_t zeros,
+                            const char* const body, const size_t body_len,
+                            const size_t body_zeros, const char* const suffix,
+                            const size_t suffix_len, const bool zero_pad)
+{
+	const size_t len = prefix_len + zeros + body_len + body_zeros + suffix_len;
+	const size_t width = spec->width > 0 ? (size_t) spec->width : 0;
+	const size_t pad = width > len ? width - len : 0;
+
+	if ((spec->flags & FMT_LEFT) == 0) {
+		if (zero_pad)
+			zeros += pad;
+		else
+			fmtPad(s, ' ', pad);
+	}
+
+	fmtPut(s, prefix, prefix_len);
+	fmtPad(s, '0', zeros);
+	fmtPut(s, body, body_len);
+	fmtPad(s, '0', body_zeros);
+	fmtPut(s, suffix, suffix_len);
+
+	if ((spec->flags & FMT_LEFT) != 0)
+		fmtPad(s, ' ', pad);
+}
+
+
+static inline void fmtString(struct MyStream* const s, const struct FmtSpec* const spec,
+                             const char* const str, const size_t len)
+{
+	fmtField(s, spec, "", 0, 0, str, len, 0, "", 0, false);
+}
+
+
+static inline char* fmtDigits(char* end, uintmax_t u, const unsigned base, const bool upper)
+{
+	if (base == 10)
+		return numToDecBackward(end, u);
+	if (base == 16)
+		return numToHexBackward(end, u, upper);
+
+	do {
+		*--end = (char)('0' + (u & 7));
+		u >>= 3;
+	} while (u != 0);
+	return end;
+}
+
+
+static inline void fmtInteger(struct MyStream* const s, const struct FmtSpec* const spec,
+                              const uintmax_t mag, const bool neg)
+{
+	char buf[3 * sizeof(uintmax_t) + 1];
+	char* const end = &buf[sizeof(buf)];
+	char prefix[3];   // "+0x" for %+p
+	size_t prefix_len = 0;
+	const bool is_signed = spec->conv == 'd' || spec->conv == 'i' || spec->conv == 'p';
+	unsigned base = 10;
+
+	if (spec->conv == 'o')
+		base = 8;
+	else if (spec->conv == 'x' || spec->conv == 'X' || spec->conv == 'p')
+		base = 16;
+
+	char* begin = end;
+	if (mag != 0 || spec->prec != 0)
+		begin = fmtDigits(end, mag, base, spec->conv == 'X');
+
+	if (is_signed && neg)
+		prefix[prefix_len++] = '-';
+	else if (is_signed && (spec->flags & FMT_PLUS) != 0)
+		prefix[prefix_len++] = '+';
+	else if (is_signed && (spec->flags & FMT_SPACE) != 0)
+		prefix[prefix_len++] = ' ';
+
+	if ((spec->flags & FMT_ALT) != 0 && base == 16 && mag != 0) {
+		prefix[prefix_len++] = '0';
+		prefix[prefix_len++] = spec->conv == 'X' ? 'X' : 'x';
+	}
+
+	size_t len = end - begin;
+	size_t zeros = spec->prec > 0 && (size_t) spec->prec > len ? spec->prec - len : 0;
+	// the alternate octal form makes sure it starts with a 0
+	if ((spec->flags & FMT_ALT) != 0 && base == 8 && zeros == 0 && (len == 0 || *begin != '0'))
+		zeros = 1;
+
+	const bool zero_pad = (spec->flags & (FMT_ZERO|FMT_LEFT)) == FMT_ZERO && spec->prec < 0;
+	fmtField(s, spec, prefix, prefix_len, zeros, begin, len, 0, "", 0, zero_pad);
+}
+
+
+/* Exact decimal expansion of a double's magnitude m * 2^e. The integer
+ * part is written out in full, up to 309 digits; the fraction F / 2^k,
+ * k <= 1074, yields nine digits per multiplication by 10^9 and always ends,
+ * after at most k digits. What's left of it after the last digit taken
+ * decides the rounding.
+ * */
+#define FMT_WORDS      ((int)36)     // 32-bit words, enough for 2^1074 and 2^1024
+#define FMT_DIGITS_MAX ((int)1500)   // integer digits + every fraction digit there can be
+
+
+struct FmtDecimal {
+	uint32_t frac[FMT_WORDS];   // F, least significant word first
+	int nwords;
+	int low;                    // words below it are zero
+	int k;                      // F < 2^k
+	char digits[FMT_DIGITS_MAX];
+	int nint;                   // integer digits, none if the value is < 1
+	int len;                    // digits so far, integer and fraction
+};
+
+
+static inline void fmtDecimalInit(struct FmtDecimal* const d, const double v)
+{
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+
+	const int bexp = (int)((bits >> 52) & 0x7FF);
+	uint64_t m = bits & (((uint64_t)1 << 52) - 1);
+	int e = -1074;
+	if (bexp != 0) {
+		m |= (uint64_t)1 << 52;
+		e = bexp - 1075;
+	}
+
+	d->len = 0;
+	d->nint = 0;
+	d->k = 0;
+	d->nwords = 0;
+	d->low = 0;
+
+	uint32_t big[FMT_WORDS];
+	int nbig = 0;
+	if (e >= 0) {
+		// m << e, no fraction at all
+		memset(big, 0, sizeof(big));
+		const int word = e / 32, shift = e % 32;
+		big[word] = (uint32_t)(m << shift);
+		big[word + 1] = (uint32_t)((m << shift) >> 32);
+		big[word + 2] = shift > 0 ? (uint32_t)(m >> (64 - shift)) : 0;
+		nbig = word + 3;
+	} else {
+		d->k = -e;
+		const uint64_t ipart = d->k < 64 ? m >> d->k : 0;
+		const uint64_t fpart = d->k < 64 ? m & (((uint64_t)1 << d->k) - 1) : m;
+		big[0] = (uint32_t) ipart;
+		big[1] = (uint32_t)(ipart >> 32);
+		nbig = 2;
+		d->nwords = (d->k + 31) / 32;
+		memset(d->frac, 0, sizeof(d->frac));
+		d->frac[0] = (uint32_t) fpart;
+		d->frac[1] = (uint32_t)(fpart >> 32);
+		while (d->low < d->nwords && d->frac[d->low] == 0)
+			++d->low;
+	}
+
+	// the integer part, 9 digits per division by 10^9, least significant first
+	while (nbig > 0 && big[nbig - 1] == 0)
+		--nbig;
+
+	char tmp[FMT_DIGITS_MAX];
+	int ntmp = 0;
+	while (nbig > 0) {
+		uint64_t rem = 0;
+		for (int i = nbig - 1; i >= 0; --i) {
+			const uint64_t cur = (rem << 32) | big[i];
+			big[i] = (uint32_t)(cur / 1000000000u);
+			rem = cur % 1000000000u;
+		}
+		while (nbig > 0 && big[nbig - 1] == 0)
+			--nbig;
+		for (int i = 0; i < 9 && (nbig > 0 || rem != 0); ++i) {
+			tmp[ntmp++] = (char)('0' + rem % 10);
+			rem /= 10;
+		}
+	}
+
+	for (int i = ntmp - 1; i >= 0; --i)
+		d->digits[d->len++] = tmp[i];
+	d->nint = d->len;
+}
+
+
+static inline bool fmtFracZero(const struct FmtDecimal* const d)
+{
+	return d->low >= d->nwords;
+}
+
+
+/* the next 9 fraction digits as one number, one multiplication by 10^9
+ * of the words still nonzero: each one leaves 9 more zero bits at the
+ * bottom, so the low words drop out as it goes */
+static inline uint32_t fmtFracChunk(struct FmtDecimal* const d)
+{
+	uint64_t carry = 0;
+	for (int i = d->low; i < d->nwords; ++i) {
+		const uint64_t cur = (uint64_t) d->frac[i] * 1000000000 + carry;
+		d->frac[i] = (uint32_t) cur;
+		carry = cur >> 32;
+	}
+
+	uint32_t chunk = (uint32_t) carry;
+	const int shift = d->k % 32;
+	if (shift != 0) {
+		uint32_t* const top = &d->frac[d->nwords - 1];
+		chunk = (uint32_t)((*top >> shift) | (carry << (32 - shift)));
+		*top &= ((uint32_t)1 << shift) - 1;
+	}
+
+	while (d->low < d->nwords && d->frac[d->low] == 0)
+		++d->low;
+	return chunk;
+}
+
+
+// appends the 9 digits of a chunk, leading zeros included
+static inline void fmtPutChunk(struct FmtDecimal* const d, uint32_t chunk)
+{
+	char* const out = &d->digits[d->len];
+	for (int i = 8; i >= 0; --i) {
+		out[i] = (char)('0' + chunk % 10);
+		chunk /= 10;
+	}
+	d->len += 9;
+}
+
+
+// -1, 0 or 1 as what's left of the fraction is below, at or above one half
+static inline int fmtFracHalf(const struct FmtDecimal* const d)
+{
+	if (d->k == 0)
+		return -1;
+
+	const int bit = d->k - 1;
+	const uint32_t half = (uint32_t)1 << (bit % 32);
+	const uint32_t top = d->frac[bit / 32];
+	if ((top & half) == 0)
+		return -1;
+	if ((top & (half - 1)) != 0)
+		return 1;
+	for (int i = 0; i < bit / 32; ++i) {
+		if (d->frac[i] != 0)
+			return 1;
+	}
+	return 0;
+}
+
+
+/* keeps the first n digits, rounded to nearest-even with what follows
+ * them; returns true if that carried into a new leading digit */
+static inline bool fmtDecimalRound(struct FmtDecimal* const d, const int n)
+{
+	int cmp;
+	if (n >= d->len) {
+		cmp = fmtFracHalf(d);
+	} else {
+		const char first = d->digits[n];
+		cmp = first > '5' ? 1 : first < '5' ? -1 : 0;
+		for (int i = n + 1; cmp == 0 && i < d->len; ++i) {
+			if (d->digits[i] != '0')
+				cmp = 1;
+		}
+		if (cmp == 0 && !fmtFracZero(d))
+			cmp = 1;
+		d->len = n;
+	}
+
+	const bool odd = n > 0 && ((d->digits[n - 1] - '0') & 1) != 0;
+	if (cmp < 0 || (cmp == 0 && !odd))
+		return false;
+
+	for (int i = n - 1; i >= 0; --i) {
+		if (d->digits[i] != '9') {
+			++d->digits[i];
+			return false;
+		}
+		d->digits[i] = '0';
+	}
+
+	memmove(&d->digits[1], d->digits, d->len);
+	d->digits[0] = '1';
+	++d->len;
+	return true;
+}
+
+
+/* formats the digits of d for %f with prec fraction digits: integer part
+ * (at least "0"), the point and the digits there are room for. *zeros
+ * gets how many more fraction zeros must follow */
+static inline int fmtFixed(struct FmtDecimal* const d, const int prec, const bool point,
+                           char* const out, int* const zeros)
+{
+	const int want = prec < FMT_DIGITS_MAX - d->nint - 1 ? prec : FMT_DIGITS_MAX - d->nint - 1;
+	while (d->len < d->nint + want && !fmtFracZero(d))
+		fmtPutChunk(d, fmtFracChunk(d));
+
+	const int have = d->len - d->nint;
+	if (have >= prec && fmtDecimalRound(d, d->nint + prec))
+		++d->nint;
+
+	int len = 0;
+	if (d->nint == 0)
+		out[len++] = '0';
+	memcpy(&out[len], d->digits, d->nint);
+	len += d->nint;
+	if (prec > 0 || point)
+		out[len++] = '.';
+
+	const int frac = d->len - d->nint;
+	memcpy(&out[len], &d->digits[d->nint], frac);
+	len += frac;
+	*zeros = prec - frac;
+	return len;
+}
+
+
+/* the first prec + 1 significant digits of d, rounded, *exp gets the
+ * decimal exponent of the first one. d must not be zero. Returns true
+ * if rounding carried into another digit, bumping the exponent */
+static inline bool fmtSignificant(struct FmtDecimal* const d, const int prec, int* const exp)
+{
+	int skipped = 0;
+	if (d->nint == 0) {
+		uint32_t chunk;
+		while ((chunk = fmtFracChunk(d)) == 0)
+			skipped += 9;
+		fmtPutChunk(d, chunk);
+		int lead = 0;
+		while (d->digits[lead] == '0')
+			++lead;
+		memmove(d->digits, &d->digits[lead], 9 - lead);
+		d->len -= lead;
+		*exp = -skipped - lead - 1;
+	} else {
+		*exp = d->nint - 1;
+	}
+
+	const int want = prec + 1 < FMT_DIGITS_MAX ? prec + 1 : FMT_DIGITS_MAX;
+	while (d->len < want && !fmtFracZero(d))
+		fmtPutChunk(d, fmtFracChunk(d));
+
+	if (d->len >= prec + 1 && fmtDecimalRound(d, prec + 1)) {
+		++*exp;
+		--d->len;
+		return true;
+	}
+
+	return false;
+}
+
+
+static inline int fmtExponent(char* const out, const char e, const int exp)
+{
+	int len = 0;
+	out[len++] = e;
+	out[len++] = exp < 0 ? '-' : '+';
+
+	char buf[8];
+	char* const end = &buf[sizeof(buf)];
+	char* begin = fmtDigits(end, exp < 0 ? -exp : exp, 10, false);
+	if (end - begin < 2)
+		*--begin = '0';
+	memcpy(&out[len], begin, end - begin);
+	return len + (int)(end - begin);
+}
+
+
+/* fixed notation of digits[0, n) * 10^(x - n + 1) with prec fraction
+ * digits, when all of them are there; *zeros gets the missing ones */
+static inline int fmtFixedShort(const char* const digits, const int n, const int x, const int prec,
+                                const bool point, char* const out, int* const zeros)
+{
+	int len = 0;
+	if (x < 0) {
+		out[len++] = '0';
+		out[len++] = '.';
+		memset(&out[len], '0', -x - 1);
+		len += -x - 1;
+		memcpy(&out[len], digits, n);
+		len += n;
+		*zeros = prec - (-x - 1) - n;
+		return len;
+	}
+
+	const int nint = n < x + 1 ? n : x + 1;
+	memcpy(out, digits, nint);
+	memset(&out[nint], '0', x + 1 - nint);
+	len = x + 1;
+	if (prec > 0 || point)
+		out[len++] = '.';
+	memcpy(&out[len], &digits[nint], n - nint);
+	len += n - nint;
+	*zeros = prec - (n - nint);
+	return len;
+}
+
+
+/* The shortest round-trip digits S of a double are within half an ulp of
+ * its exact value, and an ulp is below 2.3e-16 of it. So whenever the
+ * output keeps P >= len(S) significant digits and P <= 15, S padded with
+ * zeros is also the exact value correctly rounded to P digits, and the
+ * bignum expansion can be skipped. Returns false when that doesn't hold
+ * (or for subnormals, whose ulp is relatively larger) */
+static inline bool fmtFloatShortest(const char conv, const int prec, const bool alt,
+                                    const bool upper, const double mag, char* const out,
+                                    int* const len, int* const zeros, char* const suffix,
+                                    int* const suffix_len)
+{
+	if (mag < DBL_MIN)
+		return false;
+
+	uint64_t shortest;
+	int exp;
+	numShortest(mag, &shortest, &exp);
+
+	char digits[20];
+	const int n = numToDec(digits, shortest);
+	const int x = exp + n - 1;   // of the first digit
+
+	int sig;
+	if (conv == 'f')
+		sig = prec + x + 1;
+	else if (conv == 'e')
+		sig = prec + 1;
+	else
+		sig = prec;
+	if (sig < n || sig > 15)
+		return false;
+
+	if (conv == 'f' || (conv == 'g' && prec > x && x >= -4)) {
+		*len = fmtFixedShort(digits, n, x, conv == 'f' ? prec : prec - 1 - x, alt, out, zeros);
+		return true;
+	}
+
+	int l = 0;
+	out[l++] = digits[0];
+	if (sig > 1 || alt)
+		out[l++] = '.';
+	memcpy(&out[l], &digits[1], n - 1);
+	*len = l + n - 1;
+	*zeros = sig - n;
+	*suffix_len = fmtExponent(suffix, upper ? 'E' : 'e', x);
+	return true;
+}
+
+
+static inline void fmtFloat(struct MyStream* const s, const struct FmtSpec* const spec,
+                            const double v)
+{
+	const bool upper = spec->conv == 'F' || spec->conv == 'E' || spec->conv == 'G';
+	const bool alt = (spec->flags & FMT_ALT) != 0;
+	const char conv = (char)(spec->conv | 0x20);
+	char prefix[1];
+	size_t prefix_len = 0;
+
+	if (signbit(v))
+		prefix[prefix_len++] = '-';
+	else if ((spec->flags & FMT_PLUS) != 0)
+		prefix[prefix_len++] = '+';
+	else if ((spec->flags & FMT_SPACE) != 0)
+		prefix[prefix_len++] = ' ';
+
+	if (isinf(v) || isnan(v)) {
+		const char* const str = isnan(v) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf");
+		fmtField(s, spec, prefix, prefix_len, 0, str, 3, 0, "", 0, false);
+		return;
+	}
+
+	struct FmtDecimal d;
+	char out[FMT_DIGITS_MAX + 8];
+	char suffix[8];
+	int len = 0, zeros = 0, suffix_len = 0;
+	int prec = spec->prec >= 0 ? spec->prec : 6;
+	const double mag = signbit(v) ? -v : v;
+	if (conv == 'g' && prec == 0)
+		prec = 1;
+
+	if (mag != 0 && fmtFloatShortest(conv, prec, alt, upper, mag, out, &len, &zeros, suffix,
+	                                 &suffix_len)) {
+		// done, the digits were short enough
+	} else if (conv == 'g') {
+		// %e's exponent decides, with the digits rounded the same way
+		int exp = 0;
+		fmtDecimalInit(&d, mag);
+		if (d.len > 0 || !fmtFracZero(&d)) {
+			fmtSignificant(&d, prec - 1, &exp);
+			fmtDecimalInit(&d, mag);
+		}
+
+		if (prec > exp && exp >= -4) {
+			len = fmtFixed(&d, prec - 1 - exp, alt, out, &zeros);
+		} else {
+			const bool carried = fmtSignificant(&d, prec - 1, &exp);
+			out[len++] = d.digits[0];
+			if (prec > 1 || alt)
+				out[len++] = '.';
+			memcpy(&out[len], &d.digits[1], d.len - 1);
+			len += d.len - 1;
+			zeros = prec - d.len;
+			// glibc tries %f first and keeps its digits when that rounds
+			// up past prec of them, so e.g. %#.3g of 999.5 is "1.e+03"
+			if (alt && carried && exp == prec) {
+				len = 2;
+				zeros = 0;
+			}
+			suffix_len = fmtExponent(suffix, upper ? 'E' : 'e', exp);
+		}
+	} else if (conv == 'e') {
+		int exp = 0;
+		fmtDecimalInit(&d, mag);
+		if (d.len > 0 || !fmtFracZero(&d)) {
+			fmtSignificant(&d, prec, &exp);
+		} else {
+			d.digits[0] = '0';
+			d.len = 1;
+		}
+		out[len++] = d.digits[0];
+		if (prec > 0 || alt)
+			out[len++] = '.';
+		memcpy(&out[len], &d.digits[1], d.len - 1);
+		len += d.len - 1;
+		zeros = prec + 1 - d.len;
+		suffix_len = fmtExponent(suffix, upper ? 'E' : 'e', exp);
+	} else {
+		fmtDecimalInit(&d, mag);
+		len = fmtFixed(&d, prec, alt, out, &zeros);
+	}
+
+	// %g drops trailing zeros, unless it's the alternate form
+	if (conv == 'g' && !alt) {
+		zeros = 0;
+		if (memchr(out, '.', len) != NULL) {
+			while (out[len - 1] == '0')
+				--len;
+			if (out[len - 1] == '.')
+				--len;
+		}
+	}
+
+	const bool zero_pad = (spec->flags & (FMT_ZERO|FMT_LEFT)) == FMT_ZERO;
+	fmtField(s, spec, prefix, prefix_len, 0, out, len, zeros > 0 ? zeros : 0, suffix, suffix_len,
+	         zero_pad);
+}
+
+
+/* parses the conversion after a '%', *fmt is left past it.
+ * Returns false if it isn't one of the supported ones */
+static inline bool fmtParseSpec(const char** const fmt, struct FmtSpec* const spec)
+{
+	const char* p = *fmt;
+	spec->flags = 0;
+	spec->width = -1;
+	spec->prec = -1;
+	spec->length = FMT_LEN_NONE;
+
+	for (;; ++p) {
+		if (*p == '-') spec->flags |= FMT_LEFT;
+		else if (*p == '+') spec->flags |= FMT_PLUS;
+		else if (*p == ' ') spec->flags |= FMT_SPACE;
+		else if (*p == '#') spec->flags |= FMT_ALT;
+		else if (*p == '0') spec->flags |= FMT_ZERO;
+		else break;
+	}
+
+	if (*p == '*') {
+		spec->width = -2;
+		++p;
+	} else if (*p >= '1' && *p <= '9') {
+		spec->width = 0;
+		while (*p >= '0' && *p <= '9')
+			spec->width = spec->width * 10 + (*p++ - '0');
+	}
+
+	if (*p == '.') {
+		++p;
+		if (*p == '*') {
+			spec->prec = -2;
+			++p;
+		} else {
+			spec->prec = 0;
+			while (*p >= '0' && *p <= '9')
+				spec->prec = spec->prec * 10 + (*p++ - '0');
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		spec->length = p[1] == 'h' ? FMT_LEN_HH : FMT_LEN_H;
+		p += p[1] == 'h' ? 2 : 1;
+		break;
+	case 'l':
+		spec->length = p[1] == 'l' ? FMT_LEN_LL : FMT_LEN_L;
+		p += p[1] == 'l' ? 2 : 1;
+		break;
+	case 'j': spec->length = FMT_LEN_J; ++p; break;
+	case 'z': spec->length = FMT_LEN_Z; ++p; break;
+	case 't': spec->length = FMT_LEN_T; ++p; break;
+	}
+
+	spec->conv = *p;
+	if (*p == '\0' || strchr("diuoxXcspfFeEgG%", *p) == NULL)
+		return false;
+
+	*fmt = p + 1;
+	return true;
+}
+
+
+/* takes the conversion's argument, sign extended or zero extended
+ * from its real type so it can be formatted later */
+static inline union FmtArg fmtFetchArg(const struct FmtSpec* const spec, va_list* const args)
+{
+	union FmtArg arg;
+
+	switch (spec->conv) {
+	case 'd':
+	case 'i':
+		switch ((enum FmtLength) spec->length) {
+		case FMT_LEN_HH: arg.i = (signed char) va_arg(*args, int); break;
+		case FMT_LEN_H: arg.i = (short) va_arg(*args, int); break;
+		case FMT_LEN_L: arg.i = va_arg(*args, long); break;
+		case FMT_LEN_LL: arg.i = va_arg(*args, long long); break;
+		case FMT_LEN_J: arg.i = va_arg(*args, intmax_t); break;
+		case FMT_LEN_Z: arg.i = va_arg(*args, ssize_t); break;
+		case FMT_LEN_T: arg.i = va_arg(*args, ptrdiff_t); break;
+		default: arg.i = va_arg(*args, int); break;
+		}
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		switch ((enum FmtLength) spec->length) {
+		case FMT_LEN_HH: arg.u = (unsigned char) va_arg(*args, unsigned); break;
+		case FMT_LEN_H: arg.u = (unsigned short) va_arg(*args, unsigned); break;
+		case FMT_LEN_L: arg.u = va_arg(*args, unsigned long); break;
+		case FMT_LEN_LL: arg.u = va_arg(*args, unsigned long long); break;
+		case FMT_LEN_J: arg.u = va_arg(*args, uintmax_t); break;
+		case FMT_LEN_Z: arg.u = va_arg(*args, size_t); break;
+		case FMT_LEN_T: arg.u = (uintmax_t)(size_t) va_arg(*args, ptrdiff_t); break;
+		default: arg.u = va_arg(*args, unsigned); break;
+		}
+		break;
+	case 'c': arg.i = (unsigned char) va_arg(*args, int); break;
+	case 's': arg.s = va_arg(*args, const char*); break;
+	case 'p': arg.p = va_arg(*args, const void*); break;
+	case '%': arg.u = 0; break;
+	default: arg.f = va_arg(*args, double); break;
+	}
+
+	return arg;
+}
+
+
+/* formats one conversion whose * width and precision are resolved */
+static inline void fmtConvert(struct MyStream* const s, const struct FmtSpec* const spec,
+                              const union FmtArg arg)
+{
+	switch (spec->conv) {
+	case 'd':
+	case 'i':
+		fmtInteger(s, spec, arg.i < 0 ? -(uintmax_t) arg.i : (uintmax_t) arg.i, arg.i < 0);
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		fmtInteger(s, spec, arg.u, false);
+		break;
+	case 'p':
+		if (arg.p == NULL) {
+			fmtString(s, spec, "(nil)", 5);
+		} else {
+			struct FmtSpec ptr = *spec;
+			ptr.flags |= FMT_ALT;
+			fmtInteger(s, &ptr, (uintptr_t) arg.p, false);
+		}
+		break;
+	case 'c': {
+		const char c = (char) arg.i;
+		fmtString(s, spec, &c, 1);
+		break;
+		}
+	case 's': {
+		const char* str = arg.s;
+		size_t len;
+		if (str == NULL) {
+			// like glibc, unless the precision cuts it short
+			str = "(null)";
+			len = spec->prec < 0 || spec->prec >= 6 ? 6 : 0;
+		} else if (spec->prec >= 0) {
+			const char* const end = memchr(str, '\0', spec->prec);
+			len = end != NULL ? (size_t)(end - str) : (size_t) spec->prec;
+		} else {
+			len = strlen(str);
+		}
+		fmtString(s, spec, str, len);
+		break;
+		}
+	case '%':
+		fmtPut(s, "%", 1);
+		break;
+	default:
+		fmtFloat(s, spec, arg.f);
+		break;
+	}
+}
+
+
+static inline void fmtResolveStars(struct FmtSpec* const spec, va_list* const args)
+{
+	if (spec->width == -2) {
+		spec->width = va_arg(*args, int);
+		if (spec->width < 0) {
+			spec->flags |= FMT_LEFT;
+			spec->width = -spec->width;
+		}
+	}
+
+	if (spec->prec == -2) {
+		spec->prec = va_arg(*args, int);
+		if (spec->prec < 0)
+			spec->prec = -1;
+	}
+}
+
+
+static inline int myvfprintf(struct MyStream* const s, const char* fmt, va_list args)
+{
+	va_list ap;
+	va_copy(ap, args);
+	s->total = 0;
+
+	while (*fmt != '\0') {
+		const char* const pct = strchr(fmt, '%');
+		if (pct == NULL) {
+			fmtPut(s, fmt, strlen(fmt));
+			break;
+		}
+
+		fmtPut(s, fmt, pct - fmt);
+		fmt = pct + 1;
+
+		struct FmtSpec spec;
+		if (!fmtParseSpec(&fmt, &spec)) {
+			fmtPut(s, "%", 1);
+			continue;
+		}
+
+		fmtResolveStars(&spec, &ap);
+		fmtConvert(s, &spec, fmtFetchArg(&spec, &ap));
+	}
+
+	va_end(ap);
+	return s->error ? -1 : (int) s->total;
+}
+
+
+static inline int myfprintf(struct MyStream* const s, const char* const fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static inline int myfprintf(struct MyStream* const s, const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const int ret = myvfprintf(s, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+
+/* stdout, flushed when full, by myflush(mystdout()) and at exit. Each
+ * translation unit has its own buffer, so flush before mixing them */
+static inline void myflushStdout(void);
+static inline struct MyStream* mystdout(void)
+{
+	static char buf[MYPRINTF_BUFSIZE];
+	static struct MyStream stream = { .buf = buf, .size = sizeof(buf), .fd = STDOUT_FILENO };
+	static bool registered = false;
+
+	if (!registered) {
+		registered = true;
+		atexit(myflushStdout);
+	}
+
+	return &stream;
+}
+
+
+static inline void myflushStdout(void)
+{
+	myflush(mystdout());
+}
+
+
+static inline int myvprintf(const char* const fmt, va_list args)
+{
+	return myvfprintf(mystdout(), fmt, args);
+}
+
+
+static inline int myprintf(const char* const fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+static inline int myprintf(const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const int ret = myvfprintf(mystdout(), fmt, args);
+	va_end(args);
+	return ret;
+}
+
+
+/* writes the result to fd right away, with one write(2) unless it's
+ * larger than MYPRINTF_BUFSIZE */
+static inline int myvdprintf(const int fd, const char* const fmt, va_list args)
+{
+	char buf[MYPRINTF_BUFSIZE];
+	struct MyStream s;
+	myStreamInit(&s, fd, buf, sizeof(buf));
+	const int ret = myvfprintf(&s, fmt, args);
+	return myflush(&s) ? ret : -1;
+}
+
+
+static inline int mydprintf(const int fd, const char* const fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+static inline int mydprintf(const int fd, const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const int ret = myvdprintf(fd, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+
+/* like snprintf, returns the length the whole result would have */
+static inline int myvsnprintf(char* const dest, const size_t size, const char* const fmt,
+                              va_list args)
+{
+	struct MyStream s;
+	myStreamInit(&s, -1, dest, size > 0 ? size - 1 : 0);
+	const int ret = myvfprintf(&s, fmt, args);
+	if (size > 0)
+		dest[s.len] = '\0';
+	return ret;
+}
+
+
+static inline int mysnprintf(char* const dest, const size_t size, const char* const fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+static inline int mysnprintf(char* const dest, const size_t size, const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const int ret = myvsnprintf(dest, size, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+
+/* Precompiled formats. A constant format is parsed once, the first time
+ * its call site runs, into a flat list of ops: the literal text before
+ * each conversion and the conversion itself, with the common plain ones
+ * (%d %ld %u %s %c without flags, width or precision) marked so they skip
+ * the generic formatter. Later calls only run the ops. The MY*PRINTF
+ * macros keep one descriptor per call site, and pass the format on so
+ * the compiler still checks the arguments against it.
+ * */
+#define FMT_OPS_MAX ((int)32)
+
+
+enum FmtOpKind {
+	FMT_OP_LITERAL,   // only the literal, e.g. the tail after the last conversion
+	FMT_OP_INT,
+	FMT_OP_LONG,
+	FMT_OP_UINT,
+	FMT_OP_STR,
+	FMT_OP_CHAR,
+	FMT_OP_GENERIC
+};
+
+
+struct FmtOp {
+	const char* lit;   // into the format string
+	uint32_t lit_len;
+	uint8_t kind;      // enum FmtOpKind
+	struct FmtSpec spec;
+};
+
+
+enum FmtState {
+	FMT_STATE_NEW,
+	FMT_STATE_BUSY,    // another thread is compiling it
+	FMT_STATE_READY,
+	FMT_STATE_DYNAMIC  // too many ops, formatted the usual way
+};
+
+
+struct FmtCompiled {
+	int state;         // enum FmtState
+	int nops;
+	struct FmtOp ops[FMT_OPS_MAX];
+};
+
+
+static inline enum FmtOpKind fmtOpKind(const struct FmtSpec* const spec)
+{
+	if (spec->flags != 0 || spec->width != -1 || spec->prec != -1)
+		return FMT_OP_GENERIC;
+
+	switch (spec->conv) {
+	case 'd':
+	case 'i':
+		return spec->length == FMT_LEN_NONE ? FMT_OP_INT :
+		       spec->length == FMT_LEN_L ? FMT_OP_LONG : FMT_OP_GENERIC;
+	case 'u':
+		return spec->length == FMT_LEN_NONE ? FMT_OP_UINT : FMT_OP_GENERIC;
+	case 's':
+		return FMT_OP_STR;
+	case 'c':
+		return FMT_OP_CHAR;
+	default:
+		return FMT_OP_GENERIC;
+	}
+}
+
+
+/* false if fmt needs more than FMT_OPS_MAX ops */
+static inline bool fmtCompile(struct FmtCompiled* const c, const char* fmt)
+{
+	const char* lit = fmt;
+	c->nops = 0;
+
+	while (c->nops < FMT_OPS_MAX) {
+		const char* const pct = strchr(fmt, '%');
+		struct FmtOp* const op = &c->ops[c->nops];
+		if (pct == NULL) {
+			op->lit = lit;
+			op->lit_len = strlen(lit);
+			op->kind = FMT_OP_LITERAL;
+			++c->nops;
+			return true;
+		}
+
+		fmt = pct + 1;
+		struct FmtSpec spec;
+		// what isn't a conversion is literal text, "%%" ends a literal with its '%'
+		if (!fmtParseSpec(&fmt, &spec) || spec.conv == '%') {
+			if (spec.conv != '%')
+				continue;
+			op->kind = FMT_OP_LITERAL;
+			op->lit_len = pct + 1 - lit;
+		} else {
+			op->kind = fmtOpKind(&spec);
+			op->lit_len = pct - lit;
+		}
+
+		op->lit = lit;
+		op->spec = spec;
+		lit = fmt;
+		++c->nops;
+	}
+
+	return false;
+}
+
+
+static inline void fmtPlainInteger(struct MyStream* const s, const uintmax_t mag, const bool neg)
+{
+	char buf[3 * sizeof(uintmax_t) + 2];
+	char* const end = &buf[sizeof(buf)];
+	char* begin = numToDecBackward(end, mag);
+	if (neg)
+		*--begin = '-';
+	fmtPut(s, begin, end - begin);
+}
+
+
+static inline int myvfprintfc(struct MyStream* const s, const struct FmtCompiled* const c,
+                              va_list args)
+{
+	va_list ap;
+	va_copy(ap, args);
+	s->total = 0;
+
+	for (const struct FmtOp* op = c->ops; op < &c->ops[c->nops]; ++op) {
+		fmtPut(s, op->lit, op->lit_len);
+
+		switch ((enum FmtOpKind) op->kind) {
+		case FMT_OP_LITERAL:
+			break;
+		case FMT_OP_INT: {
+			const int i = va_arg(ap, int);
+			fmtPlainInteger(s, i < 0 ? -(uintmax_t) i : (uintmax_t) i, i < 0);
+			break;
+			}
+		case FMT_OP_LONG: {
+			const long l = va_arg(ap, long);
+			fmtPlainInteger(s, l < 0 ? -(uintmax_t) l : (uintmax_t) l, l < 0);
+			break;
+			}
+		case FMT_OP_UINT:
+			fmtPlainInteger(s, va_arg(ap, unsigned), false);
+			break;
+		case FMT_OP_STR: {
+			const char* const str = va_arg(ap, const char*);
+			if (str != NULL)
+				fmtPut(s, str, strlen(str));
+			else
+				fmtPut(s, "(null)", 6);
+			break;
+			}
+		case FMT_OP_CHAR: {
+			const char ch = (char) va_arg(ap, int);
+			fmtPut(s, &ch, 1);
+			break;
+			}
+		case FMT_OP_GENERIC: {
+			struct FmtSpec spec = op->spec;
+			fmtResolveStars(&spec, &ap);
+			fmtConvert(s, &spec, fmtFetchArg(&spec, &ap));
+			break;
+			}
+		}
+	}
+
+	va_end(ap);
+	return s->error ? -1 : (int) s->total;
+}
+
+
+/* compiles fmt into c on first use. False until it's done, or if
+ * it can't be compiled: fmt is then formatted the usual way */
+static inline bool fmtCompiledReady(struct FmtCompiled* const c, const char* const fmt)
+{
+	int state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+	if (state == FMT_STATE_NEW &&
+	    __atomic_compare_exchange_n(&c->state, &state, FMT_STATE_BUSY, false,
+	                                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		state = fmtCompile(c, fmt) ? FMT_STATE_READY : FMT_STATE_DYNAMIC;
+		__atomic_store_n(&c->state, state, __ATOMIC_RELEASE);
+	}
+
+	return state == FMT_STATE_READY;
+}
+
+
+static inline int myvfprintfcc(struct MyStream* const s, struct FmtCompiled* const c,
+                               const char* const fmt, va_list args)
+{
+	if (fmtCompiledReady(c, fmt))
+		return myvfprintfc(s, c, args);
+	return myvfprintf(s, fmt, args);
+}
+
+
+static inline int myfprintfc(struct MyStream* const s, struct FmtCompiled* const c,
+                             const char* const fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+static inline int myfprintfc(struct MyStream* const s, struct FmtCompiled* const c,
+                             const char* const fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	const int ret = myvfprintfcc(s, c, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+
+static inline int mysnprintfc(char* const dest, const size_t size, struct FmtCompiled* const c,
+                              const char* const fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+static inline int mysnprintfc(char* const dest, const size_t size, struct FmtCompiled* const c,
+                              const char* const fmt, ...)
+{
+	struct MyStream s;
+	myStreamInit(&s, -1, dest, size > 0 ? size - 1 : 0);
+
+	va_list args;
+	va_start(args, fmt);
+	const int ret = myvfprintfcc(&s, c, fmt, args);
+	va_end(args);
+
+	if (size > 0)
+		dest[s.len] = '\0';
+	return ret;
+}
+
+
+/* fmt must be a string literal (or live as long as the program) */
+#define MYPRINTF(fmt, ...) \
+	({ static struct FmtCompiled fmtc_; myfprintfc(mystdout(), &fmtc_, fmt, ##__VA_ARGS__); })
+#define MYFPRINTF(stream, fmt, ...) \
+	({ static struct FmtCompiled fmtc_; myfprintfc(stream, &fmtc_, fmt, ##__VA_ARGS__); })
+#define MYSNPRINTF(dest, size, fmt, ...) \
+	({ static struct FmtCompiled fmtc_; mysnprintfc(dest, size, &fmtc_, fmt, ##__VA_ARGS__); })
+
+
+#endif